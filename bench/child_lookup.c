@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "node.h"
+
+// Micro-benchmark for the per-entry node work processTree does, without
+// the syscalls: for every directory fan-out it times a first scan (lookup
+// misses, then add_child) and a rescan (every lookup hits, in a different
+// order than the entries were added, like readdir after a rename).
+//
+// Built by `make bench` into bench/bin/.
+//
+// Usage: child_lookup [max fan-out]   (default 1000000)
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  long max = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+  printf("%10s %14s %14s\n", "fan-out", "scan ns/entry", "rescan ns/entry");
+
+  for (long n = 10; n <= max; n *= 10) {
+    char (*names)[32] = malloc(n * sizeof(*names));
+    long *order = malloc(n * sizeof(long));
+    for (long i = 0; i < n; i++) {
+      snprintf(names[i], sizeof(names[i]), "msg%07ld", i);
+      order[i] = i;
+    }
+    srand(42);
+    for (long i = n - 1; i > 0; i--) {
+      long j = rand() % (i + 1);
+      long t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+
+    Tree *tree = create_tree("spool");
+    Node *dir = tree->root;
+    double t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+      if (!find_child(tree, dir, names[i])) {
+	add_child(tree, dir, create_node(tree, names[i], FILE_NODE));
+      }
+    }
+    double t1 = now_sec();
+    long found = 0;
+    for (long i = 0; i < n; i++) {
+      found += find_child(tree, dir, names[order[i]]) != NULL;
+    }
+    double t2 = now_sec();
+
+    if (found != n) {
+      fprintf(stderr, "lookup failed: %ld of %ld found\n", found, n);
+      return 1;
+    }
+    printf("%10ld %14.1f %14.1f\n", n, (t1 - t0) * 1e9 / n, (t2 - t1) * 1e9 / n);
+    free_tree(tree);
+    free(names);
+    free(order);
+  }
+  return 0;
+}
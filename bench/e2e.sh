@@ -0,0 +1,53 @@
+#!/bin/sh
+# End-to-end backup of TREE to a server on loopback: a first backup of
+# everything, then a rescan with nothing changed. Prints one JSON object.
+#
+# Usage: bench/e2e.sh TREE [server args...]
+#
+# Uses client/out and server/out (make all). Each run includes the
+# client's --summary, with its per-phase latencies. The server stores into a
+# scratch directory that is removed afterwards; it listens on the usual
+# port, so nothing else may be using it.
+
+set -e
+[ $# -ge 1 ] || { echo "usage: $0 TREE [server args...]" >&2; exit 1; }
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TREE=$(cd "$1" && pwd)
+shift
+CLIENT=$ROOT/client/out
+SERVER=$ROOT/server/out
+STORE=$(mktemp -d)
+LOGS=$(mktemp -d)
+
+now_ns() { date +%s%N; }
+
+cd "$STORE"
+stdbuf -oL "$SERVER" "$@" > "$LOGS/server.log" 2>&1 &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null; wait $SERVER_PID 2>/dev/null || true; rm -rf "$STORE" "$LOGS"; rm -f "$TREE/node_data.bin"' EXIT
+# wait for the listening socket rather than a fixed delay
+i=0
+until grep -q "listening" "$LOGS/server.log" 2>/dev/null; do
+  i=$((i + 1))
+  [ $i -lt 100 ] || { echo "server did not start" >&2; exit 1; }
+  sleep 0.05
+done
+
+cd "$TREE"
+rm -f node_data.bin
+run() { # name
+  start=$(now_ns)
+  "$CLIENT" --summary "$LOGS/$1.json" > "$LOGS/$1.log" 2>&1
+  end=$(now_ns)
+  secs=$(echo "$start $end" | awk '{ printf "%.3f", ($2 - $1) / 1e9 }')
+  echo "$secs" > "$LOGS/$1.secs"
+  printf '"%s": {"seconds": %s, "client": %s}' "$1" "$secs" "$(cat "$LOGS/$1.json")"
+}
+
+bytes=$(find . -type f ! -name node_data.bin -printf '%s\n' | awk '{ s += $1 } END { print s + 0 }')
+first=$(run first_backup)
+first_secs=$(cat "$LOGS/first_backup.secs")
+rescan=$(run rescan)
+mbps=$(echo "$bytes $first_secs" | awk '{ printf "%.1f", ($2 > 0 ? $1 / 1e6 / $2 : 0) }')
+printf '{"tree": "%s", "bytes": %s, "server_args": "%s",\n %s,\n %s,\n "first_backup_mb_per_sec": %s}\n' \
+  "$TREE" "$bytes" "$*" "$first" "$rescan" "$mbps"
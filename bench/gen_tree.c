@@ -0,0 +1,197 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Deterministic synthetic tree for the benchmarks: the same options and
+// seed always give the same directories, names, sizes and contents.
+//
+// Directories form a complete tree of the given depth and fan-out below
+// the output directory. Files are spread over all of them at random, with
+// sizes log-uniform between --min-size and --max-size (so most are small,
+// as in real trees). A --dup-ratio share of files repeats the contents of
+// an earlier file. Contents are pseudo-random, i.e. incompressible.
+//
+// Usage: gen_tree [--files N] [--depth N] [--fanout N] [--min-size BYTES]
+//                 [--max-size BYTES] [--dup-ratio R] [--seed N] DIR
+//
+// Prints a JSON summary of what it wrote. DIR must not exist yet.
+
+#define WRITE_BUF_SIZE (64 * 1024)
+
+typedef struct {
+  long files;
+  int depth;
+  int fanout;
+  uint64_t min_size;
+  uint64_t max_size;
+  double dup_ratio;
+  uint64_t seed;
+} GenOptions;
+
+/* contents of one unique file; duplicates regenerate it */
+typedef struct {
+  uint64_t size;
+  uint64_t seed;
+} Contents;
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t *state) {
+  return (splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int write_file(const char *path, const Contents *c, unsigned char *buf) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd == -1) {
+    perror(path);
+    return -1;
+  }
+  uint64_t state = c->seed;
+  uint64_t left = c->size;
+  while (left > 0) {
+    size_t n = left < WRITE_BUF_SIZE ? (size_t)left : WRITE_BUF_SIZE;
+    for (size_t i = 0; i < n; i += 8) {
+      uint64_t r = splitmix64(&state);
+      memcpy(buf + i, &r, n - i < 8 ? n - i : 8);
+    }
+    if (write(fd, buf, n) != (ssize_t)n) {
+      perror(path);
+      close(fd);
+      return -1;
+    }
+    left -= n;
+  }
+  return close(fd);
+}
+
+static int parse_options(int argc, char *argv[], GenOptions *opts, const char **dir) {
+  *dir = NULL;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (arg[0] != '-') {
+      *dir = arg;
+      continue;
+    }
+    if (!val) {
+      return -1;
+    }
+    i++;
+    if (strcmp(arg, "--files") == 0) {
+      opts->files = strtol(val, NULL, 10);
+    } else if (strcmp(arg, "--depth") == 0) {
+      opts->depth = (int)strtol(val, NULL, 10);
+    } else if (strcmp(arg, "--fanout") == 0) {
+      opts->fanout = (int)strtol(val, NULL, 10);
+    } else if (strcmp(arg, "--min-size") == 0) {
+      opts->min_size = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--max-size") == 0) {
+      opts->max_size = strtoull(val, NULL, 10);
+    } else if (strcmp(arg, "--dup-ratio") == 0) {
+      opts->dup_ratio = strtod(val, NULL);
+    } else if (strcmp(arg, "--seed") == 0) {
+      opts->seed = strtoull(val, NULL, 10);
+    } else {
+      return -1;
+    }
+  }
+  if (!*dir || opts->files < 0 || opts->depth < 0 || opts->fanout < 1 ||
+      opts->max_size < opts->min_size || opts->dup_ratio < 0 || opts->dup_ratio > 1) {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  GenOptions opts = { 10000, 3, 8, 1, 1024 * 1024, 0.1, 42 };
+  const char *root;
+  if (parse_options(argc, argv, &opts, &root) == -1) {
+    fprintf(stderr, "Usage: %s [--files N] [--depth N] [--fanout N] [--min-size BYTES]\n"
+	    "          [--max-size BYTES] [--dup-ratio R] [--seed N] DIR\n", argv[0]);
+    return 1;
+  }
+
+  // directories in breadth first order; children of i are fanout*i+1..
+  long dirs = 1;
+  for (long level = 1, width = 1; level <= opts.depth; level++) {
+    width *= opts.fanout;
+    dirs += width;
+  }
+  char **paths = malloc(dirs * sizeof(char *));
+  Contents *unique = malloc((opts.files > 0 ? opts.files : 1) * sizeof(Contents));
+  unsigned char *buf = malloc(WRITE_BUF_SIZE);
+  if (!paths || !unique || !buf) {
+    perror("Out of memory");
+    return 1;
+  }
+  if (mkdir(root, 0755) == -1) {
+    perror(root);
+    return 1;
+  }
+  paths[0] = strdup(root);
+  for (long i = 1; i < dirs; i++) {
+    long parent = (i - 1) / opts.fanout;
+    size_t len = strlen(paths[parent]) + 16;
+    paths[i] = malloc(len);
+    snprintf(paths[i], len, "%s/d%ld", paths[parent], (i - 1) % opts.fanout);
+    if (mkdir(paths[i], 0755) == -1) {
+      perror(paths[i]);
+      return 1;
+    }
+  }
+
+  uint64_t state = opts.seed;
+  long nunique = 0, duplicates = 0;
+  uint64_t bytes = 0;
+  double log_min = log((double)(opts.min_size ? opts.min_size : 1));
+  double log_max = log((double)(opts.max_size ? opts.max_size : 1));
+  char path[4096];
+  for (long f = 0; f < opts.files; f++) {
+    long dir = (long)(splitmix64(&state) % (uint64_t)dirs);
+    Contents c;
+    if (nunique > 0 && uniform(&state) < opts.dup_ratio) {
+      c = unique[splitmix64(&state) % (uint64_t)nunique];
+      duplicates++;
+    } else {
+      c.size = (uint64_t)exp(log_min + uniform(&state) * (log_max - log_min));
+      if (c.size < opts.min_size) {
+	c.size = opts.min_size;
+      }
+      if (c.size > opts.max_size) {
+	c.size = opts.max_size;
+      }
+      c.seed = splitmix64(&state);
+      unique[nunique++] = c;
+    }
+    snprintf(path, sizeof(path), "%s/f%06ld", paths[dir], f);
+    if (write_file(path, &c, buf) == -1) {
+      return 1;
+    }
+    bytes += c.size;
+  }
+
+  printf("{\"files\": %ld, \"dirs\": %ld, \"bytes\": %llu, \"duplicates\": %ld, "
+	 "\"depth\": %d, \"fanout\": %d, \"min_size\": %llu, \"max_size\": %llu, "
+	 "\"dup_ratio\": %g, \"seed\": %llu}\n",
+	 opts.files, dirs, (unsigned long long)bytes, duplicates, opts.depth, opts.fanout,
+	 (unsigned long long)opts.min_size, (unsigned long long)opts.max_size,
+	 opts.dup_ratio, (unsigned long long)opts.seed);
+
+  for (long i = 0; i < dirs; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+  free(unique);
+  free(buf);
+  return 0;
+}
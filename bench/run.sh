@@ -0,0 +1,25 @@
+#!/bin/sh
+# The whole suite on a freshly generated tree: generator summary, client
+# scan/hash/tree-file benchmarks and end-to-end backups, with and without
+# syncing on the server. Prints one JSON object, e.g.
+#
+#   make bench && bench/run.sh > results.json
+#   bench/run.sh --files 100000 --max-size 65536 > small_files.json
+#
+# Arguments are passed to gen_tree. The tree is generated in a scratch
+# directory (BENCH_DIR, default under /tmp) and removed afterwards.
+
+set -e
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BIN=$ROOT/bench/bin
+WORK=$(mktemp -d "${BENCH_DIR:-/tmp}/cloudvault-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+gen=$("$BIN/gen_tree" "$@" "$WORK/tree")
+scan=$("$BIN/scan_bench" "$WORK/tree")
+e2e=$("$ROOT/bench/e2e.sh" "$WORK/tree")
+e2e_nosync=$("$ROOT/bench/e2e.sh" "$WORK/tree" --no-sync)
+
+printf '{\n"generator": %s,\n"scan": %s,\n"e2e": %s,\n"e2e_no_sync": %s,\n"host": {"cpus": %s, "kernel": "%s", "commit": "%s"}\n}\n' \
+  "$gen" "$scan" "$e2e" "$e2e_nosync" "$(nproc)" "$(uname -r)" \
+  "$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)"
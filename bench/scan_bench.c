@@ -0,0 +1,256 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "checksum.h"
+#include "dir_walk.h"
+#include "file_utils.h"
+#include "node.h"
+#include "pipeline.h"
+
+// Client-side benchmarks over an existing tree (see gen_tree.c), without a
+// server:
+//
+//   first_scan   walk, stat and hash everything into an empty tree
+//   rescan_warm  walk again; every stat tuple matches, nothing is hashed
+//   rescan_cold  the same after dropping the page cache (root only)
+//   save_tree / load_tree of the resulting node_data.bin
+//   hash         calculateChecksum throughput per algorithm, warm file
+//
+// Usage: scan_bench [--walkers N] [--threads N] [--hash-mb N] DIR
+//
+// Results go to stdout as one JSON object.
+
+#define HASH_RUNS 3
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns 0 if the page cache (and dentries, inodes) could be dropped */
+static int drop_caches(void) {
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  int ok = write(fd, "3\n", 2) == 2;
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+typedef struct {
+  const char *dir;
+  Tree *tree;
+  ScanPipeline *pipeline;
+  ScanOptions *opts;
+} ScanArgs;
+
+static void *scanMain(void *arg) {
+  ScanArgs *args = arg;
+  scanDirs(args->dir, args->tree, &args->dir, 1, args->pipeline, args->opts);
+  pipeline_walk_done(args->pipeline);
+  return NULL;
+}
+
+/* one scan, with the uploader stage replaced by taking every hash as
+ * acked. Returns the seconds it took, or -1. */
+static double timed_scan(const char *dir, Tree *tree, ScanPipeline *pipeline, ScanOptions *opts) {
+  ScanArgs args = { dir, tree, pipeline, opts };
+  memset(&opts->stats, 0, sizeof(opts->stats));
+  double start = now_sec();
+  pthread_t walker;
+  if (pthread_create(&walker, NULL, scanMain, &args) != 0) {
+    perror("Failed to start directory walker");
+    return -1;
+  }
+  ScanItem *item;
+  while ((item = pipeline_next(pipeline)) != NULL) {
+    Node *node = item->node;
+    if (item->kind == ITEM_FILE && item->has_digest) {
+      node->st = item->st;
+      memcpy(node->checksum, item->digest, sizeof(node->checksum));
+      memcpy(node->blob_id, item->digest, sizeof(node->blob_id));
+      node->has_checksum = 1;
+      node->has_blob_id = 1;
+    }
+    node->is_uploaded = 1;
+    pipeline_free_item(item);
+  }
+  pthread_join(walker, NULL);
+  return now_sec() - start;
+}
+
+static void print_scan(const char *name, double secs, const ScanStats *stats, int cold) {
+  printf("  \"%s\": {\"seconds\": %.6f, \"files_per_sec\": %.0f, \"files\": %zu, "
+	 "\"hashed\": %zu, \"cold_cache\": %s},\n",
+	 name, secs, secs > 0 ? stats->files_scanned / secs : 0, stats->files_scanned,
+	 stats->rehashed + stats->new_files, cold ? "true" : "false");
+}
+
+/* hashes a warm scratch file of mb MiB with each algorithm */
+static int hash_bench(long mb) {
+  char path[] = "/tmp/scan_bench.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("Failed to create scratch file");
+    return -1;
+  }
+  unsigned char *buf = malloc(1024 * 1024);
+  if (!buf) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  uint64_t x = 88172645463325252ull;
+  for (long i = 0; i < mb; i++) {
+    for (size_t j = 0; j < 1024 * 1024; j += 8) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      memcpy(buf + j, &x, 8);
+    }
+    if (write(fd, buf, 1024 * 1024) != 1024 * 1024) {
+      perror("Failed to write scratch file");
+      close(fd);
+      unlink(path);
+      free(buf);
+      return -1;
+    }
+  }
+  close(fd);
+  free(buf);
+
+  const uint32_t algos[] = { HASH_BLAKE3, HASH_SHA256 };
+  printf("  \"hash\": [");
+  for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+    Checksummer cs;
+    unsigned char digest[HASH_DIGEST_SIZE];
+    if (checksummer_init(&cs, algos[a]) == -1) {
+      continue;
+    }
+    calculateChecksum(&cs, path, digest); // warms the page cache
+    double best = 0;
+    for (int run = 0; run < HASH_RUNS; run++) {
+      double start = now_sec();
+      if (calculateChecksum(&cs, path, digest) == -1) {
+	break;
+      }
+      double secs = now_sec() - start;
+      if (best == 0 || secs < best) {
+	best = secs;
+      }
+    }
+    checksummer_free(&cs);
+    printf("%s{\"algo\": \"%s\", \"mb\": %ld, \"mb_per_sec\": %.1f}", a ? ", " : "",
+	   hash_name(algos[a]), mb, best > 0 ? mb * 1.048576 / best : 0);
+  }
+  printf("]\n");
+  unlink(path);
+  return 0;
+}
+
+static off_t file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+int main(int argc, char *argv[]) {
+  ScanOptions opts = { 0 };
+  opts.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  opts.walkers = DEFAULT_WALKERS;
+  long hash_mb = 256;
+  const char *dir = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--walkers") == 0 && i + 1 < argc) {
+      opts.walkers = (int)strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      opts.threads = (int)strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--hash-mb") == 0 && i + 1 < argc) {
+      hash_mb = strtol(argv[++i], NULL, 10);
+    } else if (argv[i][0] != '-' && !dir) {
+      dir = argv[i];
+    } else {
+      dir = NULL;
+      break;
+    }
+  }
+  if (!dir) {
+    fprintf(stderr, "Usage: %s [--walkers N] [--threads N] [--hash-mb N] DIR\n", argv[0]);
+    return 1;
+  }
+
+  ScanPipeline pipeline;
+  if (pipeline_init(&pipeline, opts.threads, HASH_DEFAULT) == -1) {
+    return 1;
+  }
+  // the scan's own output would drown the results
+  fflush(stdout);
+  int out = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  if (out == -1 || devnull == -1 || dup2(devnull, STDOUT_FILENO) == -1) {
+    perror("Failed to silence scan output");
+    return 1;
+  }
+  close(devnull);
+
+  Tree *tree = create_tree(dir);
+  int first_cold = drop_caches() == 0;
+  double first = timed_scan(dir, tree, &pipeline, &opts);
+  ScanStats first_stats = opts.stats;
+  double warm = timed_scan(dir, tree, &pipeline, &opts);
+  ScanStats warm_stats = opts.stats;
+  int cold = drop_caches() == 0;
+  double rescan_cold = cold ? timed_scan(dir, tree, &pipeline, &opts) : 0;
+  ScanStats cold_stats = opts.stats;
+  pipeline_free(&pipeline);
+
+  char state[] = "/tmp/scan_bench_tree.XXXXXX";
+  int fd = mkstemp(state);
+  if (fd == -1) {
+    perror("Failed to create state file");
+    return 1;
+  }
+  close(fd);
+  double start = now_sec();
+  int saved = save_tree(state, tree, HASH_DEFAULT);
+  double save_secs = now_sec() - start;
+  free_tree(tree);
+  off_t state_size = file_size(state);
+  uint32_t algo;
+  start = now_sec();
+  Tree *loaded = saved == 0 ? load_tree(state, &algo) : NULL;
+  double load_secs = now_sec() - start;
+  unlink(state);
+  if (!loaded) {
+    fprintf(stderr, "Saving or loading the tree failed\n");
+    return 1;
+  }
+  free_tree(loaded);
+
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(out);
+
+  printf("{\n  \"dir\": \"%s\", \"walkers\": %d, \"threads\": %d,\n", dir, opts.walkers, opts.threads);
+  print_scan("first_scan", first, &first_stats, first_cold);
+  print_scan("rescan_warm", warm, &warm_stats, 0);
+  if (cold) {
+    print_scan("rescan_cold", rescan_cold, &cold_stats, 1);
+  } else {
+    printf("  \"rescan_cold\": null,\n");
+  }
+  printf("  \"save_tree\": {\"seconds\": %.6f, \"bytes\": %lld},\n", save_secs, (long long)state_size);
+  printf("  \"load_tree\": {\"seconds\": %.6f},\n", load_secs);
+  if (hash_bench(hash_mb) == -1) {
+    printf("  \"hash\": []\n");
+  }
+  printf("}\n");
+  return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* bump allocator: memory is carved out of large blocks and only given
+ * back all at once, by arena_free */
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size; // usable bytes after the header
+  size_t used;
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *head; // block allocations are currently carved from
+  size_t block_size;
+} Arena;
+
+void arena_init(Arena *arena, size_t block_size);
+
+/* align must be a power of two. Exits when out of memory, like
+ * create_node always has. */
+void *arena_alloc(Arena *arena, size_t size, size_t align);
+char *arena_strdup(Arena *arena, const char *str);
+
+/* releases every block; cost depends on the block count only */
+void arena_free(Arena *arena);
+
+#endif // ARENA_H
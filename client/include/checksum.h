@@ -1,6 +1,25 @@
 #ifndef CHECKSUM_H
 #define CHECKSUM_H
 
-char *calculateChecksum(const char *filepath);
+#include <stdint.h>
+#include "hash.h"
+
+// file contents are read in chunks of this size into a page aligned buffer
+#define CHECKSUM_BUF_SIZE (1024 * 1024)
+
+/* per-thread hashing state: the digest context and the read buffer are
+ * set up once and reused for every file the thread hashes */
+typedef struct {
+  HashCtx hash;
+  unsigned char *buf;
+} Checksummer;
+
+/* Returns -1 if the algorithm is unknown or memory runs out. */
+int checksummer_init(Checksummer *cs, uint32_t algo);
+void checksummer_free(Checksummer *cs);
+
+/* writes the HASH_DIGEST_SIZE byte digest of the file contents, which
+ * doubles as the file's blob id. Returns -1 on failure. */
+int calculateChecksum(Checksummer *cs, const char *filepath, unsigned char *digest);
 
 #endif // CHECKSUM_H
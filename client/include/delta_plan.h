@@ -0,0 +1,33 @@
+#ifndef DELTA_PLAN_H
+#define DELTA_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "delta.h"
+#include "hash.h"
+
+/* one MSG_PUT_DELTA op. Literals point into the file rather than holding
+ * the bytes, which are sent straight from it. */
+typedef struct {
+  uint32_t kind;  // DELTA_OP_COPY or DELTA_OP_LITERAL
+  uint32_t count; // blocks to copy, or literal bytes
+  uint64_t start; // first block, or file offset of the literal
+} DeltaOp;
+
+typedef struct {
+  DeltaOp *ops;
+  size_t count;
+  size_t capacity;
+  uint64_t size;          // new contents, as read while matching
+  uint64_t literal_bytes;
+  uint64_t wire_size;     // ops plus literals, i.e. body_len minus the prefix
+} DeltaPlan;
+
+/* matches the contents of fd against the basis' signature, rolling the
+ * weak checksum a byte at a time and confirming hits with the strong one.
+ * Gives up and returns 1 once more than max_literal bytes matched nothing.
+ * Returns -1 on read errors or when out of memory. */
+int delta_plan_build(DeltaPlan *plan, const Signature *sig, int fd, HashCtx *hash, uint64_t max_literal);
+void delta_plan_free(DeltaPlan *plan);
+
+#endif // DELTA_PLAN_H
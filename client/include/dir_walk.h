@@ -0,0 +1,102 @@
+#ifndef DIR_WALK_H
+#define DIR_WALK_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stddef.h>
+#include "arena.h"
+#include "node.h"
+
+/*
+ * Parallel directory listing for the scan. Reader threads open each
+ * directory relative to its parent's fd, read it, and fstatat only the
+ * entries d_type can't settle: regular files (for their stat tuple),
+ * symlinks and filesystems that leave d_type unknown. Subdirectories
+ * become new tasks on the reader's own deque. Readers pop their own tasks
+ * newest first, which keeps the walk depth first, and steal the oldest
+ * task from another reader when they run dry.
+ *
+ * The one thread consuming the listings walks them depth first in
+ * readdir order. That keeps the order entries reach the pipeline the same
+ * for any thread count. If it needs a directory no reader has started
+ * yet, it reads that directory itself.
+ */
+
+#define DEFAULT_WALKERS 4
+// listings read ahead of the consumer; each may still hold its fd open
+#define WALK_AHEAD 256
+
+enum { DIR_QUEUED, DIR_READING, DIR_DONE, DIR_SKIPPED };
+
+struct DirScan;
+
+/* a regular file (with its stat tuple) or a directory */
+typedef struct {
+  const char *name;
+  int is_dir;
+  StatInfo st;          // files only
+  struct DirScan *dir;  // directories only: their own listing
+} WalkEntry;
+
+typedef struct DirScan {
+  struct DirScan *parent; // NULL for roots, which are opened by path
+  const char *name;       // relative to the parent
+  int state;              // DIR_*, atomic
+  int failed;             // couldn't be opened; entries are empty
+  DIR *dir;               // open while it or a queued child needs the fd
+  int fd_refs;            // atomic
+  WalkEntry *entries;
+  size_t count;
+} DirScan;
+
+typedef struct {
+  DirScan **slots;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  pthread_mutex_t lock;
+} WalkDeque;
+
+struct DirWalk;
+
+typedef struct {
+  struct DirWalk *walk;
+  WalkDeque deque;
+  Arena arena; // DirScans and their names, freed when the walk stops
+  pthread_t thread;
+} WalkWorker;
+
+typedef struct DirWalk {
+  WalkWorker *workers; // the consumer's own slot, then the readers
+  int nslots;
+  int nthreads;       // readers actually running
+  int tasks;          // queued in any deque, atomic
+  int unconsumed;     // read but not released yet, atomic
+  int idle;           // readers asleep, atomic
+  int stopping;
+  DirScan *waiting;   // listing the consumer is blocked on, atomic
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+} DirWalk;
+
+/* nthreads may be 0: the consumer then reads every directory itself.
+ * Returns -1 on failure. */
+int dir_walk_start(DirWalk *walk, int nthreads);
+
+/* consumer side. A root listing for path, queued for the readers. */
+DirScan *dir_walk_root(DirWalk *walk, const char *path);
+
+/* blocks until ds has been read, reading it here if nobody started yet */
+void dir_walk_wait(DirWalk *walk, DirScan *ds);
+
+/* done with a waited for listing; subdirectories the consumer didn't
+ * descend into must have been discarded first */
+void dir_walk_release(DirWalk *walk, DirScan *ds);
+
+/* the consumer won't look at ds (waited for or not) or anything below it */
+void dir_walk_discard(DirWalk *walk, DirScan *ds);
+
+void dir_walk_stop(DirWalk *walk);
+
+#endif // DIR_WALK_H
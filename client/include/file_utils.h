@@ -3,19 +3,59 @@
 
 #include <stddef.h>
 #include "node.h"
+#include "pipeline.h"
+#include "upload_pool.h"
 
 #define MAX_PATH 1024
-#define MAX_FILE_SIZE 1048576
 
-/* Reads the contents of a file into memory */
-char *readFileContents(const char *filepath, size_t *size);
+/* per-run counters showing which path each regular file took */
+typedef struct {
+  size_t files_scanned;
+  size_t stat_unchanged; // stat tuple matched, hashing skipped
+  size_t rehashed;       // metadata moved (or --paranoid), contents re-read
+  size_t new_files;      // not in the saved tree, hashed for the first time
+  size_t uploaded;
+} ScanStats;
 
-/* Uploads a file to the server and updates its metadata */
-void uploadFile(Node *node, char *filepath, int server_sockt);
+typedef struct {
+  int paranoid; // ignore the stat tuple and rehash every file
+  int threads;  // hashing threads
+  int walkers;  // directory reading threads
+  int shallow;  // don't descend into directories already in the tree
+  const char *ignore; // state file whose family (see isStateFile) isn't backed up at the root
+  ScanStats stats;
+} ScanOptions;
+
+/* Streams a file (or directory entry) to the server and updates its metadata */
+void uploadFile(Node *node, const char *filepath, UploadPool *pool);
 
 /* Processes a node recursively, checking for file changes */
 void processNode(Node *node, const char *currentPath);
 
-void processTree(const char *dirpath, Node *node, int server_socket);
+/* uploader stage: the item's hash is in, decide whether to send it.
+ * Returns 1 if a request for the node went out; it must stay around
+ * until that is acked. */
+int uploadItem(ScanItem *item, UploadPool *pool, ScanOptions *opts);
+
+/* the walker stage alone, on the calling thread: reconciles each of
+ * dirpaths under rootpath (the tree's root) with the tree and queues
+ * changes on the pipeline. The caller consumes them and ends the walk
+ * with pipeline_walk_done. */
+void scanDirs(const char *rootpath, Tree *tree, const char **dirpaths, size_t count,
+	      ScanPipeline *pipeline, ScanOptions *opts);
+
+/* runs the walker on its own thread and uploads its output in walk order */
+void backupTree(const char *dirpath, Tree *tree, ScanPipeline *pipeline, UploadPool *pool, ScanOptions *opts);
+
+/* same for a set of directories under rootpath (the tree's root), in
+ * the given order. Parents must come before their subdirectories. */
+void backupDirs(const char *rootpath, Tree *tree, const char **dirpaths, size_t count,
+		ScanPipeline *pipeline, UploadPool *pool, ScanOptions *opts);
+
+void printScanStats(const ScanStats *stats);
+
+/* 1 if name is one of the files the client keeps next to state: state
+ * itself, its journal, the stream mode state and their temporaries */
+int isStateFile(const char *name, const char *state);
 
 #endif // FILE_UTILS_H
@@ -0,0 +1,70 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "node.h"
+
+/*
+ * Append-only log of the nodes the server acknowledged since
+ * node_data.bin was last saved, so an interrupted backup resumes where it
+ * stopped instead of rehashing and resending everything.
+ *
+ *   JournalHeader | (JournalRecord, path_len bytes of path)*
+ *
+ * Records go out as acks come in and are synced at most
+ * JOURNAL_SYNC_INTERVAL_NS apart. Replaying them onto the saved tree
+ * gives back every node's state as of the last sync; saving the tree
+ * again compacts them away. A crash can leave a torn last record, which
+ * replay drops. Integers are in host byte order, like node_data.bin.
+ */
+#define JOURNAL_MAGIC 0x4a4e5643u /* "CVNJ" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_SYNC_INTERVAL_NS 1000000000ull
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t hash_algo; // of the checksums in the records
+  uint32_t reserved;
+} JournalHeader;
+
+typedef struct {
+  uint32_t path_len;
+  uint32_t type;  // NodeType
+  uint32_t flags; // NODE_REC_*
+  uint32_t reserved;
+  unsigned char checksum[NODE_DIGEST_SIZE];
+  unsigned char blob_id[NODE_DIGEST_SIZE];
+  StatInfo st;
+} JournalRecord;
+
+typedef struct {
+  FILE *file;
+  uint64_t synced_ns;
+  size_t appended; // records since the last reset
+} Journal;
+
+/* applies the journal at path to tree: each record's node is created if
+ * missing, with folders along its path, and takes the recorded state.
+ * A torn tail is cut off. Returns how many records were applied; 0 if
+ * there is no journal or it was written with another hash algorithm. */
+size_t journal_replay(const char *path, Tree *tree, uint32_t hash_algo);
+
+/* opens the journal for appending. One for another algorithm, or
+ * anything unreadable, is started over. Returns -1 on failure. */
+int journal_open(Journal *j, const char *path, uint32_t hash_algo);
+
+/* records that node, which the server knows as path, is uploaded */
+void journal_append(Journal *j, const Node *node, const char *path);
+
+/* forces what was appended to disk */
+int journal_sync(Journal *j);
+
+/* empties the journal, once node_data.bin holds everything in it */
+int journal_reset(Journal *j);
+
+void journal_close(Journal *j);
+
+#endif // JOURNAL_H
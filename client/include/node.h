@@ -1,34 +1,174 @@
 #ifndef NODE_H
 #define NODE_H
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "arena.h"
 
 #define MAX_NAME_LENGTH 256
+#define NODE_DIGEST_SIZE 32
+
+/*
+ * node_data.bin, version 4: a flat image meant to be mmap'd.
+ *
+ *   NodeFileHeader | NodeRecord[node_count] | string table
+ *
+ * Records link to each other by index (NODE_NONE for none); the children
+ * of a node are stored contiguously, so next_sibling is either the
+ * following record or NODE_NONE. Names are NUL terminated strings in the
+ * table, each distinct name stored once. Integers are in host byte order.
+ * A folder's checksum is its Merkle digest, see folder_digests.
+ *
+ * Mapping does not make loading free. node_file_open maps the file and
+ * checks it in one pass over the records, copying nothing; load_tree then
+ * turns every record into a Node, so it is O(n) like the older versions,
+ * only with one allocation for all nodes and none per name.
+ *
+ * Older versions are a recursive stream of fixed size records (version 0
+ * has no header at all); load_tree still reads them.
+ */
+#define NODE_DATA_MAGIC 0x444e5643u /* "CVND" */
+#define NODE_DATA_VERSION 4
+#define NODE_NONE UINT32_MAX
 
 typedef enum { FILE_NODE, FOLDER_NODE } NodeType;
 
+/* stat tuple recorded when a file was last hashed. If none of these move
+ * the contents are assumed unchanged and hashing is skipped. */
+typedef struct {
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ctime_sec;
+  int64_t ctime_nsec;
+  uint64_t ino;
+  uint64_t dev;
+} StatInfo;
+
+// folders with more children than this get a name index
+#define CHILD_INDEX_THRESHOLD 32
+
+struct ChildIndex;
+
 typedef struct Node {
-  char name[MAX_NAME_LENGTH];
-  NodeType type;
-  char *checksum;
-  char *blob_id;
-  int is_uploaded;
-  int is_deleted;
+  const char *name; // owned by the tree's name arena
   struct Node *child;
   struct Node *sibling;
+  struct Node *last_child; // O(1) append
+  struct ChildIndex *index; // name -> child, built on demand for big folders
+  uint32_t child_count;
+  NodeType type;
+  uint8_t is_uploaded;
+  uint8_t is_deleted;
+  uint8_t has_checksum;
+  uint8_t has_blob_id;
+  StatInfo st;
+  unsigned char checksum[NODE_DIGEST_SIZE]; // digest of the contents, see load_tree for the algorithm
+  unsigned char blob_id[NODE_DIGEST_SIZE];  // content address the server stores this file under
 } Node;
 
-Node *create_node(const char *name, NodeType type);
-void add_child(Node *parent, Node *child);
-void free_node(Node *node);
-void free_tree(Node *node);
+/* A directory tree and everything it owns. Nodes and names come from
+ * arenas, so free_tree costs a few calls to free() however big the tree
+ * is. Nodes of deleted subtrees are recycled; their names stay in the
+ * arena until the tree is next loaded from disk. */
+typedef struct Tree {
+  Node *root;
+  Arena nodes;
+  Arena names;
+  Node *free_nodes; // recycled by free_subtree, linked through sibling
+  // set of the names created since load, so repeated ones are stored
+  // once. Names read from node_data.bin are already distinct.
+  const char **interned;
+  size_t interned_capacity;
+  size_t interned_count;
+  struct ChildIndex *indexes; // every live child index
+} Tree;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t hash_algo;  // algorithm the checksums were computed with, 0 if none
+  uint32_t node_count; // record 0 is the root
+  uint64_t strings_offset;
+  uint64_t strings_size;
+} NodeFileHeader;
+
+#define NODE_REC_UPLOADED     1
+#define NODE_REC_HAS_CHECKSUM 2
+#define NODE_REC_HAS_BLOB_ID  4
+
+typedef struct {
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint32_t name;  // offset into the string table
+  uint32_t type;  // NodeType
+  uint32_t flags; // NODE_REC_*
+  unsigned char checksum[NODE_DIGEST_SIZE];
+  unsigned char blob_id[NODE_DIGEST_SIZE];
+  StatInfo st;
+} NodeRecord;
+
+/* read-only view of a mapped node_data.bin. Opening checks the header,
+ * sizes and that the links form a tree, so records can then be used
+ * without further parsing. */
+typedef struct {
+  void *map;
+  size_t size;
+  const NodeFileHeader *header;
+  const NodeRecord *nodes;
+  const char *strings;
+} NodeFile;
+
+/* empty tree whose root folder is called root_name */
+Tree *create_tree(const char *root_name);
+Node *create_node(Tree *tree, const char *name, NodeType type);
+void add_child(Tree *tree, Node *parent, Node *child);
+
+/* O(1) on average: folders above CHILD_INDEX_THRESHOLD children are
+ * looked up through a hash index, smaller ones by scanning */
+Node *find_child(Tree *tree, Node *parent, const char *name);
+
+/* unlinks child, whose predecessor in the sibling list is prev (NULL if
+ * it is the first child). Hand it to free_subtree once nothing refers to
+ * it anymore. */
+void remove_child(Tree *tree, Node *parent, Node *prev, Node *child);
+
+/* returns the nodes of an unlinked subtree to the tree for reuse */
+void free_subtree(Tree *tree, Node *node);
+
+/* releases the tree with all its nodes and names */
+void free_tree(Tree *tree);
 void print_tree(const Node *root, int depth);
-void write_string(FILE *file, const char *str);
-char *read_string(FILE *file);
-void save_node(FILE *file, Node *node);
-Node *load_node(FILE *file);
-void free_node(Node *node);
+
+/* Returns -1 if path is missing, not a version 4 file or malformed. */
+int node_file_open(NodeFile *nf, const char *path);
+void node_file_close(NodeFile *nf);
+
+/* writes the tree to path.tmp, syncs it and renames it over path, so a
+ * crash leaves either the old or the new state. hash_algo is the
+ * algorithm the checksums were computed with. Returns -1 on failure. */
+int save_tree(const char *path, const Tree *tree, uint32_t hash_algo);
+
+/* loads any node_data.bin version, copying every record (O(n)). Sets
+ * hash_algo to 0 when the tree holds no usable checksums. Returns NULL if
+ * the file is unreadable. */
+Tree *load_tree(const char *path, uint32_t *hash_algo);
+
+/* forgets every checksum and blob id, e.g. after switching algorithms */
+void drop_checksums(Node *root);
+
+/* gives folder and everything below it their Merkle digests (hash_folder)
+ * in checksum, from the blob ids of the files, the way the server
+ * computes them from its manifest. Folders without a stored file below
+ * are left without one. Returns -1 on failure. */
+int folder_digests(Node *folder, uint32_t hash_algo);
+
+void stat_info_from(StatInfo *info, const struct stat *st);
+int stat_info_equal(const StatInfo *a, const StatInfo *b);
 
 #endif // NODE_H
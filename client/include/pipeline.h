@@ -0,0 +1,75 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "node.h"
+#include "uploader.h"
+
+/*
+ * Scan pipeline: the directory walk produces ScanItems in walk order, files
+ * that need hashing are fanned out to hashing threads through a bounded
+ * MPMC queue, and the uploader consumes items strictly in walk order, so
+ * what gets sent (and in what order) doesn't depend on the thread count.
+ */
+
+#define DEFAULT_HASH_QUEUE 1024
+#define MAX_PENDING_ITEMS 4096
+
+// ITEM_KNOWN: an entry that needs neither hashing nor uploading, passed
+// along only to keep its place in walk order
+typedef enum { ITEM_DIR, ITEM_FILE, ITEM_KNOWN } ItemKind;
+
+typedef struct ScanItem {
+  ItemKind kind;
+  Node *node;
+  char *path;
+  StatInfo st;          // ITEM_FILE: stat tuple the hash belongs to
+  unsigned char digest[NODE_DIGEST_SIZE]; // filled in by a hashing thread
+  int has_digest;       // 0 if hashing failed
+  int hashed;
+  struct ScanItem *next;
+} ScanItem;
+
+typedef struct {
+  ScanItem **slots;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} HashQueue;
+
+typedef struct ScanPipeline {
+  // items in walk order, walker -> uploader
+  ScanItem *head;
+  ScanItem *tail;
+  size_t pending;
+  int walk_done;
+  pthread_mutex_t lock;
+  pthread_cond_t item_ready;
+  pthread_cond_t space;
+
+  HashQueue hash_queue;
+  pthread_t *hashers;
+  int nhashers;
+  uint32_t hash_algo;
+} ScanPipeline;
+
+int pipeline_init(ScanPipeline *pipeline, int nhashers, uint32_t hash_algo);
+void pipeline_free(ScanPipeline *pipeline);
+
+/* called by the walker */
+void pipeline_add_dir(ScanPipeline *pipeline, Node *node, const char *path);
+void pipeline_add_file(ScanPipeline *pipeline, Node *node, const char *path, const StatInfo *st);
+void pipeline_add_known(ScanPipeline *pipeline, Node *node, const char *path);
+void pipeline_walk_done(ScanPipeline *pipeline);
+
+/* called by the uploader: next item in walk order, once its hash is in.
+ * Returns NULL when the walk is over and everything was handed out. */
+ScanItem *pipeline_next(ScanPipeline *pipeline);
+void pipeline_free_item(ScanItem *item);
+
+#endif // PIPELINE_H
@@ -0,0 +1,33 @@
+#ifndef RECONCILE_H
+#define RECONCILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "node.h"
+
+/*
+ * Checks the saved tree against what the server has actually linked
+ * (--verify). Both sides keep a Merkle digest per folder; the client
+ * asks for the listing of a folder only when the digests above it
+ * differ, a level of the tree per round trip, so a tree that matches
+ * is confirmed with a single request however many files it holds.
+ *
+ * Files the server doesn't hold the way the tree says are marked as not
+ * uploaded, and the scan that follows references them again. Paths only
+ * the server has are counted; the server never deletes anything.
+ */
+typedef struct {
+  size_t rounds;   // round trips
+  size_t listed;   // folders the server listed
+  size_t resend;   // files to reference again
+  size_t extra;    // paths only the server has
+} ReconcileStats;
+
+/* runs the exchange on sock, numbering requests from *seq on; nothing
+ * else may be outstanding on it. Up to window requests are sent at once.
+ * Returns -1 if the connection failed or the server could not list a
+ * folder. */
+int reconcile_tree(Tree *tree, int sock, uint32_t *seq, uint32_t window, uint32_t hash_algo,
+		   ReconcileStats *stats);
+
+#endif // RECONCILE_H
@@ -0,0 +1,35 @@
+#ifndef RESTORER_H
+#define RESTORER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "node.h"
+
+/*
+ * Restore of a backed up tree (--restore). The saved tree says which blob
+ * every file was stored as; the folders are created first, then the
+ * files are spread over several connections, each keeping up to a window
+ * of MSG_GET_BLOB requests outstanding, so the server's disk and the
+ * network stay busy instead of waiting on one blob at a time.
+ *
+ * Each file is written as its blob arrives and hashed on the way; one
+ * whose contents don't match its blob id is removed again. Files get back
+ * the modification time they had when they were backed up.
+ */
+typedef struct {
+  size_t files;
+  uint64_t bytes;
+  size_t failed;  // missing on the server, corrupt, or not writable here
+  size_t skipped; // never acked by the server, so no blob to fetch
+} RestoreStats;
+
+/* restores the files of tree under target, which is created if needed,
+ * fetching their blobs over count connections to addr. hash_algo is the
+ * one the tree's blob ids were computed with. Returns -1 if the restore
+ * could not run or a connection was lost; files that failed on their own
+ * are only counted. */
+int restore_tree(const Tree *tree, const char *target, const struct sockaddr_in *addr, int count,
+		 uint32_t window, uint32_t hash_algo, RestoreStats *stats);
+
+#endif // RESTORER_H
@@ -0,0 +1,47 @@
+#ifndef STREAM_SCAN_H
+#define STREAM_SCAN_H
+
+#include <stdint.h>
+#include "file_utils.h"
+#include "pipeline.h"
+#include "upload_pool.h"
+
+/*
+ * Backup without the tree in memory (--stream), for trees too big for
+ * the machine doing the backup. The state of the last run is a file of
+ * records sorted the way the walk visits the disk:
+ *
+ *   StreamHeader | (JournalRecord, path_len bytes of path)*
+ *
+ * Each directory's entries come sorted by name, and a subdirectory's
+ * contents follow it directly. The walk lists one directory at a time in
+ * that same order and merge-joins it with the old records as it goes,
+ * read one at a time: a path on both sides is compared by its stat tuple
+ * as usual, one only on disk is new, and one only in the old state is
+ * gone. The new state is written in walk order to a temporary file.
+ * Records of entries sent to the server are filled in once their acks
+ * are in, STREAM_BATCH at a time. The file replaces the old one at the
+ * end. Memory use then depends on the directories along the current path
+ * and the entries in flight, not on the size of the tree.
+ *
+ * Records are the journal's, integers in host byte order.
+ */
+#define STREAM_MAGIC 0x53564e43u /* "CNVS" */
+#define STREAM_VERSION 1
+#define STREAM_BATCH 4096 // entries sent to the server between settling their records
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t hash_algo; // of the checksums in the records
+  uint32_t reserved;
+} StreamHeader;
+
+/* backs up dirpath against the state in path and writes the new state
+ * there. A state from another hash algorithm, or none at all, means
+ * every file is hashed. Returns -1 if the new state could not be written;
+ * the old one is kept then. */
+int stream_backup(const char *dirpath, const char *path, ScanPipeline *pipeline, UploadPool *pool,
+		  ScanOptions *opts, uint32_t hash_algo);
+
+#endif // STREAM_SCAN_H
@@ -0,0 +1,56 @@
+#ifndef UPLOAD_POOL_H
+#define UPLOAD_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "node.h"
+#include "uploader.h"
+
+#define MAX_CONNECTIONS 64
+
+/*
+ * Several pipelined connections to the server, so that one slow stream
+ * (a single TCP window, one strand of disk jobs on the server) doesn't
+ * cap the whole backup.
+ *
+ * Each file goes to the connection with the fewest bytes outstanding,
+ * except that every copy of a blob goes where its first copy went: the
+ * per-connection dedup and ordering in Uploader then hold as before.
+ * Directories all go over the first connection; the server creates
+ * missing parents itself when a file overtakes its directory.
+ *
+ * Files of STRIPE_MIN_SIZE and up are split into STRIPE_PART_SIZE parts,
+ * each sent over whichever connection has the least outstanding at that
+ * moment. The connection the file was routed to references it once all
+ * parts are acked.
+ *
+ * With one connection this is just that uploader.
+ */
+typedef struct {
+  Uploader *conns;
+  int count;
+} UploadPool;
+
+/* connects count sockets to addr and says hello on each. Returns -1 on
+ * failure, with nothing left open. */
+int upload_pool_init(UploadPool *pool, int count, const struct sockaddr_in *addr, uint32_t window,
+		     uint32_t hash_algo, int compress_level);
+
+/* queue requests; see uploader_put_dir and uploader_put_ref */
+int upload_pool_put_dir(UploadPool *pool, Node *node, const char *path);
+int upload_pool_put_ref(UploadPool *pool, Node *node, const char *path);
+
+/* uploader_flush for all connections at once */
+int upload_pool_flush(UploadPool *pool);
+
+/* flushes, then tells the server we're done on every connection */
+int upload_pool_finish(UploadPool *pool);
+
+/* the counters of all connections added up; codec is the first's */
+void upload_pool_totals(const UploadPool *pool, Uploader *sum);
+
+/* frees the uploaders and closes their sockets */
+void upload_pool_free(UploadPool *pool);
+
+#endif // UPLOAD_POOL_H
@@ -0,0 +1,224 @@
+#ifndef UPLOADER_H
+#define UPLOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "compress.h"
+#include "hash.h"
+#include "journal.h"
+#include "node.h"
+
+// smaller files the server asks for are sent in packs of about this size
+#define PACK_MAX_FILE_SIZE (64 * 1024)
+#define PACK_TARGET_SIZE (4 * 1024 * 1024)
+// with more than one connection, bigger files go out in parts of this size
+#define STRIPE_MIN_SIZE (32 * 1024 * 1024)
+#define STRIPE_PART_SIZE (8 * 1024 * 1024)
+
+/* small file in a pack, or a file in a MSG_HAVE */
+typedef struct PackedFile {
+  Node *node;
+  char *path;
+  struct PackedFile *next;
+} PackedFile;
+
+struct Uploader;
+
+/* file big enough to go out in parts over several connections */
+typedef struct Stripe {
+  Node *node;
+  char *path;
+  struct Uploader *origin; // where the file is referenced once all parts are in
+  uint32_t parts_left;
+  int failed;
+  PackedFile *copies; // asked for meanwhile, referenced along with it
+  struct Stripe *next; // in origin->stripes
+} Stripe;
+
+/* a request that has been sent but not acknowledged yet */
+typedef struct {
+  Node *node;
+  char *path;
+  uint32_t seq;
+  uint32_t type;
+  int in_use;
+  int reref; // PUT_REF re-sent after the blob went out; must not ask again
+  PackedFile *packed; // MSG_PUT_PACK, MSG_HAVE: the files in it, node is NULL
+  Stripe *stripe;     // MSG_PUT_PART: the file it is part of
+  uint64_t bytes;     // counted in outstanding
+} InFlight;
+
+/* blob ids sent this session (open addressing, power of two capacity) */
+typedef struct {
+  unsigned char *ids;
+  unsigned char *used;
+  size_t capacity;
+  size_t count;
+} BlobSet;
+
+/* MSG_PUT_PACK being filled: index and contents are built up in memory
+ * and go out in one request once either is big enough */
+typedef struct {
+  PackedFile *head;
+  PackedFile *tail;
+  uint32_t count;
+  BlobSet ids;          // of the files in it
+  PackedFile *copies;   // of those, referenced once the pack is out
+  PackedFile *copies_tail;
+  unsigned char *index; // PACK_MAX_INDEX bytes
+  size_t index_len;
+  unsigned char *data;  // PACK_TARGET_SIZE + PACK_MAX_FILE_SIZE bytes
+  size_t data_len;
+} PackBuilder;
+
+/* MSG_HAVE being filled */
+typedef struct {
+  PackedFile *head;
+  PackedFile *tail;
+  uint32_t count;
+  unsigned char *body; // HAVE_MAX_BODY bytes
+  size_t body_len;
+} HaveBatch;
+
+/* file the server asked for with ACK_NEED_DATA, or whose basis
+ * signature came back, or one a MSG_HAVE found missing */
+typedef struct NeedData {
+  Node *node;
+  char *path;
+  int ref;            // MSG_NEEDED: only send a reference for now
+  int reref;          // ...after all parts of it went out; must not ask again
+  int whole;          // no delta: send it all
+  unsigned char *sig; // MSG_SIGNATURE body to send a delta against
+  size_t sig_len;
+  uint64_t resume_at; // MSG_RESUME: the server kept this much of it
+  struct NeedData *next;
+} NeedData;
+
+/*
+ * Pipelined connection to the server. Up to `window` requests are kept in
+ * flight; acks are consumed whenever they show up and mark the matching
+ * Node as uploaded. Files are referenced by blob id first and only sent
+ * in full when the server doesn't have the blob yet.
+ *
+ * If the server accepts a codec, blob contents go out as compressed
+ * frames. A sample of each larger file is compressed first, and files
+ * that don't shrink (media, archives) are sent raw with sendfile.
+ *
+ * A changed file whose previous version went to the server before (its
+ * node still has the old blob id) is sent as a delta against that
+ * version when it is big enough to be worth the extra round trip.
+ *
+ * Files under PACK_MAX_FILE_SIZE the server asks for are read into a
+ * pack instead, which goes out as one MSG_PUT_PACK of a few MB.
+ *
+ * When the server still has the start of a big blob from a connection
+ * that broke, it answers the reference with MSG_RESUME and only the rest
+ * is sent.
+ *
+ * With query_have set, files that were never uploaded from this tree are
+ * first looked up in batches of MSG_HAVE, and only those the server
+ * doesn't hold at their path yet are referenced.
+ *
+ * An uploader is one connection. With stripe set, blobs of STRIPE_MIN_SIZE
+ * and up are handed to it instead of being sent, so that an UploadPool
+ * can spread their parts over all of its connections.
+ */
+typedef struct Uploader {
+  int sock;
+  uint32_t next_seq;
+  uint32_t window;
+  uint32_t in_flight;
+  InFlight *slots; // indexed by seq % window
+  NeedData *need_head;
+  NeedData *need_tail;
+  int sending_needed;
+  BlobSet sent; // a later copy of one of these only needs a reference
+  Journal *journal; // acked nodes are recorded here, if set
+  size_t acked_ok;
+  size_t acked_failed;
+  size_t blobs_sent;    // contents actually transferred
+  size_t blobs_deduped; // server already had the blob
+
+  uint32_t codec; // agreed with the server, COMPRESS_NONE if off
+  Compressor comp;
+  unsigned char *frame_raw;    // STREAM_CHUNK_SIZE bytes each
+  unsigned char *frame_packed;
+  uint64_t content_bytes; // blob contents sent
+  uint64_t wire_bytes;    // what they took on the wire
+  size_t blobs_compressed;     // sent as frames
+  size_t blobs_incompressible; // sent raw after probing
+
+  int no_delta;
+  HashCtx hash;         // strong checksums of delta blocks
+  size_t blobs_delta;   // sent as deltas
+  uint64_t delta_bytes; // their size
+  uint64_t delta_wire;  // what their deltas took on the wire
+
+  int no_pack;
+  PackBuilder pack;
+  size_t packs_sent;
+  size_t blobs_packed; // files sent in them
+
+  size_t blobs_resumed;    // continued from a partial the server kept
+  uint64_t resumed_bytes;  // what that saved sending
+
+  int query_have;
+  HaveBatch have;
+  size_t have_queries;
+  size_t have_known; // files the server already had at their path
+
+  uint64_t outstanding; // bytes of requests not acked yet, see uploader_put_ref
+  BlobSet routed;       // ids an UploadPool sent this way
+  int (*stripe)(void *ctx, struct Uploader *up, Node *node, const char *path, int fd, uint64_t size);
+  void *stripe_ctx;
+  Stripe *stripes;      // started here and not done yet
+  size_t blobs_striped; // sent in parts, counted where they were asked for
+  size_t parts_sent;
+} Uploader;
+
+/* says MSG_HELLO on a fresh connection, offering the codecs (a bit per
+ * codec) to compress with. The server must accept blob ids hashed with
+ * hash_algo; codec is set to the one it picked. Returns -1 on failure. */
+int session_hello(int sock, uint32_t hash_algo, uint32_t codecs, uint32_t *codec);
+
+/* exchanges MSG_HELLO with the server, which must accept blob ids hashed
+ * with hash_algo. compress_level 0 turns compression off. Returns 0 on
+ * success. */
+int uploader_init(Uploader *up, int sock, uint32_t window, uint32_t hash_algo, int compress_level);
+
+/* queue requests; the node is marked uploaded when the server acks */
+int uploader_put_dir(Uploader *up, Node *node, const char *path);
+int uploader_put_ref(Uploader *up, Node *node, const char *path);
+
+/* sends len bytes of the open file at offset as one MSG_PUT_PART of its
+ * size bytes. Once the last part of stripe is acked, the file is
+ * referenced on stripe->origin. */
+int uploader_put_part(Uploader *up, Stripe *stripe, int fd, uint64_t offset, uint64_t len, uint64_t size);
+
+/* for a pool flushing several uploaders at once: reads the acks that
+ * arrived if readable is set, then sends everything queued, packs and
+ * have queries that aren't full yet included. Only waits for acks if
+ * the window fills up. */
+int uploader_service(Uploader *up, int readable);
+
+/* 0 while there are requests in flight or queued to be sent */
+int uploader_idle(const Uploader *up);
+
+int blob_set_contains(const BlobSet *set, const unsigned char *id);
+void blob_set_add(BlobSet *set, const unsigned char *id);
+
+/* handles acks that have arrived. If block is set, waits for at least one
+ * batch. Returns -1 if the connection broke. */
+int uploader_poll(Uploader *up, int block);
+
+/* sends the pack and have query being filled, then waits for every outstanding ack,
+ * sending any blobs the server still asks for. Afterwards no request
+ * refers to a node anymore. */
+int uploader_flush(Uploader *up);
+
+/* flushes, then tells the server we're done */
+int uploader_finish(Uploader *up);
+
+void uploader_free(Uploader *up);
+
+#endif // UPLOADER_H
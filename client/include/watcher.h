@@ -0,0 +1,52 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <signal.h>
+#include <stddef.h>
+
+/*
+ * inotify based change tracking for --watch. Every directory under the
+ * root gets a watch; events are coalesced into a set of dirty directories
+ * which the caller then rescans shallowly. If the kernel's event queue
+ * overflows, events were lost and the caller has to fall back to a full
+ * scan.
+ */
+
+// wait this long without new events before handing over a batch...
+#define WATCH_DEBOUNCE_MS 100
+// ...but never hold on to the first event of a batch for longer than this
+#define WATCH_MAX_DELAY_MS 1000
+
+typedef struct {
+  int fd;
+  const char *root;
+  const char *ignore; // state file whose family (see isStateFile) at the root is not ours to back up
+
+  char **paths; // directory of each watch descriptor, NULL if unused
+  char *dirty_flag;
+  int capacity;
+
+  int *dirty; // watch descriptors with pending changes
+  int dirty_count;
+  int overflowed;
+  int out_of_watches; // warned about the inotify watch limit
+} Watcher;
+
+/* Returns -1 if inotify is unavailable. */
+int watcher_init(Watcher *w, const char *root, const char *ignore);
+void watcher_free(Watcher *w);
+
+/* watches dirpath and every directory below it */
+void watcher_add_tree(Watcher *w, const char *dirpath);
+
+/* blocks until a batch of changes has settled. Returns 1 with the dirty
+ * set (or overflowed) filled in, 0 if *stop was raised, -1 on error. */
+int watcher_wait(Watcher *w, volatile sig_atomic_t *stop);
+
+/* dirty directory paths, sorted so parents precede their subdirectories.
+ * The array is malloc'd, the strings belong to the watcher. */
+const char **watcher_dirty_paths(Watcher *w, size_t *count);
+
+void watcher_clear(Watcher *w);
+
+#endif // WATCHER_H
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+void arena_init(Arena *arena, size_t block_size) {
+  arena->head = NULL;
+  arena->block_size = block_size;
+}
+
+static ArenaBlock *new_block(size_t size) {
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+  if (!block) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+/* offset of the next allocation in block, or SIZE_MAX if it doesn't fit */
+static size_t fit(const ArenaBlock *block, size_t size, size_t align) {
+  uintptr_t base = (uintptr_t)(block + 1);
+  size_t offset = (size_t)(((base + block->used + align - 1) & ~(uintptr_t)(align - 1)) - base);
+  return offset <= block->size && size <= block->size - offset ? offset : SIZE_MAX;
+}
+
+void *arena_alloc(Arena *arena, size_t size, size_t align) {
+  ArenaBlock *block = arena->head;
+  size_t offset = block ? fit(block, size, align) : SIZE_MAX;
+  if (offset == SIZE_MAX) {
+    if (size + align > arena->block_size / 4) {
+      // big requests get a block of their own, behind the current one so
+      // its free space isn't wasted
+      block = new_block(size + align);
+      if (arena->head) {
+	block->next = arena->head->next;
+	arena->head->next = block;
+      } else {
+	arena->head = block;
+      }
+    } else {
+      block = new_block(arena->block_size);
+      block->next = arena->head;
+      arena->head = block;
+    }
+    offset = fit(block, size, align);
+  }
+  block->used = offset + size;
+  return (char *)(block + 1) + offset;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+  size_t len = strlen(str) + 1;
+  char *copy = arena_alloc(arena, len, 1);
+  memcpy(copy, str, len);
+  return copy;
+}
+
+void arena_free(Arena *arena) {
+  ArenaBlock *block = arena->head;
+  while (block) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->head = NULL;
+}
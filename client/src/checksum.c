@@ -1,75 +1,70 @@
 #include "checksum.h"
-#include <openssl/evp.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-char *calculateChecksum(const char *filepath) {
-  FILE *file = fopen(filepath, "rb");
-  if (!file) {
-    perror("Failed to open file for checksum calculation");
-    return NULL;
-  }
-
-  EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
-  if (!md_ctx) {
-    fclose(file);
-    perror("Failed to create EVP_MD_CTX");
-    return NULL;
+int checksummer_init(Checksummer *cs, uint32_t algo) {
+  cs->buf = NULL;
+  if (hash_ctx_init(&cs->hash, algo) == -1) {
+    fprintf(stderr, "Failed to set up %s hashing\n", hash_name(algo) ? hash_name(algo) : "unknown");
+    return -1;
   }
-
-  const EVP_MD *md = EVP_MD_fetch(NULL, "MD5", NULL);
-  if (!md) {
-    EVP_MD_CTX_free(md_ctx);
-    fclose(file);
-    perror("Failed to fetch MD5 algorithm");
-    return NULL;
+  void *buf;
+  if (posix_memalign(&buf, 4096, CHECKSUM_BUF_SIZE) != 0) {
+    perror("Failed to allocate checksum buffer");
+    hash_ctx_free(&cs->hash);
+    return -1;
   }
+  cs->buf = buf;
+  return 0;
+}
 
-  if (EVP_DigestInit_ex(md_ctx, md, NULL) <= 0) {
-    EVP_MD_free((EVP_MD *)md);
-    EVP_MD_CTX_free(md_ctx);
-    fclose(file);
-    perror("Failed to initialize MD5 digest");
-    return NULL;
-  }
+void checksummer_free(Checksummer *cs) {
+  hash_ctx_free(&cs->hash);
+  free(cs->buf);
+  cs->buf = NULL;
+}
 
-  unsigned char data[1024];
-  size_t bytes;
-  while ((bytes = fread(data, 1, sizeof(data), file)) > 0) {
-    if (EVP_DigestUpdate(md_ctx, data, bytes) <= 0) {
-      EVP_MD_free((EVP_MD *)md);
-      EVP_MD_CTX_free(md_ctx);
-      fclose(file);
-      perror("Failed to update MD5 digest");
-      return NULL;
-    }
+int calculateChecksum(Checksummer *cs, const char *filepath, unsigned char *digest) {
+  int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("Failed to open file for checksum calculation");
+    return -1;
   }
+  // we read front to back exactly once
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-  unsigned char hash[EVP_MAX_MD_SIZE];
-  unsigned int hash_len;
-  if (EVP_DigestFinal_ex(md_ctx, hash, &hash_len) <= 0) {
-    EVP_MD_free((EVP_MD *)md);
-    EVP_MD_CTX_free(md_ctx);
-    fclose(file);
-    perror("Failed to finalize MD5 digest");
-    return NULL;
+  if (hash_begin(&cs->hash) == -1) {
+    fprintf(stderr, "Failed to initialize digest\n");
+    close(fd);
+    return -1;
   }
 
-  EVP_MD_free((EVP_MD *)md);
-  EVP_MD_CTX_free(md_ctx);
-  fclose(file);
-
-  char *result = malloc((hash_len * 2) + 1);
-  if (!result) {
-    perror("Failed to allocate memory for checksum");
-    return NULL;
+  while (1) {
+    ssize_t n = read(fd, cs->buf, CHECKSUM_BUF_SIZE);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to read file for checksum calculation");
+      close(fd);
+      return -1;
+    }
+    if (hash_update(&cs->hash, cs->buf, (size_t)n) == -1) {
+      fprintf(stderr, "Failed to update digest\n");
+      close(fd);
+      return -1;
+    }
   }
+  close(fd);
 
-  for (unsigned int i = 0; i < hash_len; i++) {
-    sprintf(result + (i * 2), "%02x", hash[i]);
+  if (hash_finish(&cs->hash, digest) == -1) {
+    fprintf(stderr, "Failed to finalize digest\n");
+    return -1;
   }
-  result[hash_len * 2] = '\0';
-
-  return result;
+  return 0;
 }
@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "delta_plan.h"
+#include "protocol.h"
+
+// file bytes read at a time, on top of a block of lookahead
+#define PLAN_READ_SIZE (1024 * 1024)
+#define NO_BLOCK UINT32_MAX
+
+/* weak checksum -> full size block of the basis, open addressing.
+ * Identical blocks are stored once. */
+typedef struct {
+  uint32_t *slots;
+  size_t mask;
+  unsigned shift;
+} BlockIndex;
+
+/* window of the file being matched: bytes [off, off + len) */
+typedef struct {
+  int fd;
+  unsigned char *buf;
+  size_t cap;
+  uint64_t off;
+  size_t len;
+  int eof;
+} Window;
+
+static size_t index_slot(const BlockIndex *ix, uint32_t weak) {
+  // weak sums of similar data share their low bits; spread them first
+  return (size_t)((weak * 0x9e3779b1u) >> ix->shift) & ix->mask;
+}
+
+static int index_build(BlockIndex *ix, const Signature *sig, uint32_t full_blocks) {
+  size_t capacity = 16;
+  unsigned bits = 4;
+  while (capacity < (size_t)full_blocks * 2) {
+    capacity *= 2;
+    bits++;
+  }
+  ix->slots = malloc(capacity * sizeof(uint32_t));
+  if (!ix->slots) {
+    return -1;
+  }
+  memset(ix->slots, 0xff, capacity * sizeof(uint32_t));
+  ix->mask = capacity - 1;
+  ix->shift = 32 - bits;
+
+  for (uint32_t b = 0; b < full_blocks; b++) {
+    uint32_t weak = signature_weak(sig, b);
+    size_t i = index_slot(ix, weak);
+    while (ix->slots[i] != NO_BLOCK) {
+      uint32_t other = ix->slots[i];
+      if (signature_weak(sig, other) == weak &&
+	  memcmp(signature_strong(sig, other), signature_strong(sig, b), DELTA_STRONG_SIZE) == 0) {
+	break;
+      }
+      i = (i + 1) & ix->mask;
+    }
+    if (ix->slots[i] == NO_BLOCK) {
+      ix->slots[i] = b;
+    }
+  }
+  return 0;
+}
+
+/* full size block of the basis equal to p[0..block_size), or NO_BLOCK.
+ * hint, the block after the previous match, is tried first so that
+ * unchanged stretches come out as one run. */
+static uint32_t find_block(const BlockIndex *ix, const Signature *sig, uint32_t full_blocks,
+			   uint32_t weak, const unsigned char *p, uint32_t hint, HashCtx *hash) {
+  unsigned char strong[DELTA_STRONG_SIZE];
+  int have_strong = 0;
+  if (hint < full_blocks && signature_weak(sig, hint) == weak) {
+    if (delta_strong(hash, p, sig->block_size, strong) == -1) {
+      return NO_BLOCK;
+    }
+    have_strong = 1;
+    if (memcmp(strong, signature_strong(sig, hint), DELTA_STRONG_SIZE) == 0) {
+      return hint;
+    }
+  }
+  for (size_t i = index_slot(ix, weak); ix->slots[i] != NO_BLOCK; i = (i + 1) & ix->mask) {
+    uint32_t b = ix->slots[i];
+    if (signature_weak(sig, b) != weak) {
+      continue;
+    }
+    if (!have_strong) {
+      if (delta_strong(hash, p, sig->block_size, strong) == -1) {
+	return NO_BLOCK;
+      }
+      have_strong = 1;
+    }
+    if (memcmp(strong, signature_strong(sig, b), DELTA_STRONG_SIZE) == 0) {
+      return b;
+    }
+  }
+  return NO_BLOCK;
+}
+
+/* makes the window hold [pos, pos + want), or as much of it as the file
+ * has. pos never moves backwards. Returns NULL on read errors. */
+static const unsigned char *window_at(Window *w, uint64_t pos, size_t want, size_t *avail) {
+  if (pos + want > w->off + w->len && !w->eof) {
+    size_t keep = (size_t)(w->off + w->len - pos);
+    memmove(w->buf, w->buf + (pos - w->off), keep);
+    w->off = pos;
+    w->len = keep;
+    while (w->len < w->cap) {
+      ssize_t n = read(w->fd, w->buf + w->len, w->cap - w->len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+	return NULL;
+      }
+      if (n == 0) {
+	w->eof = 1;
+	break;
+      }
+      w->len += (size_t)n;
+    }
+  }
+  size_t have = (size_t)(w->off + w->len - pos);
+  *avail = have < want ? have : want;
+  return w->buf + (pos - w->off);
+}
+
+static int push_op(DeltaPlan *plan, uint32_t kind, uint64_t start, uint32_t count) {
+  if (plan->count == plan->capacity) {
+    size_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+    DeltaOp *ops = realloc(plan->ops, capacity * sizeof(DeltaOp));
+    if (!ops) {
+      return -1;
+    }
+    plan->ops = ops;
+    plan->capacity = capacity;
+  }
+  DeltaOp *op = &plan->ops[plan->count++];
+  op->kind = kind;
+  op->start = start;
+  op->count = count;
+  return 0;
+}
+
+/* file bytes [from, to) that matched nothing, in ops of at most a chunk */
+static int emit_literal(DeltaPlan *plan, uint64_t from, uint64_t to) {
+  while (from < to) {
+    uint32_t n = to - from < STREAM_CHUNK_SIZE ? (uint32_t)(to - from) : STREAM_CHUNK_SIZE;
+    if (push_op(plan, DELTA_OP_LITERAL, from, n) == -1) {
+      return -1;
+    }
+    plan->literal_bytes += n;
+    plan->wire_size += DELTA_LITERAL_SIZE + n;
+    from += n;
+  }
+  return 0;
+}
+
+static int emit_copy(DeltaPlan *plan, uint32_t block) {
+  if (plan->count > 0) {
+    DeltaOp *last = &plan->ops[plan->count - 1];
+    if (last->kind == DELTA_OP_COPY && last->start + last->count == block) {
+      last->count++;
+      return 0;
+    }
+  }
+  plan->wire_size += DELTA_COPY_SIZE;
+  return push_op(plan, DELTA_OP_COPY, block, 1);
+}
+
+int delta_plan_build(DeltaPlan *plan, const Signature *sig, int fd, HashCtx *hash, uint64_t max_literal) {
+  memset(plan, 0, sizeof(*plan));
+  uint32_t block = sig->block_size;
+  uint32_t full_blocks = (uint32_t)(sig->basis_size / block);
+  size_t tail_len = (size_t)(sig->basis_size % block);
+
+  BlockIndex ix;
+  if (index_build(&ix, sig, full_blocks) == -1) {
+    return -1;
+  }
+  Window w = { fd, NULL, block + PLAN_READ_SIZE, 0, 0, 0 };
+  w.buf = malloc(w.cap);
+  if (!w.buf) {
+    free(ix.slots);
+    return -1;
+  }
+
+  int status = 0;
+  uint64_t pos = 0;
+  uint64_t literal_start = 0;
+  uint32_t hint = NO_BLOCK;
+  RollSum rs;
+  int rolling = 0;
+  const unsigned char *p;
+  size_t avail;
+  while (1) {
+    if (!(p = window_at(&w, pos, block + 1, &avail))) {
+      status = -1;
+      break;
+    }
+    if (avail < block) {
+      break;
+    }
+    if (!rolling) {
+      rollsum_init(&rs, p, block);
+      rolling = 1;
+    }
+    uint32_t match = find_block(&ix, sig, full_blocks, rollsum_digest(&rs), p, hint, hash);
+    if (match != NO_BLOCK) {
+      if (emit_literal(plan, literal_start, pos) == -1 || emit_copy(plan, match) == -1) {
+	status = -1;
+	break;
+      }
+      pos += block;
+      literal_start = pos;
+      hint = match + 1;
+      rolling = 0;
+      continue;
+    }
+    if (avail == block) {
+      break; // the window ends at EOF, nothing left to roll in
+    }
+    if (plan->literal_bytes + (pos - literal_start) > max_literal) {
+      status = 1;
+      break;
+    }
+    rollsum_roll(&rs, p[0], p[block]);
+    pos++;
+  }
+
+  if (status == 0 && !(p = window_at(&w, pos, block, &avail))) {
+    status = -1;
+  }
+  if (status == 0) {
+    uint64_t end = pos + avail;
+    // the basis' short last block can only match the very end of the file
+    if (tail_len > 0 && avail == tail_len) {
+      uint32_t last = sig->block_count - 1;
+      unsigned char strong[DELTA_STRONG_SIZE];
+      RollSum tail;
+      rollsum_init(&tail, p, avail);
+      if (rollsum_digest(&tail) == signature_weak(sig, last) && delta_strong(hash, p, avail, strong) == 0 &&
+	  memcmp(strong, signature_strong(sig, last), DELTA_STRONG_SIZE) == 0) {
+	status = emit_literal(plan, literal_start, pos) == -1 || emit_copy(plan, last) == -1 ? -1 : 0;
+	literal_start = end;
+      }
+    }
+    if (status == 0) {
+      status = emit_literal(plan, literal_start, end);
+    }
+    if (status == 0 && plan->literal_bytes > max_literal) {
+      status = 1;
+    }
+    plan->size = end;
+  }
+
+  free(w.buf);
+  free(ix.slots);
+  if (status != 0) {
+    delta_plan_free(plan);
+  }
+  return status;
+}
+
+void delta_plan_free(DeltaPlan *plan) {
+  free(plan->ops);
+  plan->ops = NULL;
+  plan->count = plan->capacity = 0;
+}
@@ -0,0 +1,352 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "dir_walk.h"
+#include "metrics.h"
+
+#define WALK_ARENA_BLOCK (256 * 1024)
+
+static void deque_init(WalkDeque *dq) {
+  memset(dq, 0, sizeof(*dq));
+  pthread_mutex_init(&dq->lock, NULL);
+}
+
+static void deque_free(WalkDeque *dq) {
+  free(dq->slots);
+  pthread_mutex_destroy(&dq->lock);
+}
+
+/* the owner's end */
+static void deque_push(WalkDeque *dq, DirScan *ds) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count == dq->capacity) {
+    size_t capacity = dq->capacity ? dq->capacity * 2 : 64;
+    DirScan **slots = malloc(capacity * sizeof(DirScan *));
+    if (!slots) {
+      perror("Failed to grow walk queue");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < dq->count; i++) {
+      slots[i] = dq->slots[(dq->head + i) % dq->capacity];
+    }
+    free(dq->slots);
+    dq->slots = slots;
+    dq->capacity = capacity;
+    dq->head = 0;
+  }
+  dq->slots[(dq->head + dq->count) % dq->capacity] = ds;
+  dq->count++;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+/* newest task, for the owner */
+static DirScan *deque_pop(WalkDeque *dq) {
+  DirScan *ds = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count > 0) {
+    dq->count--;
+    ds = dq->slots[(dq->head + dq->count) % dq->capacity];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return ds;
+}
+
+/* oldest task, usually the biggest subtree, for everybody else */
+static DirScan *deque_steal(WalkDeque *dq) {
+  DirScan *ds = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->count > 0) {
+    ds = dq->slots[dq->head];
+    dq->head = (dq->head + 1) % dq->capacity;
+    dq->count--;
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return ds;
+}
+
+static void wake_readers(DirWalk *walk) {
+  if (__atomic_load_n(&walk->idle, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&walk->lock);
+    pthread_cond_broadcast(&walk->work_cond);
+    pthread_mutex_unlock(&walk->lock);
+  }
+}
+
+static void queue_task(WalkWorker *self, DirScan *ds) {
+  deque_push(&self->deque, ds);
+  __atomic_add_fetch(&self->walk->tasks, 1, __ATOMIC_SEQ_CST);
+}
+
+static DirScan *take_task(WalkWorker *self) {
+  DirWalk *walk = self->walk;
+  DirScan *ds = deque_pop(&self->deque);
+  int me = (int)(self - walk->workers);
+  for (int i = 1; !ds && i < walk->nslots; i++) {
+    ds = deque_steal(&walk->workers[(me + i) % walk->nslots].deque);
+  }
+  if (ds) {
+    __atomic_sub_fetch(&walk->tasks, 1, __ATOMIC_SEQ_CST);
+  }
+  return ds;
+}
+
+static int claim(DirScan *ds, int to) {
+  int expected = DIR_QUEUED;
+  return __atomic_compare_exchange_n(&ds->state, &expected, to, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void release_fd(DirScan *ds) {
+  if (__atomic_sub_fetch(&ds->fd_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    closedir(ds->dir);
+  }
+}
+
+static void finish(DirWalk *walk, DirScan *ds) {
+  __atomic_add_fetch(&walk->unconsumed, 1, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&ds->state, DIR_DONE, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&walk->waiting, __ATOMIC_SEQ_CST) == ds) {
+    pthread_mutex_lock(&walk->lock);
+    pthread_cond_broadcast(&walk->done_cond);
+    pthread_mutex_unlock(&walk->lock);
+  }
+}
+
+static void add_entry(DirScan *ds, size_t *capacity, const WalkEntry *entry) {
+  if (ds->count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 32;
+    WalkEntry *entries = realloc(ds->entries, *capacity * sizeof(WalkEntry));
+    if (!entries) {
+      perror("Failed to allocate directory listing");
+      exit(EXIT_FAILURE);
+    }
+    ds->entries = entries;
+  }
+  ds->entries[ds->count++] = *entry;
+}
+
+/* lists ds, which self has claimed. Subdirectories are queued on self's
+ * deque if queue_children is set, first one on top. */
+static void read_dir(WalkWorker *self, DirScan *ds, int queue_children) {
+  int at = ds->parent ? dirfd(ds->parent->dir) : AT_FDCWD;
+  int fd = openat(at, ds->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (ds->parent) {
+    release_fd(ds->parent);
+  }
+  if (fd == -1 || !(ds->dir = fdopendir(fd))) {
+    perror("Failed to open directory");
+    if (fd != -1) {
+      close(fd);
+    }
+    ds->failed = 1;
+    finish(self->walk, ds);
+    return;
+  }
+  fd = dirfd(ds->dir);
+  ds->fd_refs = 1; // ours, until the listing is complete
+
+  size_t capacity = 0;
+  size_t subdirs = 0;
+  struct dirent *d;
+  while ((d = readdir(ds->dir)) != NULL) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+      continue;
+    }
+    WalkEntry entry = { 0 };
+    int flags = 0;
+    switch (d->d_type) {
+    case DT_DIR:
+      entry.is_dir = 1;
+      break;
+    case DT_REG:
+      flags = AT_SYMLINK_NOFOLLOW;
+      break;
+    case DT_LNK:
+    case DT_UNKNOWN:
+      flags = 0; // links are followed, as they always were
+      break;
+    default:
+      continue; // devices, fifos and sockets are never backed up
+    }
+    if (!entry.is_dir) {
+      struct stat st;
+      uint64_t start = metrics_now();
+      int status = fstatat(fd, d->d_name, &st, flags);
+      metrics_since(METRIC_STAT, start, 0);
+      if (status == -1) {
+	perror("Failed to get file stats");
+	continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+	entry.is_dir = 1;
+      } else if (S_ISREG(st.st_mode)) {
+	stat_info_from(&entry.st, &st);
+      } else {
+	continue;
+      }
+    }
+    entry.name = arena_strdup(&self->arena, d->d_name);
+    if (entry.is_dir) {
+      DirScan *child = arena_alloc(&self->arena, sizeof(DirScan), _Alignof(DirScan));
+      memset(child, 0, sizeof(*child));
+      child->parent = ds;
+      child->name = entry.name;
+      child->state = DIR_QUEUED;
+      entry.dir = child;
+      subdirs++;
+    }
+    add_entry(ds, &capacity, &entry);
+  }
+  __atomic_add_fetch(&ds->fd_refs, subdirs, __ATOMIC_ACQ_REL);
+  if (queue_children && subdirs > 0) {
+    for (size_t i = ds->count; i-- > 0;) {
+      if (ds->entries[i].is_dir) {
+	queue_task(self, ds->entries[i].dir);
+      }
+    }
+    wake_readers(self->walk);
+  }
+  // children may already be open; the fd goes when the last one is
+  release_fd(ds);
+  finish(self->walk, ds);
+}
+
+static void *reader_main(void *arg) {
+  WalkWorker *self = arg;
+  DirWalk *walk = self->walk;
+  while (1) {
+    DirScan *ds = NULL;
+    if (__atomic_load_n(&walk->unconsumed, __ATOMIC_SEQ_CST) < WALK_AHEAD) {
+      ds = take_task(self);
+    }
+    if (ds) {
+      if (claim(ds, DIR_READING)) {
+	read_dir(self, ds, 1);
+      }
+      continue; // otherwise the consumer got to it first
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    __atomic_add_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+    while (!walk->stopping && (__atomic_load_n(&walk->tasks, __ATOMIC_SEQ_CST) == 0 ||
+			       __atomic_load_n(&walk->unconsumed, __ATOMIC_SEQ_CST) >= WALK_AHEAD)) {
+      pthread_cond_wait(&walk->work_cond, &walk->lock);
+    }
+    __atomic_sub_fetch(&walk->idle, 1, __ATOMIC_SEQ_CST);
+    int stopping = walk->stopping;
+    pthread_mutex_unlock(&walk->lock);
+    if (stopping) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+int dir_walk_start(DirWalk *walk, int nthreads) {
+  memset(walk, 0, sizeof(*walk));
+  if (nthreads < 0) {
+    nthreads = 0;
+  }
+  pthread_mutex_init(&walk->lock, NULL);
+  pthread_cond_init(&walk->work_cond, NULL);
+  pthread_cond_init(&walk->done_cond, NULL);
+  walk->nslots = nthreads + 1;
+  walk->workers = calloc(walk->nslots, sizeof(WalkWorker));
+  if (!walk->workers) {
+    perror("Failed to allocate directory walkers");
+    return -1;
+  }
+  for (int i = 0; i < walk->nslots; i++) {
+    walk->workers[i].walk = walk;
+    deque_init(&walk->workers[i].deque);
+    arena_init(&walk->workers[i].arena, WALK_ARENA_BLOCK);
+  }
+  for (int i = 1; i < walk->nslots; i++) {
+    if (pthread_create(&walk->workers[i].thread, NULL, reader_main, &walk->workers[i]) != 0) {
+      perror("Failed to start directory walker");
+      break; // the consumer can do it all, a few helpers are a bonus
+    }
+    walk->nthreads++;
+  }
+  return 0;
+}
+
+static WalkWorker *consumer(DirWalk *walk) {
+  return &walk->workers[0];
+}
+
+DirScan *dir_walk_root(DirWalk *walk, const char *path) {
+  WalkWorker *self = consumer(walk);
+  DirScan *ds = arena_alloc(&self->arena, sizeof(DirScan), _Alignof(DirScan));
+  memset(ds, 0, sizeof(*ds));
+  ds->name = arena_strdup(&self->arena, path);
+  ds->state = DIR_QUEUED;
+  if (walk->nthreads > 0) {
+    queue_task(self, ds);
+    wake_readers(walk);
+  }
+  return ds;
+}
+
+void dir_walk_wait(DirWalk *walk, DirScan *ds) {
+  if (claim(ds, DIR_READING)) {
+    read_dir(consumer(walk), ds, walk->nthreads > 0);
+    return;
+  }
+  if (__atomic_load_n(&ds->state, __ATOMIC_SEQ_CST) == DIR_DONE) {
+    return;
+  }
+  pthread_mutex_lock(&walk->lock);
+  __atomic_store_n(&walk->waiting, ds, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&ds->state, __ATOMIC_SEQ_CST) != DIR_DONE) {
+    pthread_cond_wait(&walk->done_cond, &walk->lock);
+  }
+  __atomic_store_n(&walk->waiting, NULL, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&walk->lock);
+}
+
+void dir_walk_release(DirWalk *walk, DirScan *ds) {
+  free(ds->entries);
+  ds->entries = NULL;
+  ds->count = 0;
+  __atomic_sub_fetch(&walk->unconsumed, 1, __ATOMIC_SEQ_CST);
+  wake_readers(walk);
+}
+
+void dir_walk_discard(DirWalk *walk, DirScan *ds) {
+  if (claim(ds, DIR_SKIPPED)) {
+    if (ds->parent) {
+      release_fd(ds->parent);
+    }
+    return;
+  }
+  // already being read: its children hold the fd until they are settled
+  dir_walk_wait(walk, ds);
+  for (size_t i = 0; i < ds->count; i++) {
+    if (ds->entries[i].is_dir) {
+      dir_walk_discard(walk, ds->entries[i].dir);
+    }
+  }
+  dir_walk_release(walk, ds);
+}
+
+void dir_walk_stop(DirWalk *walk) {
+  pthread_mutex_lock(&walk->lock);
+  walk->stopping = 1;
+  pthread_cond_broadcast(&walk->work_cond);
+  pthread_mutex_unlock(&walk->lock);
+  for (int i = 1; i <= walk->nthreads; i++) {
+    pthread_join(walk->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < walk->nslots; i++) {
+    deque_free(&walk->workers[i].deque);
+    arena_free(&walk->workers[i].arena);
+  }
+  free(walk->workers);
+  walk->workers = NULL;
+  pthread_cond_destroy(&walk->work_cond);
+  pthread_cond_destroy(&walk->done_cond);
+  pthread_mutex_destroy(&walk->lock);
+}
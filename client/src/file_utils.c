@@ -7,242 +7,323 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <pthread.h>
+#include "dir_walk.h"
 #include "file_utils.h"
 #include "node.h"
 #include "checksum.h"
+#include "log.h"
 
-/* returns file contents using fread */
-char *readFileContents(const char *filepath, size_t *size) {
-  FILE *file = fopen(filepath, "rb");
-  if (!file) {
-    perror("Failed to open file!");
-    return NULL;
-  }
-
-  fseek(file, 0, SEEK_END);
-  *size = ftell(file);
-  rewind(file);
+/* Queues a file (or directory) upload on the pipelined connections. Files
+ * go out as a reference to their blob id; the uploader sends the contents
+ * only if the server doesn't have that blob yet. The node is marked
+ * uploaded once the server acks it. */
+void uploadFile(Node *node, const char *filepath, UploadPool *pool) {
+  log_debug("Uploading: %s", filepath);
 
-  if (*size > MAX_FILE_SIZE) {
-    fprintf(stderr, "File %s exceeds max supported size.\n", filepath);
-    fclose(file);
-    return NULL;
+  if (node->type == FILE_NODE) {
+    upload_pool_put_ref(pool, node, filepath);
+  } else {
+    upload_pool_put_dir(pool, node, filepath);
   }
+}
 
-  char *content = (char *)malloc(*size + 1);
-  if (!content) {
-    perror("Could not allocate memory");
-    fclose(file);
-    return NULL;
+/* one directory being reconciled, see scanTree */
+typedef struct {
+  DirScan *scan;
+  Node *node;
+  size_t next;     // entry to look at next
+  size_t path_len; // length of this directory's path in the shared buffer
+} WalkFrame;
+
+/* path + "/" + name, at path[len]. Returns the new length, or 0 if it
+ * doesn't fit. */
+static size_t appendName(char *path, size_t len, const char *name) {
+  int n = snprintf(path + len, MAX_PATH - len, "/%s", name);
+  if (n < 0 || (size_t)n >= MAX_PATH - len) {
+    path[len] = '\0';
+    log_warn("Path too long: %s/%s", path, name);
+    return 0;
   }
-
-  fread(content, 1, *size, file);
-  fclose(file);
-
-  return content;
+  return len + (size_t)n;
 }
 
-/* Uploads file to server and updates the node */
-char filechar = '/';
-void uploadFile(Node *node, char *filepath, int server_socket) {
-  printf("Uploading: %s\n", filepath);
-
-  // will send folders as path: './folder/' and file as './file' 
-  // appending '/' to folders. Server will respond according to type.
-  
-  // DEPENDENT ON FILES NOT ENDING WITH /
-  if (node->type == FILE_NODE) {
-    size_t file_size;
-    char *file_content = readFileContents(filepath, &file_size);
-    if(!file_content) {
-      fprintf(stderr, "Could not read file %s to send to the server. \n", filepath);
-      return;
-    }
-
-    // send name size
-    size_t filename_size = strlen(filepath);
-    send(server_socket, &filename_size, sizeof(filename_size), 0);
-
-    // send name 
-    send(server_socket, filepath, filename_size, 0);
-
-    // send file size
-    send(server_socket, &file_size, sizeof(file_size), 0);
-
-    // send file contents
-    ssize_t bytes_sent = send(server_socket, file_content, file_size, 0);
-    if (bytes_sent == -1)
-    {
-      perror("Error sending file data to server");
-      free(file_content);
-      return;
-    }
-    free(file_content); 
-
-    // Receive processing status from server
-    int processing_status;
-    if (recv(server_socket, &processing_status, sizeof(processing_status), 0) > 0) {
-      if (processing_status == 1) {
-	printf("Server successfully processed file: %s\n", filepath);
-      } else {
-	fprintf(stderr, "Server failed to process file: %s\n", filepath);
-      }
-    } else {
-      perror("Error receiving processing status from server");
-    }
+/* waits for the frame's listing; everything known is deleted until seen */
+static void enterDir(DirWalk *walk, WalkFrame *frame) {
+  dir_walk_wait(walk, frame->scan);
+  if (frame->scan->failed) {
+    return; // leave what we know alone
+  }
+  for (Node *current = frame->node->child; current; current = current->sibling) {
+    current->is_deleted = 1;
+  }
+}
 
-  } else {
-    int l = strlen(filepath);
-    filepath[l] = filechar;
-    filepath[l+1] = '\0';
-
-    // send name size
-    size_t filename_size = strlen(filepath);
-    send(server_socket, &filename_size, sizeof(filename_size), 0);
-
-    // send name 
-    send(server_socket, filepath, filename_size, 0);
-
-    // Receive processing status from server
-    int processing_status;
-    if (recv(server_socket, &processing_status, sizeof(processing_status), 0) > 0) {
-      if (processing_status == 1) {
-	printf("Server successfully processed directory: %s\n", filepath);
+static void leaveDir(DirWalk *walk, Tree *tree, WalkFrame *frame) {
+  if (!frame->scan->failed) {
+    // Remove any nodes still marked as deleted
+    Node *prev = NULL;
+    Node *child = frame->node->child;
+    while (child) {
+      if (child->is_deleted) {
+	log_debug("File or directory deleted: %s", child->name);
+	Node *to_delete = child;
+	child = child->sibling;
+	remove_child(tree, frame->node, prev, to_delete);
+	free_subtree(tree, to_delete);
       } else {
-	fprintf(stderr, "Server failed to process directory: %s\n", filepath);
+	prev = child;
+	child = child->sibling;
       }
-    } else {
-      perror("Error receiving processing status from server");
     }
   }
-
-  // Sent data. Update local node.
-  node->is_uploaded = 1;
-
-  char *new_checksum = calculateChecksum(filepath);
-  if (new_checksum) {
-    free(node->checksum);
-    node->checksum = new_checksum;
-  }
-  printf("Checksum: %s\n", new_checksum);
-
-  node->blob_id = strdup("unique_blob_id"); // COME BACK LATER
+  dir_walk_release(walk, frame->scan);
 }
 
-/* compare node w/ local file changes, and upload to server through server_socket.
- * the core of the backup logic. 
+/* compare node w/ local file changes and queue anything that needs
+ * hashing or uploading on the pipeline. This is the walker stage of
+ * backupTree; it never touches the network itself. Listings come from
+ * the DirWalk's readers, and are visited depth first in readdir order
+ * with an explicit stack, however deep the tree.
  */
-void processTree(const char *dirpath, Node *node, int server_socket) {
-  DIR *dir = opendir(dirpath);
-  if (!dir) {
-    perror("Failed to open directory");
+static void scanTree(DirWalk *walk, DirScan *root, const char *dirpath, Tree *tree, Node *node,
+		     ScanPipeline *pipeline, ScanOptions *opts) {
+  char path[MAX_PATH];
+  size_t root_len = strlen(dirpath);
+  if (root_len >= MAX_PATH) {
+    log_warn("Path too long: %s", dirpath);
+    dir_walk_discard(walk, root);
     return;
   }
-
-  // setting nodes as deleted initially and reverting  
-  // back if found on filesystem.
-  Node *current = node->child;
-  while (current) {
-    current->is_deleted = 1;
-    current = current->sibling;
+  memcpy(path, dirpath, root_len + 1);
+
+  size_t capacity = 16;
+  size_t depth = 0;
+  WalkFrame *stack = malloc(capacity * sizeof(WalkFrame));
+  if (!stack) {
+    perror("Failed to allocate walk stack");
+    exit(EXIT_FAILURE);
   }
-
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+  stack[depth++] = (WalkFrame){ root, node, 0, root_len };
+  enterDir(walk, &stack[0]);
+
+  while (depth > 0) {
+    WalkFrame *frame = &stack[depth - 1];
+    if (frame->next == frame->scan->count) {
+      leaveDir(walk, tree, frame);
+      depth--;
       continue;
     }
-
-    char filepath[MAX_PATH];
-    snprintf(filepath, MAX_PATH, "%s/%s", dirpath, entry->d_name);
-
-    struct stat file_stat;
-    if (stat(filepath, &file_stat) == -1) {
-      perror("Failed to get file stats");
-      continue;
+    WalkEntry *entry = &frame->scan->entries[frame->next++];
+    if (opts->ignore && frame->node == tree->root && isStateFile(entry->name, opts->ignore)) {
+      continue; // our own state files
     }
+    Node *found = find_child(tree, frame->node, entry->name);
 
-    Node *current = node->child;
-    Node *found = NULL;
-    while (current) {
-      if (strcmp(current->name, entry->d_name) == 0) {
-	found = current;
-	break;
-      }
-      current = current->sibling;
-    }
+    if (!entry->is_dir) {
+      opts->stats.files_scanned++;
 
-    if (S_ISREG(file_stat.st_mode)) {
-      char *new_checksum = calculateChecksum(filepath);
       if (found) {
 	// File exists, mark as not deleted
 	found->is_deleted = 0;
 
-	// Compare checksums
-	if (found->checksum && strcmp(found->checksum, new_checksum) != 0) {
-	  printf("File changed: %s\n", filepath);
-	  free(found->checksum);
-	  found->checksum = new_checksum;
-	  uploadFile(found, filepath, server_socket);
-	} else {
-	  free(new_checksum);
+	// Fast path: same stat tuple as when it was last hashed and uploaded
+	if (!opts->paranoid && found->has_checksum && found->is_uploaded &&
+	    stat_info_equal(&found->st, &entry->st)) {
+	  opts->stats.stat_unchanged++;
+	  continue;
 	}
-      } else {
-	// Add new file node
-	printf("New File: %s\n", entry->d_name);
-	Node *file_node = create_node(entry->d_name, FILE_NODE);
-	if (!file_node) {
-	  fprintf(stderr, "Failed to create node for %s\n", entry->d_name);
-	  free(new_checksum);
+
+	// metadata moved: rehash, uploadItem decides whether contents did
+	if (appendName(path, frame->path_len, entry->name) == 0) {
 	  continue;
 	}
-	file_node->checksum = new_checksum;
-	add_child(node, file_node);
-	uploadFile(file_node, filepath, server_socket);
-      }
-    } else if (S_ISDIR(file_stat.st_mode)) {
-      if (found) {
-	// Directory already exists, mark as not deleted
-	found->is_deleted = 0;
-	processTree(filepath, found, server_socket);
+	opts->stats.rehashed++;
+	pipeline_add_file(pipeline, found, path, &entry->st);
       } else {
-	// Add new folder node
-	printf("New Folder found: %s\n", entry->d_name);
-	Node *folder_node = create_node(entry->d_name, FOLDER_NODE);
-	if (!folder_node) {
-	  fprintf(stderr, "Failed to create node for %s\n", entry->d_name);
+	if (appendName(path, frame->path_len, entry->name) == 0) {
 	  continue;
 	}
-	folder_node->is_deleted = 0;
-	add_child(node, folder_node);
-	uploadFile(folder_node, filepath, server_socket);
-	processTree(filepath, folder_node, server_socket);
+	// Add new file node
+	log_debug("New File: %s", entry->name);
+	opts->stats.new_files++;
+	Node *file_node = create_node(tree, entry->name, FILE_NODE);
+	add_child(tree, frame->node, file_node);
+	pipeline_add_file(pipeline, file_node, path, &entry->st);
+      }
+      continue;
+    }
+
+    size_t len = 0;
+    if (found) {
+      // Directory already exists, mark as not deleted. Shallow scans
+      // leave known subdirectories to their own change events.
+      found->is_deleted = 0;
+      if (!opts->shallow) {
+	len = appendName(path, frame->path_len, entry->name);
+      }
+    } else if ((len = appendName(path, frame->path_len, entry->name)) != 0) {
+      // Add new folder node
+      log_debug("New Folder found: %s", entry->name);
+      found = create_node(tree, entry->name, FOLDER_NODE);
+      add_child(tree, frame->node, found);
+      pipeline_add_dir(pipeline, found, path);
+    }
+    if (len == 0) {
+      dir_walk_discard(walk, entry->dir);
+      continue;
+    }
+
+    if (depth == capacity) {
+      capacity *= 2;
+      WalkFrame *grown = realloc(stack, capacity * sizeof(WalkFrame));
+      if (!grown) {
+	perror("Failed to allocate walk stack");
+	exit(EXIT_FAILURE);
       }
+      stack = grown;
     }
+    stack[depth] = (WalkFrame){ entry->dir, found, 0, len };
+    enterDir(walk, &stack[depth]);
+    depth++;
   }
+  free(stack);
+}
 
-  closedir(dir);
+int isStateFile(const char *name, const char *state) {
+  // see STATE_FILE and the names derived from it in main.c
+  static const char *const suffixes[] = { "", ".tmp", ".journal", ".stream", ".stream.tmp" };
+  size_t len = strlen(state);
+  if (strncmp(name, state, len) != 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+    if (strcmp(name + len, suffixes[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  // Remove any nodes still marked as deleted
-  Node *prev = NULL;
-  Node *child = node->child;
-  while (child) {
-    if (child->is_deleted) {
-      printf("File or directory deleted: %s\n", child->name);
-      Node *to_delete = child;
+void printScanStats(const ScanStats *stats) {
+  log_info("Scanned %zu files: %zu unchanged (stat), %zu rehashed, %zu new, %zu uploaded",
+	 stats->files_scanned, stats->stat_unchanged, stats->rehashed,
+	 stats->new_files, stats->uploaded);
+}
 
-      if (prev) {
-	prev->sibling = child->sibling;
-      } else {
-	node->child = child->sibling;
-      }
+int uploadItem(ScanItem *item, UploadPool *pool, ScanOptions *opts) {
+  Node *node = item->node;
+  if (item->kind == ITEM_KNOWN) {
+    return 0;
+  }
+  if (item->kind == ITEM_DIR) {
+    uploadFile(node, item->path, pool);
+    return 1;
+  }
+
+  if (!item->has_digest) {
+    return 0; // hashing failed, already reported
+  }
+  node->st = item->st;
+
+  // Compare checksums, resending anything a previous run failed to upload
+  if (!node->has_checksum || memcmp(node->checksum, item->digest, sizeof(node->checksum)) != 0 ||
+      !node->is_uploaded) {
+    if (node->has_checksum) {
+      log_debug("File changed: %s", item->path);
+    }
+    memcpy(node->checksum, item->digest, sizeof(node->checksum));
+    node->has_checksum = 1;
+    node->is_uploaded = 0; // until the server acks this version
+    uploadFile(node, item->path, pool);
+    opts->stats.uploaded++;
+    return 1;
+  }
+  return 0;
+}
+
+typedef struct {
+  const char *rootpath;
+  Tree *tree;
+  const char **dirpaths;
+  size_t count;
+  ScanPipeline *pipeline;
+  ScanOptions *opts;
+} WalkArgs;
+
+/* node for a directory path under rootpath, or NULL if the tree doesn't
+ * have it (anymore) */
+static Node *resolveDir(Tree *tree, const char *rootpath, const char *dirpath) {
+  size_t rootlen = strlen(rootpath);
+  if (strncmp(dirpath, rootpath, rootlen) != 0 || (dirpath[rootlen] != '\0' && dirpath[rootlen] != '/')) {
+    return NULL;
+  }
+  Node *node = tree->root;
+  const char *p = dirpath + rootlen;
+  while (node && *p) {
+    p++; // '/'
+    const char *end = strchr(p, '/');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    char name[MAX_NAME_LENGTH];
+    if (len >= sizeof(name)) {
+      return NULL;
+    }
+    memcpy(name, p, len);
+    name[len] = '\0';
+    node = find_child(tree, node, name);
+    p += len;
+  }
+  return node && node->type == FOLDER_NODE ? node : NULL;
+}
 
-      child = child->sibling;
-      free_tree(to_delete);
-    } else {
-      prev = child;
-      child = child->sibling;
+void scanDirs(const char *rootpath, Tree *tree, const char **dirpaths, size_t count,
+	      ScanPipeline *pipeline, ScanOptions *opts) {
+  DirWalk walk;
+  // shallow scans read a handful of directories, not worth any threads
+  if (dir_walk_start(&walk, opts->shallow ? 0 : opts->walkers) == -1) {
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    // resolved only now: scanning an earlier (parent) directory may have
+    // removed this one from the tree
+    Node *node = resolveDir(tree, rootpath, dirpaths[i]);
+    if (node) {
+      DirScan *root = dir_walk_root(&walk, dirpaths[i]);
+      scanTree(&walk, root, dirpaths[i], tree, node, pipeline, opts);
     }
   }
+  dir_walk_stop(&walk);
+}
+
+static void *walkMain(void *arg) {
+  WalkArgs *args = arg;
+  scanDirs(args->rootpath, args->tree, args->dirpaths, args->count, args->pipeline, args->opts);
+  pipeline_walk_done(args->pipeline);
+  return NULL;
+}
+
+static void runBackup(WalkArgs *args, UploadPool *pool) {
+  pthread_t walker;
+  if (pthread_create(&walker, NULL, walkMain, args) != 0) {
+    perror("Failed to start directory walker");
+    return;
+  }
+
+  ScanItem *item;
+  while ((item = pipeline_next(args->pipeline)) != NULL) {
+    uploadItem(item, pool, args->opts);
+    pipeline_free_item(item);
+  }
+  pthread_join(walker, NULL);
+}
+
+void backupTree(const char *dirpath, Tree *tree, ScanPipeline *pipeline, UploadPool *pool, ScanOptions *opts) {
+  WalkArgs args = { dirpath, tree, &dirpath, 1, pipeline, opts };
+  runBackup(&args, pool);
+}
+
+void backupDirs(const char *rootpath, Tree *tree, const char **dirpaths, size_t count,
+		ScanPipeline *pipeline, UploadPool *pool, ScanOptions *opts) {
+  WalkArgs args = { rootpath, tree, dirpaths, count, pipeline, opts };
+  runBackup(&args, pool);
 }
@@ -0,0 +1,171 @@
+#include <unistd.h>
+#include "journal.h"
+#include "metrics.h"
+#include "protocol.h"
+
+/* the node a record is about, created along with any missing folders on
+ * the way. path is the one the client sent: the root's name followed by
+ * one component per level. */
+static int apply_record(Tree *tree, const JournalRecord *rec, char *path) {
+  size_t root_len = strlen(tree->root->name);
+  if (strncmp(path, tree->root->name, root_len) != 0 || path[root_len] != '/') {
+    return -1;
+  }
+  Node *node = tree->root;
+  char *name = path + root_len + 1;
+  while (1) {
+    char *slash = strchr(name, '/');
+    if (slash) {
+      *slash = '\0';
+    }
+    if (*name == '\0') {
+      return -1;
+    }
+    NodeType type = slash ? FOLDER_NODE : (NodeType)rec->type;
+    Node *child = find_child(tree, node, name);
+    if (!child) {
+      child = create_node(tree, name, type);
+      add_child(tree, node, child);
+    } else if (child->type != type) {
+      return -1; // replaced by the other kind since; the next scan sorts it out
+    }
+    node = child;
+    if (!slash) {
+      break;
+    }
+    name = slash + 1;
+  }
+
+  node->st = rec->st;
+  node->is_uploaded = (rec->flags & NODE_REC_UPLOADED) != 0;
+  node->has_checksum = (rec->flags & NODE_REC_HAS_CHECKSUM) != 0;
+  node->has_blob_id = (rec->flags & NODE_REC_HAS_BLOB_ID) != 0;
+  memcpy(node->checksum, rec->checksum, sizeof(node->checksum));
+  memcpy(node->blob_id, rec->blob_id, sizeof(node->blob_id));
+  return 0;
+}
+
+static int header_ok(const JournalHeader *header, uint32_t hash_algo) {
+  return header->magic == JOURNAL_MAGIC && header->version == JOURNAL_VERSION &&
+    header->hash_algo == hash_algo;
+}
+
+size_t journal_replay(const char *path, Tree *tree, uint32_t hash_algo) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return 0;
+  }
+  JournalHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || !header_ok(&header, hash_algo)) {
+    fclose(file);
+    return 0;
+  }
+
+  char node_path[MAX_WIRE_PATH + 1];
+  JournalRecord rec;
+  size_t applied = 0;
+  long good = (long)sizeof(header);
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    if (rec.path_len == 0 || rec.path_len > MAX_WIRE_PATH || rec.type > FOLDER_NODE ||
+	fread(node_path, 1, rec.path_len, file) != rec.path_len) {
+      break;
+    }
+    node_path[rec.path_len] = '\0';
+    if (apply_record(tree, &rec, node_path) == 0) {
+      applied++;
+    }
+    good = ftell(file);
+  }
+  fclose(file);
+  // appending after a torn record would hide everything that follows
+  if (truncate(path, good) == -1) {
+    perror("Failed to trim journal");
+  }
+  return applied;
+}
+
+int journal_open(Journal *j, const char *path, uint32_t hash_algo) {
+  memset(j, 0, sizeof(*j));
+  JournalHeader header;
+  FILE *file = fopen(path, "r+b");
+  if (file && fread(&header, sizeof(header), 1, file) == 1 && header_ok(&header, hash_algo)) {
+    fseek(file, 0, SEEK_END);
+  } else {
+    if (file) {
+      fclose(file);
+    }
+    file = fopen(path, "w+b");
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.hash_algo = hash_algo;
+    if (!file || fwrite(&header, sizeof(header), 1, file) != 1) {
+      perror("Failed to start journal");
+      if (file) {
+	fclose(file);
+      }
+      return -1;
+    }
+  }
+  j->file = file;
+  j->synced_ns = metrics_now();
+  return 0;
+}
+
+void journal_append(Journal *j, const Node *node, const char *path) {
+  if (!j->file || !path) {
+    return;
+  }
+  JournalRecord rec = { 0 };
+  rec.path_len = (uint32_t)strlen(path);
+  rec.type = node->type;
+  rec.flags = (node->is_uploaded ? NODE_REC_UPLOADED : 0) | (node->has_checksum ? NODE_REC_HAS_CHECKSUM : 0) |
+    (node->has_blob_id ? NODE_REC_HAS_BLOB_ID : 0);
+  memcpy(rec.checksum, node->checksum, sizeof(rec.checksum));
+  memcpy(rec.blob_id, node->blob_id, sizeof(rec.blob_id));
+  rec.st = node->st;
+  if (fwrite(&rec, sizeof(rec), 1, j->file) != 1 || fwrite(path, 1, rec.path_len, j->file) != rec.path_len) {
+    // the backup goes on; only resuming it after a crash is off
+    perror("Failed to write journal");
+    fclose(j->file);
+    j->file = NULL;
+    return;
+  }
+  j->appended++;
+  if (metrics_now() - j->synced_ns >= JOURNAL_SYNC_INTERVAL_NS) {
+    journal_sync(j);
+  }
+}
+
+int journal_sync(Journal *j) {
+  if (!j->file) {
+    return -1;
+  }
+  j->synced_ns = metrics_now();
+  if (fflush(j->file) != 0 || fdatasync(fileno(j->file)) == -1) {
+    perror("Failed to sync journal");
+    return -1;
+  }
+  return 0;
+}
+
+int journal_reset(Journal *j) {
+  if (!j->file) {
+    return -1;
+  }
+  if (fflush(j->file) != 0 || ftruncate(fileno(j->file), sizeof(JournalHeader)) == -1 ||
+      fseek(j->file, sizeof(JournalHeader), SEEK_SET) == -1) {
+    perror("Failed to reset journal");
+    return -1;
+  }
+  j->appended = 0;
+  return 0;
+}
+
+void journal_close(Journal *j) {
+  if (j->file) {
+    journal_sync(j);
+    fclose(j->file);
+    j->file = NULL;
+  }
+}
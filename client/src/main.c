@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,79 +6,455 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <unistd.h>
+#include <signal.h>
+#include "compress.h"
+#include "dir_walk.h"
 #include "file_utils.h"
+#include "hash.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
 #include "node.h"
+#include "options.h"
+#include "protocol.h"
+#include "reconcile.h"
+#include "restorer.h"
+#include "stream_scan.h"
+#include "watcher.h"
 
 #define SERVER_IP "127.0.0.1"
 #define PORT 8080
+#define STATE_FILE "node_data.bin"
+#define JOURNAL_FILE STATE_FILE ".journal"
+#define STREAM_FILE STATE_FILE ".stream"
+#define MAX_THREADS 1024 // for --threads and --walkers
+
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+/* --watch: keep the connection open and rescan only directories inotify
+ * reports changes in. Returns when asked to stop or the server is gone. */
+static void watchTree(Watcher *watcher, const char *dirpath, Tree *tree, ScanPipeline *pipeline,
+		      UploadPool *pool, Journal *journal, ScanOptions *opts, uint32_t hash_algo) {
+  log_info("Watching %s for changes", dirpath);
+  while (!stop_requested) {
+    if (watcher_wait(watcher, &stop_requested) != 1) {
+      break;
+    }
+    memset(&opts->stats, 0, sizeof(opts->stats));
+    if (watcher->overflowed) {
+      // events were dropped, so nothing short of a full scan is reliable
+      log_info("Change queue overflowed, rescanning everything");
+      watcher_add_tree(watcher, dirpath);
+      opts->shallow = 0;
+      backupTree(dirpath, tree, pipeline, pool, opts);
+    } else {
+      size_t count;
+      const char **dirty = watcher_dirty_paths(watcher, &count);
+      opts->shallow = 1;
+      backupDirs(dirpath, tree, dirty, count, pipeline, pool, opts);
+      free(dirty);
+    }
+    watcher_clear(watcher);
+
+    // acks must be in before the next scan may recycle nodes they refer to
+    if (upload_pool_flush(pool) == -1) {
+      fprintf(stderr, "Connection to server lost\n");
+      break;
+    }
+    printScanStats(&opts->stats);
+    if (save_tree(STATE_FILE, tree, hash_algo) == 0 && journal) {
+      journal_reset(journal);
+    }
+  }
+}
+
+/* the run as one JSON object: what the last scan found, what went over
+ * the wire and how long each phase took */
+static int writeSummary(const char *path, double seconds, const ScanStats *stats, const Uploader *up) {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror("Failed to write run summary");
+    return -1;
+  }
+  Histogram snap[METRIC_COUNT];
+  metrics_snapshot(snap);
+  fprintf(out, "{\"seconds\": %.6f,\n \"scan\": {\"files\": %zu, \"stat_unchanged\": %zu, "
+	  "\"rehashed\": %zu, \"new\": %zu, \"uploaded\": %zu},\n", seconds, stats->files_scanned,
+	  stats->stat_unchanged, stats->rehashed, stats->new_files, stats->uploaded);
+  fprintf(out, " \"upload\": {\"acked\": %zu, \"failed\": %zu, \"blobs_sent\": %zu, \"blobs_deduped\": %zu, "
+	  "\"content_bytes\": %llu, \"wire_bytes\": %llu, \"blobs_compressed\": %zu, "
+	  "\"blobs_incompressible\": %zu, \"blobs_delta\": %zu, \"delta_bytes\": %llu, \"delta_wire\": %llu, "
+	  "\"packs_sent\": %zu, \"blobs_packed\": %zu, \"blobs_resumed\": %zu, \"resumed_bytes\": %llu, "
+	  "\"have_queries\": %zu, \"have_known\": %zu, \"blobs_striped\": %zu, \"parts_sent\": %zu},\n",
+	  up->acked_ok, up->acked_failed, up->blobs_sent, up->blobs_deduped,
+	  (unsigned long long)up->content_bytes, (unsigned long long)up->wire_bytes, up->blobs_compressed,
+	  up->blobs_incompressible, up->blobs_delta, (unsigned long long)up->delta_bytes,
+	  (unsigned long long)up->delta_wire, up->packs_sent, up->blobs_packed, up->blobs_resumed,
+	  (unsigned long long)up->resumed_bytes, up->have_queries, up->have_known, up->blobs_striped,
+	  up->parts_sent);
+  fprintf(out, " \"phases\": ");
+  metrics_write_json(out, snap, METRICS_CLIENT);
+  fprintf(out, "}\n");
+  return fclose(out) == 0 ? 0 : -1;
+}
+
+/* --restore: fetch every file of the saved tree back into target */
+static int restoreBackup(const char *target, const struct sockaddr_in *addr, int connections, uint32_t window) {
+  uint32_t tree_algo;
+  Tree *tree = access(STATE_FILE, F_OK) == 0 ? load_tree(STATE_FILE, &tree_algo) : NULL;
+  if (!tree) {
+    fprintf(stderr, "No saved directory tree to restore from\n");
+    return 1;
+  }
+  if (tree_algo == 0) {
+    fprintf(stderr, "Saved directory tree has no blob ids\n");
+    free_tree(tree);
+    return 1;
+  }
+  // what a cut off backup got stored after the tree was last saved
+  journal_replay(JOURNAL_FILE, tree, tree_algo);
+  uint64_t started = metrics_now();
+  RestoreStats stats;
+  int status = restore_tree(tree, target, addr, connections, window, tree_algo, &stats);
+  double secs = (metrics_now() - started) / 1e9;
+  log_info("Restored %zu files (%llu bytes) in %.2fs (%.1f MB/s), %zu failed", stats.files,
+	   (unsigned long long)stats.bytes, secs, secs > 0 ? stats.bytes / 1e6 / secs : 0.0, stats.failed);
+  if (stats.skipped > 0) {
+    log_info("Skipped %zu files that were never stored", stats.skipped);
+  }
+  log_flush();
+  free_tree(tree);
+  return status == 0 && stats.failed == 0 ? 0 : 1;
+}
 
 /* 
  * Entry point for client-side backup logic. 
  * Requires active server running @ SERVER_IP:PORT
+ *
+ * --paranoid  rehash every file instead of trusting unchanged stat data
+ * --window N  number of requests kept in flight before waiting for acks,
+ *             per connection
+ * --connections N
+ *             connections to the server (default 1); files are spread
+ *             over them and big ones split into parts across all
+ * --threads N number of hashing threads (default: online CPUs)
+ * --walkers N number of threads reading directories (default 4)
+ * --hash ALGO content hash, blake3 (default) or sha256
+ * --compress fast|best|off
+ *             compression of file contents on the wire (default fast)
+ * --no-delta  send changed files whole instead of as deltas against the
+ *             version the server has
+ * --no-pack   send small files one request each instead of in packs
+ * --watch     after the initial scan keep running and back up changes as
+ *             they happen, until SIGINT/SIGTERM
+ * --log-level error|warn|info|debug
+ *             console verbosity (default info); debug lists every file
+ * --log-rate N
+ *             lines per second each level may print, 0 for no limit
+ * --summary FILE
+ *             write counters and per-phase latencies of the run as JSON
+ * --verify    before scanning, compare the saved tree with what the server
+ *             holds, folder digest by folder digest, and send again
+ *             whatever it turns out not to have
+ * --restore DIR
+ *             instead of backing up, fetch the files of the saved tree
+ *             into DIR over --connections connections of --window
+ *             requests each
+ * --stream    keep no tree in memory: join the walk with the sorted state
+ *             of the last run as it goes, for trees too big to hold.
+ *             Can't be combined with --watch, --verify or --restore.
  */
-int main() {
-
-  // Establish socket and connection with server
-  int server_socket;
-  struct sockaddr_in server_address;
-
-  server_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_socket == -1) {
-    perror("Error creating socket");
+int main(int argc, char *argv[]) {
+  ScanOptions opts = {0};
+  int window = DEFAULT_WINDOW;
+  int connections = 1;
+  uint32_t hash_algo = HASH_DEFAULT;
+  int compress_level = COMPRESS_LEVEL_FAST;
+  int watch = 0;
+  int delta = 1;
+  int pack = 1;
+  int log_lvl = LOG_LEVEL_INFO;
+  int log_rate = LOG_DEFAULT_RATE;
+  const char *summary = NULL;
+  const char *restore = NULL;
+  int verify = 0;
+  int stream = 0;
+  uint64_t started = metrics_now();
+  opts.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  opts.walkers = DEFAULT_WALKERS;
+  opts.ignore = STATE_FILE;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--paranoid") == 0) {
+      opts.paranoid = 1;
+    } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 1, MAX_WINDOW, &window) == -1) {
+	return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 1, MAX_CONNECTIONS, &connections) == -1) {
+	return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 1, MAX_THREADS, &opts.threads) == -1) {
+	return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--walkers") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 0, MAX_THREADS, &opts.walkers) == -1) {
+	return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+      const char *mode = argv[++i];
+      if (strcmp(mode, "fast") == 0) {
+	compress_level = COMPRESS_LEVEL_FAST;
+      } else if (strcmp(mode, "best") == 0) {
+	compress_level = COMPRESS_LEVEL_BEST;
+      } else if (strcmp(mode, "off") == 0) {
+	compress_level = 0;
+      } else {
+	fprintf(stderr, "Unknown compression mode '%s'\n", mode);
+	return 1;
+      }
+    } else if (strcmp(argv[i], "--no-delta") == 0) {
+      delta = 0;
+    } else if (strcmp(argv[i], "--no-pack") == 0) {
+      pack = 0;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      watch = 1;
+    } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      log_lvl = log_level_from_name(argv[++i]);
+      if (log_lvl == -1) {
+	fprintf(stderr, "Unknown log level '%s'\n", argv[i]);
+	return 1;
+      }
+    } else if (strcmp(argv[i], "--log-rate") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 0, INT_MAX, &log_rate) == -1) {
+	return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+      summary = argv[++i];
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      verify = 1;
+    } else if (strcmp(argv[i], "--stream") == 0) {
+      stream = 1;
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore = argv[++i];
+    } else if (strcmp(argv[i], "--hash") == 0 && i + 1 < argc) {
+      hash_algo = hash_from_name(argv[++i]);
+      if (hash_algo == 0) {
+	fprintf(stderr, "Unknown hash algorithm '%s'\n", argv[i]);
+	return 1;
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [--paranoid] [--window N] [--connections N] [--threads N] [--walkers N]\n"
+	      "          [--hash blake3|sha256] [--compress fast|best|off] [--no-delta]\n"
+	      "          [--no-pack] [--watch] [--log-level error|warn|info|debug] [--log-rate N]\n"
+	      "          [--summary FILE] [--verify] [--restore DIR] [--stream]\n", argv[0]);
+      return 1;
+    }
+  }
+  log_init((LogLevel)log_lvl, log_rate);
+  if (stream && (watch || verify || restore)) {
+    fprintf(stderr, "--stream can't be combined with --watch, --verify or --restore\n");
     return 1;
   }
 
+  // a dropped connection should surface as a send error, not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  // Establish the connections with the server
+  struct sockaddr_in server_address;
+  memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_port = htons(PORT);
   if (inet_pton(AF_INET, SERVER_IP, &server_address.sin_addr) <= 0) {
     perror("Invalid address/ Address not supported");
-    close(server_socket);
     return 1;
   }
+  if (restore) {
+    return restoreBackup(restore, &server_address, connections, (uint32_t)window);
+  }
 
-  if (connect(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
-    perror("Error connecting to server");
-    close(server_socket);
+  UploadPool pool;
+  if (upload_pool_init(&pool, connections, &server_address, (uint32_t)window, hash_algo, compress_level) == -1) {
     return 1;
   }
-  printf("Connected to server at %s:%d\n", SERVER_IP, PORT);
+  if (connections == 1) {
+    log_info("Connected to server at %s:%d", SERVER_IP, PORT);
+  } else {
+    log_info("Connected to server at %s:%d (%d connections)", SERVER_IP, PORT, connections);
+  }
+  int query_have = 0;
 
   // Create new empty node struct or import backup from .bin if available
   const char *dirpath = ".";
-  Node *root;
+  Tree *tree = NULL;
 
-  FILE *file = fopen("node_data.bin", "rb");
-  if (!file) {
-    printf("No saved directory tree, creating new.\n");
-    root = create_node(dirpath, FOLDER_NODE);
+  // without a saved tree, ask the server what it has before sending
+  // references for everything
+  if (stream) {
+    query_have = access(STREAM_FILE, F_OK) != 0; // read as the walk goes
+  } else if (access(STATE_FILE, F_OK) != 0) {
+    log_info("No saved directory tree, creating new.");
+    tree = create_tree(dirpath);
+    query_have = 1;
   } else {
-    root = load_node(file);
-    fclose(file);
+    uint32_t tree_algo;
+    tree = load_tree(STATE_FILE, &tree_algo);
+    if (!tree) {
+      log_info("Could not load saved directory tree, creating new.");
+      tree = create_tree(dirpath);
+      query_have = 1;
+    } else if (tree_algo != hash_algo) {
+      // stored checksums are useless for comparison; rehash everything once
+      if (tree_algo != 0) {
+	log_info("Saved tree was hashed with %s, rehashing with %s.",
+	       hash_name(tree_algo) ? hash_name(tree_algo) : "an unknown algorithm",
+	       hash_name(hash_algo));
+      }
+      drop_checksums(tree->root);
+    }
+  }
+
+  // what an interrupted run got acked after the tree was last saved
+  size_t replayed = tree ? journal_replay(JOURNAL_FILE, tree, hash_algo) : 0;
+  if (replayed > 0) {
+    log_info("Resuming an interrupted backup: %zu entries were already done.", replayed);
+  }
+  if (verify && !query_have) {
+    ReconcileStats rs;
+    Uploader *up = &pool.conns[0];
+    if (reconcile_tree(tree, up->sock, &up->next_seq, up->window, hash_algo, &rs) == -1) {
+      free_tree(tree);
+      upload_pool_free(&pool);
+      return 1;
+    }
+    log_info("Verified against the server in %zu round trips (%zu folders listed): %zu files to send again, "
+	     "%zu paths only on the server", rs.rounds, rs.listed, rs.resend, rs.extra);
+  }
+  Journal journal;
+  int journaling = tree && journal_open(&journal, JOURNAL_FILE, hash_algo) == 0;
+  for (int i = 0; i < pool.count; i++) {
+    Uploader *up = &pool.conns[i];
+    up->no_delta = !delta;
+    up->no_pack = !pack;
+    up->query_have = query_have;
+    up->journal = journaling ? &journal : NULL;
   }
 
   // compare root(node) w/ local file changes, and upload to server through server_socket.
   // the core of the backup logic.
-  processTree(dirpath, root, server_socket);
+  ScanPipeline pipeline;
+  if (pipeline_init(&pipeline, opts.threads, hash_algo) == -1) {
+    upload_pool_free(&pool);
+    return 1;
+  }
 
-  // tell server we've finished sending data 
-  size_t filename_size = 0;
-  send(server_socket, &filename_size, sizeof(filename_size), 0);
+  // watch before the first scan so changes made during it are not lost
+  Watcher watcher;
+  if (watch) {
+    if (watcher_init(&watcher, dirpath, STATE_FILE) == -1) {
+      pipeline_free(&pipeline);
+      upload_pool_free(&pool);
+      return 1;
+    }
+    watcher_add_tree(&watcher, dirpath);
+    setvbuf(stdout, NULL, _IOLBF, 0); // long running, keep logs current
+    struct sigaction sa = { 0 };
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  }
+
+  int saved = 0;
+  if (stream) {
+    // a lost connection leaves its entries unacked in the new state
+    saved = stream_backup(dirpath, STREAM_FILE, &pipeline, &pool, &opts, hash_algo);
+  } else {
+    backupTree(dirpath, tree, &pipeline, &pool, &opts);
+  }
+  if (watch) {
+    if (upload_pool_flush(&pool) == 0) {
+      printScanStats(&opts.stats);
+      if (save_tree(STATE_FILE, tree, hash_algo) == 0 && journaling) {
+	journal_reset(&journal);
+      }
+      watchTree(&watcher, dirpath, tree, &pipeline, &pool, journaling ? &journal : NULL, &opts, hash_algo);
+    }
+    watcher_free(&watcher);
+  }
+  pipeline_free(&pipeline);
 
-  printf("Tree Structure:\n");
-  print_tree(root, 0);
+  // wait for the last acks, then tell server we've finished sending data
+  int lost = upload_pool_finish(&pool) == -1;
+  if (lost) {
+    fprintf(stderr, "Connection to server lost, unacknowledged entries will be retried next run\n");
+  }
+  if (!watch) {
+    printScanStats(&opts.stats); // watch mode reported each batch already
+  }
+  Uploader up;
+  upload_pool_totals(&pool, &up);
+  log_info("Server acknowledged %zu entries, %zu failed", up.acked_ok, up.acked_failed);
+  log_info("Blobs sent: %zu, already on server: %zu", up.blobs_sent, up.blobs_deduped);
+  if (up.codec != COMPRESS_NONE) {
+    log_info("Compressed with %s: %llu bytes sent as %llu (%zu files framed, %zu incompressible)",
+	     compress_name(up.codec), (unsigned long long)up.content_bytes,
+	     (unsigned long long)up.wire_bytes, up.blobs_compressed, up.blobs_incompressible);
+  }
+  if (up.blobs_delta > 0) {
+    log_info("Sent %zu changed files as deltas: %llu bytes as %llu", up.blobs_delta,
+	     (unsigned long long)up.delta_bytes, (unsigned long long)up.delta_wire);
+  }
+  if (up.packs_sent > 0) {
+    log_info("Packed %zu small files into %zu requests", up.blobs_packed, up.packs_sent);
+  }
+  if (up.have_queries > 0) {
+    log_info("Asked about new files in %zu batches: %zu were on the server already", up.have_queries,
+	     up.have_known);
+  }
+  if (up.blobs_striped > 0) {
+    log_info("Split %zu big files into %zu parts across connections", up.blobs_striped, up.parts_sent);
+  }
+  if (up.blobs_resumed > 0) {
+    log_info("Resumed %zu cut off uploads, %llu bytes the server already had", up.blobs_resumed,
+	     (unsigned long long)up.resumed_bytes);
+  }
+  if (summary) {
+    writeSummary(summary, (metrics_now() - started) / 1e9, &opts.stats, &up);
+  }
+  upload_pool_free(&pool);
+
+  if (stream) {
+    log_flush();
+    return saved == -1 || lost;
+  }
+
+  // one line per file: only worth it when asked for
+  if (log_enabled(LOG_LEVEL_DEBUG)) {
+    log_flush();
+    printf("Tree Structure:\n");
+    print_tree(tree->root, 0);
+  }
+  log_flush();
 
-  // Store Node for future use
-  file = fopen("node_data.bin", "wb");
-  if (!file) {
-    perror("Failed to open file for writing");
-    close(server_socket);
+  // Store Node for future use; the journal is compacted into it
+  if (save_tree(STATE_FILE, tree, hash_algo) == -1) {
+    journal_close(&journal);
     return 1;
   }
-  save_node(file, root);
-  fclose(file);
+  journal_close(&journal);
+  unlink(JOURNAL_FILE);
 
-  close(server_socket);
-  free_tree(root);
-  return 0;
+  free_tree(tree);
+  return lost;
 }
@@ -1,24 +1,155 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "node.h"
+#include "hash.h"
+#include "protocol.h"
 
-Node *create_node(const char *name, NodeType type) {
-  Node *new_node = (Node *)malloc(sizeof(Node));
-  if (!new_node) {
+// nodes and names are carved from blocks of this size
+#define TREE_BLOCK_SIZE (1024 * 1024)
+
+/* open addressing table of a folder's children, keyed by name */
+typedef struct ChildIndex {
+  Node **slots;
+  size_t capacity; // power of two, at most half full
+  struct ChildIndex *prev; // Tree.indexes list
+  struct ChildIndex *next;
+} ChildIndex;
+
+static uint64_t name_hash(const char *s) {
+  uint64_t h = 1469598103934665603ULL; // FNV-1a
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static void index_insert(ChildIndex *index, Node *child) {
+  size_t i = name_hash(child->name) & (index->capacity - 1);
+  while (index->slots[i]) {
+    i = (i + 1) & (index->capacity - 1);
+  }
+  index->slots[i] = child;
+}
+
+static void drop_index(Tree *tree, Node *parent) {
+  ChildIndex *index = parent->index;
+  if (index) {
+    if (index->prev) {
+      index->prev->next = index->next;
+    } else {
+      tree->indexes = index->next;
+    }
+    if (index->next) {
+      index->next->prev = index->prev;
+    }
+    free(index->slots);
+    free(index);
+    parent->index = NULL;
+  }
+}
+
+/* (re)builds the index with room for twice the current children */
+static void build_index(Tree *tree, Node *parent) {
+  size_t capacity = 64;
+  while (capacity < (size_t)parent->child_count * 4) {
+    capacity *= 2;
+  }
+  ChildIndex *index = malloc(sizeof(ChildIndex));
+  Node **slots = calloc(capacity, sizeof(Node *));
+  if (!index || !slots) {
+    // lookups just fall back to scanning
+    free(index);
+    free(slots);
+    drop_index(tree, parent);
+    return;
+  }
+  drop_index(tree, parent);
+  index->slots = slots;
+  index->capacity = capacity;
+  for (Node *child = parent->child; child; child = child->sibling) {
+    index_insert(index, child);
+  }
+  index->prev = NULL;
+  index->next = tree->indexes;
+  if (tree->indexes) {
+    tree->indexes->prev = index;
+  }
+  tree->indexes = index;
+  parent->index = index;
+}
+
+static void intern_grow(Tree *tree) {
+  size_t capacity = tree->interned_capacity ? tree->interned_capacity * 2 : 1024;
+  const char **slots = calloc(capacity, sizeof(char *));
+  if (!slots) {
     perror("Failed to allocate memory for node");
     exit(EXIT_FAILURE);
   }
-  strncpy(new_node->name, name, MAX_NAME_LENGTH);
-  new_node->type = type;
-  new_node->child = NULL;
-  new_node->sibling = NULL;
-  new_node->checksum = NULL;
-  new_node->blob_id = NULL;
-  new_node->is_uploaded = 0;
-  new_node->is_deleted=0;
+  for (size_t i = 0; i < tree->interned_capacity; i++) {
+    if (tree->interned[i]) {
+      size_t j = name_hash(tree->interned[i]) & (capacity - 1);
+      while (slots[j]) {
+	j = (j + 1) & (capacity - 1);
+      }
+      slots[j] = tree->interned[i];
+    }
+  }
+  free(tree->interned);
+  tree->interned = slots;
+  tree->interned_capacity = capacity;
+}
 
+/* the tree's copy of name; most names (index.html, .git, ...) repeat a lot */
+static const char *intern(Tree *tree, const char *name) {
+  if ((tree->interned_count + 1) * 2 > tree->interned_capacity) {
+    intern_grow(tree);
+  }
+  size_t i = name_hash(name) & (tree->interned_capacity - 1);
+  while (tree->interned[i]) {
+    if (strcmp(tree->interned[i], name) == 0) {
+      return tree->interned[i];
+    }
+    i = (i + 1) & (tree->interned_capacity - 1);
+  }
+  tree->interned[i] = arena_strdup(&tree->names, name);
+  tree->interned_count++;
+  return tree->interned[i];
+}
+
+static Tree *new_tree(void) {
+  Tree *tree = calloc(1, sizeof(Tree));
+  if (!tree) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  arena_init(&tree->nodes, TREE_BLOCK_SIZE);
+  arena_init(&tree->names, TREE_BLOCK_SIZE);
+  return tree;
+}
+
+Tree *create_tree(const char *root_name) {
+  Tree *tree = new_tree();
+  tree->root = create_node(tree, root_name, FOLDER_NODE);
+  return tree;
+}
+
+Node *create_node(Tree *tree, const char *name, NodeType type) {
+  Node *new_node = tree->free_nodes;
+  if (new_node) {
+    tree->free_nodes = new_node->sibling;
+  } else {
+    new_node = arena_alloc(&tree->nodes, sizeof(Node), _Alignof(Node));
+  }
+  memset(new_node, 0, sizeof(Node));
+  new_node->name = intern(tree, name);
+  new_node->type = type;
   return new_node;
 }
 
-void add_child(Node *parent, Node *child) {
+void add_child(Tree *tree, Node *parent, Node *child) {
   if (!parent || parent->type != FOLDER_NODE) {
     fprintf(stderr, "Cannot add child to non-folder node\n");
     return;
@@ -26,25 +157,120 @@ void add_child(Node *parent, Node *child) {
   if (!parent->child) {
     parent->child = child;
   } else {
-    Node *temp = parent->child;
-    while (temp->sibling) {
-      temp = temp->sibling;
+    parent->last_child->sibling = child;
+  }
+  parent->last_child = child;
+  parent->child_count++;
+
+  if (parent->index) {
+    if ((size_t)parent->child_count * 2 > parent->index->capacity) {
+      build_index(tree, parent);
+    } else {
+      index_insert(parent->index, child);
     }
-    temp->sibling = child;
   }
 }
 
-void free_tree(Node *root) {
-  if (!root) return;
-  if (root->type == FOLDER_NODE) {
-    Node *child = root->child;
-    while (child) {
-      Node *next = child->sibling;
-      free_tree(child);
-      child = next;
+Node *find_child(Tree *tree, Node *parent, const char *name) {
+  if (!parent->index && parent->child_count > CHILD_INDEX_THRESHOLD) {
+    build_index(tree, parent);
+  }
+  if (parent->index) {
+    ChildIndex *index = parent->index;
+    size_t i = name_hash(name) & (index->capacity - 1);
+    while (index->slots[i]) {
+      if (strcmp(index->slots[i]->name, name) == 0) {
+	return index->slots[i];
+      }
+      i = (i + 1) & (index->capacity - 1);
+    }
+    return NULL;
+  }
+  for (Node *child = parent->child; child; child = child->sibling) {
+    if (strcmp(child->name, name) == 0) {
+      return child;
+    }
+  }
+  return NULL;
+}
+
+void remove_child(Tree *tree, Node *parent, Node *prev, Node *child) {
+  if (prev) {
+    prev->sibling = child->sibling;
+  } else {
+    parent->child = child->sibling;
+  }
+  if (parent->last_child == child) {
+    parent->last_child = prev;
+  }
+  child->sibling = NULL;
+  parent->child_count--;
+  // open addressing can't simply clear a slot; rebuild on next lookup
+  drop_index(tree, parent);
+}
+
+/* sets last_child and child_count after a loader linked child/sibling
+ * pointers directly */
+static void count_children(Node *root) {
+  size_t depth = 0, capacity = 64;
+  Node **stack = malloc(capacity * sizeof(Node *));
+  if (!stack) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  stack[depth++] = root;
+  while (depth > 0) {
+    Node *node = stack[--depth];
+    node->child_count = 0;
+    node->last_child = NULL;
+    for (Node *child = node->child; child; child = child->sibling) {
+      node->child_count++;
+      node->last_child = child;
+      if (child->child) {
+	if (depth == capacity) {
+	  capacity *= 2;
+	  Node **bigger = realloc(stack, capacity * sizeof(Node *));
+	  if (!bigger) {
+	    perror("Failed to allocate memory for node");
+	    exit(EXIT_FAILURE);
+	  }
+	  stack = bigger;
+	}
+	stack[depth++] = child;
+      }
     }
   }
-  free(root);
+  free(stack);
+}
+
+void free_subtree(Tree *tree, Node *node) {
+  // the not yet recycled nodes form one list: a node's children are
+  // spliced in front of its successors as it is taken off
+  while (node) {
+    Node *next = node->sibling;
+    if (node->child) {
+      node->last_child->sibling = next;
+      next = node->child;
+    }
+    drop_index(tree, node);
+    node->sibling = tree->free_nodes;
+    tree->free_nodes = node;
+    node = next;
+  }
+}
+
+void free_tree(Tree *tree) {
+  if (!tree) return;
+  while (tree->indexes) {
+    ChildIndex *next = tree->indexes->next;
+    free(tree->indexes->slots);
+    free(tree->indexes);
+    tree->indexes = next;
+  }
+  arena_free(&tree->nodes);
+  arena_free(&tree->names);
+  free(tree->interned);
+  free(tree);
 }
 
 void print_tree(const Node *root, int depth) {
@@ -61,72 +287,521 @@ void print_tree(const Node *root, int depth) {
   }
 }
 
-void write_string(FILE *file, const char *str) {
-  size_t length = str ? strlen(str) : 0;
-  fwrite(&length, sizeof(size_t), 1, file);
-  if (length > 0) {
-    fwrite(str, sizeof(char), length, file);
-  }
-}
+/* ---- legacy stream format (versions 0-3), read only ---- */
 
-char *read_string(FILE *file) {
+static char *read_string(FILE *file) {
   size_t length;
-  fread(&length, sizeof(size_t), 1, file);
-  if (length == 0) {
+  if (fread(&length, sizeof(size_t), 1, file) != 1 || length == 0 || length > MAX_NAME_LENGTH * 16) {
     return NULL;
   }
   char *str = (char *)malloc(length + 1);
-  fread(str, sizeof(char), length, file);
+  if (!str || fread(str, sizeof(char), length, file) != length) {
+    free(str);
+    return NULL;
+  }
   str[length] = '\0';
   return str;
 }
 
-void save_node(FILE *file, Node *node) {
-  if (node == NULL) {
-    int null_flag = 1;
-    fwrite(&null_flag, sizeof(int), 1, file);
-    return;
+/* one record; the null flag was already consumed */
+static Node *read_legacy_node(Tree *tree, FILE *file, uint32_t version) {
+  char name[MAX_NAME_LENGTH] = "";
+  NodeType type = FILE_NODE;
+  int is_uploaded = 0;
+  fread(name, sizeof(char), MAX_NAME_LENGTH, file);
+  name[MAX_NAME_LENGTH - 1] = '\0';
+  fread(&type, sizeof(NodeType), 1, file);
+  Node *node = create_node(tree, name, type == FOLDER_NODE ? FOLDER_NODE : FILE_NODE);
+  char *checksum = read_string(file);
+  char *blob_id = read_string(file);
+  fread(&is_uploaded, sizeof(int), 1, file);
+  node->is_uploaded = is_uploaded != 0;
+
+  // legacy trees have no stat tuple; a zeroed one never matches, so
+  // those files get hashed once and pick up their metadata.
+  if (version >= 1) {
+    fread(&node->st, sizeof(StatInfo), 1, file);
+  }
+
+  // before version 2 checksums were MD5 and blob ids placeholders; drop
+  // them so the files get rehashed and re-referenced
+  if (version >= 2) {
+    node->has_checksum = blob_id_from_hex(checksum, node->checksum) == 0;
+    node->has_blob_id = blob_id_from_hex(blob_id, node->blob_id) == 0;
+  }
+  free(checksum);
+  free(blob_id);
+  return node;
+}
+
+/* records are written node, child subtree, sibling subtree. An explicit
+ * stack of slots to fill keeps long sibling chains off the call stack. */
+static Tree *load_legacy(FILE *file, uint32_t version) {
+  Tree *tree = new_tree();
+  Node *root = NULL;
+  size_t depth = 0, capacity = 64;
+  Node ***stack = malloc(capacity * sizeof(Node **));
+  if (!stack) {
+    perror("Failed to allocate memory for node");
+    exit(EXIT_FAILURE);
+  }
+  stack[depth++] = &root;
+
+  while (depth > 0) {
+    Node **slot = stack[--depth];
+    int null_flag;
+    if (fread(&null_flag, sizeof(int), 1, file) != 1 || null_flag) {
+      *slot = NULL;
+      continue;
+    }
+    Node *node = read_legacy_node(tree, file, version);
+    *slot = node;
+    if (depth + 2 > capacity) {
+      capacity *= 2;
+      Node ***bigger = realloc(stack, capacity * sizeof(Node **));
+      if (!bigger) {
+	perror("Failed to allocate memory for node");
+	exit(EXIT_FAILURE);
+      }
+      stack = bigger;
+    }
+    stack[depth++] = &node->sibling;
+    stack[depth++] = &node->child; // read first
+  }
+  free(stack);
+  if (!root) {
+    free_tree(tree);
+    return NULL;
+  }
+  count_children(root);
+  tree->root = root;
+  return tree;
+}
+
+/* ---- version 4 flat image ---- */
+
+/* name -> string table offset, so each distinct name is stored once */
+typedef struct {
+  const char **keys;
+  uint32_t *offsets;
+  size_t capacity;
+  size_t count;
+  char *table;
+  size_t table_size;
+  size_t table_cap;
+} StringTable;
+
+static int strtab_grow(StringTable *st) {
+  size_t capacity = st->capacity ? st->capacity * 2 : 1024;
+  const char **keys = calloc(capacity, sizeof(char *));
+  uint32_t *offsets = calloc(capacity, sizeof(uint32_t));
+  if (!keys || !offsets) {
+    free(keys);
+    free(offsets);
+    return -1;
+  }
+  for (size_t i = 0; i < st->capacity; i++) {
+    if (st->keys[i]) {
+      size_t j = name_hash(st->keys[i]) & (capacity - 1);
+      while (keys[j]) {
+	j = (j + 1) & (capacity - 1);
+      }
+      keys[j] = st->keys[i];
+      offsets[j] = st->offsets[i];
+    }
+  }
+  free(st->keys);
+  free(st->offsets);
+  st->keys = keys;
+  st->offsets = offsets;
+  st->capacity = capacity;
+  return 0;
+}
+
+/* Returns the name's offset, or UINT32_MAX when out of memory. Keys point
+ * into the tree, which outlives the table. */
+static uint32_t strtab_add(StringTable *st, const char *name) {
+  if ((st->count + 1) * 2 > st->capacity && strtab_grow(st) == -1) {
+    return UINT32_MAX;
+  }
+  size_t i = name_hash(name) & (st->capacity - 1);
+  while (st->keys[i]) {
+    if (strcmp(st->keys[i], name) == 0) {
+      return st->offsets[i];
+    }
+    i = (i + 1) & (st->capacity - 1);
+  }
+
+  size_t len = strlen(name) + 1;
+  if (st->table_size + len > st->table_cap) {
+    size_t cap = st->table_cap ? st->table_cap * 2 : 64 * 1024;
+    while (cap < st->table_size + len) {
+      cap *= 2;
+    }
+    char *table = realloc(st->table, cap);
+    if (!table) {
+      return UINT32_MAX;
+    }
+    st->table = table;
+    st->table_cap = cap;
+  }
+  uint32_t offset = (uint32_t)st->table_size;
+  memcpy(st->table + offset, name, len);
+  st->table_size += len;
+  st->keys[i] = name;
+  st->offsets[i] = offset;
+  st->count++;
+  return offset;
+}
+
+static void strtab_free(StringTable *st) {
+  free(st->keys);
+  free(st->offsets);
+  free(st->table);
+}
+
+/* breadth first, so every node's children end up next to each other */
+static int flatten(const Node *root, NodeRecord **records_out, uint32_t *count_out, StringTable *strings) {
+  size_t capacity = 1024, count = 0;
+  const Node **order = malloc(capacity * sizeof(Node *));
+  NodeRecord *records = malloc(capacity * sizeof(NodeRecord));
+  if (!order || !records) {
+    goto fail;
+  }
+
+  order[count++] = root;
+  for (size_t i = 0; i < count; i++) {
+    const Node *node = order[i];
+    NodeRecord *rec = &records[i];
+    if (i == 0) {
+      rec->parent = NODE_NONE;
+      rec->next_sibling = NODE_NONE;
+    }
+    rec->first_child = NODE_NONE;
+    rec->name = strtab_add(strings, node->name);
+    rec->type = (uint32_t)node->type;
+    rec->flags = node->is_uploaded ? NODE_REC_UPLOADED : 0;
+    memset(rec->checksum, 0, sizeof(rec->checksum));
+    memset(rec->blob_id, 0, sizeof(rec->blob_id));
+    if (node->has_checksum) {
+      memcpy(rec->checksum, node->checksum, sizeof(rec->checksum));
+      rec->flags |= NODE_REC_HAS_CHECKSUM;
+    }
+    if (node->has_blob_id) {
+      memcpy(rec->blob_id, node->blob_id, sizeof(rec->blob_id));
+      rec->flags |= NODE_REC_HAS_BLOB_ID;
+    }
+    rec->st = node->st;
+    if (rec->name == UINT32_MAX) {
+      goto fail;
+    }
+
+    for (const Node *child = node->child; child; child = child->sibling) {
+      if (count == capacity) {
+	if (capacity >= NODE_NONE / 2) {
+	  goto fail;
+	}
+	capacity *= 2;
+	const Node **o = realloc(order, capacity * sizeof(Node *));
+	if (o) order = o;
+	NodeRecord *r = realloc(records, capacity * sizeof(NodeRecord));
+	if (r) records = r;
+	if (!o || !r) {
+	  goto fail;
+	}
+	rec = &records[i];
+      }
+      if (rec->first_child == NODE_NONE) {
+	rec->first_child = (uint32_t)count;
+      }
+      records[count].parent = (uint32_t)i;
+      records[count].next_sibling = child->sibling ? (uint32_t)count + 1 : NODE_NONE;
+      order[count++] = child;
+    }
+  }
+
+  free(order);
+  *records_out = records;
+  *count_out = (uint32_t)count;
+  return 0;
+
+fail:
+  perror("Failed to flatten directory tree");
+  free(order);
+  free(records);
+  return -1;
+}
+
+static int write_all(FILE *file, const void *data, size_t len) {
+  return len == 0 || fwrite(data, 1, len, file) == len ? 0 : -1;
+}
+
+int save_tree(const char *path, const Tree *tree, uint32_t hash_algo) {
+  NodeRecord *records;
+  uint32_t count;
+  StringTable strings = { 0 };
+  if (flatten(tree->root, &records, &count, &strings) == -1) {
+    strtab_free(&strings);
+    return -1;
+  }
+
+  NodeFileHeader header = { 0 };
+  header.magic = NODE_DATA_MAGIC;
+  header.version = NODE_DATA_VERSION;
+  header.hash_algo = hash_algo;
+  header.node_count = count;
+  header.strings_offset = sizeof(header) + (uint64_t)count * sizeof(NodeRecord);
+  header.strings_size = strings.table_size;
+
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp = malloc(tmp_len);
+  FILE *file = tmp ? (snprintf(tmp, tmp_len, "%s.tmp", path), fopen(tmp, "wb")) : NULL;
+  int status = -1;
+  if (!file) {
+    perror("Failed to open file for writing");
+  } else if (write_all(file, &header, sizeof(header)) == -1 ||
+	     write_all(file, records, (size_t)count * sizeof(NodeRecord)) == -1 ||
+	     write_all(file, strings.table, strings.table_size) == -1 ||
+	     fflush(file) != 0 || fsync(fileno(file)) == -1) {
+    perror("Failed to write directory tree");
+    fclose(file);
+    unlink(tmp);
+  } else if (fclose(file) != 0 || rename(tmp, path) == -1) {
+    perror("Failed to replace directory tree");
+    unlink(tmp);
+  } else {
+    status = 0;
+  }
+
+  free(tmp);
+  free(records);
+  strtab_free(&strings);
+  return status;
+}
+
+int node_file_open(NodeFile *nf, const char *path) {
+  memset(nf, 0, sizeof(*nf));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(NodeFileHeader)) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("Failed to map directory tree");
+    return -1;
+  }
+  nf->map = map;
+  nf->size = (size_t)st.st_size;
+  nf->header = map;
+
+  const NodeFileHeader *h = nf->header;
+  uint64_t nodes_end = sizeof(NodeFileHeader) + (uint64_t)h->node_count * sizeof(NodeRecord);
+  if (h->magic != NODE_DATA_MAGIC || h->version != NODE_DATA_VERSION || h->node_count == 0 ||
+      h->strings_offset != nodes_end || h->strings_size == 0 ||
+      h->strings_offset + h->strings_size != nf->size) {
+    goto bad;
+  }
+  nf->nodes = (const NodeRecord *)((const char *)map + sizeof(NodeFileHeader));
+  nf->strings = (const char *)map + h->strings_offset;
+  if (nf->strings[h->strings_size - 1] != '\0') {
+    goto bad;
+  }
+
+  // links only point forward (breadth first order), so walking them
+  // always terminates
+  for (uint32_t i = 0; i < h->node_count; i++) {
+    const NodeRecord *rec = &nf->nodes[i];
+    if (rec->name >= h->strings_size ||
+	(rec->first_child != NODE_NONE && (rec->first_child <= i || rec->first_child >= h->node_count)) ||
+	(rec->next_sibling != NODE_NONE && (rec->next_sibling <= i || rec->next_sibling >= h->node_count)) ||
+	(i > 0 && rec->parent >= i)) {
+      goto bad;
+    }
+  }
+
+  // and they form a tree: only folders have children, every record but
+  // the root is on exactly one child list, the one of its parent
+  unsigned char *reached = calloc(h->node_count, 1);
+  if (!reached) {
+    perror("Failed to check directory tree");
+    node_file_close(nf);
+    return -1;
+  }
+  int tree = nf->nodes[0].next_sibling == NODE_NONE;
+  for (uint32_t i = 0; tree && i < h->node_count; i++) {
+    const NodeRecord *rec = &nf->nodes[i];
+    if (rec->first_child != NODE_NONE && rec->type != FOLDER_NODE) {
+      tree = 0;
+    }
+    for (uint32_t c = rec->first_child; tree && c != NODE_NONE; c = nf->nodes[c].next_sibling) {
+      if (reached[c] || nf->nodes[c].parent != i) {
+	tree = 0;
+      }
+      reached[c] = 1;
+    }
+  }
+  for (uint32_t i = 1; tree && i < h->node_count; i++) {
+    tree = reached[i];
+  }
+  free(reached);
+  if (tree) {
+    return 0;
   }
-  int null_flag = 0;
-  fwrite(&null_flag, sizeof(int), 1, file);
 
-  fwrite(node->name, sizeof(char), MAX_NAME_LENGTH, file);
-  fwrite(&node->type, sizeof(NodeType), 1, file);
-  write_string(file, node->checksum);
-  write_string(file, node->blob_id);
-  fwrite(&node->is_uploaded, sizeof(int), 1, file);
+bad:
+  fprintf(stderr, "%s is malformed\n", path);
+  node_file_close(nf);
+  return -1;
+}
 
-  save_node(file, node->child);
-  save_node(file, node->sibling);
+void node_file_close(NodeFile *nf) {
+  if (nf->map) {
+    munmap(nf->map, nf->size);
+  }
+  memset(nf, 0, sizeof(*nf));
 }
 
-Node *load_node(FILE *file) {
-  int null_flag;
-  fread(&null_flag, sizeof(int), 1, file);
-  if (null_flag) {
+static Tree *load_flat(const char *path, uint32_t *hash_algo) {
+  NodeFile nf;
+  if (node_file_open(&nf, path) == -1) {
     return NULL;
   }
+  uint32_t count = nf.header->node_count;
+  Tree *tree = new_tree();
+  // one block for all nodes, and the string table taken over as is: it
+  // already holds every name exactly once
+  Node *nodes = arena_alloc(&tree->nodes, (size_t)count * sizeof(Node), _Alignof(Node));
+  char *names = arena_alloc(&tree->names, nf.header->strings_size, 1);
+  memcpy(names, nf.strings, nf.header->strings_size);
 
-  Node *node = (Node *)malloc(sizeof(Node));
-  fread(node->name, sizeof(char), MAX_NAME_LENGTH, file);
-  fread(&node->type, sizeof(NodeType), 1, file);
-  node->checksum = read_string(file);
-  node->blob_id = read_string(file);
-  fread(&node->is_uploaded, sizeof(int), 1, file);
+  for (uint32_t i = 0; i < count; i++) {
+    const NodeRecord *rec = &nf.nodes[i];
+    Node *node = &nodes[i];
+    memset(node, 0, sizeof(Node));
+    node->name = names + rec->name;
+    node->type = rec->type == FOLDER_NODE ? FOLDER_NODE : FILE_NODE;
+    node->is_uploaded = (rec->flags & NODE_REC_UPLOADED) != 0;
+    node->has_checksum = (rec->flags & NODE_REC_HAS_CHECKSUM) != 0;
+    node->has_blob_id = (rec->flags & NODE_REC_HAS_BLOB_ID) != 0;
+    memcpy(node->checksum, rec->checksum, sizeof(node->checksum));
+    memcpy(node->blob_id, rec->blob_id, sizeof(node->blob_id));
+    node->st = rec->st;
+    // links were checked to point forward, into this same array
+    node->child = rec->first_child != NODE_NONE ? &nodes[rec->first_child] : NULL;
+    node->sibling = rec->next_sibling != NODE_NONE ? &nodes[rec->next_sibling] : NULL;
+  }
 
-  node->child = load_node(file);
-  node->sibling = load_node(file);
+  tree->root = &nodes[0];
+  count_children(tree->root);
+  *hash_algo = nf.header->hash_algo;
+  node_file_close(&nf);
+  return tree;
+}
 
-  return node;
+Tree *load_tree(const char *path, uint32_t *hash_algo) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  uint32_t header[3];
+  size_t got = fread(header, sizeof(uint32_t), 3, file);
+  if (got >= 2 && header[0] == NODE_DATA_MAGIC) {
+    if (header[1] > NODE_DATA_VERSION) {
+      fprintf(stderr, "%s version %u is newer than supported (%u)\n", path,
+	      header[1], NODE_DATA_VERSION);
+      fclose(file);
+      return NULL;
+    }
+    if (header[1] == NODE_DATA_VERSION) {
+      fclose(file);
+      return load_flat(path, hash_algo);
+    }
+
+    Tree *tree = NULL;
+    if (header[1] == 3) {
+      // stream follows the hash algorithm
+      *hash_algo = got == 3 ? header[2] : 0;
+      tree = got == 3 ? load_legacy(file, 3) : NULL;
+    } else {
+      // version 2 trees were hashed with SHA-256, older ones lose their checksums
+      *hash_algo = header[1] == 2 ? HASH_SHA256 : 0;
+      fseek(file, 2 * sizeof(uint32_t), SEEK_SET);
+      tree = load_legacy(file, header[1]);
+    }
+    fclose(file);
+    return tree;
+  }
+
+  // pre-header file: starts directly with the root's null flag
+  rewind(file);
+  *hash_algo = 0;
+  Tree *tree = load_legacy(file, 0);
+  fclose(file);
+  return tree;
 }
 
-void free_node(Node *node) {
-  if (node == NULL) {
-    return;
+void drop_checksums(Node *root) {
+  for (Node *node = root; node; node = node->sibling) {
+    node->has_checksum = 0;
+    node->has_blob_id = 0;
+    drop_checksums(node->child);
   }
-  free(node->checksum);
-  free(node->blob_id);
-  free_node(node->child);
-  free_node(node->sibling);
-  free(node);
+}
+
+static int digest_folder(Node *folder, HashCtx *ctx) {
+  HashChild *children = malloc((folder->child_count + 1) * sizeof(HashChild));
+  if (!children) {
+    return -1;
+  }
+  size_t count = 0;
+  for (Node *child = folder->child; child; child = child->sibling) {
+    if (child->type == FOLDER_NODE) {
+      if (digest_folder(child, ctx) == -1) {
+	free(children);
+	return -1;
+      }
+      if (child->has_checksum) {
+	children[count++] = (HashChild){ child->name, strlen(child->name), child->checksum, 1 };
+      }
+    } else if (child->has_blob_id) {
+      children[count++] = (HashChild){ child->name, strlen(child->name), child->blob_id, 0 };
+    }
+  }
+  int status = count > 0 ? hash_folder(ctx, children, count, folder->checksum) : 0;
+  folder->has_checksum = count > 0 && status == 0;
+  free(children);
+  return status;
+}
+
+int folder_digests(Node *folder, uint32_t hash_algo) {
+  HashCtx ctx;
+  if (hash_ctx_init(&ctx, hash_algo) == -1) {
+    return -1;
+  }
+  int status = digest_folder(folder, &ctx);
+  hash_ctx_free(&ctx);
+  return status;
+}
+
+void stat_info_from(StatInfo *info, const struct stat *st) {
+  info->size = (uint64_t)st->st_size;
+  info->mtime_sec = st->st_mtim.tv_sec;
+  info->mtime_nsec = st->st_mtim.tv_nsec;
+  info->ctime_sec = st->st_ctim.tv_sec;
+  info->ctime_nsec = st->st_ctim.tv_nsec;
+  info->ino = (uint64_t)st->st_ino;
+  info->dev = (uint64_t)st->st_dev;
+}
+
+int stat_info_equal(const StatInfo *a, const StatInfo *b) {
+  return a->size == b->size &&
+    a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+    a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec &&
+    a->ino == b->ino && a->dev == b->dev;
 }
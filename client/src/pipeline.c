@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "checksum.h"
+#include "metrics.h"
+#include "pipeline.h"
+
+static int hash_queue_init(HashQueue *queue, size_t capacity) {
+  memset(queue, 0, sizeof(*queue));
+  queue->slots = calloc(capacity, sizeof(ScanItem *));
+  if (!queue->slots) {
+    perror("Failed to allocate hash queue");
+    return -1;
+  }
+  queue->capacity = capacity;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  return 0;
+}
+
+static void hash_queue_push(HashQueue *queue, ScanItem *item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  queue->slots[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* returns NULL once the queue is closed and drained */
+static ScanItem *hash_queue_pop(HashQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  ScanItem *item = NULL;
+  if (queue->count > 0) {
+    item = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+static void hash_queue_close(HashQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static void *hasher_main(void *arg) {
+  ScanPipeline *pipeline = arg;
+  ScanItem *item;
+  Checksummer cs;
+  // without a context every file comes back unhashed and is retried next run
+  int ready = checksummer_init(&cs, pipeline->hash_algo) == 0;
+  while ((item = hash_queue_pop(&pipeline->hash_queue)) != NULL) {
+    uint64_t start = metrics_now();
+    int ok = ready && calculateChecksum(&cs, item->path, item->digest) == 0;
+    metrics_since(METRIC_HASH, start, ok ? item->st.size : 0);
+
+    pthread_mutex_lock(&pipeline->lock);
+    item->has_digest = ok;
+    item->hashed = 1;
+    if (pipeline->head == item) {
+      pthread_cond_signal(&pipeline->item_ready);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+  }
+  if (ready) {
+    checksummer_free(&cs);
+  }
+  return NULL;
+}
+
+int pipeline_init(ScanPipeline *pipeline, int nhashers, uint32_t hash_algo) {
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->hash_algo = hash_algo;
+  if (nhashers < 1) {
+    nhashers = 1;
+  }
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->item_ready, NULL);
+  pthread_cond_init(&pipeline->space, NULL);
+  if (hash_queue_init(&pipeline->hash_queue, DEFAULT_HASH_QUEUE) == -1) {
+    return -1;
+  }
+
+  pipeline->hashers = calloc(nhashers, sizeof(pthread_t));
+  if (!pipeline->hashers) {
+    perror("Failed to allocate hashing threads");
+    return -1;
+  }
+  for (int i = 0; i < nhashers; i++) {
+    if (pthread_create(&pipeline->hashers[i], NULL, hasher_main, pipeline) != 0) {
+      perror("Failed to start hashing thread");
+      pipeline_free(pipeline);
+      return -1;
+    }
+    pipeline->nhashers++;
+  }
+  return 0;
+}
+
+void pipeline_free(ScanPipeline *pipeline) {
+  hash_queue_close(&pipeline->hash_queue);
+  for (int i = 0; i < pipeline->nhashers; i++) {
+    pthread_join(pipeline->hashers[i], NULL);
+  }
+  free(pipeline->hashers);
+  free(pipeline->hash_queue.slots);
+  pipeline->hashers = NULL;
+  pipeline->hash_queue.slots = NULL;
+}
+
+static ScanItem *new_item(ItemKind kind, Node *node, const char *path) {
+  ScanItem *item = calloc(1, sizeof(ScanItem));
+  if (!item || !(item->path = strdup(path))) {
+    perror("Failed to allocate scan item");
+    exit(EXIT_FAILURE);
+  }
+  item->kind = kind;
+  item->node = node;
+  return item;
+}
+
+/* appends in walk order, blocking while the uploader is too far behind */
+static void append_item(ScanPipeline *pipeline, ScanItem *item) {
+  pthread_mutex_lock(&pipeline->lock);
+  while (pipeline->pending >= MAX_PENDING_ITEMS) {
+    pthread_cond_wait(&pipeline->space, &pipeline->lock);
+  }
+  if (pipeline->tail) {
+    pipeline->tail->next = item;
+  } else {
+    pipeline->head = item;
+  }
+  pipeline->tail = item;
+  pipeline->pending++;
+  pthread_cond_signal(&pipeline->item_ready);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+void pipeline_add_dir(ScanPipeline *pipeline, Node *node, const char *path) {
+  append_item(pipeline, new_item(ITEM_DIR, node, path));
+}
+
+void pipeline_add_file(ScanPipeline *pipeline, Node *node, const char *path, const StatInfo *st) {
+  ScanItem *item = new_item(ITEM_FILE, node, path);
+  item->st = *st;
+  append_item(pipeline, item);
+  hash_queue_push(&pipeline->hash_queue, item);
+}
+
+void pipeline_add_known(ScanPipeline *pipeline, Node *node, const char *path) {
+  append_item(pipeline, new_item(ITEM_KNOWN, node, path));
+}
+
+void pipeline_walk_done(ScanPipeline *pipeline) {
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->walk_done = 1;
+  pthread_cond_signal(&pipeline->item_ready);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+ScanItem *pipeline_next(ScanPipeline *pipeline) {
+  pthread_mutex_lock(&pipeline->lock);
+  while (1) {
+    ScanItem *item = pipeline->head;
+    if (item && (item->kind != ITEM_FILE || item->hashed)) {
+      pipeline->head = item->next;
+      if (!pipeline->head) {
+	pipeline->tail = NULL;
+      }
+      pipeline->pending--;
+      pthread_cond_signal(&pipeline->space);
+      pthread_mutex_unlock(&pipeline->lock);
+      item->next = NULL;
+      return item;
+    }
+    if (!item && pipeline->walk_done) {
+      pipeline->walk_done = 0; // ready for the next scan
+      pthread_mutex_unlock(&pipeline->lock);
+      return NULL;
+    }
+    pthread_cond_wait(&pipeline->item_ready, &pipeline->lock);
+  }
+}
+
+void pipeline_free_item(ScanItem *item) {
+  free(item->path);
+  free(item);
+}
@@ -0,0 +1,241 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "log.h"
+#include "protocol.h"
+#include "reconcile.h"
+
+/* a folder whose digest differs, to be listed */
+typedef struct {
+  Node *node;
+  char *path; // as sent, starting with the root's name
+} Folder;
+
+typedef struct {
+  Folder *items;
+  size_t count;
+  size_t cap;
+} FolderList;
+
+static int push_folder(FolderList *list, Node *node, const char *parent, const char *name) {
+  if (list->count == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 64;
+    Folder *items = realloc(list->items, cap * sizeof(Folder));
+    if (!items) {
+      return -1;
+    }
+    list->items = items;
+    list->cap = cap;
+  }
+  size_t len = (parent ? strlen(parent) + 1 : 0) + strlen(name) + 1;
+  char *path = malloc(len);
+  if (!path) {
+    return -1;
+  }
+  if (parent) {
+    snprintf(path, len, "%s/%s", parent, name);
+  } else {
+    memcpy(path, name, len);
+  }
+  list->items[list->count++] = (Folder){ node, path };
+  return 0;
+}
+
+static void clear_folders(FolderList *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->items[i].path);
+  }
+  list->count = 0;
+}
+
+/* the server doesn't hold node as the tree says: send it again */
+static void forget(Node *node, ReconcileStats *stats) {
+  if (node->type == FILE_NODE) {
+    if (node->has_blob_id) {
+      node->has_blob_id = 0;
+      node->is_uploaded = 0;
+      stats->resend++;
+    }
+    return;
+  }
+  node->has_checksum = 0;
+  for (Node *child = node->child; child; child = child->sibling) {
+    forget(child, stats);
+  }
+}
+
+/* strcmp order against a name that isn't NUL terminated */
+static int compare_name(const char *a, const char *b, size_t b_len) {
+  size_t a_len = strlen(a);
+  int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (c != 0) {
+    return c;
+  }
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+  return strcmp((*(Node *const *)a)->name, (*(Node *const *)b)->name);
+}
+
+/* merges the server's listing of f with f's children. Subfolders whose
+ * digests differ go on next. Returns -1 on a malformed listing. */
+static int compare_folder(const Folder *f, const unsigned char *body, size_t len, FolderList *next,
+			  ReconcileStats *stats) {
+  if (len < TREE_PREFIX_SIZE) {
+    fprintf(stderr, "Malformed listing of %s\n", f->path);
+    return -1;
+  }
+  uint32_t count;
+  memcpy(&count, body + BLOB_ID_SIZE, 4);
+  count = be32toh(count);
+  if (f->node->has_checksum && count > 0 && memcmp(body, f->node->checksum, BLOB_ID_SIZE) == 0) {
+    return 0; // only the root gets here; below, digests are compared before asking
+  }
+
+  // the children a digest covers, in the listing's order
+  Node **mine = malloc((f->node->child_count + 1) * sizeof(Node *));
+  if (!mine) {
+    perror("Failed to allocate folder listing");
+    return -1;
+  }
+  size_t n = 0;
+  for (Node *child = f->node->child; child; child = child->sibling) {
+    if (child->type == FOLDER_NODE ? child->has_checksum : child->has_blob_id) {
+      mine[n++] = child;
+    }
+  }
+  qsort(mine, n, sizeof(Node *), compare_nodes);
+
+  int status = 0;
+  size_t i = 0;
+  const unsigned char *p = body + TREE_PREFIX_SIZE;
+  const unsigned char *end = body + len;
+  for (uint32_t e = 0; e < count; e++) {
+    TreeEntryHeader entry;
+    if ((size_t)(end - p) < TREE_ENTRY_SIZE) {
+      status = -1;
+      break;
+    }
+    decode_tree_entry(&entry, p);
+    const char *name = (const char *)p + TREE_ENTRY_SIZE;
+    if (entry.type > 1 || entry.name_len == 0 || entry.name_len > (size_t)(end - p) - TREE_ENTRY_SIZE) {
+      status = -1;
+      break;
+    }
+    p += TREE_ENTRY_SIZE + entry.name_len;
+
+    while (i < n && compare_name(mine[i]->name, name, entry.name_len) < 0) {
+      forget(mine[i++], stats); // the server has nothing by that name
+    }
+    if (i == n || compare_name(mine[i]->name, name, entry.name_len) != 0) {
+      log_debug("Only on the server: %s/%.*s", f->path, (int)entry.name_len, name);
+      stats->extra++;
+      continue;
+    }
+    Node *child = mine[i++];
+    int is_folder = child->type == FOLDER_NODE;
+    if (entry.type != (uint32_t)is_folder) {
+      forget(child, stats);
+      stats->extra++;
+    } else if (memcmp(entry.digest, is_folder ? child->checksum : child->blob_id, BLOB_ID_SIZE) == 0) {
+      continue;
+    } else if (!is_folder) {
+      log_debug("Server holds other contents for %s/%s", f->path, child->name);
+      forget(child, stats);
+    } else if (push_folder(next, child, f->path, child->name) == -1) {
+      perror("Failed to allocate folder list");
+      status = -2;
+      break;
+    }
+  }
+  if (status == -1) {
+    fprintf(stderr, "Malformed listing of %s\n", f->path);
+  } else if (status == 0) {
+    while (i < n) {
+      forget(mine[i++], stats);
+    }
+  }
+  free(mine);
+  return status < 0 ? -1 : 0;
+}
+
+/* sends the requests for items [start, end) of level, then merges the
+ * listings as they come back */
+static int list_folders(const FolderList *level, size_t start, size_t end, int sock, uint32_t *seq,
+			FolderList *next, ReconcileStats *stats) {
+  uint32_t base = *seq;
+  for (size_t i = start; i < end; i++) {
+    const char *path = level->items[i].path;
+    MsgHeader header = { MSG_GET_TREE, (*seq)++, (uint32_t)strlen(path), 0, 0 };
+    if (send_header(sock, &header, path, i + 1 < end ? MSG_MORE : 0) == -1) {
+      perror("Error sending folder listing request");
+      return -1;
+    }
+  }
+  for (size_t got = 0; got < end - start; got++) {
+    MsgHeader header;
+    if (recv_header(sock, &header) == -1) {
+      fprintf(stderr, "Connection to server lost\n");
+      return -1;
+    }
+    if (header.type == MSG_ACK) {
+      fprintf(stderr, "Server could not list a folder\n");
+      return -1;
+    }
+    if (header.type != MSG_TREE || header.path_len != 0 || header.seq - base >= end - start) {
+      fprintf(stderr, "Unexpected message %u from server\n", header.type);
+      return -1;
+    }
+    unsigned char *body = malloc(header.body_len ? header.body_len : 1);
+    if (!body) {
+      perror("Failed to allocate folder listing");
+      return -1;
+    }
+    if (recv_all(sock, body, header.body_len) == -1) {
+      fprintf(stderr, "Connection to server lost\n");
+      free(body);
+      return -1;
+    }
+    int status = compare_folder(&level->items[start + (header.seq - base)], body, header.body_len, next, stats);
+    free(body);
+    if (status == -1) {
+      return -1;
+    }
+    stats->listed++;
+  }
+  return 0;
+}
+
+int reconcile_tree(Tree *tree, int sock, uint32_t *seq, uint32_t window, uint32_t hash_algo,
+		   ReconcileStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (folder_digests(tree->root, hash_algo) == -1) {
+    fprintf(stderr, "Failed to compute folder digests\n");
+    return -1;
+  }
+  FolderList level = { 0 }, next = { 0 };
+  if (push_folder(&level, tree->root, NULL, tree->root->name) == -1) {
+    perror("Failed to allocate folder list");
+    return -1;
+  }
+  // a level of the tree per round trip, each folder on it asked for at once
+  int status = 0;
+  while (status == 0 && level.count > 0) {
+    for (size_t start = 0; start < level.count && status == 0; start += window) {
+      stats->rounds++;
+      size_t end = level.count - start < window ? level.count : start + window;
+      status = list_folders(&level, start, end, sock, seq, &next, stats);
+    }
+    clear_folders(&level);
+    FolderList swap = level;
+    level = next;
+    next = swap;
+  }
+  clear_folders(&level);
+  free(level.items);
+  free(next.items);
+  return status;
+}
@@ -0,0 +1,459 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "compress.h"
+#include "hash.h"
+#include "log.h"
+#include "protocol.h"
+#include "restorer.h"
+#include "upload_pool.h"
+#include "uploader.h"
+
+#define RESTORE_NONE UINT32_MAX
+
+/* a file to fetch; its path, relative to the tree's root, is in paths */
+typedef struct {
+  const Node *node;
+  size_t path;
+} RestoreItem;
+
+typedef struct {
+  const Tree *tree;
+  const char *target;
+  RestoreItem *items;
+  size_t count;
+  size_t cap;
+  char *paths;
+  size_t paths_len;
+  size_t paths_cap;
+  size_t next; // first item no connection took yet
+} Restore;
+
+/* one connection and the requests it has outstanding */
+typedef struct {
+  Restore *r;
+  const struct sockaddr_in *addr;
+  uint32_t window;
+  uint32_t hash_algo;
+  int sock;
+  uint32_t codec;
+  uint32_t *slots; // item per seq % window, RESTORE_NONE if free
+  uint32_t next_seq;
+  uint32_t in_flight;
+  HashCtx hash;
+  Decompressor dec;
+  unsigned char *raw;
+  unsigned char *packed;
+  RestoreStats stats;
+  int status;
+} RestoreConn;
+
+static int add_item(Restore *r, const Node *node, const char *path) {
+  size_t len = strlen(path) + 1;
+  if (r->count == r->cap) {
+    size_t cap = r->cap ? r->cap * 2 : 1024;
+    RestoreItem *items = realloc(r->items, cap * sizeof(RestoreItem));
+    if (!items) {
+      return -1;
+    }
+    r->items = items;
+    r->cap = cap;
+  }
+  if (r->paths_len + len > r->paths_cap) {
+    size_t cap = r->paths_cap ? r->paths_cap * 2 : 64 * 1024;
+    while (cap < r->paths_len + len) {
+      cap *= 2;
+    }
+    char *paths = realloc(r->paths, cap);
+    if (!paths) {
+      return -1;
+    }
+    r->paths = paths;
+    r->paths_cap = cap;
+  }
+  memcpy(r->paths + r->paths_len, path, len);
+  r->items[r->count++] = (RestoreItem){ node, r->paths_len };
+  r->paths_len += len;
+  return 0;
+}
+
+/* creates the folders under dir and lists the files to fetch. path is
+ * relative to the root, "" for the root itself. */
+static int collect(Restore *r, const Node *dir, const char *path, RestoreStats *stats) {
+  char local[PATH_MAX];
+  snprintf(local, sizeof(local), "%s/%s", r->target, path);
+  if (mkdir(local, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Failed to create directory %s: %s\n", local, strerror(errno));
+    return -1;
+  }
+  for (const Node *child = dir->child; child; child = child->sibling) {
+    char sub[PATH_MAX];
+    if (snprintf(sub, sizeof(sub), "%s%s%s", path, *path ? "/" : "", child->name) >= (int)sizeof(sub)) {
+      fprintf(stderr, "Path too long: %s/%s\n", path, child->name);
+      stats->failed++;
+      continue;
+    }
+    if (child->type == FOLDER_NODE) {
+      if (collect(r, child, sub, stats) == -1) {
+	return -1;
+      }
+    } else if (!child->has_blob_id) {
+      log_debug("Skipping %s, it was never stored", sub);
+      stats->skipped++;
+    } else if (add_item(r, child, sub) == -1) {
+      perror("Failed to allocate restore list");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/* sends the next requests while the window has room */
+static int send_requests(RestoreConn *rc) {
+  Restore *r = rc->r;
+  while (rc->slots[rc->next_seq % rc->window] == RESTORE_NONE) {
+    size_t i = __atomic_fetch_add(&r->next, 1, __ATOMIC_RELAXED);
+    if (i >= r->count) {
+      break;
+    }
+    const RestoreItem *item = &r->items[i];
+    char wire[MAX_WIRE_PATH];
+    int len = snprintf(wire, sizeof(wire), "%s/%s", r->tree->root->name, r->paths + item->path);
+    if (len >= (int)sizeof(wire)) {
+      fprintf(stderr, "Path too long to fetch: %s\n", r->paths + item->path);
+      rc->stats.failed++;
+      continue;
+    }
+    MsgHeader header = { MSG_GET_BLOB, rc->next_seq, (uint32_t)len, 0, BLOB_ID_SIZE };
+    if (send_header(rc->sock, &header, wire, MSG_MORE) == -1 ||
+	send_all(rc->sock, item->node->blob_id, BLOB_ID_SIZE, 0) == -1) {
+      perror("Error sending restore request");
+      return -1;
+    }
+    rc->slots[rc->next_seq % rc->window] = (uint32_t)i;
+    rc->next_seq++;
+    rc->in_flight++;
+  }
+  return 0;
+}
+
+/* takes the item a reply with seq answers out of the window */
+static const RestoreItem *take_slot(RestoreConn *rc, uint32_t seq) {
+  uint32_t *slot = &rc->slots[seq % rc->window];
+  if (*slot == RESTORE_NONE || seq >= rc->next_seq || rc->next_seq - seq > rc->window) {
+    fprintf(stderr, "Server answered request %u, which is not outstanding\n", seq);
+    return NULL;
+  }
+  const RestoreItem *item = &rc->r->items[*slot];
+  *slot = RESTORE_NONE;
+  rc->in_flight--;
+  return item;
+}
+
+/* reads a MSG_BLOB body into the file the request was for. Failing to
+ * write it only fails the file; the body is read to the end regardless,
+ * and -1 means the connection is no good anymore. */
+static int receive_blob(RestoreConn *rc, const MsgHeader *header, const RestoreItem *item) {
+  Restore *r = rc->r;
+  const char *rel = r->paths + item->path;
+  char local[PATH_MAX];
+  snprintf(local, sizeof(local), "%s/%s", r->target, rel);
+  int fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create %s: %s\n", local, strerror(errno));
+  } else if (header->body_len > 0) {
+    // one extent, and ENOSPC before any data is fetched for it
+    if (posix_fallocate(fd, 0, (off_t)header->body_len) == ENOSPC) {
+      fprintf(stderr, "No space for %s\n", local);
+      close(fd);
+      unlink(local);
+      fd = -1;
+    }
+  }
+  int ok = fd != -1;
+  hash_begin(&rc->hash);
+
+  uint64_t left = header->body_len;
+  while (left > 0) {
+    const unsigned char *data = rc->raw;
+    size_t len;
+    if (header->flags & MSG_FLAG_FRAMED) {
+      unsigned char buf[FRAME_HEADER_SIZE];
+      FrameHeader frame;
+      if (recv_all(rc->sock, buf, sizeof(buf)) == -1) {
+	goto lost;
+      }
+      decode_frame(&frame, buf);
+      if (frame.raw_len == 0 || frame.raw_len > STREAM_CHUNK_SIZE || frame.raw_len > left ||
+	  frame.data_len == 0 || frame.data_len > frame.raw_len) {
+	fprintf(stderr, "Malformed frame in the blob of %s\n", rel);
+	goto lost;
+      }
+      if (frame.data_len == frame.raw_len) {
+	if (recv_all(rc->sock, rc->raw, frame.raw_len) == -1) {
+	  goto lost;
+	}
+      } else if (recv_all(rc->sock, rc->packed, frame.data_len) == -1 ||
+		 decompress_frame(&rc->dec, rc->packed, frame.data_len, rc->raw, frame.raw_len) == -1) {
+	fprintf(stderr, "Failed to decompress the blob of %s\n", rel);
+	goto lost;
+      }
+      len = frame.raw_len;
+    } else {
+      len = left < STREAM_CHUNK_SIZE ? (size_t)left : STREAM_CHUNK_SIZE;
+      if (recv_all(rc->sock, rc->raw, len) == -1) {
+	goto lost;
+      }
+    }
+    left -= len;
+    hash_update(&rc->hash, data, len);
+    if (ok && write_all(fd, data, len) == -1) {
+      fprintf(stderr, "Error writing %s: %s\n", local, strerror(errno));
+      ok = 0;
+    }
+  }
+
+  unsigned char digest[BLOB_ID_SIZE];
+  if (hash_finish(&rc->hash, digest) == -1 || memcmp(digest, item->node->blob_id, BLOB_ID_SIZE) != 0) {
+    if (ok) {
+      fprintf(stderr, "Contents of %s don't match its blob id\n", rel);
+    }
+    ok = 0;
+  }
+  if (ok) {
+    struct timespec times[2] = { { 0, UTIME_OMIT },
+				 { (time_t)item->node->st.mtime_sec, (long)item->node->st.mtime_nsec } };
+    futimens(fd, times);
+  }
+  if (fd != -1) {
+    if (close(fd) == -1 && ok) {
+      fprintf(stderr, "Error writing %s: %s\n", local, strerror(errno));
+      ok = 0;
+    }
+    if (!ok) {
+      unlink(local);
+    }
+  }
+  if (ok) {
+    log_debug("Restored %s", rel);
+    rc->stats.files++;
+    rc->stats.bytes += header->body_len;
+  } else {
+    rc->stats.failed++;
+  }
+  return 0;
+
+lost:
+  if (fd != -1) {
+    close(fd);
+    unlink(local);
+  }
+  rc->stats.failed++;
+  return -1;
+}
+
+/* one server message: a blob, or acks failing requests */
+static int receive_reply(RestoreConn *rc) {
+  MsgHeader header;
+  if (recv_header(rc->sock, &header) == -1) {
+    fprintf(stderr, "Connection to server lost\n");
+    return -1;
+  }
+  if (header.type == MSG_BLOB && header.path_len == 0 &&
+      (rc->codec != COMPRESS_NONE || !(header.flags & MSG_FLAG_FRAMED))) {
+    const RestoreItem *item = take_slot(rc, header.seq);
+    return item ? receive_blob(rc, &header, item) : -1;
+  }
+  if (header.type != MSG_ACK || header.path_len != 0 || header.body_len % ACK_ENTRY_SIZE != 0 ||
+      header.body_len > MAX_ACK_BATCH * ACK_ENTRY_SIZE) {
+    fprintf(stderr, "Unexpected message %u from server\n", header.type);
+    return -1;
+  }
+  unsigned char buf[MAX_ACK_BATCH * ACK_ENTRY_SIZE];
+  if (recv_all(rc->sock, buf, header.body_len) == -1) {
+    fprintf(stderr, "Connection to server lost\n");
+    return -1;
+  }
+  for (size_t off = 0; off < header.body_len; off += ACK_ENTRY_SIZE) {
+    AckEntry ack;
+    decode_ack(&ack, buf + off);
+    const RestoreItem *item = take_slot(rc, ack.seq);
+    if (!item) {
+      return -1;
+    }
+    fprintf(stderr, "Server could not send %s\n", rc->r->paths + item->path);
+    rc->stats.failed++;
+  }
+  return 0;
+}
+
+static void *restore_worker(void *arg) {
+  RestoreConn *rc = arg;
+  while (rc->status == 0) {
+    if (send_requests(rc) == -1) {
+      rc->status = -1;
+      break;
+    }
+    if (rc->in_flight == 0) {
+      break;
+    }
+    rc->status = receive_reply(rc);
+  }
+  if (rc->status == 0) {
+    MsgHeader end = { MSG_END, rc->next_seq, 0, 0, 0 };
+    if (send_header(rc->sock, &end, NULL, 0) == -1) {
+      rc->status = -1;
+    }
+  } else {
+    rc->stats.failed += rc->in_flight; // whatever it still waited for
+  }
+  return NULL;
+}
+
+static int connect_server(const struct sockaddr_in *addr) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1) {
+    perror("Error creating socket");
+    return -1;
+  }
+  if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+    perror("Error connecting to server");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* connects and says hello; frames in any codec we know can be decoded */
+static int restore_conn_init(RestoreConn *rc) {
+  rc->sock = connect_server(rc->addr);
+  if (rc->sock == -1) {
+    return -1;
+  }
+  rc->slots = malloc(rc->window * sizeof(uint32_t));
+  rc->raw = malloc(STREAM_CHUNK_SIZE);
+  rc->packed = malloc(STREAM_CHUNK_SIZE);
+  if (!rc->slots || !rc->raw || !rc->packed) {
+    perror("Failed to allocate restore buffers");
+    return -1;
+  }
+  for (uint32_t i = 0; i < rc->window; i++) {
+    rc->slots[i] = RESTORE_NONE;
+  }
+  if (hash_ctx_init(&rc->hash, rc->hash_algo) == -1) {
+    fprintf(stderr, "Unknown hash algorithm %u\n", rc->hash_algo);
+    return -1;
+  }
+  if (session_hello(rc->sock, rc->hash_algo, COMPRESS_SUPPORTED, &rc->codec) == -1) {
+    return -1;
+  }
+  if (rc->codec != COMPRESS_NONE && decompressor_init(&rc->dec, rc->codec) == -1) {
+    fprintf(stderr, "Failed to set up codec %u\n", rc->codec);
+    return -1;
+  }
+  return 0;
+}
+
+static void restore_conn_free(RestoreConn *rc) {
+  if (rc->sock != -1) {
+    close(rc->sock);
+  }
+  hash_ctx_free(&rc->hash);
+  if (rc->codec != COMPRESS_NONE) {
+    decompressor_free(&rc->dec);
+  }
+  free(rc->slots);
+  free(rc->raw);
+  free(rc->packed);
+}
+
+int restore_tree(const Tree *tree, const char *target, const struct sockaddr_in *addr, int count,
+		 uint32_t window, uint32_t hash_algo, RestoreStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (count < 1 || count > MAX_CONNECTIONS) {
+    fprintf(stderr, "Connections must be between 1 and %d\n", MAX_CONNECTIONS);
+    return -1;
+  }
+  if (window == 0 || window > MAX_WINDOW) {
+    fprintf(stderr, "Window must be between 1 and %d\n", MAX_WINDOW);
+    return -1;
+  }
+  Restore r = { .tree = tree, .target = target };
+  if (collect(&r, tree->root, "", stats) == -1) {
+    free(r.items);
+    free(r.paths);
+    return -1;
+  }
+  log_info("Restoring %zu files into %s", r.count, target);
+
+  RestoreConn *conns = calloc((size_t)count, sizeof(RestoreConn));
+  pthread_t *threads = calloc((size_t)count, sizeof(pthread_t));
+  int status = conns && threads ? 0 : -1;
+  if (status == -1) {
+    perror("Failed to allocate restore connections");
+  }
+  int started = 0;
+  for (int i = 0; i < count && status == 0; i++) {
+    RestoreConn *rc = &conns[i];
+    *rc = (RestoreConn){ .r = &r, .addr = addr, .window = window, .hash_algo = hash_algo, .sock = -1 };
+    if (restore_conn_init(rc) == -1) {
+      restore_conn_free(rc);
+      status = -1;
+      break;
+    }
+    started++;
+  }
+  // nothing is fetched until every connection is up; the threads that do
+  // start share out all the files between them
+  int running = 0;
+  for (int i = 0; i < started && status == 0; i++) {
+    if (pthread_create(&threads[i], NULL, restore_worker, &conns[i]) != 0) {
+      perror("Failed to start restore thread");
+      status = -1;
+      break;
+    }
+    running++;
+  }
+  for (int i = 0; i < running; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < started; i++) {
+    RestoreConn *rc = &conns[i];
+    if (rc->status == -1) {
+      status = -1;
+    }
+    stats->files += rc->stats.files;
+    stats->bytes += rc->stats.bytes;
+    stats->failed += rc->stats.failed;
+    restore_conn_free(rc);
+  }
+  if (status == -1 && r.next < r.count) {
+    stats->failed += r.count - r.next; // never asked for
+  }
+  free(conns);
+  free(threads);
+  free(r.items);
+  free(r.paths);
+  return status;
+}
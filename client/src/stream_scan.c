@@ -0,0 +1,461 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "stream_scan.h"
+
+/* one entry of a directory listing */
+typedef struct {
+  char *name;
+  int is_dir;
+  StatInfo st; // files only
+} StreamEntry;
+
+/* one directory being walked; its listing is freed when it is left */
+typedef struct {
+  StreamEntry *entries;
+  size_t count;
+  size_t next;     // entry to look at next
+  size_t path_len; // length of this directory's path in the shared buffer
+} StreamFrame;
+
+/* a node lent to the pipeline, and to the uploader until its ack is in.
+ * Its record in the new state starts at offset. */
+typedef struct StreamNode {
+  Node node;
+  uint64_t offset;
+  uint32_t path_len;
+  struct StreamNode *next; // in the batch waiting for acks
+  char name[];
+} StreamNode;
+
+/* the last run's records, one at a time */
+typedef struct {
+  FILE *file;
+  JournalRecord rec;
+  char path[MAX_WIRE_PATH + 1];
+  int valid; // rec and path hold the next record
+} StreamReader;
+
+typedef struct {
+  const char *dirpath;
+  StreamReader prev;
+  ScanPipeline *pipeline;
+  ScanOptions *opts;
+  size_t deleted;
+} StreamWalk;
+
+/* strcmp, except that '/' sorts before every other byte, so a directory's
+ * contents come right after it and before any sibling whose name merely
+ * starts with the directory's */
+static int compare_paths(const char *a, const char *b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  unsigned ca = *a == '/' ? 1 : (unsigned char)*a;
+  unsigned cb = *b == '/' ? 1 : (unsigned char)*b;
+  return (int)ca - (int)cb;
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const StreamEntry *)a)->name, ((const StreamEntry *)b)->name);
+}
+
+static void reader_next(StreamReader *r) {
+  r->valid = 0;
+  if (!r->file) {
+    return;
+  }
+  if (fread(&r->rec, sizeof(r->rec), 1, r->file) != 1) {
+    return;
+  }
+  if (r->rec.path_len == 0 || r->rec.path_len > MAX_WIRE_PATH || r->rec.type > FOLDER_NODE ||
+      fread(r->path, 1, r->rec.path_len, r->file) != r->rec.path_len) {
+    log_warn("Saved stream state is damaged, the rest of it is ignored");
+    return;
+  }
+  r->path[r->rec.path_len] = '\0';
+  r->valid = 1;
+}
+
+static void reader_open(StreamReader *r, const char *path, uint32_t hash_algo) {
+  memset(r, 0, sizeof(*r));
+  r->file = fopen(path, "rb");
+  if (!r->file) {
+    log_info("No saved stream state, creating new.");
+    return;
+  }
+  StreamHeader header;
+  if (fread(&header, sizeof(header), 1, r->file) != 1 || header.magic != STREAM_MAGIC ||
+      header.version != STREAM_VERSION) {
+    log_info("Could not load saved stream state, creating new.");
+  } else if (header.hash_algo != hash_algo) {
+    log_info("Saved stream state was hashed with %s, rehashing with %s.",
+	     hash_name(header.hash_algo) ? hash_name(header.hash_algo) : "an unknown algorithm",
+	     hash_name(hash_algo));
+  } else {
+    reader_next(r);
+    return;
+  }
+  fclose(r->file);
+  r->file = NULL;
+}
+
+static void reader_close(StreamReader *r) {
+  if (r->file) {
+    fclose(r->file);
+  }
+  r->file = NULL;
+  r->valid = 0;
+}
+
+static void free_listing(StreamFrame *frame) {
+  for (size_t i = 0; i < frame->count; i++) {
+    free(frame->entries[i].name);
+  }
+  free(frame->entries);
+  frame->entries = NULL;
+  frame->count = 0;
+}
+
+/* lists path into frame, sorted by name. Returns -1 if it can't be read. */
+static int list_dir(const char *path, StreamFrame *frame) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    perror("Failed to open directory");
+    return -1;
+  }
+  int fd = dirfd(dir);
+  size_t capacity = 0;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+      continue;
+    }
+    StreamEntry entry = { 0 };
+    int flags = 0;
+    switch (d->d_type) {
+    case DT_DIR:
+      entry.is_dir = 1;
+      break;
+    case DT_REG:
+      flags = AT_SYMLINK_NOFOLLOW;
+      break;
+    case DT_LNK:
+    case DT_UNKNOWN:
+      flags = 0; // links are followed, as they always were
+      break;
+    default:
+      continue; // devices, fifos and sockets are never backed up
+    }
+    if (!entry.is_dir) {
+      struct stat st;
+      uint64_t start = metrics_now();
+      int status = fstatat(fd, d->d_name, &st, flags);
+      metrics_since(METRIC_STAT, start, 0);
+      if (status == -1) {
+	perror("Failed to get file stats");
+	continue;
+      }
+      if (S_ISDIR(st.st_mode)) {
+	entry.is_dir = 1;
+      } else if (S_ISREG(st.st_mode)) {
+	stat_info_from(&entry.st, &st);
+      } else {
+	continue;
+      }
+    }
+    if (frame->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      StreamEntry *entries = realloc(frame->entries, capacity * sizeof(StreamEntry));
+      if (!entries) {
+	perror("Failed to allocate directory listing");
+	exit(EXIT_FAILURE);
+      }
+      frame->entries = entries;
+    }
+    if (!(entry.name = strdup(d->d_name))) {
+      perror("Failed to allocate directory listing");
+      exit(EXIT_FAILURE);
+    }
+    frame->entries[frame->count++] = entry;
+  }
+  closedir(dir);
+  qsort(frame->entries, frame->count, sizeof(StreamEntry), compare_entries);
+  return 0;
+}
+
+/* path + "/" + name, at path[len]. Returns the new length, or 0 if it
+ * doesn't fit. */
+static size_t append_name(char *path, size_t len, const char *name) {
+  int n = snprintf(path + len, MAX_PATH - len, "/%s", name);
+  if (n < 0 || (size_t)n >= MAX_PATH - len) {
+    path[len] = '\0';
+    log_warn("Path too long: %s/%s", path, name);
+    return 0;
+  }
+  return len + (size_t)n;
+}
+
+/* a node for name, in the state rec left it in if there is one */
+static StreamNode *new_node(const char *name, NodeType type, const JournalRecord *rec) {
+  size_t len = strlen(name);
+  StreamNode *sn = calloc(1, sizeof(StreamNode) + len + 1);
+  if (!sn) {
+    perror("Failed to allocate node");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(sn->name, name, len + 1);
+  sn->node.name = sn->name;
+  sn->node.type = type;
+  if (rec) {
+    sn->node.st = rec->st;
+    sn->node.is_uploaded = (rec->flags & NODE_REC_UPLOADED) != 0;
+    sn->node.has_checksum = (rec->flags & NODE_REC_HAS_CHECKSUM) != 0;
+    sn->node.has_blob_id = (rec->flags & NODE_REC_HAS_BLOB_ID) != 0;
+    memcpy(sn->node.checksum, rec->checksum, sizeof(sn->node.checksum));
+    memcpy(sn->node.blob_id, rec->blob_id, sizeof(sn->node.blob_id));
+  }
+  return sn;
+}
+
+/* the old records of everything below path, which couldn't be listed:
+ * carried over as they are */
+static void keep_below(StreamWalk *w, const char *path, size_t len) {
+  while (w->prev.valid && strncmp(w->prev.path, path, len) == 0 && w->prev.path[len] == '/') {
+    const char *name = strrchr(w->prev.path, '/') + 1;
+    StreamNode *sn = new_node(name, (NodeType)w->prev.rec.type, &w->prev.rec);
+    pipeline_add_known(w->pipeline, &sn->node, w->prev.path);
+    reader_next(&w->prev);
+  }
+}
+
+/* the walker stage: lists dirpath depth first in sorted order and joins
+ * it with the old records, queueing every entry on the pipeline. Only the
+ * listings of the directories on the current path are held. */
+static void *stream_walk(void *arg) {
+  StreamWalk *w = arg;
+  ScanOptions *opts = w->opts;
+  char path[MAX_PATH];
+  size_t root_len = strlen(w->dirpath);
+  size_t capacity = 16;
+  size_t depth = 0;
+  StreamFrame *stack = malloc(capacity * sizeof(StreamFrame));
+  if (!stack) {
+    perror("Failed to allocate walk stack");
+    exit(EXIT_FAILURE);
+  }
+  if (root_len >= MAX_PATH) {
+    log_warn("Path too long: %s", w->dirpath);
+  } else {
+    memcpy(path, w->dirpath, root_len + 1);
+    stack[0] = (StreamFrame){ NULL, 0, 0, root_len };
+    if (list_dir(path, &stack[0]) == 0) {
+      depth = 1;
+    } else {
+      keep_below(w, path, root_len);
+    }
+  }
+
+  while (depth > 0) {
+    StreamFrame *frame = &stack[depth - 1];
+    if (frame->next == frame->count) {
+      free_listing(frame);
+      depth--;
+      continue;
+    }
+    StreamEntry *entry = &frame->entries[frame->next++];
+    if (opts->ignore && depth == 1 && isStateFile(entry->name, opts->ignore)) {
+      continue; // our own state files
+    }
+    size_t len = append_name(path, frame->path_len, entry->name);
+    if (len == 0) {
+      continue;
+    }
+
+    // old records sorting before this path are of entries that are gone
+    int c = 1;
+    while (w->prev.valid && (c = compare_paths(w->prev.path, path)) < 0) {
+      log_debug("File or directory deleted: %s", w->prev.path);
+      w->deleted++;
+      reader_next(&w->prev);
+    }
+    NodeType type = entry->is_dir ? FOLDER_NODE : FILE_NODE;
+    const JournalRecord *old = w->prev.valid && c == 0 && w->prev.rec.type == type ? &w->prev.rec : NULL;
+    StreamNode *sn = new_node(entry->name, type, old);
+    if (w->prev.valid && c == 0) {
+      reader_next(&w->prev); // a file replaced by a folder or back starts over
+    }
+    Node *node = &sn->node;
+
+    if (!entry->is_dir) {
+      opts->stats.files_scanned++;
+      if (old && !opts->paranoid && node->has_checksum && node->is_uploaded &&
+	  stat_info_equal(&node->st, &entry->st)) {
+	opts->stats.stat_unchanged++;
+	pipeline_add_known(w->pipeline, node, path);
+      } else {
+	if (old) {
+	  opts->stats.rehashed++;
+	} else {
+	  log_debug("New File: %s", entry->name);
+	  opts->stats.new_files++;
+	}
+	pipeline_add_file(w->pipeline, node, path, &entry->st);
+      }
+      continue;
+    }
+
+    if (old && node->is_uploaded) {
+      pipeline_add_known(w->pipeline, node, path);
+    } else {
+      log_debug("New Folder found: %s", entry->name);
+      pipeline_add_dir(w->pipeline, node, path);
+    }
+    if (depth == capacity) {
+      capacity *= 2;
+      StreamFrame *grown = realloc(stack, capacity * sizeof(StreamFrame));
+      if (!grown) {
+	perror("Failed to allocate walk stack");
+	exit(EXIT_FAILURE);
+      }
+      stack = grown;
+    }
+    stack[depth] = (StreamFrame){ NULL, 0, 0, len };
+    if (list_dir(path, &stack[depth]) == 0) {
+      depth++;
+    } else {
+      keep_below(w, path, len); // leave what we know alone
+    }
+  }
+  free(stack);
+
+  while (w->prev.valid) {
+    log_debug("File or directory deleted: %s", w->prev.path);
+    w->deleted++;
+    reader_next(&w->prev);
+  }
+  pipeline_walk_done(w->pipeline);
+  return NULL;
+}
+
+static void encode_record(JournalRecord *rec, const Node *node, uint32_t path_len) {
+  memset(rec, 0, sizeof(*rec));
+  rec->path_len = path_len;
+  rec->type = node->type;
+  rec->flags = (node->is_uploaded ? NODE_REC_UPLOADED : 0) |
+    (node->has_checksum ? NODE_REC_HAS_CHECKSUM : 0) |
+    (node->has_blob_id ? NODE_REC_HAS_BLOB_ID : 0);
+  memcpy(rec->checksum, node->checksum, sizeof(rec->checksum));
+  memcpy(rec->blob_id, node->blob_id, sizeof(rec->blob_id));
+  rec->st = node->st;
+}
+
+/* waits for the acks of the batch and rewrites its records with what
+ * they changed. Returns -1 if the state file could not be written. */
+static int settle(FILE *out, StreamNode **batch, UploadPool *pool) {
+  // a lost connection leaves the nodes unacked, and the next run retries them
+  upload_pool_flush(pool);
+  int status = fflush(out) == 0 ? 0 : -1;
+  while (*batch) {
+    StreamNode *sn = *batch;
+    *batch = sn->next;
+    JournalRecord rec;
+    encode_record(&rec, &sn->node, sn->path_len);
+    if (status == 0 && pwrite(fileno(out), &rec, sizeof(rec), (off_t)sn->offset) != (ssize_t)sizeof(rec)) {
+      status = -1;
+    }
+    free(sn);
+  }
+  return status;
+}
+
+int stream_backup(const char *dirpath, const char *path, ScanPipeline *pipeline, UploadPool *pool,
+		  ScanOptions *opts, uint32_t hash_algo) {
+  char tmp[MAX_PATH];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *out = fopen(tmp, "wb");
+  StreamHeader header = { STREAM_MAGIC, STREAM_VERSION, hash_algo, 0 };
+  if (!out || fwrite(&header, sizeof(header), 1, out) != 1) {
+    perror("Failed to start stream state");
+    if (out) {
+      fclose(out);
+    }
+    return -1;
+  }
+
+  StreamWalk walk = { dirpath, { 0 }, pipeline, opts, 0 };
+  reader_open(&walk.prev, path, hash_algo);
+  pthread_t walker;
+  if (pthread_create(&walker, NULL, stream_walk, &walk) != 0) {
+    perror("Failed to start directory walker");
+    reader_close(&walk.prev);
+    fclose(out);
+    unlink(tmp);
+    return -1;
+  }
+
+  int status = 0;
+  uint64_t offset = sizeof(header);
+  StreamNode *batch = NULL;
+  size_t batched = 0;
+  ScanItem *item;
+  while ((item = pipeline_next(pipeline)) != NULL) {
+    StreamNode *sn = (StreamNode *)item->node;
+    int sent = uploadItem(item, pool, opts);
+    sn->offset = offset;
+    sn->path_len = (uint32_t)strlen(item->path);
+    JournalRecord rec;
+    encode_record(&rec, &sn->node, sn->path_len);
+    if (fwrite(&rec, sizeof(rec), 1, out) != 1 || fwrite(item->path, 1, sn->path_len, out) != sn->path_len) {
+      status = -1; // keep consuming, the walker must be able to finish
+    }
+    offset += sizeof(rec) + sn->path_len;
+    pipeline_free_item(item);
+    if (!sent) {
+      free(sn);
+      continue;
+    }
+    sn->next = batch;
+    batch = sn;
+    if (++batched == STREAM_BATCH) {
+      if (settle(out, &batch, pool) == -1) {
+	status = -1;
+      }
+      batched = 0;
+    }
+  }
+  pthread_join(walker, NULL);
+  reader_close(&walk.prev);
+  if (settle(out, &batch, pool) == -1) {
+    status = -1;
+  }
+  if (walk.deleted > 0) {
+    log_info("%zu files or folders are gone since the last run", walk.deleted);
+  }
+
+  if (status == 0 && fsync(fileno(out)) == -1) {
+    status = -1;
+  }
+  if (fclose(out) != 0) {
+    status = -1;
+  }
+  if (status == 0 && rename(tmp, path) == -1) {
+    status = -1;
+  }
+  if (status == -1) {
+    perror("Failed to save stream state");
+    unlink(tmp);
+  }
+  return status;
+}
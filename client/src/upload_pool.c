@@ -0,0 +1,216 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "log.h"
+#include "metrics.h"
+#include "upload_pool.h"
+
+static Uploader *least_loaded(UploadPool *pool) {
+  Uploader *best = &pool->conns[0];
+  for (int i = 1; i < pool->count; i++) {
+    if (pool->conns[i].outstanding < best->outstanding) {
+      best = &pool->conns[i];
+    }
+  }
+  return best;
+}
+
+/* the connection a blob goes over: wherever it went before, so copies
+ * after the first are still just references there */
+static Uploader *route(UploadPool *pool, const unsigned char *id) {
+  if (pool->count == 1) {
+    return &pool->conns[0];
+  }
+  for (int i = 0; i < pool->count; i++) {
+    if (blob_set_contains(&pool->conns[i].routed, id)) {
+      return &pool->conns[i];
+    }
+  }
+  Uploader *up = least_loaded(pool);
+  blob_set_add(&up->routed, id);
+  return up;
+}
+
+/* Uploader.stripe: sends the open file as parts over the least loaded
+ * connections and closes it */
+static int stripe_file(void *ctx, Uploader *origin, Node *node, const char *path, int fd, uint64_t size) {
+  UploadPool *pool = ctx;
+  Stripe *stripe = calloc(1, sizeof(Stripe));
+  if (!stripe || !(stripe->path = strdup(path))) {
+    perror("Failed to allocate stripe");
+    free(stripe);
+    close(fd);
+    return 0;
+  }
+  stripe->node = node;
+  stripe->origin = origin;
+  // all of them, before the first can be acked
+  uint32_t parts = (uint32_t)((size + STRIPE_PART_SIZE - 1) / STRIPE_PART_SIZE);
+  stripe->parts_left = parts;
+  stripe->next = origin->stripes;
+  origin->stripes = stripe;
+  for (uint64_t offset = 0; offset < size; offset += STRIPE_PART_SIZE) {
+    uint64_t len = size - offset < STRIPE_PART_SIZE ? size - offset : STRIPE_PART_SIZE;
+    if (uploader_put_part(least_loaded(pool), stripe, fd, offset, len, size) == -1) {
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  log_debug("Sent %s in %u parts", path, parts);
+  return 0;
+}
+
+static int connect_server(const struct sockaddr_in *addr) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1) {
+    perror("Error creating socket");
+    return -1;
+  }
+  if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+    perror("Error connecting to server");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+int upload_pool_init(UploadPool *pool, int count, const struct sockaddr_in *addr, uint32_t window,
+		     uint32_t hash_algo, int compress_level) {
+  pool->count = 0;
+  if (count < 1 || count > MAX_CONNECTIONS) {
+    fprintf(stderr, "Connections must be between 1 and %d\n", MAX_CONNECTIONS);
+    pool->conns = NULL;
+    return -1;
+  }
+  pool->conns = calloc((size_t)count, sizeof(Uploader));
+  if (!pool->conns) {
+    perror("Failed to allocate connections");
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    int sock = connect_server(addr);
+    if (sock == -1) {
+      upload_pool_free(pool);
+      return -1;
+    }
+    Uploader *up = &pool->conns[i];
+    if (uploader_init(up, sock, window, hash_algo, compress_level) == -1) {
+      uploader_free(up);
+      close(sock);
+      upload_pool_free(pool);
+      return -1;
+    }
+    pool->count++;
+    if (count > 1) {
+      up->stripe = stripe_file;
+      up->stripe_ctx = pool;
+    }
+  }
+  return 0;
+}
+
+int upload_pool_put_dir(UploadPool *pool, Node *node, const char *path) {
+  return uploader_put_dir(&pool->conns[0], node, path);
+}
+
+int upload_pool_put_ref(UploadPool *pool, Node *node, const char *path) {
+  if (!node->has_checksum) {
+    fprintf(stderr, "No blob id for %s\n", path);
+    return 0;
+  }
+  return uploader_put_ref(route(pool, node->checksum), node, path);
+}
+
+int upload_pool_flush(UploadPool *pool) {
+  if (pool->count == 1) {
+    return uploader_flush(&pool->conns[0]);
+  }
+  struct pollfd *fds = calloc((size_t)pool->count, sizeof(struct pollfd));
+  if (!fds) {
+    perror("Failed to allocate poll set");
+    return -1;
+  }
+  int status = 0;
+  while (status == 0) {
+    // an ack on one connection can queue a reference on another, so
+    // everything is sent before anyone waits
+    int waiting = 0;
+    for (int i = 0; i < pool->count && status == 0; i++) {
+      Uploader *up = &pool->conns[i];
+      status = uploader_service(up, 0);
+      fds[i] = (struct pollfd){ up->sock, up->in_flight > 0 ? POLLIN : 0, 0 };
+      waiting += up->in_flight > 0;
+    }
+    if (status == -1 || waiting == 0) {
+      break;
+    }
+    uint64_t start = metrics_now();
+    int ready = poll(fds, (nfds_t)pool->count, -1);
+    metrics_since(METRIC_ACK_WAIT, start, 0);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("Error polling server sockets");
+      status = -1;
+      break;
+    }
+    for (int i = 0; i < pool->count && status == 0; i++) {
+      if (fds[i].revents) {
+	status = uploader_service(&pool->conns[i], 1);
+      }
+    }
+  }
+  free(fds);
+  return status;
+}
+
+int upload_pool_finish(UploadPool *pool) {
+  int status = upload_pool_flush(pool);
+  for (int i = 0; i < pool->count; i++) {
+    if (uploader_finish(&pool->conns[i]) == -1) {
+      status = -1;
+    }
+  }
+  return status;
+}
+
+void upload_pool_totals(const UploadPool *pool, Uploader *sum) {
+  memset(sum, 0, sizeof(*sum));
+  sum->codec = pool->conns[0].codec;
+  for (int i = 0; i < pool->count; i++) {
+    const Uploader *up = &pool->conns[i];
+    sum->acked_ok += up->acked_ok;
+    sum->acked_failed += up->acked_failed;
+    sum->blobs_sent += up->blobs_sent;
+    sum->blobs_deduped += up->blobs_deduped;
+    sum->content_bytes += up->content_bytes;
+    sum->wire_bytes += up->wire_bytes;
+    sum->blobs_compressed += up->blobs_compressed;
+    sum->blobs_incompressible += up->blobs_incompressible;
+    sum->blobs_delta += up->blobs_delta;
+    sum->delta_bytes += up->delta_bytes;
+    sum->delta_wire += up->delta_wire;
+    sum->packs_sent += up->packs_sent;
+    sum->blobs_packed += up->blobs_packed;
+    sum->blobs_resumed += up->blobs_resumed;
+    sum->resumed_bytes += up->resumed_bytes;
+    sum->have_queries += up->have_queries;
+    sum->have_known += up->have_known;
+    sum->blobs_striped += up->blobs_striped;
+    sum->parts_sent += up->parts_sent;
+  }
+}
+
+void upload_pool_free(UploadPool *pool) {
+  for (int i = 0; i < pool->count; i++) {
+    uploader_free(&pool->conns[i]);
+    close(pool->conns[i].sock);
+  }
+  free(pool->conns);
+  pool->conns = NULL;
+  pool->count = 0;
+}
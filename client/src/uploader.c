@@ -0,0 +1,1285 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "delta.h"
+#include "delta_plan.h"
+#include "hash.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "uploader.h"
+
+// files at least this big are probed before they are compressed; for
+// smaller ones trying the (single) frame is just as cheap
+#define PROBE_MIN_SIZE (64 * 1024)
+#define PROBE_SAMPLE 4096
+// frames sent raw without trying after one failed to shrink
+#define INCOMPRESSIBLE_BACKOFF 8
+// smaller changed files are sent whole; the signature round trip and the
+// block granularity eat most of what a delta would save
+#define DELTA_MIN_FILE_SIZE (256 * 1024)
+
+int session_hello(int sock, uint32_t hash_algo, uint32_t codecs, uint32_t *codec) {
+  // hello body: protocol version, hash algorithm of our blob ids, codecs
+  // we can compress with
+  unsigned char hello_body[HELLO_BODY_SIZE];
+  uint32_t v = htobe32(PROTOCOL_VERSION);
+  memcpy(hello_body, &v, 4);
+  v = htobe32(hash_algo);
+  memcpy(hello_body + 4, &v, 4);
+  v = htobe32(codecs);
+  memcpy(hello_body + 8, &v, 4);
+  MsgHeader hello = { MSG_HELLO, 0, 0, 0, sizeof(hello_body) };
+  if (send_header(sock, &hello, NULL, MSG_MORE) == -1 ||
+      send_all(sock, hello_body, sizeof(hello_body), 0) == -1) {
+    perror("Error sending hello to server");
+    return -1;
+  }
+
+  MsgHeader reply;
+  if (recv_header(sock, &reply) == -1 || reply.type != MSG_HELLO ||
+      reply.body_len != sizeof(hello_body) || recv_all(sock, hello_body, sizeof(hello_body)) == -1) {
+    fprintf(stderr, "Server did not complete the handshake\n");
+    return -1;
+  }
+  memcpy(&v, hello_body, 4);
+  if (be32toh(v) != PROTOCOL_VERSION) {
+    fprintf(stderr, "Server speaks protocol version %u, we need %u\n", be32toh(v), PROTOCOL_VERSION);
+    return -1;
+  }
+  memcpy(&v, hello_body + 4, 4);
+  if (be32toh(v) != hash_algo) {
+    fprintf(stderr, "Server does not support %s blob ids\n", hash_name(hash_algo));
+    return -1;
+  }
+  memcpy(&v, hello_body + 8, 4);
+  *codec = be32toh(v);
+  if (*codec != COMPRESS_NONE && !(codecs & COMPRESS_SUPPORTED & (1u << *codec))) {
+    fprintf(stderr, "Server picked codec %u, which we did not offer\n", *codec);
+    return -1;
+  }
+  return 0;
+}
+
+int uploader_init(Uploader *up, int sock, uint32_t window, uint32_t hash_algo, int compress_level) {
+  memset(up, 0, sizeof(*up));
+  if (window == 0 || window > MAX_WINDOW) {
+    fprintf(stderr, "Window must be between 1 and %d\n", MAX_WINDOW);
+    return -1;
+  }
+  up->sock = sock;
+  up->window = window;
+  up->slots = calloc(window, sizeof(InFlight));
+  if (!up->slots) {
+    perror("Failed to allocate upload window");
+    return -1;
+  }
+  if (hash_ctx_init(&up->hash, hash_algo) == -1) {
+    fprintf(stderr, "Unknown hash algorithm %u\n", hash_algo);
+    return -1;
+  }
+  uint32_t codec;
+  if (session_hello(sock, hash_algo, compress_level > 0 ? COMPRESS_SUPPORTED : 0, &codec) == -1) {
+    return -1;
+  }
+  if (codec == COMPRESS_NONE) {
+    return 0;
+  }
+  if (compressor_init(&up->comp, codec, compress_level) == -1) {
+    fprintf(stderr, "Failed to set up codec %u\n", codec);
+    return -1;
+  }
+  up->codec = codec;
+  up->frame_raw = malloc(STREAM_CHUNK_SIZE);
+  up->frame_packed = malloc(STREAM_CHUNK_SIZE);
+  if (!up->frame_raw || !up->frame_packed) {
+    perror("Failed to allocate compression buffers");
+    return -1;
+  }
+  return 0;
+}
+
+static size_t blob_slot(const BlobSet *set, const unsigned char *id) {
+  uint64_t h;
+  memcpy(&h, id, sizeof(h)); // ids are hashes already
+  size_t i = h & (set->capacity - 1);
+  while (set->used[i] && memcmp(set->ids + i * BLOB_ID_SIZE, id, BLOB_ID_SIZE) != 0) {
+    i = (i + 1) & (set->capacity - 1);
+  }
+  return i;
+}
+
+int blob_set_contains(const BlobSet *set, const unsigned char *id) {
+  return set->capacity > 0 && set->used[blob_slot(set, id)];
+}
+
+void blob_set_add(BlobSet *set, const unsigned char *id) {
+  if ((set->count + 1) * 2 > set->capacity) {
+    BlobSet bigger = { 0 };
+    bigger.capacity = set->capacity ? set->capacity * 2 : 1024;
+    bigger.ids = malloc(bigger.capacity * BLOB_ID_SIZE);
+    bigger.used = calloc(bigger.capacity, 1);
+    if (!bigger.ids || !bigger.used) {
+      free(bigger.ids);
+      free(bigger.used);
+      return; // only an optimisation
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (set->used[i]) {
+	size_t j = blob_slot(&bigger, set->ids + i * BLOB_ID_SIZE);
+	memcpy(bigger.ids + j * BLOB_ID_SIZE, set->ids + i * BLOB_ID_SIZE, BLOB_ID_SIZE);
+	bigger.used[j] = 1;
+      }
+    }
+    bigger.count = set->count;
+    free(set->ids);
+    free(set->used);
+    *set = bigger;
+  }
+  size_t i = blob_slot(set, id);
+  if (!set->used[i]) {
+    memcpy(set->ids + i * BLOB_ID_SIZE, id, BLOB_ID_SIZE);
+    set->used[i] = 1;
+    set->count++;
+  }
+}
+
+static NeedData *queue_need_data(Uploader *up, Node *node, char *path) {
+  NeedData *need = calloc(1, sizeof(NeedData));
+  if (!need) {
+    perror("Failed to queue blob upload");
+    free(path);
+    return NULL;
+  }
+  need->node = node;
+  need->path = path;
+  if (up->need_tail) {
+    up->need_tail->next = need;
+  } else {
+    up->need_head = need;
+  }
+  up->need_tail = need;
+  return need;
+}
+
+static void free_packed(PackedFile *file) {
+  while (file) {
+    PackedFile *next = file->next;
+    free(file->path);
+    free(file);
+    file = next;
+  }
+}
+
+static void release_slot(Uploader *up, InFlight *slot) {
+  up->outstanding -= slot->bytes;
+  slot->bytes = 0;
+  slot->stripe = NULL;
+  free(slot->path);
+  slot->path = NULL;
+  free_packed(slot->packed);
+  slot->packed = NULL;
+  slot->in_use = 0;
+  slot->node = NULL;
+  up->in_flight--;
+}
+
+static void mark_uploaded(Uploader *up, Node *node, const char *path) {
+  node->is_uploaded = 1;
+  if (node->type == FILE_NODE && node->has_checksum) {
+    memcpy(node->blob_id, node->checksum, sizeof(node->blob_id));
+    node->has_blob_id = 1;
+  }
+  if (up->journal) {
+    journal_append(up->journal, node, path);
+  }
+}
+
+/* one ack covers every file in a pack. Files that weren't stored are
+ * sent again on their own. */
+static void handle_pack_ack(Uploader *up, InFlight *slot, int32_t status) {
+  for (PackedFile *file = slot->packed; file; file = file->next) {
+    if (status == ACK_OK) {
+      mark_uploaded(up, file->node, file->path);
+      up->acked_ok++;
+    } else if (status == ACK_NEED_DATA) {
+      NeedData *need = queue_need_data(up, file->node, file->path);
+      if (need) {
+	need->whole = 1;
+      }
+      file->path = NULL;
+    } else {
+      log_warn("Server failed to process: %s", file->path);
+      file->node->is_uploaded = 0;
+      up->acked_failed++;
+    }
+  }
+}
+
+/* files whose bit is clear in the MSG_NEEDED bitmap are on the server
+ * already; the others are referenced from the top of the next uploader
+ * call. Without a bitmap, all of them are. */
+static void handle_needed(Uploader *up, InFlight *slot, const unsigned char *bitmap) {
+  uint32_t i = 0;
+  for (PackedFile *file = slot->packed; file; file = file->next, i++) {
+    if (bitmap && !(bitmap[i / 8] & (1u << (i % 8)))) {
+      mark_uploaded(up, file->node, file->path);
+      up->acked_ok++;
+      up->have_known++;
+      continue;
+    }
+    NeedData *need = queue_need_data(up, file->node, file->path);
+    if (need) {
+      need->ref = 1;
+    }
+    file->path = NULL;
+  }
+}
+
+/* one part of a striped file is in (or not). After the last one the
+ * file is referenced where it was asked for, and that ack marks it. */
+static void handle_part_ack(InFlight *slot, int32_t status) {
+  Stripe *stripe = slot->stripe;
+  if (status != ACK_OK) {
+    stripe->failed = 1;
+  }
+  if (--stripe->parts_left > 0) {
+    return;
+  }
+  Uploader *origin = stripe->origin;
+  Stripe **link = &origin->stripes;
+  while (*link != stripe) {
+    link = &(*link)->next;
+  }
+  *link = stripe->next;
+
+  PackedFile whole = { stripe->node, stripe->path, stripe->copies };
+  if (!stripe->failed) {
+    blob_set_add(&origin->sent, stripe->node->checksum);
+    origin->blobs_sent++;
+    origin->blobs_striped++;
+  }
+  for (PackedFile *file = &whole; file; file = file->next) {
+    if (stripe->failed) {
+      log_warn("Server failed to process: %s", file->path);
+      file->node->is_uploaded = 0;
+      origin->acked_failed++;
+      continue;
+    }
+    NeedData *need = queue_need_data(origin, file->node, file->path);
+    if (need) {
+      need->ref = 1;
+      need->reref = 1;
+    }
+    file->path = NULL;
+  }
+  free(whole.path);
+  free_packed(stripe->copies);
+  free(stripe);
+}
+
+static void handle_ack(Uploader *up, const AckEntry *ack) {
+  InFlight *slot = &up->slots[ack->seq % up->window];
+  if (!slot->in_use || slot->seq != ack->seq) {
+    fprintf(stderr, "Ack for unknown request %u\n", ack->seq);
+    return;
+  }
+  if (slot->type == MSG_PUT_PART) {
+    handle_part_ack(slot, ack->status);
+    release_slot(up, slot);
+    return;
+  }
+  if (slot->type == MSG_PUT_PACK) {
+    handle_pack_ack(up, slot, ack->status);
+    release_slot(up, slot);
+    return;
+  }
+  if (slot->type == MSG_HAVE) {
+    handle_needed(up, slot, NULL);
+    release_slot(up, slot);
+    return;
+  }
+
+  Node *node = slot->node;
+  if (ack->status == ACK_NEED_DATA && slot->type == MSG_PUT_REF && !slot->reref) {
+    // sent from the top of the next uploader call, not from inside a poll
+    queue_need_data(up, node, slot->path);
+    slot->path = NULL;
+  } else if (slot->type == MSG_GET_SIG ||
+	     (ack->status == ACK_NEED_DATA && (slot->type == MSG_PUT_DELTA || slot->type == MSG_PUT_BLOB))) {
+    // no delta after all: the basis is gone, or the rebuild failed. Same
+    // for a resumed blob whose partial couldn't be used.
+    NeedData *need = queue_need_data(up, node, slot->path);
+    if (need) {
+      need->whole = 1;
+    }
+    slot->path = NULL;
+  } else if (ack->status == ACK_OK) {
+    mark_uploaded(up, node, slot->path);
+    if (slot->type == MSG_PUT_REF) {
+      up->blobs_deduped++;
+    }
+    up->acked_ok++;
+  } else {
+    // left as not uploaded so the next run tries again
+    log_warn("Server failed to process: %s", slot->path ? slot->path : node->name);
+    node->is_uploaded = 0;
+    up->acked_failed++;
+  }
+  release_slot(up, slot);
+}
+
+/* the basis signature for a MSG_GET_SIG; the delta goes out from the top
+ * of the next uploader call, like blobs asked for with ACK_NEED_DATA */
+static int read_signature(Uploader *up, const MsgHeader *header) {
+  if (header->body_len > DELTA_SIG_HEADER_SIZE + (uint64_t)DELTA_MAX_BLOCKS * DELTA_SIG_ENTRY_SIZE) {
+    fprintf(stderr, "Oversized signature from server\n");
+    return -1;
+  }
+  unsigned char *sig = malloc(header->body_len ? header->body_len : 1);
+  if (!sig) {
+    perror("Failed to allocate signature");
+    return -1;
+  }
+  if (recv_all(up->sock, sig, header->body_len) == -1) {
+    perror("Error receiving signature from server");
+    free(sig);
+    return -1;
+  }
+
+  InFlight *slot = &up->slots[header->seq % up->window];
+  if (!slot->in_use || slot->seq != header->seq || slot->type != MSG_GET_SIG) {
+    fprintf(stderr, "Signature for unknown request %u\n", header->seq);
+    free(sig);
+    return 0;
+  }
+  NeedData *need = queue_need_data(up, slot->node, slot->path);
+  slot->path = NULL;
+  if (need) {
+    need->sig = sig;
+    need->sig_len = header->body_len;
+  } else {
+    free(sig);
+  }
+  release_slot(up, slot);
+  return 0;
+}
+
+/* MSG_RESUME: the server has the start of the blob a PUT_REF asked for.
+ * Anything else it could answer is treated like ACK_NEED_DATA. */
+static int read_resume(Uploader *up, const MsgHeader *header) {
+  uint64_t offset;
+  if (header->body_len != RESUME_OFFSET_SIZE || recv_all(up->sock, &offset, sizeof(offset)) == -1) {
+    fprintf(stderr, "Malformed resume offer from server\n");
+    return -1;
+  }
+  InFlight *slot = &up->slots[header->seq % up->window];
+  if (!slot->in_use || slot->seq != header->seq || slot->type != MSG_PUT_REF || slot->reref) {
+    AckEntry ack = { header->seq, ACK_NEED_DATA };
+    handle_ack(up, &ack);
+    return 0;
+  }
+  NeedData *need = queue_need_data(up, slot->node, slot->path);
+  slot->path = NULL;
+  if (need) {
+    need->resume_at = be64toh(offset);
+  }
+  release_slot(up, slot);
+  return 0;
+}
+
+/* the answer to a MSG_HAVE */
+static int read_needed(Uploader *up, const MsgHeader *header) {
+  unsigned char bitmap[(HAVE_MAX_ENTRIES + 7) / 8];
+  if (header->body_len > sizeof(bitmap) || recv_all(up->sock, bitmap, header->body_len) == -1) {
+    fprintf(stderr, "Malformed have reply from server\n");
+    return -1;
+  }
+  InFlight *slot = &up->slots[header->seq % up->window];
+  if (!slot->in_use || slot->seq != header->seq || slot->type != MSG_HAVE) {
+    fprintf(stderr, "Have reply for unknown request %u\n", header->seq);
+    return 0;
+  }
+  uint32_t count = 0;
+  for (PackedFile *file = slot->packed; file; file = file->next) {
+    count++;
+  }
+  handle_needed(up, slot, header->body_len == (count + 7) / 8 ? bitmap : NULL);
+  release_slot(up, slot);
+  return 0;
+}
+
+/* reads one message from the server: an ack batch, a signature, a resume
+ * offer or a have reply */
+static int read_ack_batch(Uploader *up) {
+  MsgHeader header;
+  if (recv_header(up->sock, &header) == -1) {
+    perror("Error receiving acks from server");
+    return -1;
+  }
+  if (header.type == MSG_SIGNATURE) {
+    return read_signature(up, &header);
+  }
+  if (header.type == MSG_RESUME) {
+    return read_resume(up, &header);
+  }
+  if (header.type == MSG_NEEDED) {
+    return read_needed(up, &header);
+  }
+  if (header.type != MSG_ACK || header.body_len % ACK_ENTRY_SIZE != 0 ||
+      header.body_len > MAX_ACK_BATCH * ACK_ENTRY_SIZE) {
+    fprintf(stderr, "Unexpected message type %u from server\n", header.type);
+    return -1;
+  }
+
+  unsigned char buf[MAX_ACK_BATCH * ACK_ENTRY_SIZE];
+  if (recv_all(up->sock, buf, header.body_len) == -1) {
+    perror("Error receiving acks from server");
+    return -1;
+  }
+  for (size_t off = 0; off < header.body_len; off += ACK_ENTRY_SIZE) {
+    AckEntry ack;
+    decode_ack(&ack, buf + off);
+    handle_ack(up, &ack);
+  }
+  return 0;
+}
+
+int uploader_poll(Uploader *up, int block) {
+  while (up->in_flight > 0) {
+    struct pollfd pfd = { up->sock, POLLIN, 0 };
+    uint64_t start = block ? metrics_now() : 0;
+    int ready = poll(&pfd, 1, block ? -1 : 0);
+    if (block) {
+      metrics_since(METRIC_ACK_WAIT, start, 0);
+    }
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("Error polling server socket");
+      return -1;
+    }
+    if (ready == 0) {
+      break;
+    }
+    if (read_ack_batch(up) == -1) {
+      return -1;
+    }
+    block = 0; // got at least one batch, only take what's already here
+  }
+  return 0;
+}
+
+/* waits for a free window slot, then sends the request header, path and
+ * any prefix of the body. The rest of the body must follow right after. */
+static int begin_request(Uploader *up, Node *node, uint32_t type, uint32_t flags, const char *path,
+			 const void *prefix, size_t prefix_len, uint64_t body_len) {
+  // acks can come back out of order, so wait for this particular slot
+  // rather than just for in_flight < window
+  InFlight *slot = &up->slots[up->next_seq % up->window];
+  while (slot->in_use) {
+    if (uploader_poll(up, 1) == -1) {
+      return -1;
+    }
+  }
+
+  MsgHeader header = { type, up->next_seq, (uint32_t)strlen(path), flags, prefix_len + body_len };
+  int more = header.body_len > 0 ? MSG_MORE : 0;
+  if (send_header(up->sock, &header, path, more) == -1 ||
+      (prefix_len > 0 && send_all(up->sock, prefix, prefix_len, body_len > 0 ? MSG_MORE : 0) == -1)) {
+    perror("Error sending request to server");
+    return -1;
+  }
+
+  slot->node = node;
+  slot->path = strdup(path);
+  slot->seq = up->next_seq++;
+  slot->type = type;
+  slot->in_use = 1;
+  slot->reref = 0;
+  slot->bytes = header.body_len;
+  up->outstanding += slot->bytes;
+  up->in_flight++;
+  return 0;
+}
+
+/* stands in for file contents that disappeared while sending */
+static int send_zeros(int sock, uint64_t remaining) {
+  static const char zeros[4096];
+  while (remaining > 0) {
+    size_t n = remaining < sizeof(zeros) ? remaining : sizeof(zeros);
+    if (send_all(sock, zeros, n, 0) == -1) {
+      return -1;
+    }
+    remaining -= n;
+  }
+  return 0;
+}
+
+/* streams bytes start to end of an open file straight from the page
+ * cache. If the file shrank since it was sized the rest is zero filled so
+ * the stream stays framed; the server will then reject it on the hash
+ * check. */
+static int send_file_body(int sock, int fd, uint64_t start, uint64_t end) {
+  off_t offset = (off_t)start;
+  ssize_t sent = send_file_range(sock, fd, &offset, end - start);
+  if (sent == -1) {
+    return -1;
+  }
+
+  if ((uint64_t)sent < end - start) {
+    return send_zeros(sock, end - start - sent) == -1 ? -1 : 1;
+  }
+  return 0;
+}
+
+/* compresses samples from the start, middle and end of the file. Media
+ * and archives look random throughout and are better sent as they are. */
+static int worth_compressing(Uploader *up, int fd, uint64_t file_size) {
+  if (file_size < PROBE_MIN_SIZE) {
+    return 1;
+  }
+  off_t offsets[3] = { 0, (off_t)(file_size / 2), (off_t)(file_size - PROBE_SAMPLE) };
+  size_t len = 0;
+  for (int i = 0; i < 3; i++) {
+    ssize_t n = pread(fd, up->frame_raw + len, PROBE_SAMPLE, offsets[i]);
+    if (n > 0) {
+      len += (size_t)n;
+    }
+  }
+  // must save at least an eighth to be worth the CPU
+  return len > 0 && compress_frame(&up->comp, up->frame_raw, len, up->frame_packed, len - len / 8) > 0;
+}
+
+/* sends len bytes of raw as one frame, compressed if that makes it
+ * smaller. After a frame that didn't shrink, *backoff frames are sent
+ * without trying. */
+static int send_frame(Uploader *up, const unsigned char *raw, size_t len, int *backoff, int flags) {
+  size_t packed = 0;
+  if (*backoff > 0) {
+    (*backoff)--;
+  } else if (!(packed = compress_frame(&up->comp, raw, len, up->frame_packed, len - 1))) {
+    *backoff = INCOMPRESSIBLE_BACKOFF;
+  }
+
+  FrameHeader frame = { (uint32_t)len, packed ? (uint32_t)packed : (uint32_t)len };
+  unsigned char frame_buf[FRAME_HEADER_SIZE];
+  encode_frame(&frame, frame_buf);
+  if (send_all(up->sock, frame_buf, sizeof(frame_buf), MSG_MORE) == -1 ||
+      send_all(up->sock, packed ? up->frame_packed : raw, frame.data_len, flags) == -1) {
+    return -1;
+  }
+  up->wire_bytes += sizeof(frame_buf) + frame.data_len;
+  return 0;
+}
+
+/* like send_file_body, but as frames (see protocol.h), each compressed if
+ * that makes it smaller. A file that shrank is zero filled just the same.
+ * Returns -1 on socket errors, 1 if the file shrank. */
+static int send_frames(Uploader *up, int fd, uint64_t start, uint64_t end) {
+  uint64_t left = end - start;
+  int shrank = 0;
+  int backoff = 0;
+  while (left > 0) {
+    size_t want = left < STREAM_CHUNK_SIZE ? (size_t)left : STREAM_CHUNK_SIZE;
+    size_t got = 0;
+    while (got < want && !shrank) {
+      // pread: parts of one file share its descriptor
+      ssize_t n = pread(fd, up->frame_raw + got, want - got, (off_t)(end - left + got));
+      if (n < 0 && errno == EINTR) {
+	continue;
+      }
+      if (n < 0) {
+	perror("Failed to read file for upload");
+      }
+      if (n <= 0) {
+	shrank = 1;
+	break;
+      }
+      got += (size_t)n;
+    }
+    memset(up->frame_raw + got, 0, want - got);
+    left -= want;
+    if (send_frame(up, up->frame_raw, want, &backoff, left > 0 ? MSG_MORE : 0) == -1) {
+      return -1;
+    }
+  }
+  return shrank;
+}
+
+/* sends the pack being filled as one MSG_PUT_PACK, if it has anything */
+static int send_pack(Uploader *up) {
+  PackBuilder *pack = &up->pack;
+  if (pack->count == 0) {
+    return 0;
+  }
+  unsigned char prefix[PACK_PREFIX_SIZE];
+  uint32_t v = htobe32(pack->count);
+  memcpy(prefix, &v, 4);
+  v = htobe32((uint32_t)pack->index_len);
+  memcpy(prefix + 4, &v, 4);
+  int framed = up->codec != COMPRESS_NONE;
+  if (begin_request(up, NULL, MSG_PUT_PACK, framed ? MSG_FLAG_FRAMED : 0, "", prefix, sizeof(prefix),
+		    pack->index_len + pack->data_len) == -1) {
+    return -1;
+  }
+  // the slot owns the files from here on, whatever happens to the rest
+  InFlight *slot = &up->slots[(up->next_seq - 1) % up->window];
+  slot->packed = pack->head;
+  uint32_t count = pack->count;
+  size_t data_len = pack->data_len;
+  PackedFile *copies = pack->copies;
+  pack->head = pack->tail = NULL;
+  pack->copies = pack->copies_tail = NULL;
+  pack->count = 0;
+  pack->data_len = 0;
+  if (pack->ids.count > 0) {
+    memset(pack->ids.used, 0, pack->ids.capacity);
+    pack->ids.count = 0;
+  }
+
+  int status = send_all(up->sock, pack->index, pack->index_len, data_len > 0 ? MSG_MORE : 0);
+  up->wire_bytes += pack->index_len;
+  pack->index_len = 0;
+  uint64_t start = metrics_now();
+  uint64_t wire_before = up->wire_bytes;
+  if (status == 0 && framed) {
+    int backoff = 0;
+    for (size_t off = 0; off < data_len && status == 0; off += STREAM_CHUNK_SIZE) {
+      size_t len = data_len - off < STREAM_CHUNK_SIZE ? data_len - off : STREAM_CHUNK_SIZE;
+      status = send_frame(up, pack->data + off, len, &backoff, off + len < data_len ? MSG_MORE : 0);
+    }
+  } else if (status == 0) {
+    status = send_all(up->sock, pack->data, data_len, 0);
+    up->wire_bytes += data_len;
+  }
+  metrics_since(METRIC_SEND, start, up->wire_bytes - wire_before);
+  if (status == -1) {
+    perror("Error sending pack to server");
+    free_packed(copies);
+    return -1;
+  }
+  for (PackedFile *file = slot->packed; file; file = file->next) {
+    blob_set_add(&up->sent, file->node->checksum);
+  }
+  up->content_bytes += data_len;
+  up->blobs_sent += count;
+  up->blobs_packed += count;
+  up->packs_sent++;
+
+  while (copies && status == 0) {
+    PackedFile *copy = copies;
+    copies = copy->next;
+    status = begin_request(up, copy->node, MSG_PUT_REF, 0, copy->path, copy->node->checksum,
+			   BLOB_ID_SIZE, 0);
+    if (status == 0) {
+      up->slots[(up->next_seq - 1) % up->window].reref = 1;
+    }
+    free(copy->path);
+    free(copy);
+  }
+  free_packed(copies);
+  return status;
+}
+
+/* reads a small file into the pack, sending the pack first if its index
+ * is full and afterwards if it is big enough. Returns 1 if the pack
+ * buffers can't be had, and the file should go out on its own. */
+static int pack_file(Uploader *up, Node *node, const char *path, int fd, uint64_t file_size) {
+  PackBuilder *pack = &up->pack;
+  if (!pack->data) {
+    pack->index = malloc(PACK_MAX_INDEX);
+    pack->data = malloc(PACK_TARGET_SIZE + PACK_MAX_FILE_SIZE);
+    if (!pack->index || !pack->data) {
+      perror("Failed to allocate pack buffers");
+      free(pack->index);
+      free(pack->data);
+      pack->index = pack->data = NULL;
+      up->no_pack = 1;
+      return 1;
+    }
+  }
+  size_t path_len = strlen(path);
+  if (pack->index_len + PACK_ENTRY_SIZE + path_len > PACK_MAX_INDEX && send_pack(up) == -1) {
+    return -1;
+  }
+  PackedFile *file = malloc(sizeof(PackedFile));
+  char *copy = strdup(path);
+  if (!file || !copy) {
+    perror("Failed to add file to pack");
+    free(file);
+    free(copy);
+    return 0;
+  }
+  file->node = node;
+  file->path = copy;
+  file->next = NULL;
+
+  // same contents as a file already in the pack: refer to it once the
+  // pack is out rather than carry it twice
+  if (blob_set_contains(&pack->ids, node->checksum)) {
+    if (pack->copies_tail) {
+      pack->copies_tail->next = file;
+    } else {
+      pack->copies = file;
+    }
+    pack->copies_tail = file;
+    return 0;
+  }
+
+  // a file that shrank is zero filled, like a streamed one
+  unsigned char *dst = pack->data + pack->data_len;
+  size_t got = 0;
+  while (got < file_size) {
+    ssize_t n = read(fd, dst + got, file_size - got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      perror("Failed to read file for upload");
+    }
+    if (n <= 0) {
+      log_warn("File %s shrank while uploading", path);
+      memset(dst + got, 0, file_size - got);
+      break;
+    }
+    got += (size_t)n;
+  }
+
+  PackEntryHeader entry = { { 0 }, file_size, (uint32_t)path_len };
+  memcpy(entry.blob_id, node->checksum, BLOB_ID_SIZE);
+  encode_pack_entry(&entry, pack->index + pack->index_len);
+  memcpy(pack->index + pack->index_len + PACK_ENTRY_SIZE, path, path_len);
+  pack->index_len += PACK_ENTRY_SIZE + path_len;
+  pack->data_len += file_size;
+  blob_set_add(&pack->ids, node->checksum);
+
+  if (pack->tail) {
+    pack->tail->next = file;
+  } else {
+    pack->head = file;
+  }
+  pack->tail = file;
+  pack->count++;
+
+  if (pack->data_len >= PACK_TARGET_SIZE || pack->count == PACK_MAX_ENTRIES) {
+    return send_pack(up);
+  }
+  return 0;
+}
+
+/* sends the open file from offset on as a MSG_PUT_BLOB and closes it */
+static int send_blob(Uploader *up, Node *node, const char *path, int fd, uint64_t file_size, uint64_t offset) {
+  const unsigned char *id = node->checksum;
+  unsigned char prefix[BLOB_ID_SIZE + RESUME_OFFSET_SIZE];
+  memcpy(prefix, id, BLOB_ID_SIZE);
+  uint64_t v = htobe64(offset);
+  memcpy(prefix + BLOB_ID_SIZE, &v, sizeof(v));
+  uint32_t flags = offset > 0 ? MSG_FLAG_RESUME : 0;
+  int framed = up->codec != COMPRESS_NONE && worth_compressing(up, fd, file_size);
+  if (framed) {
+    flags |= MSG_FLAG_FRAMED;
+  }
+  if (begin_request(up, node, MSG_PUT_BLOB, flags, path, prefix,
+		    offset > 0 ? sizeof(prefix) : BLOB_ID_SIZE, file_size - offset) == -1) {
+    close(fd);
+    return -1;
+  }
+  int body_status;
+  uint64_t start = metrics_now();
+  uint64_t wire_before = up->wire_bytes;
+  if (framed) {
+    body_status = send_frames(up, fd, offset, file_size);
+    up->blobs_compressed++;
+  } else {
+    body_status = send_file_body(up->sock, fd, offset, file_size);
+    up->wire_bytes += file_size - offset;
+    if (up->codec != COMPRESS_NONE) {
+      up->blobs_incompressible++;
+    }
+  }
+  metrics_since(METRIC_SEND, start, up->wire_bytes - wire_before);
+  up->content_bytes += file_size - offset;
+  close(fd);
+  if (body_status == -1) {
+    perror("Error sending file data to server");
+    return -1;
+  }
+  if (body_status == 1) {
+    log_warn("File %s shrank while uploading", path);
+  }
+  blob_set_add(&up->sent, id);
+  up->blobs_sent++;
+  return 0;
+}
+
+/* a file that can't be sent after all: left as not uploaded so the next
+ * run tries again. The connection is fine, so this returns 0. */
+static int give_up(Uploader *up, Node *node) {
+  node->is_uploaded = 0;
+  up->acked_failed++;
+  return 0;
+}
+
+/* sends the rest of a blob the server kept the first offset bytes of */
+static int put_resumed(Uploader *up, Node *node, const char *path, uint64_t offset) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    log_warn("Could not open file %s to send to the server.", path);
+    return give_up(up, node);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    perror("Failed to get file stats");
+    close(fd);
+    return give_up(up, node);
+  }
+  uint64_t file_size = (uint64_t)file_stat.st_size;
+  if (offset >= file_size) {
+    offset = 0; // not the file the partial came from, send all of it
+  } else {
+    up->blobs_resumed++;
+    up->resumed_bytes += offset;
+  }
+  return send_blob(up, node, path, fd, file_size, offset);
+}
+
+/* whole skips the delta attempt, and packing: it is also how files of a
+ * pack the server didn't take are sent again */
+static int put_blob(Uploader *up, Node *node, const char *path, int whole) {
+  if (!node->has_checksum) {
+    fprintf(stderr, "No blob id for %s\n", path);
+    return give_up(up, node);
+  }
+  const unsigned char *id = node->checksum;
+
+  // a copy of something already sent on this connection: the server
+  // handles our requests in order, so by now a reference is enough
+  if (!whole && blob_set_contains(&up->sent, id)) {
+    if (begin_request(up, node, MSG_PUT_REF, 0, path, id, BLOB_ID_SIZE, 0) == -1) {
+      return -1;
+    }
+    up->slots[(up->next_seq - 1) % up->window].reref = 1;
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    log_warn("Could not open file %s to send to the server.", path);
+    return give_up(up, node);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    perror("Failed to get file stats");
+    close(fd);
+    return give_up(up, node);
+  }
+  uint64_t file_size = (uint64_t)file_stat.st_size;
+
+  // the server has the previous version: get its signature, then send
+  // only what changed
+  if (!whole && !up->no_delta && file_size >= DELTA_MIN_FILE_SIZE && node->has_blob_id &&
+      memcmp(node->blob_id, id, BLOB_ID_SIZE) != 0) {
+    close(fd);
+    return begin_request(up, node, MSG_GET_SIG, 0, path, node->blob_id, BLOB_ID_SIZE, 0);
+  }
+
+  // big enough to be worth spreading over several connections; the
+  // pool takes the descriptor. A copy of one on its way waits for it.
+  if (up->stripe && file_size >= STRIPE_MIN_SIZE) {
+    Stripe *stripe = up->stripes;
+    while (stripe && memcmp(stripe->node->checksum, id, BLOB_ID_SIZE) != 0) {
+      stripe = stripe->next;
+    }
+    if (!stripe) {
+      return up->stripe(up->stripe_ctx, up, node, path, fd, file_size);
+    }
+    close(fd);
+    PackedFile *copy = malloc(sizeof(PackedFile));
+    if (!copy || !(copy->path = strdup(path))) {
+      perror("Failed to queue blob upload");
+      free(copy);
+      return 0;
+    }
+    copy->node = node;
+    copy->next = stripe->copies;
+    stripe->copies = copy;
+    return 0;
+  }
+
+  if (!whole && !up->no_pack && file_size < PACK_MAX_FILE_SIZE) {
+    int status = pack_file(up, node, path, fd, file_size);
+    if (status != 1) {
+      close(fd);
+      return status;
+    }
+  }
+  return send_blob(up, node, path, fd, file_size, 0);
+}
+
+
+/* sends the ops of a delta, literals straight from the file. Returns -1
+ * on socket errors, 1 if the file shrank. */
+static int send_delta_ops(Uploader *up, int fd, const DeltaPlan *plan) {
+  int shrank = 0;
+  for (size_t i = 0; i < plan->count; i++) {
+    const DeltaOp *op = &plan->ops[i];
+    unsigned char buf[DELTA_COPY_SIZE];
+    uint32_t v = htobe32(op->kind);
+    memcpy(buf, &v, 4);
+    if (op->kind == DELTA_OP_COPY) {
+      v = htobe32((uint32_t)op->start);
+      memcpy(buf + 4, &v, 4);
+      v = htobe32(op->count);
+      memcpy(buf + 8, &v, 4);
+      if (send_all(up->sock, buf, DELTA_COPY_SIZE, i + 1 < plan->count ? MSG_MORE : 0) == -1) {
+	return -1;
+      }
+      continue;
+    }
+    v = htobe32(op->count);
+    memcpy(buf + 4, &v, 4);
+    if (send_all(up->sock, buf, DELTA_LITERAL_SIZE, MSG_MORE) == -1) {
+      return -1;
+    }
+    off_t offset = (off_t)op->start;
+    ssize_t sent = send_file_range(up->sock, fd, &offset, op->count);
+    if (sent == -1) {
+      return -1;
+    }
+    if ((size_t)sent < op->count) {
+      if (send_zeros(up->sock, op->count - sent) == -1) {
+	return -1;
+      }
+      shrank = 1;
+    }
+  }
+  return shrank;
+}
+
+/* sends the file as a delta against its previous version, or whole if
+ * too little of it matches the signature */
+static int put_delta(Uploader *up, Node *node, const char *path, const unsigned char *sig_body,
+		     size_t sig_len) {
+  Signature sig;
+  if (signature_parse(&sig, sig_body, sig_len) == -1) {
+    fprintf(stderr, "Malformed signature for %s\n", path);
+    return put_blob(up, node, path, 1);
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    log_warn("Could not open file %s to send to the server.", path);
+    return give_up(up, node);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    perror("Failed to get file stats");
+    close(fd);
+    return give_up(up, node);
+  }
+  // must save at least an eighth, like compression
+  uint64_t file_size = (uint64_t)file_stat.st_size;
+  DeltaPlan plan;
+  int status = delta_plan_build(&plan, &sig, fd, &up->hash, file_size - file_size / 8);
+  if (status != 0) {
+    if (status == -1) {
+      perror("Failed to compute delta");
+    }
+    close(fd);
+    return put_blob(up, node, path, 1);
+  }
+
+  unsigned char prefix[DELTA_PREFIX_SIZE];
+  memcpy(prefix, node->checksum, BLOB_ID_SIZE);
+  memcpy(prefix + BLOB_ID_SIZE, node->blob_id, BLOB_ID_SIZE);
+  uint32_t v = htobe32(sig.block_size);
+  memcpy(prefix + 2 * BLOB_ID_SIZE, &v, 4);
+  if (begin_request(up, node, MSG_PUT_DELTA, 0, path, prefix, sizeof(prefix), plan.wire_size) == -1) {
+    delta_plan_free(&plan);
+    close(fd);
+    return -1;
+  }
+  uint64_t start = metrics_now();
+  status = send_delta_ops(up, fd, &plan);
+  metrics_since(METRIC_SEND, start, plan.wire_size);
+  close(fd);
+  if (status == -1) {
+    perror("Error sending file data to server");
+    delta_plan_free(&plan);
+    return -1;
+  }
+  if (status == 1) {
+    log_warn("File %s shrank while uploading", path);
+  }
+  up->blobs_delta++;
+  up->delta_bytes += plan.size;
+  up->delta_wire += plan.wire_size;
+  delta_plan_free(&plan);
+  return 0;
+}
+
+/* sends the have query being filled, if it has anything */
+static int send_have(Uploader *up) {
+  HaveBatch *have = &up->have;
+  if (have->count == 0) {
+    return 0;
+  }
+  unsigned char prefix[HAVE_PREFIX_SIZE];
+  uint32_t v = htobe32(have->count);
+  memcpy(prefix, &v, 4);
+  if (begin_request(up, NULL, MSG_HAVE, 0, "", prefix, sizeof(prefix), have->body_len) == -1) {
+    return -1;
+  }
+  InFlight *slot = &up->slots[(up->next_seq - 1) % up->window];
+  slot->packed = have->head;
+  have->head = have->tail = NULL;
+  have->count = 0;
+  size_t len = have->body_len;
+  have->body_len = 0;
+  if (send_all(up->sock, have->body, len, 0) == -1) {
+    perror("Error sending have query to server");
+    return -1;
+  }
+  up->have_queries++;
+  return 0;
+}
+
+/* adds a file to the have query, sending the query first if the file
+ * doesn't fit and afterwards if it is full. Returns 1 if the query
+ * buffer can't be had, and the file should be referenced right away. */
+static int have_file(Uploader *up, Node *node, const char *path) {
+  HaveBatch *have = &up->have;
+  if (!have->body) {
+    have->body = malloc(HAVE_MAX_BODY);
+    if (!have->body) {
+      perror("Failed to allocate have query");
+      up->query_have = 0;
+      return 1;
+    }
+  }
+  size_t path_len = strlen(path);
+  if (HAVE_PREFIX_SIZE + have->body_len + HAVE_ENTRY_SIZE + path_len > HAVE_MAX_BODY && send_have(up) == -1) {
+    return -1;
+  }
+  PackedFile *file = malloc(sizeof(PackedFile));
+  char *copy = strdup(path);
+  if (!file || !copy) {
+    perror("Failed to add file to have query");
+    free(file);
+    free(copy);
+    return 1;
+  }
+  file->node = node;
+  file->path = copy;
+  file->next = NULL;
+  unsigned char *p = have->body + have->body_len;
+  memcpy(p, node->checksum, BLOB_ID_SIZE);
+  uint32_t v = htobe32((uint32_t)path_len);
+  memcpy(p + BLOB_ID_SIZE, &v, 4);
+  memcpy(p + HAVE_ENTRY_SIZE, path, path_len);
+  have->body_len += HAVE_ENTRY_SIZE + path_len;
+  if (have->tail) {
+    have->tail->next = file;
+  } else {
+    have->head = file;
+  }
+  have->tail = file;
+  if (++have->count == HAVE_MAX_ENTRIES) {
+    return send_have(up);
+  }
+  return 0;
+}
+
+/* sends every blob the server asked for so far */
+static int send_needed(Uploader *up) {
+  if (up->sending_needed) {
+    return 0;
+  }
+  up->sending_needed = 1;
+  int status = 0;
+  while (up->need_head && status == 0) {
+    NeedData *need = up->need_head;
+    up->need_head = need->next;
+    if (!up->need_head) {
+      up->need_tail = NULL;
+    }
+    if (need->ref) {
+      status = begin_request(up, need->node, MSG_PUT_REF, 0, need->path, need->node->checksum, BLOB_ID_SIZE, 0);
+      if (status == 0) {
+	up->slots[(up->next_seq - 1) % up->window].reref = need->reref;
+      }
+    } else if (need->sig) {
+      status = put_delta(up, need->node, need->path, need->sig, need->sig_len);
+    } else if (need->resume_at > 0) {
+      status = put_resumed(up, need->node, need->path, need->resume_at);
+    } else {
+      status = put_blob(up, need->node, need->path, need->whole);
+    }
+    free(need->sig);
+    free(need->path);
+    free(need);
+    if (status == 0) {
+      status = uploader_poll(up, 0);
+    }
+  }
+  up->sending_needed = 0;
+  return status;
+}
+
+int uploader_put_dir(Uploader *up, Node *node, const char *path) {
+  if (begin_request(up, node, MSG_PUT_DIR, 0, path, NULL, 0, 0) == -1) {
+    return -1;
+  }
+  // is_uploaded is set when the ack comes in; collect any that are ready
+  if (uploader_poll(up, 0) == -1) {
+    return -1;
+  }
+  return send_needed(up);
+}
+
+int uploader_put_ref(Uploader *up, Node *node, const char *path) {
+  if (!node->has_checksum) {
+    fprintf(stderr, "No blob id for %s\n", path);
+    return 0;
+  }
+  // never uploaded from here: maybe the server has it from a lost tree
+  int status = up->query_have && !node->has_blob_id ? have_file(up, node, path) : 1;
+  if (status == -1) {
+    return -1;
+  }
+  if (status == 1) {
+    if (begin_request(up, node, MSG_PUT_REF, 0, path, node->checksum, BLOB_ID_SIZE, 0) == -1) {
+      return -1;
+    }
+    // likely to turn into that much data on this connection; counted
+    // until the ack says either way
+    InFlight *slot = &up->slots[(up->next_seq - 1) % up->window];
+    slot->bytes += node->st.size;
+    up->outstanding += node->st.size;
+  }
+  if (uploader_poll(up, 0) == -1) {
+    return -1;
+  }
+  return send_needed(up);
+}
+
+int uploader_put_part(Uploader *up, Stripe *stripe, int fd, uint64_t offset, uint64_t len, uint64_t size) {
+  unsigned char prefix[PART_PREFIX_SIZE];
+  memcpy(prefix, stripe->node->checksum, BLOB_ID_SIZE);
+  uint64_t v = htobe64(offset);
+  memcpy(prefix + BLOB_ID_SIZE, &v, 8);
+  v = htobe64(size);
+  memcpy(prefix + BLOB_ID_SIZE + 8, &v, 8);
+  int framed = up->codec != COMPRESS_NONE && worth_compressing(up, fd, size);
+  if (begin_request(up, stripe->node, MSG_PUT_PART, framed ? MSG_FLAG_FRAMED : 0, stripe->path, prefix,
+		    sizeof(prefix), len) == -1) {
+    return -1;
+  }
+  up->slots[(up->next_seq - 1) % up->window].stripe = stripe;
+  int body_status;
+  uint64_t start = metrics_now();
+  uint64_t wire_before = up->wire_bytes;
+  if (framed) {
+    body_status = send_frames(up, fd, offset, offset + len);
+  } else {
+    body_status = send_file_body(up->sock, fd, offset, offset + len);
+    up->wire_bytes += len;
+  }
+  metrics_since(METRIC_SEND, start, up->wire_bytes - wire_before);
+  up->content_bytes += len;
+  if (body_status == -1) {
+    perror("Error sending file data to server");
+    return -1;
+  }
+  if (body_status == 1) {
+    log_warn("File %s shrank while uploading", stripe->path);
+  }
+  up->parts_sent++;
+  return 0;
+}
+
+int uploader_service(Uploader *up, int readable) {
+  if (readable && (read_ack_batch(up) == -1 || uploader_poll(up, 0) == -1)) {
+    return -1;
+  }
+  // files asked for again can land in a new pack, so go until all is sent
+  while (up->have.count > 0 || up->need_head || up->pack.count > 0) {
+    int status;
+    if (up->have.count > 0) {
+      status = send_have(up);
+    } else if (up->need_head) {
+      status = send_needed(up);
+    } else {
+      status = send_pack(up);
+    }
+    if (status == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int uploader_idle(const Uploader *up) {
+  return up->in_flight == 0 && !up->need_head && up->pack.count == 0 && up->have.count == 0;
+}
+
+int uploader_flush(Uploader *up) {
+  while (!uploader_idle(up)) {
+    if (uploader_service(up, 0) == -1 || (up->in_flight > 0 && uploader_poll(up, 1) == -1)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int uploader_finish(Uploader *up) {
+  int status = uploader_flush(up);
+
+  MsgHeader end = { MSG_END, up->next_seq, 0, 0, 0 };
+  if (send_header(up->sock, &end, NULL, 0) == -1) {
+    status = -1;
+  }
+  return status;
+}
+
+void uploader_free(Uploader *up) {
+  for (uint32_t i = 0; up->slots && i < up->window; i++) {
+    free(up->slots[i].path);
+    free_packed(up->slots[i].packed);
+  }
+  free_packed(up->pack.head);
+  free_packed(up->pack.copies);
+  free(up->pack.ids.ids);
+  free(up->pack.ids.used);
+  free(up->pack.index);
+  free(up->pack.data);
+  memset(&up->pack, 0, sizeof(up->pack));
+  free_packed(up->have.head);
+  free(up->have.body);
+  memset(&up->have, 0, sizeof(up->have));
+  while (up->need_head) {
+    NeedData *need = up->need_head;
+    up->need_head = need->next;
+    free(need->sig);
+    free(need->path);
+    free(need);
+  }
+  up->need_tail = NULL;
+  free(up->sent.ids);
+  free(up->sent.used);
+  free(up->routed.ids);
+  free(up->routed.used);
+  free(up->slots);
+  up->slots = NULL;
+  compressor_free(&up->comp);
+  hash_ctx_free(&up->hash);
+  free(up->frame_raw);
+  free(up->frame_packed);
+  up->frame_raw = up->frame_packed = NULL;
+}
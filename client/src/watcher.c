@@ -0,0 +1,227 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "file_utils.h"
+#include "watcher.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+		    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+int watcher_init(Watcher *w, const char *root, const char *ignore) {
+  memset(w, 0, sizeof(*w));
+  w->root = root;
+  w->ignore = ignore;
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->fd == -1) {
+    perror("Failed to initialize inotify");
+    return -1;
+  }
+  return 0;
+}
+
+void watcher_free(Watcher *w) {
+  if (w->fd != -1) {
+    close(w->fd);
+  }
+  for (int i = 0; i < w->capacity; i++) {
+    free(w->paths[i]);
+  }
+  free(w->paths);
+  free(w->dirty_flag);
+  free(w->dirty);
+  memset(w, 0, sizeof(*w));
+  w->fd = -1;
+}
+
+static int grow(Watcher *w, int wd) {
+  if (wd < w->capacity) {
+    return 0;
+  }
+  int capacity = w->capacity ? w->capacity : 256;
+  while (capacity <= wd) {
+    capacity *= 2;
+  }
+  char **paths = realloc(w->paths, capacity * sizeof(char *));
+  char *flags = realloc(w->dirty_flag, capacity);
+  int *dirty = realloc(w->dirty, capacity * sizeof(int));
+  if (paths) w->paths = paths;
+  if (flags) w->dirty_flag = flags;
+  if (dirty) w->dirty = dirty;
+  if (!paths || !flags || !dirty) {
+    perror("Failed to grow watch table");
+    return -1;
+  }
+  memset(w->paths + w->capacity, 0, (capacity - w->capacity) * sizeof(char *));
+  memset(w->dirty_flag + w->capacity, 0, capacity - w->capacity);
+  w->capacity = capacity;
+  return 0;
+}
+
+static void add_watch(Watcher *w, const char *dirpath) {
+  int wd = inotify_add_watch(w->fd, dirpath, WATCH_MASK);
+  if (wd == -1) {
+    if (errno == ENOSPC && !w->out_of_watches) {
+      fprintf(stderr, "Out of inotify watches (see fs.inotify.max_user_watches); "
+	      "changes below %s are picked up by the next full scan only\n", dirpath);
+      w->out_of_watches = 1;
+    } else if (errno != ENOENT && errno != ENOSPC) {
+      perror("Failed to watch directory");
+    }
+    return;
+  }
+  if (grow(w, wd) == -1) {
+    return;
+  }
+  // a directory that was moved keeps its watch; just learn the new path
+  free(w->paths[wd]);
+  w->paths[wd] = strdup(dirpath);
+}
+
+void watcher_add_tree(Watcher *w, const char *dirpath) {
+  add_watch(w, dirpath);
+  DIR *dir = opendir(dirpath);
+  if (!dir) {
+    return; // already gone again
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", dirpath, entry->d_name);
+    struct stat st;
+    if (entry->d_type == DT_DIR ||
+	(entry->d_type == DT_UNKNOWN && lstat(path, &st) == 0 && S_ISDIR(st.st_mode))) {
+      watcher_add_tree(w, path);
+    }
+  }
+  closedir(dir);
+}
+
+static void mark_dirty(Watcher *w, int wd) {
+  if (wd < 0 || wd >= w->capacity || !w->paths[wd] || w->dirty_flag[wd]) {
+    return;
+  }
+  w->dirty_flag[wd] = 1;
+  w->dirty[w->dirty_count++] = wd;
+}
+
+static void handle_event(Watcher *w, const struct inotify_event *ev) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    w->overflowed = 1;
+    return;
+  }
+  if (ev->wd < 0 || ev->wd >= w->capacity || !w->paths[ev->wd]) {
+    return;
+  }
+  const char *dirpath = w->paths[ev->wd];
+  if (ev->mask & IN_IGNORED) {
+    // directory deleted; its parent sees IN_DELETE
+    free(w->paths[ev->wd]);
+    w->paths[ev->wd] = NULL;
+    return;
+  }
+  if (ev->len > 0 && strcmp(dirpath, w->root) == 0 && isStateFile(ev->name, w->ignore)) {
+    return; // our own state file
+  }
+  if (ev->len > 0 && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+    // watch before the rescan so nothing created in between is missed
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", dirpath, ev->name);
+    watcher_add_tree(w, path);
+  }
+  mark_dirty(w, ev->wd);
+}
+
+/* drains whatever the kernel has queued. Returns -1 on error. */
+static int read_events(Watcher *w) {
+  char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1) {
+    ssize_t n = read(w->fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EAGAIN) return 0;
+      if (errno == EINTR) continue;
+      perror("Failed to read filesystem events");
+      return -1;
+    }
+    for (char *p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      handle_event(w, ev);
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+}
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int watcher_wait(Watcher *w, volatile sig_atomic_t *stop) {
+  long long first = -1;
+  while (!*stop) {
+    int timeout = -1;
+    if (first != -1) {
+      // quiet period, capped by the latest we may flush the batch
+      long long left = first + WATCH_MAX_DELAY_MS - now_ms();
+      timeout = left < WATCH_DEBOUNCE_MS ? (int)(left > 0 ? left : 0) : WATCH_DEBOUNCE_MS;
+    }
+    struct pollfd pfd = { w->fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      perror("Error waiting for filesystem events");
+      return -1;
+    }
+    if (ready == 0) {
+      return 1; // settled, or waited long enough
+    }
+    if (read_events(w) == -1) {
+      return -1;
+    }
+    if (first == -1 && (w->dirty_count > 0 || w->overflowed)) {
+      first = now_ms();
+    }
+  }
+  return 0;
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+const char **watcher_dirty_paths(Watcher *w, size_t *count) {
+  const char **paths = malloc((w->dirty_count ? w->dirty_count : 1) * sizeof(char *));
+  if (!paths) {
+    perror("Failed to allocate dirty path list");
+    *count = 0;
+    return NULL;
+  }
+  size_t n = 0;
+  for (int i = 0; i < w->dirty_count; i++) {
+    if (w->paths[w->dirty[i]]) {
+      paths[n++] = w->paths[w->dirty[i]];
+    }
+  }
+  // a parent sorts before anything below it
+  qsort(paths, n, sizeof(char *), compare_paths);
+  *count = n;
+  return paths;
+}
+
+void watcher_clear(Watcher *w) {
+  for (int i = 0; i < w->dirty_count; i++) {
+    w->dirty_flag[w->dirty[i]] = 0;
+  }
+  w->dirty_count = 0;
+  w->overflowed = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * BLAKE3 (hash mode, 32 byte output). Whole chunks are hashed eight at a
+ * time with AVX2 when the CPU has it, otherwise one at a time.
+ */
+
+#define BLAKE3_OUT_LEN 32
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+typedef struct {
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t buf[BLAKE3_BLOCK_LEN];
+  uint8_t buf_len;
+  uint8_t blocks_compressed;
+} Blake3ChunkState;
+
+typedef struct {
+  Blake3ChunkState chunk;
+  uint8_t cv_stack_len;
+  uint8_t cv_stack[(BLAKE3_MAX_DEPTH + 1) * BLAKE3_OUT_LEN];
+} Blake3Hasher;
+
+void blake3_init(Blake3Hasher *hasher);
+void blake3_update(Blake3Hasher *hasher, const void *input, size_t len);
+void blake3_final(const Blake3Hasher *hasher, uint8_t *out);
+
+#endif // BLAKE3_H
@@ -0,0 +1,54 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/*
+ * Codecs for framed MSG_PUT_BLOB bodies (see protocol.h). The client
+ * offers a bit mask of codecs in its hello (bit n for codec n) and the
+ * server answers with the one it picked, or COMPRESS_NONE.
+ *
+ * Deflate through zlib is the only codec built in; "fast" and "best" are
+ * compression levels, which only the sender needs to know. Other codecs
+ * (LZ4, zstd) just need an id and a case in compress.c.
+ */
+
+#define COMPRESS_NONE    0
+#define COMPRESS_DEFLATE 1
+
+#define COMPRESS_SUPPORTED (1u << COMPRESS_DEFLATE)
+
+#define COMPRESS_LEVEL_FAST 1
+#define COMPRESS_LEVEL_BEST 6
+
+/* one compression context, reused for every frame */
+typedef struct {
+  uint32_t codec;
+  z_stream zs;
+} Compressor;
+
+typedef struct {
+  uint32_t codec;
+  z_stream zs;
+} Decompressor;
+
+/* Returns -1 for an unknown codec or when out of memory. */
+int compressor_init(Compressor *c, uint32_t codec, int level);
+void compressor_free(Compressor *c);
+
+/* compresses len bytes of src into dst. Returns the compressed size, or
+ * 0 if it doesn't fit in cap bytes; send the frame as is then. */
+size_t compress_frame(Compressor *c, const void *src, size_t len, void *dst, size_t cap);
+
+int decompressor_init(Decompressor *d, uint32_t codec);
+void decompressor_free(Decompressor *d);
+
+/* Returns 0 if src decodes to exactly raw_len bytes, -1 otherwise. */
+int decompress_frame(Decompressor *d, const void *src, size_t len, void *dst, size_t raw_len);
+
+/* "deflate", or NULL for codecs we don't know */
+const char *compress_name(uint32_t codec);
+
+#endif // COMPRESS_H
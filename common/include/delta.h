@@ -0,0 +1,89 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hash.h"
+#include "protocol.h"
+
+/*
+ * rsync style delta transfer of a file the server already holds an older
+ * version of (the basis, named by its blob id).
+ *
+ * MSG_SIGNATURE describes the basis in blocks of block_size bytes, the
+ * last one possibly shorter:
+ *
+ *   u32 block_size, u32 block_count, u64 basis size,
+ *   block_count * (u32 weak, DELTA_STRONG_SIZE bytes strong)
+ *
+ * weak is the rolling checksum below, strong the start of the block's
+ * digest with the session's hash algorithm. MSG_PUT_DELTA rebuilds the
+ * new contents from blocks of the basis and literal bytes:
+ *
+ *   new blob id, basis blob id, u32 block_size, then ops until body_len:
+ *   DELTA_OP_COPY:    u32 op, u32 first block, u32 block count
+ *   DELTA_OP_LITERAL: u32 op, u32 length (1..STREAM_CHUNK_SIZE), bytes
+ *
+ * The result is verified against the new blob id like any upload.
+ */
+
+#define DELTA_STRONG_SIZE 16
+#define DELTA_SIG_HEADER_SIZE 16
+#define DELTA_SIG_ENTRY_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_PREFIX_SIZE (2 * BLOB_ID_SIZE + 4)
+
+#define DELTA_OP_COPY    1
+#define DELTA_OP_LITERAL 2
+#define DELTA_COPY_SIZE    12
+#define DELTA_LITERAL_SIZE 8 // header only
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_MAX_BLOCKS (1u << 22)
+
+/* rsync's rolling checksum over a window of len bytes */
+typedef struct {
+  uint32_t a;
+  uint32_t b;
+  uint32_t len;
+} RollSum;
+
+void rollsum_init(RollSum *rs, const unsigned char *p, size_t len);
+
+/* slides the window one byte: out leaves at the front, in enters at the back */
+static inline void rollsum_roll(RollSum *rs, unsigned char out, unsigned char in) {
+  rs->a += (uint32_t)in - out;
+  rs->b += rs->a - rs->len * out;
+}
+
+static inline uint32_t rollsum_digest(const RollSum *rs) {
+  return (rs->a & 0xffff) | (rs->b << 16);
+}
+
+/* block size for a basis of size bytes: about its square root */
+uint32_t delta_block_size(uint64_t size);
+
+/* strong checksum of one block. Returns -1 if hashing fails. */
+int delta_strong(HashCtx *hash, const unsigned char *p, size_t len, unsigned char *out);
+
+/* reads fd (size bytes) and returns its MSG_SIGNATURE body, or NULL on a
+ * read error or when out of memory */
+unsigned char *delta_signature(HashCtx *hash, int fd, uint64_t size, size_t *len_out);
+
+/* parsed view of a MSG_SIGNATURE body */
+typedef struct {
+  uint32_t block_size;
+  uint32_t block_count;
+  uint64_t basis_size;
+  const unsigned char *entries;
+} Signature;
+
+/* Returns -1 if body is not a well formed signature. */
+int signature_parse(Signature *sig, const unsigned char *body, size_t len);
+uint32_t signature_weak(const Signature *sig, uint32_t block);
+const unsigned char *signature_strong(const Signature *sig, uint32_t block);
+
+/* length of a block of the basis; only the last one can be short */
+size_t signature_block_len(const Signature *sig, uint32_t block);
+
+#endif // DELTA_H
@@ -0,0 +1,61 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+#include "blake3.h"
+
+/*
+ * Content hash engines. Both produce 32 byte digests, so blob ids keep
+ * their size whichever one a session uses; the algorithm id travels in
+ * the hello and in node_data.bin instead.
+ *
+ * BLAKE3 is the default: it is SIMD friendly and well ahead of SHA-256 on
+ * CPUs without SHA extensions. SHA-256 goes through OpenSSL and stays
+ * available for stores and trees built with it.
+ */
+
+#define HASH_SHA256 1
+#define HASH_BLAKE3 2
+#define HASH_DEFAULT HASH_BLAKE3
+
+#define HASH_DIGEST_SIZE 32
+
+/* one hashing context, reusable across any number of inputs */
+typedef struct {
+  uint32_t algo;
+  EVP_MD_CTX *evp; // HASH_SHA256
+  Blake3Hasher blake3;
+} HashCtx;
+
+/* Returns -1 for an unknown algorithm or allocation failure. */
+int hash_ctx_init(HashCtx *ctx, uint32_t algo);
+void hash_ctx_free(HashCtx *ctx);
+
+/* begin/update/finish one digest. Return -1 on failure. */
+int hash_begin(HashCtx *ctx);
+int hash_update(HashCtx *ctx, const void *data, size_t len);
+int hash_finish(HashCtx *ctx, unsigned char *digest);
+
+/* a folder's entry as its Merkle digest covers it: a file with its blob
+ * id or a subfolder with its own digest */
+typedef struct {
+  const char *name; // not necessarily NUL terminated
+  size_t name_len;
+  const unsigned char *digest;
+  int is_folder;
+} HashChild;
+
+/* digest of a folder from its children, which are sorted by name in
+ * place first. It covers, for each one in that order, a byte 0 for a
+ * file or 1 for a folder, the name, a NUL and the child's digest. Client
+ * and server compute it the same way, so equal digests mean equal
+ * subtrees. Returns -1 on failure. */
+int hash_folder(HashCtx *ctx, HashChild *children, size_t count, unsigned char *digest);
+
+/* "sha256", "blake3"; NULL / 0 when unknown */
+const char *hash_name(uint32_t algo);
+uint32_t hash_from_name(const char *name);
+
+#endif // HASH_H
@@ -0,0 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Leveled console logging. Errors and warnings go to stderr, the rest to
+ * stdout. Messages below the current level cost a comparison; the macros
+ * don't even evaluate their arguments.
+ *
+ * Each level other than LOG_LEVEL_ERROR may print at most `rate` lines
+ * per second (with bursts of as many). What goes over is counted and
+ * reported with the level's next line, so a million changed files can't
+ * turn the console into the bottleneck.
+ */
+
+typedef enum { LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG } LogLevel;
+
+#define LOG_DEFAULT_RATE 100
+
+extern LogLevel log_level;
+
+/* rate 0 turns rate limiting off */
+void log_init(LogLevel level, int rate);
+
+/* "error", "warn", "info", "debug"; -1 when unknown */
+int log_level_from_name(const char *name);
+
+/* one line, without the trailing newline */
+void log_write(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* reports anything still suppressed */
+void log_flush(void);
+
+#define log_enabled(level) (log_level >= (level))
+
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)							\
+  do { if (log_enabled(LOG_LEVEL_WARN)) log_write(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define log_info(...)							\
+  do { if (log_enabled(LOG_LEVEL_INFO)) log_write(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define log_debug(...)							\
+  do { if (log_enabled(LOG_LEVEL_DEBUG)) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+
+#endif // LOG_H
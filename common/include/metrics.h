@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Per-phase latency histograms for client and server.
+ *
+ * Every thread records into its own shard, so the hot path is two clock
+ * reads and a few uncontended stores. Readers sum all shards; the shard of
+ * a thread that exits is folded into a retired total and reused.
+ *
+ * Buckets are powers of two of nanoseconds: bucket 0 holds everything
+ * under 1024 ns, bucket i values in [2^(i+9), 2^(i+10)) and the last one
+ * everything above. Percentiles are reported as the upper bound of the
+ * bucket they fall in.
+ */
+
+typedef enum {
+  METRIC_STAT,       // client: fstatat of one directory entry
+  METRIC_HASH,       // client: checksum of one file
+  METRIC_SEND,       // client: one blob or delta body onto the socket
+  METRIC_ACK_WAIT,   // client: blocked until the server acks
+  METRIC_RECV,       // server: one recv from a client
+  METRIC_DISK_WRITE, // server: one chunk or delta copy written to a blob
+  METRIC_SYNC,       // server: one syncfs of the store
+  METRIC_COUNT
+} MetricId;
+
+#define METRICS_CLIENT ((1u << METRIC_STAT) | (1u << METRIC_HASH) | (1u << METRIC_SEND) | \
+			(1u << METRIC_ACK_WAIT))
+#define METRICS_SERVER ((1u << METRIC_RECV) | (1u << METRIC_DISK_WRITE) | (1u << METRIC_SYNC))
+
+#define HIST_BUCKETS 26 // the last finite bound is 2^34 ns, about 17 s
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t bytes; // payload the operations moved, if any
+  uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+static inline uint64_t metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* records one operation of the calling thread */
+void metrics_observe(MetricId id, uint64_t ns, uint64_t bytes);
+
+/* one operation that started at metrics_now() == start */
+static inline void metrics_since(MetricId id, uint64_t start, uint64_t bytes) {
+  metrics_observe(id, metrics_now() - start, bytes);
+}
+
+/* totals over every thread so far */
+void metrics_snapshot(Histogram out[METRIC_COUNT]);
+
+/* "stat", "hash", ... */
+const char *metric_name(MetricId id);
+
+/* the metrics in mask as one JSON object keyed by name */
+void metrics_write_json(FILE *out, const Histogram snap[METRIC_COUNT], unsigned mask);
+
+/* the metrics in mask in the Prometheus text format, as cloudvault_*
+ * histograms in seconds plus a byte counter each */
+void metrics_write_prometheus(FILE *out, const Histogram snap[METRIC_COUNT], unsigned mask);
+
+#endif // METRICS_H
@@ -0,0 +1,10 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+/* Command line helpers shared by the client and the server. */
+
+/* the value of a numeric option. Returns -1, after saying why, unless it
+ * is a whole number between min and max. */
+int parse_number(const char *option, const char *value, int min, int max, int *out);
+
+#endif // OPTIONS_H
@@ -0,0 +1,236 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Wire format shared by client and server.
+ *
+ * Every message is a fixed size header followed by path_len bytes of path
+ * and body_len bytes of body. Integers are big-endian on the wire.
+ * Paths are relative to the client's root, "." followed by '/' separated
+ * names; the server drops a connection that sends one with an empty, "."
+ * or ".." name in it, in the header, a pack index or MSG_HAVE.
+ *
+ * A session starts with MSG_HELLO in both directions, which also fixes the
+ * hash algorithm (see hash.h) blob ids are computed with and the codec
+ * file contents may be compressed with (see compress.h). After that the
+ * client pipelines requests, each tagged with its own sequence number,
+ * and the server answers with MSG_ACK batches carrying a status per
+ * sequence number. Acks are not guaranteed to arrive in request order.
+ *
+ * Files are content addressed. The client first sends MSG_PUT_REF with
+ * the blob id; if the server already stores that blob it links <path> to
+ * it and acks ACK_OK, otherwise it acks ACK_NEED_DATA and the client
+ * follows up with MSG_PUT_BLOB carrying the contents.
+ *
+ * With MSG_FLAG_FRAMED set, the contents of a MSG_PUT_BLOB travel as
+ * frames of at most STREAM_CHUNK_SIZE decoded bytes:
+ *
+ *   u32 raw_len, u32 data_len, data_len bytes
+ *
+ * The data is compressed with the session's codec, unless data_len equals
+ * raw_len, in which case it is stored as is. body_len still counts the
+ * blob id plus the decoded size, so the frames end once their raw_len
+ * values add up to it.
+ *
+ * A file whose previous version the server stores can go out as a delta
+ * instead (see delta.h): MSG_GET_SIG names the old blob and the server
+ * replies with MSG_SIGNATURE, tagged with the request's seq, or acks
+ * ACK_NEED_DATA if it can't. MSG_PUT_DELTA then carries the new contents
+ * as references to blocks of the old blob plus literal bytes. The server
+ * acks ACK_NEED_DATA if it can't rebuild the file, and the client falls
+ * back to MSG_PUT_BLOB.
+ *
+ * Small files the server asks for are better sent many at a time:
+ * MSG_PUT_PACK has no path and its body is
+ *
+ *   u32 count, u32 index_len, index, contents
+ *
+ * The index holds count entries of blob id, u64 size and u32 path_len,
+ * each followed by its path. The contents are the files back to back in
+ * index order, so every file starts where the previous one ends. With
+ * MSG_FLAG_FRAMED the contents travel as frames, like a MSG_PUT_BLOB's;
+ * body_len counts them decoded. The pack is acked once: ACK_OK if every
+ * file was stored, ACK_NEED_DATA if some weren't, and the client then
+ * sends each of them with MSG_PUT_BLOB.
+ *
+ * The server keeps what it got of a big blob whose upload was cut off.
+ * When a later MSG_PUT_REF names that blob, the server replies with
+ * MSG_RESUME, tagged with the request's seq, instead of ACK_NEED_DATA. Its
+ * body is a u64 offset. The client then sends MSG_PUT_BLOB with
+ * MSG_FLAG_RESUME: blob id, the u64 offset, then the contents from that
+ * offset on. If the server can't resume after all, it acks ACK_NEED_DATA
+ * and the client sends the whole blob.
+ *
+ * A client without a record of what it backed up before can ask about
+ * many files at once. MSG_HAVE has no path and its body is
+ *
+ *   u32 count, then count entries of blob id, u32 path_len and the path
+ *
+ * The server replies with MSG_NEEDED, tagged with the request's seq: a
+ * bitmap of (count + 7) / 8 bytes where bit i % 8 of byte i / 8 is set
+ * if the i-th path does not point at that blob yet. The client sends
+ * MSG_PUT_REF for those only. An ack instead of the bitmap (ACK_FAILED)
+ * means every path is needed.
+ *
+ * A big blob can also arrive in parts, over any of a client's
+ * connections. MSG_PUT_PART's body is blob id, u64 offset, u64 size of
+ * the whole blob, then the part's contents (frames with MSG_FLAG_FRAMED);
+ * its path is only for the logs. The server writes each part at its
+ * offset and acks it once on disk. The part that completes the blob is
+ * acked only after the blob was verified and stored, ACK_FAILED if that
+ * didn't work out, and the client then links the path with MSG_PUT_REF.
+ *
+ * Restores go the other way. MSG_GET_BLOB names a blob; its path is only
+ * for the logs. The server replies with MSG_BLOB, tagged with the
+ * request's seq, whose body is the contents, or acks ACK_FAILED if it
+ * doesn't have the blob. A blob the server keeps compressed is sent as
+ * the frames it was uploaded as, with MSG_FLAG_FRAMED set and body_len
+ * counting the decoded size as for MSG_PUT_BLOB; anything else goes out
+ * plain. Replies come in whatever order the server finds the blobs, each
+ * one whole.
+ *
+ * Every folder has a Merkle digest (hash_folder in hash.h) over its
+ * entries: files with their blob ids, subfolders with their digests.
+ * Folders without a file anywhere below are left out, as the server only
+ * knows folders by the paths in them. MSG_GET_TREE names a folder; the
+ * server replies with MSG_TREE, tagged with the request's seq, holding
+ * what its manifest says is there:
+ *
+ *   folder digest, u32 count, then count entries of u32 type (0 file,
+ *   1 folder), u32 name_len, digest, name
+ *
+ * sorted by name. A count of 0 means the server has nothing there. A
+ * client compares the digests with its own and asks only about the
+ * subfolders that differ, so an unchanged tree is checked in one round
+ * trip however big it is.
+ */
+
+#define PROTOCOL_VERSION 11
+
+#define MSG_END       0 // client is done, no path or body
+#define MSG_PUT_DIR   1 // create directory <path>
+#define MSG_PUT_REF   2 // body: blob id. Point <path> at an existing blob
+#define MSG_HELLO     3 // body: u32 protocol version, u32 hash algorithm, u32 codecs
+#define MSG_ACK       4 // server -> client, body: AckEntry array
+#define MSG_PUT_BLOB  5 // body: blob id, then the file contents
+#define MSG_GET_SIG   6 // body: blob id of the basis; <path> is the file's
+#define MSG_SIGNATURE 7 // server -> client, answers MSG_GET_SIG with seq
+#define MSG_PUT_DELTA 8 // body: see delta.h
+#define MSG_PUT_PACK  9 // no path, body: pack index and contents
+#define MSG_RESUME   10 // server -> client, answers MSG_PUT_REF with seq, body: u64 offset
+#define MSG_HAVE     11 // no path, body: (blob id, path) pairs to look up
+#define MSG_NEEDED   12 // server -> client, answers MSG_HAVE with seq, body: bitmap
+#define MSG_PUT_PART 13 // body: blob id, u64 offset, u64 size, then part of the contents
+#define MSG_GET_BLOB 14 // body: blob id. Send back the blob's contents
+#define MSG_BLOB     15 // server -> client, answers MSG_GET_BLOB with seq, body: the contents
+#define MSG_GET_TREE 16 // no body. List the folder <path> with its digests
+#define MSG_TREE     17 // server -> client, answers MSG_GET_TREE with seq, body: the listing
+
+// MsgHeader.flags
+#define MSG_FLAG_FRAMED 1 // MSG_PUT_BLOB, MSG_PUT_PACK, MSG_PUT_PART, MSG_BLOB: contents are sent as frames
+#define MSG_FLAG_RESUME 2 // MSG_PUT_BLOB: continues a partial upload, see MSG_RESUME
+
+// blob ids are digests of the file contents, with the session's algorithm
+#define BLOB_ID_SIZE 32
+#define BLOB_HEX_SIZE (BLOB_ID_SIZE * 2)
+
+#define MSG_HEADER_SIZE 24
+#define HELLO_BODY_SIZE 12
+#define FRAME_HEADER_SIZE 8
+#define RESUME_OFFSET_SIZE 8
+#define PART_PREFIX_SIZE (BLOB_ID_SIZE + 16)
+#define MAX_WIRE_PATH 4096
+
+#define PACK_PREFIX_SIZE 8
+#define PACK_ENTRY_SIZE (BLOB_ID_SIZE + 12) // without its path
+#define PACK_MAX_ENTRIES 4096
+#define PACK_MAX_INDEX (1024 * 1024)
+
+#define HAVE_PREFIX_SIZE 4
+#define HAVE_ENTRY_SIZE (BLOB_ID_SIZE + 4) // without its path
+#define HAVE_MAX_ENTRIES 4096
+#define HAVE_MAX_BODY (1024 * 1024)
+
+#define TREE_PREFIX_SIZE (BLOB_ID_SIZE + 4)
+#define TREE_ENTRY_SIZE (BLOB_ID_SIZE + 8) // without its name
+
+// size of the chunks the server streams to disk
+#define STREAM_CHUNK_SIZE (256 * 1024)
+
+// requests a client may have outstanding, and acks per MSG_ACK
+#define DEFAULT_WINDOW 64
+#define MAX_WINDOW 4096
+#define MAX_ACK_BATCH 256
+
+#define ACK_OK 1
+#define ACK_FAILED -1
+#define ACK_NEED_DATA 2 // blob unknown or no delta possible, send it with MSG_PUT_BLOB
+
+typedef struct {
+  uint32_t type;
+  uint32_t seq;
+  uint32_t path_len;
+  uint32_t flags; // MSG_FLAG_*
+  uint64_t body_len;
+} MsgHeader;
+
+#define ACK_ENTRY_SIZE 8
+
+typedef struct {
+  uint32_t seq;
+  int32_t status;
+} AckEntry;
+
+typedef struct {
+  uint32_t raw_len;
+  uint32_t data_len;
+} FrameHeader;
+
+/* one entry of a MSG_TREE listing */
+typedef struct {
+  uint32_t type; // 0 file, 1 folder
+  uint32_t name_len;
+  unsigned char digest[BLOB_ID_SIZE];
+} TreeEntryHeader;
+
+/* one file in a MSG_PUT_PACK index */
+typedef struct {
+  unsigned char blob_id[BLOB_ID_SIZE];
+  uint64_t size;
+  uint32_t path_len;
+} PackEntryHeader;
+
+void encode_header(const MsgHeader *header, unsigned char *buf);
+void decode_header(MsgHeader *header, const unsigned char *buf);
+void encode_ack(const AckEntry *ack, unsigned char *buf);
+void decode_ack(AckEntry *ack, const unsigned char *buf);
+void encode_frame(const FrameHeader *frame, unsigned char *buf);
+void decode_frame(FrameHeader *frame, const unsigned char *buf);
+void encode_pack_entry(const PackEntryHeader *entry, unsigned char *buf);
+void decode_pack_entry(PackEntryHeader *entry, const unsigned char *buf);
+void encode_tree_entry(const TreeEntryHeader *entry, unsigned char *buf);
+void decode_tree_entry(TreeEntryHeader *entry, const unsigned char *buf);
+
+/* hex <-> raw blob ids. blob_id_from_hex returns -1 on malformed input. */
+void blob_id_to_hex(const unsigned char *id, char *hex);
+int blob_id_from_hex(const char *hex, unsigned char *id);
+
+/* send/recv until len bytes are transferred. Return 0 on success, -1 on
+ * error or if the peer closed the connection early (errno ECONNRESET). */
+int send_all(int sock, const void *buf, size_t len, int flags);
+int recv_all(int sock, void *buf, size_t len);
+
+/* sends a header followed by path (may be NULL when path_len is 0) */
+int send_header(int sock, const MsgHeader *header, const char *path, int flags);
+int recv_header(int sock, MsgHeader *header);
+
+/* sends len bytes of fd starting at *offset with sendfile, looping over
+ * short writes. Returns bytes sent, which is less than len if the file
+ * shrank underneath us, or -1 on socket error. */
+ssize_t send_file_range(int sock, int fd, off_t *offset, size_t len);
+
+#endif // PROTOCOL_H
@@ -0,0 +1,411 @@
+#include <string.h>
+#include <immintrin.h>
+#include "blake3.h"
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+// chunks hashed per hash_many call
+#define SIMD_DEGREE 8
+
+static const uint32_t IV[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+// message word order for each of the 7 rounds
+static const uint8_t MSG_SCHEDULE[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t load32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t rotr32(uint32_t v, int n) {
+  return (v >> n) | (v << (32 - n));
+}
+
+static inline void g(uint32_t *s, int a, int b, int c, int d, uint32_t mx, uint32_t my) {
+  s[a] = s[a] + s[b] + mx;
+  s[d] = rotr32(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + my;
+  s[d] = rotr32(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+		     uint64_t counter, uint8_t flags, uint32_t out[16]) {
+  uint32_t m[16], s[16];
+  for (int i = 0; i < 16; i++) {
+    m[i] = load32(block + i * 4);
+  }
+  memcpy(s, cv, 8 * sizeof(uint32_t));
+  memcpy(s + 8, IV, 4 * sizeof(uint32_t));
+  s[12] = (uint32_t)counter;
+  s[13] = (uint32_t)(counter >> 32);
+  s[14] = block_len;
+  s[15] = flags;
+
+  for (int r = 0; r < 7; r++) {
+    const uint8_t *k = MSG_SCHEDULE[r];
+    g(s, 0, 4, 8, 12, m[k[0]], m[k[1]]);
+    g(s, 1, 5, 9, 13, m[k[2]], m[k[3]]);
+    g(s, 2, 6, 10, 14, m[k[4]], m[k[5]]);
+    g(s, 3, 7, 11, 15, m[k[6]], m[k[7]]);
+    g(s, 0, 5, 10, 15, m[k[8]], m[k[9]]);
+    g(s, 1, 6, 11, 12, m[k[10]], m[k[11]]);
+    g(s, 2, 7, 8, 13, m[k[12]], m[k[13]]);
+    g(s, 3, 4, 9, 14, m[k[14]], m[k[15]]);
+  }
+
+  for (int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+    out[i + 8] = s[i + 8] ^ cv[i];
+  }
+}
+
+/* one full chunk -> its chaining value */
+static void hash_chunk_portable(const uint8_t *input, uint64_t counter, uint8_t *out) {
+  uint32_t cv[8], full[16];
+  memcpy(cv, IV, sizeof(cv));
+  for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+    uint8_t flags = (b == 0 ? CHUNK_START : 0) |
+      (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+    compress(cv, input + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter, flags, full);
+    memcpy(cv, full, sizeof(cv));
+  }
+  for (int i = 0; i < 8; i++) {
+    store32(out + i * 4, cv[i]);
+  }
+}
+
+/* ---- AVX2: eight chunks side by side, one per 32-bit lane ---- */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i rot16_avx2(__m256i x) {
+  return _mm256_shuffle_epi8(x, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+						13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+AVX2 static inline __m256i rot8_avx2(__m256i x) {
+  return _mm256_shuffle_epi8(x, _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+						12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+AVX2 static inline __m256i rot12_avx2(__m256i x) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(x, 20));
+}
+
+AVX2 static inline __m256i rot7_avx2(__m256i x) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, 7), _mm256_slli_epi32(x, 25));
+}
+
+AVX2 static inline void g_avx2(__m256i *s, int a, int b, int c, int d, __m256i mx, __m256i my) {
+  s[a] = _mm256_add_epi32(_mm256_add_epi32(s[a], s[b]), mx);
+  s[d] = rot16_avx2(_mm256_xor_si256(s[d], s[a]));
+  s[c] = _mm256_add_epi32(s[c], s[d]);
+  s[b] = rot12_avx2(_mm256_xor_si256(s[b], s[c]));
+  s[a] = _mm256_add_epi32(_mm256_add_epi32(s[a], s[b]), my);
+  s[d] = rot8_avx2(_mm256_xor_si256(s[d], s[a]));
+  s[c] = _mm256_add_epi32(s[c], s[d]);
+  s[b] = rot7_avx2(_mm256_xor_si256(s[b], s[c]));
+}
+
+// unrolled so the schedule lookups fold into register picks
+#define ROUND_AVX2(s, m, r) do {						\
+    g_avx2(s, 0, 4, 8, 12, m[MSG_SCHEDULE[r][0]], m[MSG_SCHEDULE[r][1]]);	\
+    g_avx2(s, 1, 5, 9, 13, m[MSG_SCHEDULE[r][2]], m[MSG_SCHEDULE[r][3]]);	\
+    g_avx2(s, 2, 6, 10, 14, m[MSG_SCHEDULE[r][4]], m[MSG_SCHEDULE[r][5]]);	\
+    g_avx2(s, 3, 7, 11, 15, m[MSG_SCHEDULE[r][6]], m[MSG_SCHEDULE[r][7]]);	\
+    g_avx2(s, 0, 5, 10, 15, m[MSG_SCHEDULE[r][8]], m[MSG_SCHEDULE[r][9]]);	\
+    g_avx2(s, 1, 6, 11, 12, m[MSG_SCHEDULE[r][10]], m[MSG_SCHEDULE[r][11]]); \
+    g_avx2(s, 2, 7, 8, 13, m[MSG_SCHEDULE[r][12]], m[MSG_SCHEDULE[r][13]]); \
+    g_avx2(s, 3, 4, 9, 14, m[MSG_SCHEDULE[r][14]], m[MSG_SCHEDULE[r][15]]); \
+  } while (0)
+
+/* vecs[i] holds row i; afterwards vecs[j] holds column j */
+AVX2 static void transpose_avx2(__m256i vecs[8]) {
+  __m256i ab_0145 = _mm256_unpacklo_epi32(vecs[0], vecs[1]);
+  __m256i ab_2367 = _mm256_unpackhi_epi32(vecs[0], vecs[1]);
+  __m256i cd_0145 = _mm256_unpacklo_epi32(vecs[2], vecs[3]);
+  __m256i cd_2367 = _mm256_unpackhi_epi32(vecs[2], vecs[3]);
+  __m256i ef_0145 = _mm256_unpacklo_epi32(vecs[4], vecs[5]);
+  __m256i ef_2367 = _mm256_unpackhi_epi32(vecs[4], vecs[5]);
+  __m256i gh_0145 = _mm256_unpacklo_epi32(vecs[6], vecs[7]);
+  __m256i gh_2367 = _mm256_unpackhi_epi32(vecs[6], vecs[7]);
+
+  __m256i abcd_04 = _mm256_unpacklo_epi64(ab_0145, cd_0145);
+  __m256i abcd_15 = _mm256_unpackhi_epi64(ab_0145, cd_0145);
+  __m256i abcd_26 = _mm256_unpacklo_epi64(ab_2367, cd_2367);
+  __m256i abcd_37 = _mm256_unpackhi_epi64(ab_2367, cd_2367);
+  __m256i efgh_04 = _mm256_unpacklo_epi64(ef_0145, gh_0145);
+  __m256i efgh_15 = _mm256_unpackhi_epi64(ef_0145, gh_0145);
+  __m256i efgh_26 = _mm256_unpacklo_epi64(ef_2367, gh_2367);
+  __m256i efgh_37 = _mm256_unpackhi_epi64(ef_2367, gh_2367);
+
+  vecs[0] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x20);
+  vecs[1] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x20);
+  vecs[2] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x20);
+  vecs[3] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x20);
+  vecs[4] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x31);
+  vecs[5] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x31);
+  vecs[6] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x31);
+  vecs[7] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x31);
+}
+
+/* eight consecutive full chunks starting at input -> eight chaining values */
+AVX2 static void hash8_avx2(const uint8_t *input, uint64_t counter, uint8_t *out) {
+  __m256i cv[8];
+  for (int i = 0; i < 8; i++) {
+    cv[i] = _mm256_set1_epi32((int)IV[i]);
+  }
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i lo = _mm256_add_epi32(_mm256_set1_epi32((int)(uint32_t)counter), lanes);
+  // carry into the high word when the low word wrapped
+  __m256i carry = _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)counter), _mm256_set1_epi32(INT32_MIN)),
+				     _mm256_xor_si256(lo, _mm256_set1_epi32(INT32_MIN)));
+  __m256i hi = _mm256_sub_epi32(_mm256_set1_epi32((int)(uint32_t)(counter >> 32)), carry);
+
+  for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+    __m256i m[16];
+    for (int i = 0; i < 8; i++) {
+      const uint8_t *block = input + (size_t)i * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN;
+      m[i] = _mm256_loadu_si256((const __m256i *)block);
+      m[i + 8] = _mm256_loadu_si256((const __m256i *)(block + 32));
+    }
+    transpose_avx2(m);
+    transpose_avx2(m + 8);
+
+    uint32_t flags = (b == 0 ? CHUNK_START : 0) |
+      (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0);
+    __m256i s[16] = {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      _mm256_set1_epi32((int)IV[0]), _mm256_set1_epi32((int)IV[1]),
+      _mm256_set1_epi32((int)IV[2]), _mm256_set1_epi32((int)IV[3]),
+      lo, hi, _mm256_set1_epi32(BLAKE3_BLOCK_LEN), _mm256_set1_epi32((int)flags),
+    };
+
+    ROUND_AVX2(s, m, 0);
+    ROUND_AVX2(s, m, 1);
+    ROUND_AVX2(s, m, 2);
+    ROUND_AVX2(s, m, 3);
+    ROUND_AVX2(s, m, 4);
+    ROUND_AVX2(s, m, 5);
+    ROUND_AVX2(s, m, 6);
+    for (int i = 0; i < 8; i++) {
+      cv[i] = _mm256_xor_si256(s[i], s[i + 8]);
+    }
+  }
+
+  // lanes back to one chaining value per chunk
+  transpose_avx2(cv);
+  for (int i = 0; i < 8; i++) {
+    _mm256_storeu_si256((__m256i *)(out + i * BLAKE3_OUT_LEN), cv[i]);
+  }
+}
+
+static int have_avx2(void) {
+  static int cached = -1;
+  if (cached == -1) {
+    __builtin_cpu_init();
+    cached = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return cached;
+}
+
+/* SIMD_DEGREE full chunks -> SIMD_DEGREE chaining values */
+static void hash_many(const uint8_t *input, uint64_t counter, uint8_t *out) {
+  if (have_avx2()) {
+    hash8_avx2(input, counter, out);
+    return;
+  }
+  for (int i = 0; i < SIMD_DEGREE; i++) {
+    hash_chunk_portable(input + (size_t)i * BLAKE3_CHUNK_LEN, counter + i, out + i * BLAKE3_OUT_LEN);
+  }
+}
+
+/* ---- incremental hasher ---- */
+
+static void chunk_state_init(Blake3ChunkState *chunk, uint64_t counter) {
+  memcpy(chunk->cv, IV, sizeof(chunk->cv));
+  chunk->chunk_counter = counter;
+  chunk->buf_len = 0;
+  chunk->blocks_compressed = 0;
+}
+
+static size_t chunk_state_len(const Blake3ChunkState *chunk) {
+  return (size_t)chunk->blocks_compressed * BLAKE3_BLOCK_LEN + chunk->buf_len;
+}
+
+static uint8_t chunk_start_flag(const Blake3ChunkState *chunk) {
+  return chunk->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static void chunk_state_update(Blake3ChunkState *chunk, const uint8_t *input, size_t len) {
+  while (len > 0) {
+    // the last block of a chunk is held back until we know it is the last
+    if (chunk->buf_len == BLAKE3_BLOCK_LEN) {
+      uint32_t full[16];
+      compress(chunk->cv, chunk->buf, BLAKE3_BLOCK_LEN, chunk->chunk_counter,
+	       chunk_start_flag(chunk), full);
+      memcpy(chunk->cv, full, sizeof(chunk->cv));
+      chunk->blocks_compressed++;
+      chunk->buf_len = 0;
+    }
+    size_t take = BLAKE3_BLOCK_LEN - chunk->buf_len;
+    if (take > len) take = len;
+    memcpy(chunk->buf + chunk->buf_len, input, take);
+    chunk->buf_len += (uint8_t)take;
+    input += take;
+    len -= take;
+  }
+}
+
+typedef struct {
+  uint32_t cv[8];
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  uint8_t block_len;
+  uint64_t counter;
+  uint8_t flags;
+} Output;
+
+static Output chunk_state_output(const Blake3ChunkState *chunk) {
+  Output out;
+  memcpy(out.cv, chunk->cv, sizeof(out.cv));
+  memset(out.block, 0, sizeof(out.block));
+  memcpy(out.block, chunk->buf, chunk->buf_len);
+  out.block_len = chunk->buf_len;
+  out.counter = chunk->chunk_counter;
+  out.flags = chunk_start_flag(chunk) | CHUNK_END;
+  return out;
+}
+
+static Output parent_output(const uint8_t *left_and_right) {
+  Output out;
+  memcpy(out.cv, IV, sizeof(out.cv));
+  memcpy(out.block, left_and_right, BLAKE3_BLOCK_LEN);
+  out.block_len = BLAKE3_BLOCK_LEN;
+  out.counter = 0;
+  out.flags = PARENT;
+  return out;
+}
+
+static void output_cv(const Output *out, uint8_t *cv) {
+  uint32_t full[16];
+  compress(out->cv, out->block, out->block_len, out->counter, out->flags, full);
+  for (int i = 0; i < 8; i++) {
+    store32(cv + i * 4, full[i]);
+  }
+}
+
+/* pushes a finished chunk's cv, merging completed subtrees first. The
+ * number of set bits in total_chunks is the number of subtrees. */
+static void push_chunk_cv(Blake3Hasher *hasher, const uint8_t *cv, uint64_t total_chunks) {
+  uint8_t new_cv[BLAKE3_OUT_LEN];
+  memcpy(new_cv, cv, BLAKE3_OUT_LEN);
+  while ((total_chunks & 1) == 0) {
+    hasher->cv_stack_len--;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    memcpy(block, hasher->cv_stack + hasher->cv_stack_len * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+    memcpy(block + BLAKE3_OUT_LEN, new_cv, BLAKE3_OUT_LEN);
+    Output parent = parent_output(block);
+    output_cv(&parent, new_cv);
+    total_chunks >>= 1;
+  }
+  memcpy(hasher->cv_stack + hasher->cv_stack_len * BLAKE3_OUT_LEN, new_cv, BLAKE3_OUT_LEN);
+  hasher->cv_stack_len++;
+}
+
+void blake3_init(Blake3Hasher *hasher) {
+  chunk_state_init(&hasher->chunk, 0);
+  hasher->cv_stack_len = 0;
+}
+
+void blake3_update(Blake3Hasher *hasher, const void *data, size_t len) {
+  const uint8_t *input = data;
+
+  // finish a partially filled chunk first
+  if (chunk_state_len(&hasher->chunk) > 0) {
+    size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&hasher->chunk);
+    if (take > len) take = len;
+    chunk_state_update(&hasher->chunk, input, take);
+    input += take;
+    len -= take;
+    if (len == 0) {
+      return; // might still be the final chunk
+    }
+    uint8_t cv[BLAKE3_OUT_LEN];
+    Output out = chunk_state_output(&hasher->chunk);
+    output_cv(&out, cv);
+    uint64_t total = hasher->chunk.chunk_counter + 1;
+    push_chunk_cv(hasher, cv, total);
+    chunk_state_init(&hasher->chunk, total);
+  }
+
+  // whole chunks in bulk, as long as more input follows them
+  while (len > SIMD_DEGREE * BLAKE3_CHUNK_LEN) {
+    uint8_t cvs[SIMD_DEGREE * BLAKE3_OUT_LEN];
+    uint64_t counter = hasher->chunk.chunk_counter;
+    hash_many(input, counter, cvs);
+    for (int i = 0; i < SIMD_DEGREE; i++) {
+      push_chunk_cv(hasher, cvs + i * BLAKE3_OUT_LEN, counter + i + 1);
+    }
+    chunk_state_init(&hasher->chunk, counter + SIMD_DEGREE);
+    input += SIMD_DEGREE * BLAKE3_CHUNK_LEN;
+    len -= SIMD_DEGREE * BLAKE3_CHUNK_LEN;
+  }
+
+  while (len > 0) {
+    if (chunk_state_len(&hasher->chunk) == BLAKE3_CHUNK_LEN) {
+      uint8_t cv[BLAKE3_OUT_LEN];
+      Output out = chunk_state_output(&hasher->chunk);
+      output_cv(&out, cv);
+      uint64_t total = hasher->chunk.chunk_counter + 1;
+      push_chunk_cv(hasher, cv, total);
+      chunk_state_init(&hasher->chunk, total);
+    }
+    size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&hasher->chunk);
+    if (take > len) take = len;
+    chunk_state_update(&hasher->chunk, input, take);
+    input += take;
+    len -= take;
+  }
+}
+
+void blake3_final(const Blake3Hasher *hasher, uint8_t *out) {
+  Output output = chunk_state_output(&hasher->chunk);
+  int remaining = hasher->cv_stack_len;
+  while (remaining > 0) {
+    remaining--;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    memcpy(block, hasher->cv_stack + remaining * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+    output_cv(&output, block + BLAKE3_OUT_LEN);
+    output = parent_output(block);
+  }
+
+  uint32_t full[16];
+  compress(output.cv, output.block, output.block_len, 0, output.flags | ROOT, full);
+  for (int i = 0; i < 8; i++) {
+    store32(out + i * 4, full[i]);
+  }
+}
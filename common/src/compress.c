@@ -0,0 +1,73 @@
+#include <string.h>
+#include "compress.h"
+
+int compressor_init(Compressor *c, uint32_t codec, int level) {
+  memset(c, 0, sizeof(*c));
+  if (codec != COMPRESS_DEFLATE || deflateInit(&c->zs, level) != Z_OK) {
+    return -1;
+  }
+  c->codec = codec;
+  return 0;
+}
+
+void compressor_free(Compressor *c) {
+  if (c->codec == COMPRESS_DEFLATE) {
+    deflateEnd(&c->zs);
+  }
+  c->codec = COMPRESS_NONE;
+}
+
+size_t compress_frame(Compressor *c, const void *src, size_t len, void *dst, size_t cap) {
+  // every frame is a stream of its own, so frames decode independently
+  if (deflateReset(&c->zs) != Z_OK) {
+    return 0;
+  }
+  c->zs.next_in = (Bytef *)src;
+  c->zs.avail_in = (uInt)len;
+  c->zs.next_out = dst;
+  c->zs.avail_out = (uInt)cap;
+  if (deflate(&c->zs, Z_FINISH) != Z_STREAM_END) {
+    return 0; // out of room: it didn't shrink enough
+  }
+  return cap - c->zs.avail_out;
+}
+
+int decompressor_init(Decompressor *d, uint32_t codec) {
+  memset(d, 0, sizeof(*d));
+  if (codec != COMPRESS_DEFLATE || inflateInit(&d->zs) != Z_OK) {
+    return -1;
+  }
+  d->codec = codec;
+  return 0;
+}
+
+void decompressor_free(Decompressor *d) {
+  if (d->codec == COMPRESS_DEFLATE) {
+    inflateEnd(&d->zs);
+  }
+  d->codec = COMPRESS_NONE;
+}
+
+int decompress_frame(Decompressor *d, const void *src, size_t len, void *dst, size_t raw_len) {
+  if (d->codec != COMPRESS_DEFLATE || inflateReset(&d->zs) != Z_OK) {
+    return -1;
+  }
+  d->zs.next_in = (Bytef *)src;
+  d->zs.avail_in = (uInt)len;
+  d->zs.next_out = dst;
+  d->zs.avail_out = (uInt)raw_len;
+  // must end exactly at raw_len, with all input consumed
+  if (inflate(&d->zs, Z_FINISH) != Z_STREAM_END || d->zs.avail_out != 0 || d->zs.avail_in != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+const char *compress_name(uint32_t codec) {
+  switch (codec) {
+  case COMPRESS_DEFLATE:
+    return "deflate";
+  default:
+    return NULL;
+  }
+}
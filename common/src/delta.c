@@ -0,0 +1,137 @@
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "delta.h"
+
+#define SIGNATURE_READ_SIZE (1024 * 1024)
+
+void rollsum_init(RollSum *rs, const unsigned char *p, size_t len) {
+  rs->a = rs->b = 0;
+  rs->len = (uint32_t)len;
+  for (size_t i = 0; i < len; i++) {
+    rs->a += p[i];
+    rs->b += rs->a;
+  }
+}
+
+uint32_t delta_block_size(uint64_t size) {
+  // sqrt(size) balances signature size against match granularity
+  uint64_t block = DELTA_MIN_BLOCK;
+  while (block < DELTA_MAX_BLOCK && block * block < size) {
+    block *= 2;
+  }
+  return (uint32_t)block;
+}
+
+int delta_strong(HashCtx *hash, const unsigned char *p, size_t len, unsigned char *out) {
+  unsigned char digest[HASH_DIGEST_SIZE];
+  if (hash_begin(hash) == -1 || hash_update(hash, p, len) == -1 || hash_finish(hash, digest) == -1) {
+    return -1;
+  }
+  memcpy(out, digest, DELTA_STRONG_SIZE);
+  return 0;
+}
+
+static void put_entry(unsigned char *entry, uint32_t weak) {
+  weak = htobe32(weak);
+  memcpy(entry, &weak, 4);
+}
+
+unsigned char *delta_signature(HashCtx *hash, int fd, uint64_t size, size_t *len_out) {
+  uint32_t block = delta_block_size(size);
+  uint64_t count = (size + block - 1) / block;
+  if (count > DELTA_MAX_BLOCKS) {
+    return NULL;
+  }
+  size_t len = DELTA_SIG_HEADER_SIZE + count * DELTA_SIG_ENTRY_SIZE;
+  unsigned char *sig = malloc(len);
+  // block sizes are powers of two, so every read covers whole blocks
+  size_t buf_size = SIGNATURE_READ_SIZE;
+  unsigned char *buf = malloc(buf_size);
+  if (!sig || !buf) {
+    free(sig);
+    free(buf);
+    return NULL;
+  }
+  uint32_t v = htobe32(block);
+  memcpy(sig, &v, 4);
+  v = htobe32((uint32_t)count);
+  memcpy(sig + 4, &v, 4);
+  uint64_t size_be = htobe64(size);
+  memcpy(sig + 8, &size_be, 8);
+
+  unsigned char *entry = sig + DELTA_SIG_HEADER_SIZE;
+  uint64_t done = 0;
+  while (done < size) {
+    size_t want = size - done < buf_size ? (size_t)(size - done) : buf_size;
+    size_t got = 0;
+    while (got < want) {
+      ssize_t n = pread(fd, buf + got, want - got, (off_t)(done + got));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+	// error, or the file is shorter than it said
+	free(sig);
+	free(buf);
+	return NULL;
+      }
+      got += n;
+    }
+    for (size_t off = 0; off < got; off += block) {
+      size_t n = got - off < block ? got - off : block;
+      RollSum rs;
+      rollsum_init(&rs, buf + off, n);
+      put_entry(entry, rollsum_digest(&rs));
+      if (delta_strong(hash, buf + off, n, entry + 4) == -1) {
+	free(sig);
+	free(buf);
+	return NULL;
+      }
+      entry += DELTA_SIG_ENTRY_SIZE;
+    }
+    done += got;
+  }
+  free(buf);
+  *len_out = len;
+  return sig;
+}
+
+int signature_parse(Signature *sig, const unsigned char *body, size_t len) {
+  if (len < DELTA_SIG_HEADER_SIZE) {
+    return -1;
+  }
+  uint32_t v;
+  memcpy(&v, body, 4);
+  sig->block_size = be32toh(v);
+  memcpy(&v, body + 4, 4);
+  sig->block_count = be32toh(v);
+  uint64_t size;
+  memcpy(&size, body + 8, 8);
+  sig->basis_size = be64toh(size);
+  sig->entries = body + DELTA_SIG_HEADER_SIZE;
+
+  if (sig->block_size < DELTA_MIN_BLOCK || sig->block_size > DELTA_MAX_BLOCK ||
+      sig->block_count == 0 || sig->block_count > DELTA_MAX_BLOCKS ||
+      len != DELTA_SIG_HEADER_SIZE + (size_t)sig->block_count * DELTA_SIG_ENTRY_SIZE ||
+      (sig->basis_size + sig->block_size - 1) / sig->block_size != sig->block_count) {
+    return -1;
+  }
+  return 0;
+}
+
+uint32_t signature_weak(const Signature *sig, uint32_t block) {
+  uint32_t v;
+  memcpy(&v, sig->entries + (size_t)block * DELTA_SIG_ENTRY_SIZE, 4);
+  return be32toh(v);
+}
+
+const unsigned char *signature_strong(const Signature *sig, uint32_t block) {
+  return sig->entries + (size_t)block * DELTA_SIG_ENTRY_SIZE + 4;
+}
+
+size_t signature_block_len(const Signature *sig, uint32_t block) {
+  uint64_t start = (uint64_t)block * sig->block_size;
+  uint64_t left = sig->basis_size - start;
+  return left < sig->block_size ? (size_t)left : sig->block_size;
+}
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+int hash_ctx_init(HashCtx *ctx, uint32_t algo) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->algo = algo;
+  switch (algo) {
+  case HASH_SHA256:
+    ctx->evp = EVP_MD_CTX_new();
+    return ctx->evp ? 0 : -1;
+  case HASH_BLAKE3:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+void hash_ctx_free(HashCtx *ctx) {
+  EVP_MD_CTX_free(ctx->evp);
+  ctx->evp = NULL;
+}
+
+int hash_begin(HashCtx *ctx) {
+  if (ctx->algo == HASH_SHA256) {
+    // re-initializing keeps the context's allocations
+    return EVP_DigestInit_ex(ctx->evp, EVP_sha256(), NULL) > 0 ? 0 : -1;
+  }
+  blake3_init(&ctx->blake3);
+  return 0;
+}
+
+int hash_update(HashCtx *ctx, const void *data, size_t len) {
+  if (ctx->algo == HASH_SHA256) {
+    return EVP_DigestUpdate(ctx->evp, data, len) > 0 ? 0 : -1;
+  }
+  blake3_update(&ctx->blake3, data, len);
+  return 0;
+}
+
+int hash_finish(HashCtx *ctx, unsigned char *digest) {
+  if (ctx->algo == HASH_SHA256) {
+    unsigned int len = 0;
+    return EVP_DigestFinal_ex(ctx->evp, digest, &len) > 0 && len == HASH_DIGEST_SIZE ? 0 : -1;
+  }
+  blake3_final(&ctx->blake3, digest);
+  return 0;
+}
+
+/* bytewise, which is strcmp order for names without NULs */
+static int compare_children(const void *a, const void *b) {
+  const HashChild *x = a, *y = b;
+  size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  int c = memcmp(x->name, y->name, len);
+  if (c != 0) {
+    return c;
+  }
+  return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+int hash_folder(HashCtx *ctx, HashChild *children, size_t count, unsigned char *digest) {
+  qsort(children, count, sizeof(HashChild), compare_children);
+  if (hash_begin(ctx) == -1) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned char type = children[i].is_folder ? 1 : 0;
+    unsigned char nul = 0;
+    if (hash_update(ctx, &type, 1) == -1 || hash_update(ctx, children[i].name, children[i].name_len) == -1 ||
+	hash_update(ctx, &nul, 1) == -1 || hash_update(ctx, children[i].digest, HASH_DIGEST_SIZE) == -1) {
+      return -1;
+    }
+  }
+  return hash_finish(ctx, digest);
+}
+
+const char *hash_name(uint32_t algo) {
+  switch (algo) {
+  case HASH_SHA256: return "sha256";
+  case HASH_BLAKE3: return "blake3";
+  default: return NULL;
+  }
+}
+
+uint32_t hash_from_name(const char *name) {
+  if (strcmp(name, "sha256") == 0) return HASH_SHA256;
+  if (strcmp(name, "blake3") == 0) return HASH_BLAKE3;
+  return 0;
+}
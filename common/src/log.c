@@ -0,0 +1,98 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "metrics.h"
+
+LogLevel log_level = LOG_LEVEL_INFO;
+
+/* token bucket of one level */
+typedef struct {
+  double tokens;
+  uint64_t refilled_ns;
+  unsigned long suppressed;
+} LogBucket;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_rate = LOG_DEFAULT_RATE;
+static LogBucket buckets[LOG_LEVEL_DEBUG + 1];
+
+static const char *const level_names[] = { "error", "warn", "info", "debug" };
+
+void log_init(LogLevel level, int rate) {
+  pthread_mutex_lock(&lock);
+  log_level = level;
+  log_rate = rate > 0 ? rate : 0;
+  memset(buckets, 0, sizeof(buckets));
+  pthread_mutex_unlock(&lock);
+}
+
+int log_level_from_name(const char *name) {
+  for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+    if (strcmp(name, level_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static FILE *stream(LogLevel level) {
+  return level <= LOG_LEVEL_WARN ? stderr : stdout;
+}
+
+/* called with the lock held */
+static void report_suppressed(LogLevel level) {
+  LogBucket *b = &buckets[level];
+  if (b->suppressed > 0) {
+    fprintf(stream(level), "(%lu %s messages suppressed)\n", b->suppressed, level_names[level]);
+    b->suppressed = 0;
+  }
+}
+
+/* called with the lock held. Returns 1 if a line may go out now. */
+static int take_token(LogLevel level) {
+  if (log_rate == 0 || level == LOG_LEVEL_ERROR) {
+    return 1;
+  }
+  LogBucket *b = &buckets[level];
+  uint64_t now = metrics_now();
+  if (b->refilled_ns == 0) {
+    b->tokens = log_rate;
+  } else {
+    b->tokens += (double)(now - b->refilled_ns) / 1e9 * log_rate;
+    if (b->tokens > log_rate) {
+      b->tokens = log_rate;
+    }
+  }
+  b->refilled_ns = now;
+  if (b->tokens < 1) {
+    b->suppressed++;
+    return 0;
+  }
+  b->tokens -= 1;
+  return 1;
+}
+
+void log_write(LogLevel level, const char *fmt, ...) {
+  pthread_mutex_lock(&lock);
+  if (take_token(level)) {
+    FILE *out = stream(level);
+    report_suppressed(level);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+    fputc('\n', out);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void log_flush(void) {
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i <= LOG_LEVEL_DEBUG; i++) {
+    report_suppressed(i);
+  }
+  fflush(stdout);
+  pthread_mutex_unlock(&lock);
+}
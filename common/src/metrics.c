@@ -0,0 +1,203 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "metrics.h"
+
+typedef struct Shard {
+  Histogram hist[METRIC_COUNT];
+  struct Shard *next;
+} Shard;
+
+static const char *const names[METRIC_COUNT] = {
+  "stat", "hash", "send", "ack_wait", "recv", "disk_write", "sync"
+};
+
+static const char *const help[METRIC_COUNT] = {
+  "Time to stat one directory entry",
+  "Time to checksum one file",
+  "Time to send one blob or delta body",
+  "Time blocked waiting for acknowledgements",
+  "Time of one recv from a client",
+  "Time to write one chunk or delta copy to a blob",
+  "Time of one sync of the store",
+};
+
+// whether the operations move payload worth a byte counter
+static const int has_bytes[METRIC_COUNT] = { 0, 1, 1, 0, 1, 1, 0 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static Shard *live;     // shards of running threads
+static Shard *spare;    // left behind by threads that exited
+static Histogram retired[METRIC_COUNT];
+static __thread Shard *local;
+
+static void add_hist(Histogram *to, const Histogram *from) {
+  to->count += from->count;
+  to->sum_ns += from->sum_ns;
+  to->bytes += from->bytes;
+  if (from->max_ns > to->max_ns) {
+    to->max_ns = from->max_ns;
+  }
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    to->buckets[b] += from->buckets[b];
+  }
+}
+
+static void detach(void *arg) {
+  Shard *shard = arg;
+  pthread_mutex_lock(&lock);
+  Shard **link = &live;
+  while (*link != shard) {
+    link = &(*link)->next;
+  }
+  *link = shard->next;
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    add_hist(&retired[i], &shard->hist[i]);
+  }
+  memset(shard->hist, 0, sizeof(shard->hist));
+  shard->next = spare;
+  spare = shard;
+  pthread_mutex_unlock(&lock);
+}
+
+static void make_key(void) {
+  pthread_key_create(&shard_key, detach);
+}
+
+/* NULL if out of memory; that thread's operations then go uncounted */
+static Shard *attach(void) {
+  pthread_once(&key_once, make_key);
+  pthread_mutex_lock(&lock);
+  Shard *shard = spare;
+  if (shard) {
+    spare = shard->next;
+  } else {
+    shard = calloc(1, sizeof(Shard));
+  }
+  if (shard) {
+    shard->next = live;
+    live = shard;
+  }
+  pthread_mutex_unlock(&lock);
+  if (shard) {
+    pthread_setspecific(shard_key, shard);
+  }
+  return shard;
+}
+
+/* only the owning thread writes a shard, readers may load concurrently */
+static inline void bump(uint64_t *field, uint64_t by) {
+  __atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + by, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(MetricId id, uint64_t ns, uint64_t bytes) {
+  if (!local && !(local = attach())) {
+    return;
+  }
+  Histogram *h = &local->hist[id];
+  uint64_t scaled = ns >> 10;
+  int b = scaled ? 64 - __builtin_clzll(scaled) : 0;
+  if (b >= HIST_BUCKETS) {
+    b = HIST_BUCKETS - 1;
+  }
+  bump(&h->count, 1);
+  bump(&h->sum_ns, ns);
+  bump(&h->bytes, bytes);
+  bump(&h->buckets[b], 1);
+  if (ns > h->max_ns) {
+    __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+  }
+}
+
+void metrics_snapshot(Histogram out[METRIC_COUNT]) {
+  pthread_mutex_lock(&lock);
+  memcpy(out, retired, sizeof(retired));
+  for (Shard *shard = live; shard; shard = shard->next) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      const Histogram *h = &shard->hist[i];
+      Histogram copy;
+      copy.count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+      copy.sum_ns = __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+      copy.max_ns = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+      copy.bytes = __atomic_load_n(&h->bytes, __ATOMIC_RELAXED);
+      for (int b = 0; b < HIST_BUCKETS; b++) {
+	copy.buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+      }
+      add_hist(&out[i], &copy);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+const char *metric_name(MetricId id) {
+  return id < METRIC_COUNT ? names[id] : NULL;
+}
+
+/* upper bound of bucket b in ns; the last one has none */
+static uint64_t bucket_bound(int b) {
+  return 1ull << (b + 10);
+}
+
+/* upper bound of the bucket the p-th fraction of operations falls in */
+static uint64_t percentile_ns(const Histogram *h, double p) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(p * (double)h->count);
+  uint64_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+    seen += h->buckets[b];
+    if (seen > rank) {
+      return bucket_bound(b) < h->max_ns ? bucket_bound(b) : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+void metrics_write_json(FILE *out, const Histogram snap[METRIC_COUNT], unsigned mask) {
+  const char *sep = "";
+  fprintf(out, "{");
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    if (!(mask & (1u << i))) {
+      continue;
+    }
+    const Histogram *h = &snap[i];
+    fprintf(out, "%s\"%s\": {\"count\": %llu, \"seconds\": %.6f, \"bytes\": %llu, \"mean_us\": %.1f, "
+	    "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+	    sep, names[i], (unsigned long long)h->count, h->sum_ns / 1e9, (unsigned long long)h->bytes,
+	    h->count ? h->sum_ns / 1e3 / h->count : 0.0, percentile_ns(h, 0.5) / 1e3,
+	    percentile_ns(h, 0.9) / 1e3, percentile_ns(h, 0.99) / 1e3, h->max_ns / 1e3);
+    sep = ", ";
+  }
+  fprintf(out, "}");
+}
+
+void metrics_write_prometheus(FILE *out, const Histogram snap[METRIC_COUNT], unsigned mask) {
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    if (!(mask & (1u << i))) {
+      continue;
+    }
+    const Histogram *h = &snap[i];
+    fprintf(out, "# HELP cloudvault_%s_seconds %s.\n", names[i], help[i]);
+    fprintf(out, "# TYPE cloudvault_%s_seconds histogram\n", names[i]);
+    uint64_t cumulative = 0;
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+      cumulative += h->buckets[b];
+      fprintf(out, "cloudvault_%s_seconds_bucket{le=\"%.9g\"} %llu\n", names[i], bucket_bound(b) / 1e9,
+	      (unsigned long long)cumulative);
+    }
+    // the total comes from the buckets too, so a snapshot taken during an
+    // update still has them add up
+    cumulative += h->buckets[HIST_BUCKETS - 1];
+    fprintf(out, "cloudvault_%s_seconds_bucket{le=\"+Inf\"} %llu\n", names[i], (unsigned long long)cumulative);
+    fprintf(out, "cloudvault_%s_seconds_sum %.9f\n", names[i], h->sum_ns / 1e9);
+    fprintf(out, "cloudvault_%s_seconds_count %llu\n", names[i], (unsigned long long)cumulative);
+    if (has_bytes[i]) {
+      fprintf(out, "# HELP cloudvault_%s_bytes_total Bytes moved by those operations.\n", names[i]);
+      fprintf(out, "# TYPE cloudvault_%s_bytes_total counter\n", names[i]);
+      fprintf(out, "cloudvault_%s_bytes_total %llu\n", names[i], (unsigned long long)h->bytes);
+    }
+  }
+}
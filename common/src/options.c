@@ -0,0 +1,16 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "options.h"
+
+int parse_number(const char *option, const char *value, int min, int max, int *out) {
+  char *end;
+  errno = 0;
+  long v = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || errno == ERANGE || v < min || v > max) {
+    fprintf(stderr, "%s must be a number between %d and %d\n", option, min, max);
+    return -1;
+  }
+  *out = (int)v;
+  return 0;
+}
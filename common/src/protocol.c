@@ -0,0 +1,189 @@
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "protocol.h"
+
+static void put32(unsigned char *buf, uint32_t v) {
+  v = htobe32(v);
+  memcpy(buf, &v, 4);
+}
+
+static void put64(unsigned char *buf, uint64_t v) {
+  v = htobe64(v);
+  memcpy(buf, &v, 8);
+}
+
+static uint32_t get32(const unsigned char *buf) {
+  uint32_t v;
+  memcpy(&v, buf, 4);
+  return be32toh(v);
+}
+
+static uint64_t get64(const unsigned char *buf) {
+  uint64_t v;
+  memcpy(&v, buf, 8);
+  return be64toh(v);
+}
+
+void encode_header(const MsgHeader *header, unsigned char *buf) {
+  put32(buf, header->type);
+  put32(buf + 4, header->seq);
+  put32(buf + 8, header->path_len);
+  put32(buf + 12, header->flags);
+  put64(buf + 16, header->body_len);
+}
+
+void decode_header(MsgHeader *header, const unsigned char *buf) {
+  header->type = get32(buf);
+  header->seq = get32(buf + 4);
+  header->path_len = get32(buf + 8);
+  header->flags = get32(buf + 12);
+  header->body_len = get64(buf + 16);
+}
+
+void encode_ack(const AckEntry *ack, unsigned char *buf) {
+  put32(buf, ack->seq);
+  put32(buf + 4, (uint32_t)ack->status);
+}
+
+void decode_ack(AckEntry *ack, const unsigned char *buf) {
+  ack->seq = get32(buf);
+  ack->status = (int32_t)get32(buf + 4);
+}
+
+void encode_frame(const FrameHeader *frame, unsigned char *buf) {
+  put32(buf, frame->raw_len);
+  put32(buf + 4, frame->data_len);
+}
+
+void decode_frame(FrameHeader *frame, const unsigned char *buf) {
+  frame->raw_len = get32(buf);
+  frame->data_len = get32(buf + 4);
+}
+
+void encode_pack_entry(const PackEntryHeader *entry, unsigned char *buf) {
+  memcpy(buf, entry->blob_id, BLOB_ID_SIZE);
+  put64(buf + BLOB_ID_SIZE, entry->size);
+  put32(buf + BLOB_ID_SIZE + 8, entry->path_len);
+}
+
+void decode_pack_entry(PackEntryHeader *entry, const unsigned char *buf) {
+  memcpy(entry->blob_id, buf, BLOB_ID_SIZE);
+  entry->size = get64(buf + BLOB_ID_SIZE);
+  entry->path_len = get32(buf + BLOB_ID_SIZE + 8);
+}
+
+void encode_tree_entry(const TreeEntryHeader *entry, unsigned char *buf) {
+  put32(buf, entry->type);
+  put32(buf + 4, entry->name_len);
+  memcpy(buf + 8, entry->digest, BLOB_ID_SIZE);
+}
+
+void decode_tree_entry(TreeEntryHeader *entry, const unsigned char *buf) {
+  entry->type = get32(buf);
+  entry->name_len = get32(buf + 4);
+  memcpy(entry->digest, buf + 8, BLOB_ID_SIZE);
+}
+
+void blob_id_to_hex(const unsigned char *id, char *hex) {
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < BLOB_ID_SIZE; i++) {
+    hex[i * 2] = digits[id[i] >> 4];
+    hex[i * 2 + 1] = digits[id[i] & 0xf];
+  }
+  hex[BLOB_HEX_SIZE] = '\0';
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+int blob_id_from_hex(const char *hex, unsigned char *id) {
+  if (!hex || strlen(hex) != BLOB_HEX_SIZE) {
+    return -1;
+  }
+  for (int i = 0; i < BLOB_ID_SIZE; i++) {
+    int hi = hex_value(hex[i * 2]);
+    int lo = hex_value(hex[i * 2 + 1]);
+    if (hi < 0 || lo < 0) {
+      return -1;
+    }
+    id[i] = (unsigned char)((hi << 4) | lo);
+  }
+  return 0;
+}
+
+int send_all(int sock, const void *buf, size_t len, int flags) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int recv_all(int sock, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = recv(sock, p, len, 0);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (n == 0) {
+      errno = ECONNRESET; // peer closed; perror shouldn't show a stale errno
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int send_header(int sock, const MsgHeader *header, const char *path, int flags) {
+  unsigned char buf[MSG_HEADER_SIZE];
+  encode_header(header, buf);
+  int more = header->path_len > 0 ? MSG_MORE : 0;
+  if (send_all(sock, buf, sizeof(buf), flags | more) == -1) {
+    return -1;
+  }
+  if (header->path_len > 0 && send_all(sock, path, header->path_len, flags) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+int recv_header(int sock, MsgHeader *header) {
+  unsigned char buf[MSG_HEADER_SIZE];
+  if (recv_all(sock, buf, sizeof(buf)) == -1) {
+    return -1;
+  }
+  decode_header(header, buf);
+  return 0;
+}
+
+ssize_t send_file_range(int sock, int fd, off_t *offset, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = sendfile(sock, fd, offset, len - sent);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (n == 0) {
+      break; // EOF, file got shorter since we sized it
+    }
+    sent += n;
+  }
+  return sent;
+}
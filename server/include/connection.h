@@ -0,0 +1,235 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include "compress.h"
+#include "group_commit.h"
+#include "hash.h"
+#include "manifest.h"
+#include "protocol.h"
+#include "worker_pool.h"
+
+#define BACKUP_DIR "backup"
+
+#define CONN_INBUF_SIZE (64 * 1024)
+#define MAX_BUFFERS 256     // chunk buffers shared by all connections
+#define CONN_MAX_BUFFERS 8  // chunk buffers one connection may have queued
+#define SEND_BURST (4u * 1024 * 1024) // blob bytes one connection sends before the loop moves on
+
+typedef enum {
+  CONN_HELLO, CONN_HEADER, CONN_PATH, CONN_PACK_INDEX, CONN_HAVE, CONN_BODY, CONN_FRAME_HEADER,
+  CONN_FRAME_DATA, CONN_DELTA_OP, CONN_LITERAL, CONN_DONE
+} ConnState;
+
+/* acks waiting to be sent back in one MSG_ACK */
+typedef struct {
+  uint32_t count;
+  unsigned char entries[MAX_ACK_BATCH * ACK_ENTRY_SIZE];
+} AckBatch;
+
+/* body bytes on their way to disk: plain contents, one frame, or one
+ * delta literal */
+typedef struct ChunkBuffer {
+  size_t len;
+  size_t raw_len; // decoded size; equal to len unless the data is compressed
+  struct ChunkBuffer *next; // free list
+  char data[STREAM_CHUNK_SIZE];
+} ChunkBuffer;
+
+// an assembly no part arrived for in this long is given up on
+#define ASSEMBLY_MAX_IDLE 600
+
+/* [start, end) of a blob */
+typedef struct {
+  uint64_t start;
+  uint64_t end;
+} ByteRange;
+
+/* blob arriving as MSG_PUT_PARTs, maybe over several connections. The
+ * parts are written straight to their offset in tmp_path; the one that
+ * makes it whole verifies and commits the blob. A part that fails only
+ * fails itself, the client may send it again. Everything but fd and
+ * tmp_path is only touched under Server.assembly_lock. */
+typedef struct Assembly {
+  uint32_t hash_algo;
+  unsigned char blob_id[BLOB_ID_SIZE];
+  uint64_t size;
+  char *tmp_path;
+  int fd;
+  ByteRange *ranges; // of parts that were closed, sorted and merged
+  size_t range_count;
+  size_t range_cap;
+  uint64_t received; // bytes those ranges cover
+  int users;         // parts being received
+  time_t idle_since; // when users last dropped to 0
+  struct Assembly *next;
+} Assembly;
+
+/* blob being received; only touched by the connection's disk jobs
+ * until its close job completes */
+typedef struct {
+  char *path;     // client path under BACKUP_DIR to link once stored
+  char *tmp_path; // where the body lands until it is verified
+  int fd;
+  int failed;
+  uint64_t size; // decoded; counted up as a delta is rebuilt
+  uint64_t written; // decoded bytes in tmp_path so far
+  uint64_t resume_from; // MSG_FLAG_RESUME: bytes a kept partial contributes
+  unsigned char blob_id[BLOB_ID_SIZE]; // what the client says it is
+  HashCtx *hash;                       // what it actually is (the connection's)
+  int framed;       // body arrives as frames
+  int store_frames; // ...and is stored that way, see BLOB_FRAMES_MAGIC
+  Decompressor *dec;      // the connection's
+  unsigned char *scratch; // STREAM_CHUNK_SIZE bytes, the connection's
+  int delta;        // rebuilt from a MSG_PUT_DELTA, see delta.h
+  unsigned char basis_id[BLOB_ID_SIZE];
+  uint32_t block_size;
+  int basis_fd;
+  unsigned char *copy_buf; // STREAM_CHUNK_SIZE bytes, copies from the basis
+  int part;              // a MSG_PUT_PART; size is that of the part
+  uint64_t part_offset;  // where it goes in the blob
+  uint64_t blob_size;    // the whole blob's
+  Assembly *assembly;    // from the open job on; the close job keeps it only if it completed the blob
+} FileTarget;
+
+/* one file of a pack */
+typedef struct {
+  char *path;      // client path under BACKUP_DIR
+  char *tmp_path;  // NULL if the pack has one file for all of them
+  uint64_t offset; // of its contents in that file
+  uint64_t size;
+  int failed;
+  unsigned char blob_id[BLOB_ID_SIZE];
+} PackFile;
+
+/* MSG_PUT_PACK being received. Its files are written one after the
+ * other as the contents go by; like a FileTarget, only touched by the
+ * connection's disk jobs until its close job completes. Packed blobs are
+ * always stored raw. */
+typedef struct {
+  uint32_t count;
+  PackFile *files;      // NULL until the whole index is in
+  unsigned char *index; // while it arrives
+  uint32_t index_len;
+  uint32_t index_got;
+  uint32_t current; // file the next contents belong to
+  uint64_t written; // bytes of it so far
+  int fd;
+  // with a segment store, where the files are headed anyway, the pack is
+  // written to this one temp file rather than one per file
+  char *tmp_path;
+  uint32_t failed;
+  unsigned char *held_ids; // ids of the files that made it, for the group commit
+} PackTarget;
+
+/* a blob on its way to a restoring client: the MSG_BLOB header, then
+ * left bytes of fd from offset on, sent with sendfile */
+typedef struct Outgoing {
+  unsigned char header[MSG_HEADER_SIZE];
+  size_t header_sent;
+  int fd;
+  uint64_t offset;
+  uint64_t left;
+  int active; // all output queued before it is out
+  struct Outgoing *next;
+} Outgoing;
+
+typedef struct Server Server;
+
+typedef struct Connection {
+  int sock;
+  char peer[64];
+  Server *server;
+  ConnState state;
+  Strand strand; // disk jobs for this connection run in order
+
+  // blob id algorithm from the hello. Files arrive one at a time on the
+  // strand, so a single context serves all of them.
+  uint32_t hash_algo;
+  HashCtx hash;
+
+  // codec from the hello, COMPRESS_NONE if frames can't be compressed.
+  // Like hash, only used by the strand's disk jobs.
+  uint32_t codec;
+  Decompressor dec;
+  unsigned char *scratch;
+
+  unsigned char inbuf[CONN_INBUF_SIZE];
+  size_t in_off;
+  size_t in_len;
+  MsgHeader header;
+
+  FileTarget *file; // file whose body is being received
+  PackTarget *pack; // or pack
+  unsigned char *have; // MSG_HAVE body while it arrives
+  uint32_t have_got;
+  uint64_t body_left;  // decoded bytes still to come; wire bytes for deltas
+  uint32_t frame_raw;  // current frame's (or literal's) decoded size
+  uint32_t frame_left; // its bytes still to come
+  ChunkBuffer *chunk; // partially filled buffer for the current file
+  int buffers_held;
+
+  AckBatch acks;
+  unsigned char *outbuf;
+  size_t out_off;
+  size_t out_len;
+  size_t out_cap;
+  // blobs to send, in the order they were found; acks queued meanwhile
+  // wait for the one being sent
+  Outgoing *send_head;
+  Outgoing *send_tail;
+
+  int jobs_outstanding;
+  int closed;        // socket gone, waiting on disk jobs before freeing
+  int read_paused;   // out of chunk buffers
+  int waiting;       // on server->waiting list
+  int dirty;         // on server->dirty list
+  uint32_t events;   // currently registered epoll events
+  struct Connection *next_waiting;
+  struct Connection *next_dirty;
+  struct Connection *next_closed;
+} Connection;
+
+struct Server {
+  int epoll_fd;
+  WorkerPool pool;
+  int buffers_in_use;
+  ChunkBuffer *free_buffers;
+  Connection *waiting_head;
+  Connection *waiting_tail;
+  Connection *dirty_head;
+  Connection *closed_head; // freed by server_reap once their jobs finish
+  size_t connections;
+  int store_frames; // keep compressed uploads compressed
+  GroupCommit commit;
+  Manifest manifest;
+  pthread_mutex_t assembly_lock;
+  Assembly *assemblies;
+
+  // reported whenever the last client leaves
+  uint64_t bytes_stored; // decoded bytes written to blobs, atomic
+  uint64_t bytes_sent;   // blob bytes sent to restores
+  uint64_t busy_since_ns;
+  uint64_t busy_bytes;
+  uint64_t busy_sent;
+  GroupCommitStats busy_stats;
+};
+
+Connection *conn_create(Server *server, int sock, const struct sockaddr_in *addr);
+
+/* event loop callbacks */
+void conn_on_readable(Connection *conn);
+void conn_on_writable(Connection *conn);
+void conn_on_hangup(Connection *conn);
+void server_handle_completions(Server *server);
+void server_flush_dirty(Server *server);
+void server_reap(Server *server);
+
+/* phase histograms and server gauges in the Prometheus text format */
+void server_write_metrics(Server *server, FILE *out);
+
+#endif // CONNECTION_H
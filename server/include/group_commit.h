@@ -0,0 +1,82 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "worker_pool.h"
+
+/*
+ * Group commit for everything that gets acked to a client.
+ *
+ * Disk jobs write blobs to temp files and pass themselves on here. A
+ * single thread takes whatever has queued up as one batch and:
+ *
+ *   1. syncs the filesystem, so every temp file's data is on disk,
+ *   2. runs each job again, in submission order, to rename blobs into
+ *      the store and link paths under backup/ to them,
+ *   3. syncs again, so those names are on disk too,
+ *   4. hands the jobs back to the event loop, which acks them.
+ *
+ * A crash can therefore lose unacked uploads, but never leaves a torn
+ * blob or path behind, and the cost is two syncs per batch rather than
+ * one per file. Batches grow by themselves while a sync is running.
+ *
+ * Blobs waiting in the queue are held: a reference to one is queued
+ * behind it instead of being told the blob is unknown.
+ */
+
+#define HOLD_BUCKETS 1024
+
+typedef struct HeldBlob {
+  unsigned char id[BLOB_ID_SIZE];
+  int count;
+  struct HeldBlob *next;
+} HeldBlob;
+
+typedef struct CommitEntry {
+  Job *job;
+  const unsigned char *ids; // the job's, BLOB_ID_SIZE bytes each
+  uint32_t held;            // how many of them are in the hold table
+  struct CommitEntry *next;
+} CommitEntry;
+
+typedef struct {
+  uint64_t batches;
+  uint64_t entries;
+  uint64_t syncs;
+  uint64_t sync_ns;     // total time spent in syncfs
+  uint64_t sync_max_ns;
+} GroupCommitStats;
+
+typedef struct {
+  WorkerPool *pool;
+  int sync;    // 0: order and batch, but skip the syncs
+  int sync_fd; // any fd on the store's filesystem
+  pthread_t thread;
+  int started;
+  pthread_mutex_t lock;
+  pthread_cond_t ready_cond;
+  CommitEntry *head;
+  CommitEntry *tail;
+  HeldBlob *held[HOLD_BUCKETS];
+  GroupCommitStats stats;
+  int stopping;
+} GroupCommit;
+
+/* dir is any directory on the store's filesystem. Returns -1 on failure. */
+int group_commit_init(GroupCommit *gc, WorkerPool *pool, const char *dir, int sync);
+
+/* queues a job for the next batch, where its run function is called
+ * again. hold_ids are count blob ids, back to back, that the job commits;
+ * they must stay valid until the job completes. */
+void group_commit_submit(GroupCommit *gc, Job *job, const unsigned char *hold_ids, uint32_t count);
+
+/* queues the job only if blob id is held. Returns 1 if it was queued. */
+int group_commit_submit_if_held(GroupCommit *gc, Job *job, const unsigned char *id);
+
+void group_commit_get_stats(GroupCommit *gc, GroupCommitStats *out);
+
+void group_commit_shutdown(GroupCommit *gc);
+
+#endif // GROUP_COMMIT_H
@@ -0,0 +1,102 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+
+/*
+ * Index of what BACKUP_DIR holds: for every path linked so far, the blob
+ * it points at and the size and mtime of what got stored there. It lets
+ * a client without a saved tree ask which of its files the server
+ * already has (MSG_HAVE) instead of sending a reference for each.
+ *
+ * On disk it is an append-only log,
+ *
+ *   ManifestHeader | (ManifestRecord, path_len bytes of path)*
+ *
+ * written by the commit thread as paths are linked, so the group
+ * commit's second sync makes records durable along with the links they
+ * describe. Later records for a path replace earlier ones. At startup
+ * the log is read into a hash table (torn tails are cut off) and
+ * rewritten without the replaced records once they are the majority.
+ * A store from before the manifest starts out with an empty one; its
+ * paths are indexed as clients link them again. Integers are in host
+ * byte order.
+ *
+ * The paths are also filed by directory, and each directory keeps its
+ * Merkle digest (see MSG_GET_TREE) until a path below it changes, so a
+ * listing only rehashes the directories changed since the last one.
+ */
+#define MANIFEST_FILE "manifest.log"
+#define MANIFEST_MAGIC 0x4d564e43u /* "CNVM" */
+#define MANIFEST_VERSION 1
+#define MANIFEST_COMPACT_MIN 4096 // records below which the log is left as is
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} ManifestHeader;
+
+typedef struct {
+  uint32_t path_len;
+  uint32_t hash_algo;
+  unsigned char blob_id[BLOB_ID_SIZE];
+  uint64_t size;
+  int64_t mtime;
+} ManifestRecord;
+
+typedef struct ManifestEntry {
+  ManifestRecord rec;
+  struct ManifestEntry *next;
+  struct ManifestEntry *dir_next; // in its directory
+  char path[]; // rec.path_len bytes plus a NUL
+} ManifestEntry;
+
+typedef struct ManifestDir {
+  struct ManifestDir *parent; // NULL for the top one
+  struct ManifestDir *dirs;   // subdirectories, linked through sibling
+  struct ManifestDir *sibling;
+  ManifestEntry *files;       // linked through dir_next
+  struct ManifestDir *next;   // in the directory table
+  uint32_t digest_algo;       // 0 while stale
+  int has_digest;             // false if nothing below is hashed with digest_algo
+  unsigned char digest[BLOB_ID_SIZE];
+  uint32_t path_len;
+  char path[];
+} ManifestDir;
+
+typedef struct {
+  pthread_mutex_t lock;
+  ManifestEntry **buckets;
+  size_t capacity; // power of two
+  size_t count;
+  ManifestDir **dir_buckets;
+  size_t dir_capacity; // power of two
+  size_t dir_count;
+  uint64_t records; // in the log, replaced ones included
+  int fd;           // -1 once appending failed
+} Manifest;
+
+/* loads the log at path, creating it if missing. Returns -1 on failure. */
+int manifest_open(Manifest *m, const char *path);
+
+/* records that path was just linked to blob id; size and mtime are read
+ * from path, or for a blob kept in a segment, which path doesn't exist
+ * for, are its length and now. Called from the commit thread. */
+void manifest_record(Manifest *m, const char *path, uint32_t hash_algo, const unsigned char *id);
+
+/* true if path is known to point at blob id */
+int manifest_has(Manifest *m, const char *path, uint32_t hash_algo, const unsigned char *id);
+
+/* the MSG_TREE body for directory path with digests in hash_algo, in a
+ * new buffer. Returns -1 on failure. */
+int manifest_tree(Manifest *m, const char *path, uint32_t hash_algo, unsigned char **body, size_t *len);
+
+/* calls fn for every path, holding the lock; fn must not call back in */
+void manifest_each(Manifest *m, void (*fn)(void *ctx, const ManifestRecord *rec), void *ctx);
+
+void manifest_close(Manifest *m);
+
+#endif // MANIFEST_H
@@ -0,0 +1,136 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "manifest.h"
+#include "protocol.h"
+
+/*
+ * Log-structured home for small blobs (--segments). Instead of a file per
+ * blob and a hard link per path, blobs under SEGMENT_MAX_BLOB are appended
+ * to large segment files, and the paths that point at them live only in
+ * the manifest. Ingesting many small files then turns into sequential
+ * appends rather than inode and directory updates.
+ *
+ * SEGMENT_DIR/<8 hex digits>.seg holds records back to back,
+ *
+ *   SegmentRecord | length bytes of plain contents
+ *
+ * and is appended to until it passes SEGMENT_TARGET_SIZE. It is then
+ * synced and sealed: its index, an array of SegmentIndexRecord after a
+ * SegmentIndexHeader, is written next to it as <same>.idx. At startup the
+ * indexes are read into one hash table of blob id to (segment, offset,
+ * length); a segment without one was still being appended to, so its
+ * records are read back and checked against their ids instead, and it is
+ * cut off at the first one that doesn't hold up.
+ *
+ * Blobs no path in the manifest points at anymore are dead. A background
+ * thread looks for sealed segments that are mostly dead, copies what is
+ * still live to the segment being appended to and deletes them. Integers
+ * are in host byte order.
+ */
+#define SEGMENT_DIR "blobs/segments"
+#define SEGMENT_TARGET_SIZE (256u * 1024 * 1024)
+#define SEGMENT_MAX_BLOB (256 * 1024) // bigger blobs are stored as files of their own
+#define SEGMENT_RECORD_MAGIC 0x47455343u /* "CSEG" */
+#define SEGMENT_INDEX_MAGIC 0x58444943u /* "CIDX" */
+#define SEGMENT_COMPACT_INTERVAL 60 // seconds between looks for dead data
+#define SEGMENT_COMPACT_MIN_AGE 600 // seconds a segment stays sealed before it is compacted
+#define SEGMENT_COMPACT_LIVE 50 // percent live below which a segment is rewritten
+
+typedef struct {
+  uint32_t magic;
+  uint32_t hash_algo;
+  uint32_t length;
+  uint32_t reserved;
+  unsigned char blob_id[BLOB_ID_SIZE];
+} SegmentRecord;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t count;
+} SegmentIndexHeader;
+
+typedef struct {
+  uint32_t hash_algo;
+  uint32_t offset; // of the contents
+  uint32_t length;
+  uint32_t reserved;
+  unsigned char blob_id[BLOB_ID_SIZE];
+} SegmentIndexRecord;
+
+#define SEGMENT_LIVE 1   // a path in the manifest pointed at it when compaction looked
+#define SEGMENT_LINKED 2 // a path was pointed at it since
+
+/* where a blob is; segment 0 marks a free slot */
+typedef struct {
+  unsigned char blob_id[BLOB_ID_SIZE];
+  uint32_t segment;
+  uint32_t offset; // of the contents
+  uint32_t length;
+  uint16_t hash_algo;
+  uint16_t flags; // SEGMENT_LIVE, SEGMENT_LINKED
+} SegmentEntry;
+
+typedef struct {
+  uint32_t id;
+  uint64_t size;
+  int64_t sealed_at; // 0 while it is appended to
+} SegmentInfo;
+
+typedef struct {
+  pthread_mutex_t lock;
+  SegmentEntry *entries; // open addressing, power of two capacity
+  size_t capacity;
+  size_t count;
+  SegmentInfo *segments; // ascending id, the last one may be open
+  size_t segment_count;
+  size_t segment_cap;
+  int active_fd; // of the last segment if it is open, else -1
+  int writes;    // new small blobs go here
+
+  // links to segment blobs (store_link up to manifest_record) hold this
+  // for reading; compaction holds it while it marks what is live, so no
+  // link can slip between the manifest and the marks
+  pthread_rwlock_t linking;
+  pthread_t compactor;
+  int compactor_started;
+  int stopping;
+  pthread_cond_t wake;
+  Manifest *manifest;
+  uint64_t compacted_records; // manifest records when compaction last looked
+  size_t compacted_old;       // and the sealed segments old enough for it
+  uint64_t reclaimed;         // bytes of dead data dropped so far
+} SegmentStore;
+
+/* loads the segments in SEGMENT_DIR. With writes set, new small blobs
+ * are appended to them; otherwise existing ones are only read. Returns
+ * -1 on failure. */
+int segment_store_open(SegmentStore *s, int writes);
+
+/* appends length bytes of fd from offset on as blob id, unless it is
+ * stored already. Returns -1 on failure. */
+int segment_store_put(SegmentStore *s, uint32_t algo, const unsigned char *id, int fd, uint64_t offset,
+		      uint64_t length);
+
+/* true if the blob is in a segment; with link set it is also kept alive
+ * through the compaction running right now. Links call it holding
+ * linking. */
+int segment_store_has(SegmentStore *s, uint32_t algo, const unsigned char *id, int link);
+
+/* length of a blob kept in a segment. Returns -1 if it isn't. */
+int segment_store_length(SegmentStore *s, uint32_t algo, const unsigned char *id, uint64_t *length);
+
+/* opens the segment holding the blob, for reading length bytes from
+ * offset on. Returns -1 if it isn't stored here. */
+int segment_store_open_blob(SegmentStore *s, uint32_t algo, const unsigned char *id, uint64_t *offset,
+			    uint64_t *length);
+
+/* starts the background compaction, which takes what is live from m */
+int segment_store_start_compactor(SegmentStore *s, Manifest *m);
+
+void segment_store_close(SegmentStore *s);
+
+#endif // SEGMENT_H
@@ -0,0 +1,125 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "manifest.h"
+#include "protocol.h"
+
+/*
+ * Content addressed blob store. Every distinct file body is kept once as
+ * BLOB_DIR/<hash name>/<first two hex digits>/<rest of the hex id>, and
+ * client paths under BACKUP_DIR are hard links to those blobs, so copies
+ * and renames take no extra space. Each hash algorithm gets its own
+ * namespace since ids from different algorithms are unrelated.
+ *
+ * With --store-compressed, blobs uploaded as frames are kept that way
+ * under the blob path plus BLOB_FRAMES_SUFFIX: a header of magic, codec
+ * and decoded size (16 bytes, big-endian), then the frames exactly as
+ * they came off the wire. The id is always the hash of the decoded
+ * contents. Paths pointing at such a blob exist only in the manifest,
+ * like those of segment records: a link would show the frames instead of
+ * the file.
+ *
+ * An upload cut off after at least PARTIAL_MIN_SIZE bytes is kept in
+ * BLOB_PARTIAL_DIR as <hash name>-<hex id>, so the client can resume it
+ * (see MSG_RESUME). Partials are plain contents, never frames, and are
+ * dropped at startup once they are PARTIAL_MAX_AGE old.
+ *
+ * With --segments, plain blobs under SEGMENT_MAX_BLOB go into the
+ * segment store instead (see segment.h), and paths pointing at them
+ * exist only in the manifest. Segments found at startup are read either
+ * way; the flag only decides where new small blobs go.
+ */
+
+#define BLOB_DIR "blobs"
+#define BLOB_TMP_DIR BLOB_DIR "/tmp"
+#define BLOB_PARTIAL_DIR BLOB_DIR "/partial"
+#define BLOB_FRAMES_SUFFIX ".z"
+#define BLOB_PATH_SIZE (sizeof(BLOB_DIR) + 8 + BLOB_HEX_SIZE + 3 + sizeof(BLOB_FRAMES_SUFFIX))
+
+#define BLOB_PARTIAL_PATH_SIZE (sizeof(BLOB_PARTIAL_DIR) + 16 + BLOB_HEX_SIZE)
+#define PARTIAL_MIN_SIZE (1024 * 1024)
+#define PARTIAL_MAX_AGE (7 * 24 * 3600)
+
+#define BLOB_FRAMES_MAGIC 0x4356465au /* "CVFZ" */
+#define BLOB_FRAMES_HEADER_SIZE 16
+
+/* creates the fan-out directories for every known algorithm, moves a
+ * store from before the namespaces into BLOB_DIR/sha256 and clears out
+ * temp files a crash left behind, and stale partials. Loads the segment
+ * store if there is one or segments is set. Returns -1 on failure. */
+int store_init(int segments);
+
+/* true if new small blobs go into segments */
+int store_segmented(void);
+
+/* starts compacting segments against the paths in m */
+int store_start_compactor(Manifest *m);
+
+void store_close(void);
+
+void store_blob_path(uint32_t algo, const unsigned char *id, char *out);
+
+/* true if the blob is stored in any form */
+int store_has_blob(uint32_t algo, const unsigned char *id);
+
+/* opens the plain form of a blob for reading, as the basis of a delta.
+ * Returns -1 if it is missing, only stored as frames or in a segment. */
+int store_open_blob(uint32_t algo, const unsigned char *id);
+
+/* a stored blob as it is read back: length bytes of fd from offset on.
+ * Those are frames of codec decoding to size bytes if the blob is kept
+ * compressed, the plain contents (size == length) otherwise. */
+typedef struct {
+  int fd;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t size;
+  uint32_t codec; // COMPRESS_NONE unless framed
+} StoredBlob;
+
+/* finds a blob wherever it is stored and opens it for reading. Returns
+ * -1 if it is missing. */
+int store_open_read(uint32_t algo, const unsigned char *id, StoredBlob *blob);
+
+/* fresh, unique name for a blob being received */
+char *store_temp_path(void);
+
+/* moves a fully received and verified blob into place; framed says it is
+ * in the BLOB_FRAMES_MAGIC format */
+int store_commit_blob(const char *tmp_path, uint32_t algo, const unsigned char *id, int framed);
+
+/* stores length bytes of fd from offset on, fully received and verified,
+ * as blob id; fd is left as it is */
+int store_commit_range(int fd, uint64_t offset, uint64_t length, uint32_t algo, const unsigned char *id);
+
+/* decoded size of a blob, however it is kept. Returns -1 if it is
+ * missing. */
+int store_blob_size(uint32_t algo, const unsigned char *id, uint64_t *size);
+
+/* bytes kept of an upload of blob id that was cut off, 0 if none */
+uint64_t store_partial_size(uint32_t algo, const unsigned char *id);
+
+/* keeps tmp_path, the beginning of blob id, for a later upload to resume */
+int store_keep_partial(const char *tmp_path, uint32_t algo, const unsigned char *id);
+
+/* moves the partial of blob id to tmp_path, for one upload to continue.
+ * Returns -1 if there is none (anymore). */
+int store_claim_partial(uint32_t algo, const unsigned char *id, const char *tmp_path);
+
+/* creates whatever directories above path are missing */
+int store_make_parents(const char *path);
+
+/* atomically points path at the blob, creating missing directories on
+ * the way (a client's connections may overtake each other). For a blob
+ * in a segment or in frame format, whatever path held is removed and the
+ * manifest record is the link. Returns -1 on failure. */
+int store_link(uint32_t algo, const unsigned char *id, const char *path);
+
+/* bracket store_link and recording the link in the manifest, so segment
+ * compaction never sees one without the other */
+void store_begin_links(void);
+void store_end_links(void);
+
+#endif // STORE_H
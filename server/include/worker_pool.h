@@ -0,0 +1,55 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+/*
+ * Fixed size thread pool for blocking disk work.
+ *
+ * Jobs are submitted to a strand. Jobs on the same strand run one at a
+ * time in submission order, different strands run in parallel. Finished
+ * jobs are handed back to the event loop through pool_take_completed,
+ * and event_fd becomes readable whenever there is something to take.
+ *
+ * A job can also pass itself on to another thread (see group_commit.h),
+ * which then finishes it with pool_complete.
+ */
+
+typedef struct Job {
+  // returns 0 if the job was passed on rather than finished
+  int (*run)(struct Job *job);
+  struct Job *next;
+} Job;
+
+typedef struct Strand {
+  Job *head;
+  Job *tail;
+  int scheduled; // queued on the pool or being run by a worker
+  struct Strand *next;
+} Strand;
+
+typedef struct {
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t ready_cond;
+  Strand *ready_head;
+  Strand *ready_tail;
+  Job *done_head;
+  Job *done_tail;
+  int event_fd;
+  int stopping;
+} WorkerPool;
+
+int pool_init(WorkerPool *pool, int nthreads);
+void pool_submit(WorkerPool *pool, Strand *strand, Job *job);
+
+/* hands a job that was passed on back to the event loop; any thread */
+void pool_complete(WorkerPool *pool, Job *job);
+
+/* returns every finished job as a list linked through next */
+Job *pool_take_completed(WorkerPool *pool);
+
+void pool_shutdown(WorkerPool *pool);
+
+#endif // WORKER_POOL_H
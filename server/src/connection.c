@@ -0,0 +1,2020 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "connection.h"
+#include "delta.h"
+#include "log.h"
+#include "metrics.h"
+#include "store.h"
+
+/*
+ * Per-connection state machine. Everything in here runs on the event loop
+ * thread except run_disk_job, which runs on the worker pool (and, for
+ * jobs that end in an ack, again on the commit thread) and only touches
+ * the job, its FileTarget or PackTarget and the connection's hash context.
+ */
+
+typedef enum {
+  JOB_MKDIR, JOB_LINK, JOB_OPEN, JOB_WRITE, JOB_COPY, JOB_CLOSE, JOB_SIGNATURE,
+  JOB_PACK_WRITE, JOB_PACK_CLOSE, JOB_HAVE, JOB_READ, JOB_TREE
+} DiskJobKind;
+
+typedef struct {
+  Job base;
+  DiskJobKind kind;
+  Connection *conn;
+  FileTarget *file;
+  PackTarget *pack; // JOB_PACK_*
+  ChunkBuffer *chunk;
+  char *path;  // JOB_MKDIR, JOB_LINK, JOB_READ, JOB_TREE
+  uint32_t hash_algo;
+  unsigned char blob_id[BLOB_ID_SIZE]; // JOB_LINK, JOB_SIGNATURE, JOB_READ
+  StoredBlob blob; // JOB_READ: where to send it from
+  uint64_t offset; // JOB_COPY: byte range of the basis; JOB_LINK: partial to resume
+  uint64_t length;
+  unsigned char *payload; // JOB_SIGNATURE: the reply body; JOB_HAVE: the request's, then the reply's
+  size_t payload_len;
+  uint32_t seq;
+  int aborted; // JOB_CLOSE, JOB_PACK_CLOSE: client went away mid-body
+  int committing; // passed on to the commit thread, see group_commit.h
+  int32_t status;
+} DiskJob;
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return be32toh(v);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* true if a path from the client stays inside BACKUP_DIR: no NUL bytes
+ * and no empty, "." or ".." components, except the "." every path of the
+ * client's tree starts with */
+static int wire_path_ok(const unsigned char *path, size_t len) {
+  if (memchr(path, '\0', len)) {
+    return 0;
+  }
+  size_t start = 0;
+  while (start <= len) {
+    const unsigned char *slash = memchr(path + start, '/', len - start);
+    size_t end = slash ? (size_t)(slash - path) : len;
+    size_t n = end - start;
+    if (n == 0 || (n == 2 && path[start] == '.' && path[start + 1] == '.') ||
+	(n == 1 && path[start] == '.' && start > 0)) {
+      return 0;
+    }
+    start = end + 1;
+  }
+  return 1;
+}
+
+static int pwrite_all(int fd, const char *p, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, (off_t)offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+    offset += (uint64_t)n;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* removes the single temp file of a pack, once its blobs are stored or
+ * none of them made it */
+static void pack_drop_file(PackTarget *pack) {
+  if (!pack->tmp_path) {
+    return;
+  }
+  if (pack->fd != -1) {
+    close(pack->fd);
+    pack->fd = -1;
+  }
+  unlink(pack->tmp_path);
+}
+
+/* second half of a job, on the commit thread between two syncs: put
+ * its names in place */
+static void commit_disk_job(DiskJob *dj) {
+  FileTarget *file = dj->file;
+  Manifest *manifest = &dj->conn->server->manifest;
+  store_begin_links();
+  switch (dj->kind) {
+  case JOB_LINK:
+    // segment compaction may have dropped it since it was looked up
+    dj->status = store_link(dj->hash_algo, dj->blob_id, dj->path) == 0 ? ACK_OK
+	    : store_has_blob(dj->hash_algo, dj->blob_id) ? ACK_FAILED : ACK_NEED_DATA;
+    if (dj->status == ACK_OK) {
+      manifest_record(manifest, dj->path, dj->hash_algo, dj->blob_id);
+    }
+    break;
+  case JOB_CLOSE:
+    if (file->part) {
+      // the client links paths to it once the last part is acked
+      if (file->assembly && store_commit_blob(file->assembly->tmp_path, dj->hash_algo, file->blob_id, 0) == -1) {
+	file->failed = 1;
+	unlink(file->assembly->tmp_path);
+      }
+      dj->status = file->failed ? ACK_FAILED : ACK_OK;
+      if (file->assembly && !file->failed) {
+	log_debug("Blob of '%s' assembled from parts (%llu bytes).", file->path,
+		  (unsigned long long)file->blob_size);
+      }
+      break;
+    }
+    if (store_commit_blob(file->tmp_path, dj->hash_algo, file->blob_id, file->store_frames) == -1 ||
+	store_link(dj->hash_algo, file->blob_id, file->path) == -1) {
+      file->failed = 1;
+      unlink(file->tmp_path);
+    }
+    dj->status = file->failed ? (file->delta ? ACK_NEED_DATA : ACK_FAILED) : ACK_OK;
+    if (!file->failed) {
+      manifest_record(manifest, file->path, dj->hash_algo, file->blob_id);
+      log_debug("File %s to '%s' (%llu bytes).", file->delta ? "rebuilt from delta" : "saved successfully",
+		file->path, (unsigned long long)file->size);
+    }
+    break;
+  case JOB_PACK_CLOSE: {
+    PackTarget *pack = dj->pack;
+    for (uint32_t i = 0; i < pack->count; i++) {
+      PackFile *f = &pack->files[i];
+      if (f->failed) {
+	continue;
+      }
+      int stored = pack->tmp_path ? store_commit_range(pack->fd, f->offset, f->size, dj->hash_algo, f->blob_id)
+	      : store_commit_blob(f->tmp_path, dj->hash_algo, f->blob_id, 0);
+      if (stored == -1 || store_link(dj->hash_algo, f->blob_id, f->path) == -1) {
+	f->failed = 1;
+	pack->failed++;
+	if (f->tmp_path) {
+	  unlink(f->tmp_path);
+	}
+	continue;
+      }
+      manifest_record(manifest, f->path, dj->hash_algo, f->blob_id);
+      log_debug("File saved successfully to '%s' (%llu bytes, packed).", f->path,
+		(unsigned long long)f->size);
+    }
+    pack_drop_file(pack);
+    dj->status = pack->failed ? ACK_NEED_DATA : ACK_OK;
+    break;
+  }
+  default:
+    // JOB_MKDIR: done already, the ack only had to wait for the sync
+    break;
+  }
+  store_end_links();
+}
+
+/* closes the pack's current file and checks it against its blob id */
+static void pack_finish_file(Connection *conn, PackTarget *pack) {
+  PackFile *f = &pack->files[pack->current];
+  if (!pack->tmp_path) {
+    if (pack->fd != -1 && close(pack->fd) == -1) {
+      perror("Error closing blob");
+      f->failed = 1;
+    }
+    pack->fd = -1;
+  }
+  if (!f->failed) {
+    unsigned char digest[HASH_DIGEST_SIZE];
+    if (hash_finish(&conn->hash, digest) == -1 || memcmp(digest, f->blob_id, BLOB_ID_SIZE) != 0) {
+      fprintf(stderr, "Contents of '%s' do not match their blob id\n", f->path);
+      f->failed = 1;
+    }
+  }
+  if (f->failed) {
+    if (f->tmp_path) {
+      unlink(f->tmp_path);
+    }
+    pack->failed++;
+  }
+  pack->current++;
+  pack->written = 0;
+}
+
+/* hands decoded pack contents to the files they belong to, opening each
+ * where the previous one ends. Files of size 0 are dealt with as soon as
+ * the one before them is done. data NULL stands for len bytes that were
+ * lost, which fails the files they belong to. */
+static void pack_write(Connection *conn, PackTarget *pack, const char *data, size_t len) {
+  while (pack->current < pack->count) {
+    PackFile *f = &pack->files[pack->current];
+    if (pack->written == 0 && !f->failed) {
+      if (pack->fd == -1 &&
+	  (pack->fd = open(pack->tmp_path ? pack->tmp_path : f->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			   0666)) == -1) {
+	perror("Error opening blob for writing");
+	f->failed = 1;
+      } else if (hash_begin(&conn->hash) == -1) {
+	fprintf(stderr, "Error initializing blob digest\n");
+	f->failed = 1;
+      }
+    }
+    size_t n = f->size - pack->written < len ? (size_t)(f->size - pack->written) : len;
+    if (n > 0 && !data) {
+      f->failed = 1;
+    } else if (n > 0 && !f->failed) {
+      if (hash_update(&conn->hash, data, n) == -1 ||
+	  pwrite_all(pack->fd, data, n, f->offset + pack->written) == -1) {
+	perror("Error writing to blob");
+	f->failed = 1;
+      } else {
+	__atomic_fetch_add(&conn->server->bytes_stored, n, __ATOMIC_RELAXED);
+      }
+    }
+    if (data) {
+      data += n;
+    }
+    len -= n;
+    pack->written += n;
+    if (pack->written < f->size) {
+      break; // continues in the next chunk
+    }
+    pack_finish_file(conn, pack);
+  }
+}
+
+/* continues a kept partial upload: claims it, cuts it back to where the
+ * client resumes and runs what it holds through the digest */
+static int open_partial(uint32_t hash_algo, FileTarget *file) {
+  if (store_claim_partial(hash_algo, file->blob_id, file->tmp_path) == -1) {
+    return -1; // gone, or another upload got it first
+  }
+  file->fd = open(file->tmp_path, O_RDWR | O_CLOEXEC);
+  struct stat st;
+  if (file->fd == -1 || fstat(file->fd, &st) == -1 || (uint64_t)st.st_size < file->resume_from ||
+      ftruncate(file->fd, (off_t)file->resume_from) == -1 || hash_begin(file->hash) == -1) {
+    return -1;
+  }
+  unsigned char *buf = malloc(STREAM_CHUNK_SIZE);
+  uint64_t off = 0;
+  while (buf && off < file->resume_from) {
+    size_t want = file->resume_from - off < STREAM_CHUNK_SIZE ? (size_t)(file->resume_from - off) : STREAM_CHUNK_SIZE;
+    ssize_t n = pread(file->fd, buf, want, (off_t)off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0 || hash_update(file->hash, buf, (size_t)n) == -1) {
+      break;
+    }
+    off += (uint64_t)n;
+  }
+  free(buf);
+  if (off < file->resume_from || lseek(file->fd, 0, SEEK_END) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+static void free_assembly(Assembly *a) {
+  if (a->fd != -1) {
+    close(a->fd);
+  }
+  free(a->ranges);
+  free(a->tmp_path);
+  free(a);
+}
+
+/* notes that [start, end) arrived; a part sent twice counts once.
+ * Returns -1 if out of memory. */
+static int add_range(Assembly *a, uint64_t start, uint64_t end) {
+  if (a->range_count == a->range_cap) {
+    size_t cap = a->range_cap ? a->range_cap * 2 : 8;
+    ByteRange *ranges = realloc(a->ranges, cap * sizeof(ByteRange));
+    if (!ranges) {
+      return -1;
+    }
+    a->ranges = ranges;
+    a->range_cap = cap;
+  }
+  size_t i = 0;
+  while (i < a->range_count && a->ranges[i].start < start) {
+    i++;
+  }
+  memmove(&a->ranges[i + 1], &a->ranges[i], (a->range_count - i) * sizeof(ByteRange));
+  a->ranges[i] = (ByteRange){ start, end };
+  a->range_count++;
+
+  // merge whatever overlaps or touches, and count again
+  size_t n = 0;
+  a->received = 0;
+  for (size_t j = 0; j < a->range_count; j++) {
+    if (n > 0 && a->ranges[j].start <= a->ranges[n - 1].end) {
+      if (a->ranges[j].end > a->ranges[n - 1].end) {
+	a->received += a->ranges[j].end - a->ranges[n - 1].end;
+	a->ranges[n - 1].end = a->ranges[j].end;
+      }
+    } else {
+      a->ranges[n++] = a->ranges[j];
+      a->received += a->ranges[j].end - a->ranges[j].start;
+    }
+  }
+  a->range_count = n;
+  return 0;
+}
+
+/* finds the assembly the part belongs to, or starts it: a temp file of
+ * the blob's full size the parts are written into */
+static int open_part(Server *server, uint32_t hash_algo, FileTarget *file) {
+  pthread_mutex_lock(&server->assembly_lock);
+  Assembly *a = server->assemblies;
+  while (a && (a->hash_algo != hash_algo || memcmp(a->blob_id, file->blob_id, BLOB_ID_SIZE) != 0)) {
+    a = a->next;
+  }
+  if (!a) {
+    a = calloc(1, sizeof(Assembly));
+    if (a) {
+      a->hash_algo = hash_algo;
+      memcpy(a->blob_id, file->blob_id, BLOB_ID_SIZE);
+      a->size = file->blob_size;
+      a->fd = -1;
+      a->tmp_path = store_temp_path();
+    }
+    if (a && a->tmp_path) {
+      a->fd = open(a->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (!a || a->fd == -1 || ftruncate(a->fd, (off_t)a->size) == -1) {
+      perror("Error starting blob assembly");
+      if (a) {
+	if (a->fd != -1) {
+	  unlink(a->tmp_path);
+	}
+	free_assembly(a);
+      }
+      pthread_mutex_unlock(&server->assembly_lock);
+      return -1;
+    }
+    a->next = server->assemblies;
+    server->assemblies = a;
+  }
+  int status = a->size == file->blob_size ? 0 : -1;
+  if (status == 0) {
+    a->users++;
+    file->assembly = a;
+  }
+  pthread_mutex_unlock(&server->assembly_lock);
+  return status;
+}
+
+static void remove_assembly(Server *server, Assembly *a) {
+  Assembly **link = &server->assemblies;
+  while (*link != a) {
+    link = &(*link)->next;
+  }
+  *link = a->next;
+}
+
+/* an assembly nobody finished: what arrived from the start of the blob
+ * on is kept as a partial for the client to resume, like a cut off
+ * upload, the rest is dropped */
+static void abandon_assembly(Assembly *a) {
+  uint64_t prefix = a->range_count > 0 && a->ranges[0].start == 0 ? a->ranges[0].end : 0;
+  if (prefix >= PARTIAL_MIN_SIZE && ftruncate(a->fd, (off_t)prefix) == 0 &&
+      store_keep_partial(a->tmp_path, a->hash_algo, a->blob_id) == 0) {
+    log_info("Kept %llu bytes of an unfinished striped upload to resume", (unsigned long long)prefix);
+  } else {
+    unlink(a->tmp_path);
+  }
+  free_assembly(a);
+}
+
+/* gives up on the assemblies no part is being received for whose client
+ * went away: all of them once nobody is connected, otherwise those idle
+ * for ASSEMBLY_MAX_IDLE */
+static void retire_assemblies(Server *server) {
+  time_t now = time(NULL);
+  Assembly *retired = NULL;
+  pthread_mutex_lock(&server->assembly_lock);
+  Assembly **link = &server->assemblies;
+  while (*link) {
+    Assembly *a = *link;
+    if (a->users == 0 && (server->connections == 0 || now - a->idle_since >= ASSEMBLY_MAX_IDLE)) {
+      *link = a->next;
+      a->next = retired;
+      retired = a;
+    } else {
+      link = &a->next;
+    }
+  }
+  pthread_mutex_unlock(&server->assembly_lock);
+  while (retired) {
+    Assembly *a = retired;
+    retired = a->next;
+    abandon_assembly(a);
+  }
+}
+
+/* true if the assembled blob hashes to its id */
+static int verify_assembly(FileTarget *file, Assembly *a) {
+  unsigned char *buf = malloc(STREAM_CHUNK_SIZE);
+  if (!buf || hash_begin(file->hash) == -1) {
+    free(buf);
+    return 0;
+  }
+  uint64_t off = 0;
+  while (off < a->size) {
+    size_t want = a->size - off < STREAM_CHUNK_SIZE ? (size_t)(a->size - off) : STREAM_CHUNK_SIZE;
+    ssize_t n = pread(a->fd, buf, want, (off_t)off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0 || hash_update(file->hash, buf, (size_t)n) == -1) {
+      break;
+    }
+    off += (uint64_t)n;
+  }
+  free(buf);
+  unsigned char digest[HASH_DIGEST_SIZE];
+  return off == a->size && hash_finish(file->hash, digest) == 0 && memcmp(digest, a->blob_id, BLOB_ID_SIZE) == 0;
+}
+
+/* JOB_CLOSE of a part. Every part is acked after a sync; the one that
+ * completes the blob only once the blob is verified and in the store. */
+static int close_part(DiskJob *dj) {
+  FileTarget *file = dj->file;
+  Assembly *a = file->assembly;
+  Server *server = dj->conn->server;
+  if (!a) {
+    dj->status = ACK_FAILED;
+    return 1;
+  }
+  if (dj->aborted || file->written != file->size) {
+    file->failed = 1;
+  }
+
+  pthread_mutex_lock(&server->assembly_lock);
+  if (--a->users == 0) {
+    a->idle_since = time(NULL);
+  }
+  // a failed part leaves the others be: its range is still missing
+  if (!file->failed && add_range(a, file->part_offset, file->part_offset + file->size) == -1) {
+    perror("Error recording a part");
+    file->failed = 1;
+  }
+  int failed = file->failed;
+  int last = !failed && a->received == a->size;
+  int drop = 0;
+  if (last) {
+    remove_assembly(server, a);
+  }
+  pthread_mutex_unlock(&server->assembly_lock);
+
+  // only the part that completes the blob keeps it
+  file->assembly = NULL;
+  if (last) {
+    int ok = verify_assembly(file, a);
+    if (!ok) {
+      fprintf(stderr, "Contents of '%s' do not match their blob id\n", file->path);
+    }
+    if (close(a->fd) == -1) {
+      perror("Error closing blob");
+      ok = 0;
+    }
+    a->fd = -1;
+    if (ok) {
+      file->assembly = a;
+    } else {
+      failed = drop = 1;
+    }
+  }
+  if (drop) {
+    unlink(a->tmp_path);
+    free_assembly(a);
+  }
+  if (failed) {
+    dj->status = ACK_FAILED;
+    return 1;
+  }
+  dj->committing = 1;
+  group_commit_submit(&server->commit, &dj->base, last ? a->blob_id : NULL, last ? 1 : 0);
+  return 0;
+}
+
+/* starts writeback of what was just written, so the next group sync
+ * finds less to flush */
+static void start_writeback(Connection *conn, int fd) {
+  if (conn->server->commit.sync) {
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  }
+}
+
+static int run_disk_job(Job *job) {
+  DiskJob *dj = (DiskJob *)job;
+  FileTarget *file = dj->file;
+  GroupCommit *commit = &dj->conn->server->commit;
+
+  if (dj->committing) {
+    commit_disk_job(dj);
+    return 1;
+  }
+
+  switch (dj->kind) {
+  case JOB_MKDIR: {
+    // the parents may still be on their way over another connection
+    int made = mkdir(dj->path, 0777);
+    if (made == -1 && errno == ENOENT && store_make_parents(dj->path) == 0) {
+      made = mkdir(dj->path, 0777);
+    }
+    if (made == -1 && errno != EEXIST) {
+      perror("Error creating directory");
+      dj->status = ACK_FAILED;
+      break;
+    }
+    dj->status = ACK_OK;
+    dj->committing = 1;
+    group_commit_submit(commit, job, NULL, 0);
+    return 0;
+  }
+  case JOB_LINK:
+    // MSG_PUT_REF: free if we have the blob (or it is about to be
+    // committed), otherwise ask for it. Held comes first: a blob stops
+    // being held only once it is in the store.
+    dj->committing = 1;
+    if (group_commit_submit_if_held(commit, job, dj->blob_id)) {
+      return 0;
+    }
+    if (store_has_blob(dj->hash_algo, dj->blob_id)) {
+      group_commit_submit(commit, job, NULL, 0);
+      return 0;
+    }
+    dj->committing = 0;
+    dj->status = ACK_NEED_DATA;
+    // if an earlier upload of it was cut off, the client can continue that
+    dj->offset = store_partial_size(dj->hash_algo, dj->blob_id);
+    if (dj->offset < PARTIAL_MIN_SIZE) {
+      dj->offset = 0;
+    }
+    break;
+  case JOB_OPEN:
+    if (file->part) {
+      if (open_part(dj->conn->server, dj->hash_algo, file) == -1) {
+	fprintf(stderr, "Can't take a part of '%s'\n", file->path);
+	file->failed = 1;
+      }
+      break;
+    }
+    if (file->resume_from > 0) {
+      // resumed uploads are never deltas nor kept as frames
+      if (open_partial(dj->hash_algo, file) == -1) {
+	fprintf(stderr, "Can't resume '%s', asking for all of it\n", file->path);
+	file->failed = 1;
+      }
+      break;
+    }
+    file->fd = open(file->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (file->fd == -1) {
+      perror("Error opening blob for writing");
+      file->failed = 1;
+    }
+    if (hash_begin(file->hash) == -1) {
+      fprintf(stderr, "Error initializing blob digest\n");
+      file->failed = 1;
+    }
+    if (!file->failed && file->delta) {
+      file->basis_fd = store_open_blob(dj->hash_algo, file->basis_id);
+      file->copy_buf = malloc(STREAM_CHUNK_SIZE);
+      if (file->basis_fd == -1 || !file->copy_buf) {
+	fprintf(stderr, "No basis to rebuild '%s' from\n", file->path);
+	file->failed = 1;
+      }
+    }
+    if (!file->failed && file->store_frames) {
+      unsigned char header[BLOB_FRAMES_HEADER_SIZE];
+      uint32_t v = htobe32(BLOB_FRAMES_MAGIC);
+      memcpy(header, &v, 4);
+      v = htobe32(file->dec->codec);
+      memcpy(header + 4, &v, 4);
+      uint64_t size = htobe64(file->size);
+      memcpy(header + 8, &size, 8);
+      if (write_all(file->fd, (const char *)header, sizeof(header)) == -1) {
+	perror("Error writing to blob");
+	file->failed = 1;
+      }
+    }
+    break;
+  case JOB_WRITE: {
+    ChunkBuffer *chunk = dj->chunk;
+    const char *raw = chunk->data;
+    if (file->failed) {
+      break;
+    }
+    // the digest is over the decoded contents, whatever gets stored
+    if (chunk->raw_len != chunk->len) {
+      if (decompress_frame(file->dec, chunk->data, chunk->len, file->scratch, chunk->raw_len) == -1) {
+	fprintf(stderr, "Corrupt frame in '%s'\n", file->path);
+	file->failed = 1;
+	break;
+      }
+      raw = (const char *)file->scratch;
+    }
+    // parts are hashed once the blob is whole
+    if (!file->part && hash_update(file->hash, raw, chunk->raw_len) == -1) {
+      fprintf(stderr, "Error updating blob digest\n");
+      file->failed = 1;
+      break;
+    }
+    int status;
+    uint64_t start = metrics_now();
+    if (file->part) {
+      status = pwrite_all(file->assembly->fd, raw, chunk->raw_len, file->part_offset + file->written);
+    } else if (file->store_frames) {
+      unsigned char frame_buf[FRAME_HEADER_SIZE];
+      FrameHeader frame = { (uint32_t)chunk->raw_len, (uint32_t)chunk->len };
+      encode_frame(&frame, frame_buf);
+      status = write_all(file->fd, (const char *)frame_buf, sizeof(frame_buf)) == -1 ||
+	write_all(file->fd, chunk->data, chunk->len) == -1 ? -1 : 0;
+    } else {
+      status = write_all(file->fd, raw, chunk->raw_len);
+    }
+    metrics_since(METRIC_DISK_WRITE, start, status == -1 ? 0 : chunk->raw_len);
+    if (status == -1) {
+      perror("Error writing to blob");
+      file->failed = 1;
+      break;
+    }
+    if (file->delta) {
+      file->size += chunk->raw_len;
+    }
+    file->written += chunk->raw_len;
+    __atomic_fetch_add(&dj->conn->server->bytes_stored, chunk->raw_len, __ATOMIC_RELAXED);
+    start_writeback(dj->conn, file->part ? file->assembly->fd : file->fd);
+    break;
+  }
+  case JOB_COPY: {
+    // a run that takes in the basis' short last block ends at its EOF
+    uint64_t offset = dj->offset;
+    uint64_t left = dj->length;
+    uint64_t start = metrics_now();
+    while (left > 0 && !file->failed) {
+      size_t want = left < STREAM_CHUNK_SIZE ? (size_t)left : STREAM_CHUNK_SIZE;
+      ssize_t n = pread(file->basis_fd, file->copy_buf, want, (off_t)offset);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) {
+	perror("Error reading delta basis");
+	file->failed = 1;
+	break;
+      }
+      if (n == 0) {
+	break;
+      }
+      if (hash_update(file->hash, file->copy_buf, (size_t)n) == -1 ||
+	  write_all(file->fd, (const char *)file->copy_buf, (size_t)n) == -1) {
+	perror("Error writing to blob");
+	file->failed = 1;
+	break;
+      }
+      offset += (uint64_t)n;
+      left -= (uint64_t)n;
+      file->size += (uint64_t)n;
+      __atomic_fetch_add(&dj->conn->server->bytes_stored, (uint64_t)n, __ATOMIC_RELAXED);
+    }
+    metrics_since(METRIC_DISK_WRITE, start, dj->length - left);
+    start_writeback(dj->conn, file->fd);
+    break;
+  }
+  case JOB_CLOSE: {
+    if (file->part) {
+      return close_part(dj);
+    }
+    int opened = file->fd != -1;
+    if (file->fd != -1 && close(file->fd) == -1) {
+      perror("Error closing blob");
+      file->failed = 1;
+    }
+    file->fd = -1;
+    if (file->basis_fd != -1) {
+      close(file->basis_fd);
+      file->basis_fd = -1;
+    }
+    free(file->copy_buf);
+    file->copy_buf = NULL;
+    if (dj->aborted) {
+      // what made it of a big plain upload is kept for the client to resume
+      if (opened && !file->failed && !file->delta && !file->store_frames && file->written >= PARTIAL_MIN_SIZE &&
+	  store_keep_partial(file->tmp_path, dj->hash_algo, file->blob_id) == 0) {
+	log_info("Kept %llu bytes of '%s' to resume", (unsigned long long)file->written, file->path);
+	dj->status = ACK_FAILED;
+	break;
+      }
+      file->failed = 1;
+    }
+    if (!file->failed) {
+      unsigned char digest[HASH_DIGEST_SIZE];
+      if (hash_finish(file->hash, digest) == -1 ||
+	  memcmp(digest, file->blob_id, BLOB_ID_SIZE) != 0) {
+	fprintf(stderr, "Contents of '%s' do not match their blob id\n", file->path);
+	file->failed = 1;
+      }
+    }
+    if (!file->failed) {
+      // verified; the commit thread moves it into place once it is on disk
+      dj->committing = 1;
+      group_commit_submit(commit, job, file->blob_id, 1);
+      return 0;
+    }
+    unlink(file->tmp_path);
+    // a delta or resume that didn't work out is sent again whole
+    dj->status = file->delta || file->resume_from > 0 ? ACK_NEED_DATA : ACK_FAILED;
+    break;
+  }
+  case JOB_PACK_WRITE: {
+    ChunkBuffer *chunk = dj->chunk;
+    const char *raw = chunk->data;
+    if (chunk->raw_len != chunk->len) {
+      if (decompress_frame(&dj->conn->dec, chunk->data, chunk->len, dj->conn->scratch, chunk->raw_len) == -1) {
+	fprintf(stderr, "Corrupt frame in a pack\n");
+	raw = NULL; // fails the files it belongs to, the others can still make it
+      } else {
+	raw = (const char *)dj->conn->scratch;
+      }
+    }
+    uint64_t start = metrics_now();
+    pack_write(dj->conn, dj->pack, raw, chunk->raw_len);
+    metrics_since(METRIC_DISK_WRITE, start, raw ? chunk->raw_len : 0);
+    break;
+  }
+  case JOB_PACK_CLOSE: {
+    PackTarget *pack = dj->pack;
+    if (!dj->aborted) {
+      pack_write(dj->conn, pack, NULL, 0); // empty files at the end
+    }
+    // whatever is left was cut off
+    while (pack->current < pack->count) {
+      pack->files[pack->current].failed = 1;
+      pack_finish_file(dj->conn, pack);
+    }
+    uint32_t good = 0;
+    for (uint32_t i = 0; i < pack->count; i++) {
+      if (!pack->files[i].failed) {
+	memcpy(pack->held_ids + (size_t)good++ * BLOB_ID_SIZE, pack->files[i].blob_id, BLOB_ID_SIZE);
+      }
+    }
+    if (good > 0) {
+      dj->committing = 1;
+      group_commit_submit(commit, job, pack->held_ids, good);
+      return 0;
+    }
+    pack_drop_file(pack);
+    dj->status = ACK_NEED_DATA;
+    break;
+  }
+  case JOB_SIGNATURE: {
+    // whatever goes wrong, the client can still send the file whole
+    dj->status = ACK_NEED_DATA;
+    int fd = store_open_blob(dj->hash_algo, dj->blob_id);
+    if (fd == -1) {
+      break;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+	(dj->payload = delta_signature(&dj->conn->hash, fd, (uint64_t)st.st_size, &dj->payload_len))) {
+      dj->status = ACK_OK;
+    }
+    close(fd);
+    break;
+  }
+  case JOB_READ:
+    // MSG_GET_BLOB: find it and get the disk going; the event loop
+    // sends it once whatever is queued before it is out
+    dj->status = ACK_FAILED;
+    if (store_open_read(dj->hash_algo, dj->blob_id, &dj->blob) == -1) {
+      log_warn("Blob of '%s' is not in the store", dj->path);
+      break;
+    }
+    if (dj->blob.codec != COMPRESS_NONE && dj->blob.codec != dj->conn->codec) {
+      log_warn("Blob of '%s' is kept compressed with a codec %s did not offer", dj->path, dj->conn->peer);
+      close(dj->blob.fd);
+      break;
+    }
+    posix_fadvise(dj->blob.fd, (off_t)dj->blob.offset, (off_t)dj->blob.length, POSIX_FADV_WILLNEED);
+    dj->status = ACK_OK;
+    break;
+  case JOB_TREE:
+    // MSG_GET_TREE: the manifest rehashes what changed since it was last asked
+    dj->status = manifest_tree(&dj->conn->server->manifest, dj->path, dj->hash_algo, &dj->payload,
+			       &dj->payload_len) == 0 ? ACK_OK : ACK_FAILED;
+    if (dj->status != ACK_OK) {
+      log_warn("Could not list '%s' for %s", dj->path, dj->conn->peer);
+    }
+    break;
+  case JOB_HAVE: {
+    // entries were checked when the request came in
+    uint32_t count = read32(dj->payload);
+    unsigned char *bitmap = calloc((count + 7) / 8, 1);
+    if (!bitmap) {
+      perror("Error allocating have bitmap");
+      dj->status = ACK_FAILED;
+      break;
+    }
+    char path[sizeof(BACKUP_DIR) + 1 + MAX_WIRE_PATH];
+    const unsigned char *p = dj->payload + HAVE_PREFIX_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t path_len = read32(p + BLOB_ID_SIZE);
+      snprintf(path, sizeof(path), "%s/%.*s", BACKUP_DIR, (int)path_len, (const char *)p + HAVE_ENTRY_SIZE);
+      if (!manifest_has(&dj->conn->server->manifest, path, dj->hash_algo, p)) {
+	bitmap[i / 8] |= 1u << (i % 8);
+      }
+      p += HAVE_ENTRY_SIZE + path_len;
+    }
+    free(dj->payload);
+    dj->payload = bitmap;
+    dj->payload_len = (count + 7) / 8;
+    dj->status = ACK_OK;
+    break;
+  }
+  }
+  return 1;
+}
+
+static DiskJob *new_job(Connection *conn, DiskJobKind kind, FileTarget *file, ChunkBuffer *chunk,
+		        char *path, const unsigned char *blob_id, uint32_t seq) {
+  DiskJob *dj = calloc(1, sizeof(DiskJob));
+  if (!dj) {
+    perror("Error allocating disk job");
+    exit(EXIT_FAILURE);
+  }
+  dj->base.run = run_disk_job;
+  dj->kind = kind;
+  dj->conn = conn;
+  dj->file = file;
+  dj->chunk = chunk;
+  dj->path = path;
+  dj->hash_algo = conn->hash_algo;
+  if (blob_id) {
+    memcpy(dj->blob_id, blob_id, BLOB_ID_SIZE);
+  }
+  dj->seq = seq;
+  dj->aborted = conn->closed;
+  return dj;
+}
+
+static void queue_job(Connection *conn, DiskJob *dj) {
+  conn->jobs_outstanding++;
+  pool_submit(&conn->server->pool, &conn->strand, &dj->base);
+}
+
+static void submit_job(Connection *conn, DiskJobKind kind, FileTarget *file, ChunkBuffer *chunk,
+		       char *path, const unsigned char *blob_id, uint32_t seq) {
+  queue_job(conn, new_job(conn, kind, file, chunk, path, blob_id, seq));
+}
+
+static void free_pack(PackTarget *pack) {
+  for (uint32_t i = 0; pack->files && i < pack->count; i++) {
+    free(pack->files[i].path);
+    free(pack->files[i].tmp_path);
+  }
+  free(pack->tmp_path);
+  free(pack->files);
+  free(pack->index);
+  free(pack->held_ids);
+  free(pack);
+}
+
+/* conn->chunk is complete: write it to the current file or pack */
+static void submit_chunk(Connection *conn) {
+  DiskJob *dj = new_job(conn, conn->pack ? JOB_PACK_WRITE : JOB_WRITE, conn->file, conn->chunk, NULL, NULL, 0);
+  dj->pack = conn->pack;
+  queue_job(conn, dj);
+  conn->chunk = NULL;
+}
+
+/* the body is complete, or cut off: close the current file or pack */
+static void submit_close(Connection *conn) {
+  DiskJob *dj = new_job(conn, conn->pack ? JOB_PACK_CLOSE : JOB_CLOSE, conn->file, NULL, NULL, NULL,
+			conn->header.seq);
+  dj->pack = conn->pack;
+  queue_job(conn, dj);
+  conn->file = NULL;
+  conn->pack = NULL;
+}
+
+static void update_events(Connection *conn) {
+  if (conn->closed) {
+    return;
+  }
+  uint32_t events = 0;
+  if (!conn->read_paused && conn->state != CONN_DONE) {
+    events |= EPOLLIN;
+  }
+  if (conn->out_off < conn->out_len || conn->send_head) {
+    events |= EPOLLOUT;
+  }
+  if (events != conn->events) {
+    struct epoll_event ev = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(conn->server->epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev) == -1) {
+      perror("Error updating epoll registration");
+    }
+    conn->events = events;
+  }
+}
+
+static void mark_dirty(Connection *conn) {
+  if (!conn->dirty) {
+    conn->dirty = 1;
+    conn->next_dirty = conn->server->dirty_head;
+    conn->server->dirty_head = conn;
+  }
+}
+
+static void release_buffer(Server *server, Connection *conn, ChunkBuffer *chunk) {
+  chunk->next = server->free_buffers;
+  server->free_buffers = chunk;
+  server->buffers_in_use--;
+  conn->buffers_held--;
+}
+
+/* write throughput and sync latency since the server was last idle */
+static void report_activity(Server *server) {
+  GroupCommitStats stats;
+  group_commit_get_stats(&server->commit, &stats);
+  double secs = (double)(now_ns() - server->busy_since_ns) / 1e9;
+  double mb = (double)(__atomic_load_n(&server->bytes_stored, __ATOMIC_RELAXED) - server->busy_bytes) / 1e6;
+  double sent = (double)(server->bytes_sent - server->busy_sent) / 1e6;
+  uint64_t entries = stats.entries - server->busy_stats.entries;
+  uint64_t batches = stats.batches - server->busy_stats.batches;
+  uint64_t syncs = stats.syncs - server->busy_stats.syncs;
+  char sync[96] = "";
+  if (syncs > 0) {
+    snprintf(sync, sizeof(sync), ", sync %.2f ms avg, %.2f ms worst so far",
+	     (double)(stats.sync_ns - server->busy_stats.sync_ns) / syncs / 1e6, (double)stats.sync_max_ns / 1e6);
+  }
+  log_info("Stored %.1f MB in %.2fs (%.1f MB/s); %llu acks in %llu group commits%s", mb, secs,
+	   secs > 0 ? mb / secs : 0.0, (unsigned long long)entries, (unsigned long long)batches, sync);
+  if (sent > 0) {
+    log_info("Sent %.1f MB of blobs to restores (%.1f MB/s)", sent, secs > 0 ? sent / secs : 0.0);
+  }
+}
+
+void server_write_metrics(Server *server, FILE *out) {
+  Histogram snap[METRIC_COUNT];
+  GroupCommitStats stats;
+  metrics_snapshot(snap);
+  group_commit_get_stats(&server->commit, &stats);
+  metrics_write_prometheus(out, snap, METRICS_SERVER);
+  fprintf(out, "# HELP cloudvault_connections Clients connected right now.\n"
+	  "# TYPE cloudvault_connections gauge\ncloudvault_connections %zu\n", server->connections);
+  fprintf(out, "# HELP cloudvault_buffers_in_use Chunk buffers on their way to disk.\n"
+	  "# TYPE cloudvault_buffers_in_use gauge\ncloudvault_buffers_in_use %d\n", server->buffers_in_use);
+  fprintf(out, "# HELP cloudvault_stored_bytes_total Decoded bytes written to blobs.\n"
+	  "# TYPE cloudvault_stored_bytes_total counter\ncloudvault_stored_bytes_total %llu\n",
+	  (unsigned long long)__atomic_load_n(&server->bytes_stored, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP cloudvault_commit_batches_total Group commits.\n"
+	  "# TYPE cloudvault_commit_batches_total counter\ncloudvault_commit_batches_total %llu\n",
+	  (unsigned long long)stats.batches);
+  fprintf(out, "# HELP cloudvault_commit_entries_total Acks that went through a group commit.\n"
+	  "# TYPE cloudvault_commit_entries_total counter\ncloudvault_commit_entries_total %llu\n",
+	  (unsigned long long)stats.entries);
+}
+
+/* the socket is closed right away; the struct lives on until its disk
+ * jobs drain and server_reap frees it */
+static void conn_close(Connection *conn) {
+  if (conn->closed) {
+    return;
+  }
+  Server *server = conn->server;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+  close(conn->sock);
+  conn->closed = 1;
+  server->connections--;
+  log_info("Client disconnected: %s", conn->peer);
+  if (server->connections == 0) {
+    report_activity(server);
+  }
+
+  if (conn->chunk) {
+    release_buffer(server, conn, conn->chunk);
+    conn->chunk = NULL;
+  }
+  if (conn->pack && !conn->pack->files) {
+    // still reading its index, no job knows about it yet
+    free_pack(conn->pack);
+    conn->pack = NULL;
+  }
+  free(conn->have);
+  conn->have = NULL;
+  while (conn->send_head) {
+    Outgoing *o = conn->send_head;
+    conn->send_head = o->next;
+    close(o->fd);
+    free(o);
+  }
+  conn->send_tail = NULL;
+  if (conn->file || conn->pack) {
+    // partial body: close the file and report it failed (to nobody)
+    submit_close(conn);
+  }
+
+  conn->next_closed = server->closed_head;
+  server->closed_head = conn;
+}
+
+static int out_append(Connection *conn, const void *data, size_t len) {
+  if (conn->out_len + len > conn->out_cap) {
+    size_t cap = conn->out_cap ? conn->out_cap : 4096;
+    while (cap < conn->out_len + len) {
+      cap *= 2;
+    }
+    unsigned char *buf = realloc(conn->outbuf, cap);
+    if (!buf) {
+      perror("Error growing output buffer");
+      return -1;
+    }
+    conn->outbuf = buf;
+    conn->out_cap = cap;
+  }
+  memcpy(conn->outbuf + conn->out_len, data, len);
+  conn->out_len += len;
+  return 0;
+}
+
+static int move_acks_to_out(Connection *conn) {
+  if (conn->acks.count == 0) {
+    return 0;
+  }
+  unsigned char header_buf[MSG_HEADER_SIZE];
+  MsgHeader header = { MSG_ACK, 0, 0, 0, (uint64_t)conn->acks.count * ACK_ENTRY_SIZE };
+  encode_header(&header, header_buf);
+  int status = out_append(conn, header_buf, sizeof(header_buf)) == -1 ||
+    out_append(conn, conn->acks.entries, header.body_len) == -1 ? -1 : 0;
+  conn->acks.count = 0;
+  return status;
+}
+
+/* answers a request with a message of its own instead of an ack: a
+ * MSG_SIGNATURE, which is too big for an ack batch, or a MSG_RESUME.
+ * Returns -1 if there's no room for it. */
+static int queue_reply(Connection *conn, uint32_t type, uint32_t seq, const unsigned char *body, size_t len) {
+  if (conn->closed) {
+    return 0;
+  }
+  unsigned char header_buf[MSG_HEADER_SIZE];
+  MsgHeader header = { type, seq, 0, 0, len };
+  encode_header(&header, header_buf);
+  if (out_append(conn, header_buf, sizeof(header_buf)) == -1) {
+    return -1;
+  }
+  if (out_append(conn, body, len) == -1) {
+    conn->out_len -= sizeof(header_buf);
+    return -1;
+  }
+  mark_dirty(conn);
+  return 0;
+}
+
+/* answers a MSG_GET_BLOB with the blob a read job opened. Returns -1 if
+ * there's no room for it; the blob is closed either way then. */
+static int queue_blob(Connection *conn, DiskJob *dj) {
+  Outgoing *o = conn->closed ? NULL : calloc(1, sizeof(Outgoing));
+  if (!o) {
+    if (!conn->closed) {
+      perror("Error allocating outgoing blob");
+    }
+    close(dj->blob.fd);
+    return conn->closed ? 0 : -1;
+  }
+  MsgHeader header = { MSG_BLOB, dj->seq, 0, dj->blob.codec != COMPRESS_NONE ? MSG_FLAG_FRAMED : 0,
+		       dj->blob.size };
+  encode_header(&header, o->header);
+  o->fd = dj->blob.fd;
+  o->offset = dj->blob.offset;
+  o->left = dj->blob.length;
+  if (conn->send_tail) {
+    conn->send_tail->next = o;
+  } else {
+    conn->send_head = o;
+  }
+  conn->send_tail = o;
+  mark_dirty(conn);
+  return 0;
+}
+
+static void queue_ack(Connection *conn, uint32_t seq, int32_t status) {
+  if (conn->closed) {
+    return;
+  }
+  AckEntry ack = { seq, status };
+  encode_ack(&ack, conn->acks.entries + conn->acks.count * ACK_ENTRY_SIZE);
+  if (++conn->acks.count == MAX_ACK_BATCH) {
+    move_acks_to_out(conn);
+  }
+  mark_dirty(conn);
+}
+
+/* sends as much output as the socket takes without blocking: buffered
+ * acks and replies, and blobs, each after what was queued before it. At
+ * most SEND_BURST bytes of blobs go per call, so a restore can't keep
+ * the loop from other clients. */
+static int flush_out(Connection *conn) {
+  uint64_t budget = SEND_BURST;
+  while (budget > 0) {
+    Outgoing *o = conn->send_head;
+    ssize_t n;
+    if (o && o->active && o->header_sent < MSG_HEADER_SIZE) {
+      n = send(conn->sock, o->header + o->header_sent, MSG_HEADER_SIZE - o->header_sent,
+	       MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE);
+      if (n > 0) {
+	o->header_sent += (size_t)n;
+      }
+    } else if (o && o->active && o->left > 0) {
+      off_t offset = (off_t)o->offset;
+      n = sendfile(conn->sock, o->fd, &offset, o->left < budget ? (size_t)o->left : (size_t)budget);
+      if (n > 0) {
+	o->offset += (uint64_t)n;
+	o->left -= (uint64_t)n;
+	budget -= (uint64_t)n;
+	conn->server->bytes_sent += (uint64_t)n;
+      } else if (n == 0) {
+	fprintf(stderr, "Blob shrank while it was sent to %s\n", conn->peer);
+	return -1;
+      }
+    } else if (o && o->active) {
+      conn->send_head = o->next;
+      if (!conn->send_head) {
+	conn->send_tail = NULL;
+      }
+      close(o->fd);
+      free(o);
+      continue;
+    } else if (conn->out_off < conn->out_len) {
+      n = send(conn->sock, conn->outbuf + conn->out_off, conn->out_len - conn->out_off,
+	       MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n > 0) {
+	conn->out_off += (size_t)n;
+      }
+      if (conn->out_off == conn->out_len) {
+	conn->out_off = conn->out_len = 0;
+      }
+    } else if (o) {
+      o->active = 1;
+      continue;
+    } else {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      perror("Error sending to client");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* after MSG_END: close once every ack has made it out */
+static void maybe_finish(Connection *conn) {
+  if (!conn->closed && conn->state == CONN_DONE && conn->jobs_outstanding == 0 &&
+      conn->acks.count == 0 && conn->out_len == 0 && !conn->send_head) {
+    conn_close(conn);
+  }
+}
+
+static void pause_reading(Connection *conn) {
+  Server *server = conn->server;
+  conn->read_paused = 1;
+  if (!conn->waiting) {
+    conn->waiting = 1;
+    conn->next_waiting = NULL;
+    if (server->waiting_tail) {
+      server->waiting_tail->next_waiting = conn;
+    } else {
+      server->waiting_head = conn;
+    }
+    server->waiting_tail = conn;
+  }
+  update_events(conn);
+}
+
+static ChunkBuffer *acquire_buffer(Connection *conn) {
+  Server *server = conn->server;
+  if (conn->buffers_held >= CONN_MAX_BUFFERS || server->buffers_in_use >= MAX_BUFFERS) {
+    pause_reading(conn);
+    return NULL;
+  }
+  ChunkBuffer *chunk = server->free_buffers;
+  if (chunk) {
+    server->free_buffers = chunk->next;
+  } else {
+    chunk = malloc(sizeof(ChunkBuffer));
+    if (!chunk) {
+      perror("Error allocating chunk buffer");
+      pause_reading(conn);
+      return NULL;
+    }
+  }
+  chunk->len = 0;
+  server->buffers_in_use++;
+  conn->buffers_held++;
+  return chunk;
+}
+
+/* how many more body bytes may go into conn->chunk right now */
+static size_t body_room(const Connection *conn) {
+  size_t room = STREAM_CHUNK_SIZE - conn->chunk->len;
+  uint64_t left = conn->state == CONN_FRAME_DATA || conn->state == CONN_LITERAL ?
+    conn->frame_left : conn->body_left;
+  return left < room ? (size_t)left : room;
+}
+
+/* n more body bytes landed in conn->chunk. Plain bodies are cut into
+ * chunks wherever the buffer fills up; a frame or a literal always gets
+ * one chunk. */
+static void body_advance(Connection *conn, size_t n) {
+  if (conn->state == CONN_FRAME_DATA || conn->state == CONN_LITERAL) {
+    int literal = conn->state == CONN_LITERAL;
+    conn->frame_left -= n;
+    if (literal) {
+      conn->body_left -= n;
+    }
+    if (conn->frame_left > 0) {
+      return;
+    }
+    conn->chunk->raw_len = conn->frame_raw;
+    if (!literal) {
+      conn->body_left -= conn->frame_raw;
+    }
+    submit_chunk(conn);
+    conn->state = literal ? CONN_DELTA_OP : CONN_FRAME_HEADER;
+  } else {
+    conn->body_left -= n;
+    if (conn->chunk->len == STREAM_CHUNK_SIZE || conn->body_left == 0) {
+      conn->chunk->raw_len = conn->chunk->len;
+      submit_chunk(conn);
+    }
+  }
+  if (conn->body_left == 0) {
+    submit_close(conn);
+    conn->state = CONN_HEADER;
+  }
+}
+
+/* p points at the u32 count, u32 index_len that open a MSG_PUT_PACK */
+static int start_pack(Connection *conn, const unsigned char *p) {
+  uint32_t count = read32(p);
+  uint32_t index_len = read32(p + 4);
+  if (count == 0 || count > PACK_MAX_ENTRIES || index_len > PACK_MAX_INDEX ||
+      index_len < (uint64_t)count * PACK_ENTRY_SIZE || PACK_PREFIX_SIZE + (uint64_t)index_len > conn->header.body_len) {
+    fprintf(stderr, "Malformed pack from %s\n", conn->peer);
+    return -1;
+  }
+  PackTarget *pack = calloc(1, sizeof(PackTarget));
+  if (!pack || !(pack->index = malloc(index_len))) {
+    perror("Error allocating pack");
+    free(pack);
+    return -1;
+  }
+  pack->count = count;
+  pack->index_len = index_len;
+  pack->fd = -1;
+  conn->pack = pack;
+  conn->state = CONN_PACK_INDEX;
+  return 0;
+}
+
+/* the whole index is in: set up the pack's files and expect their
+ * contents, which must add up to the rest of the body */
+static int parse_pack_index(Connection *conn) {
+  PackTarget *pack = conn->pack;
+  pack->files = calloc(pack->count, sizeof(PackFile));
+  pack->held_ids = malloc((size_t)pack->count * BLOB_ID_SIZE);
+  if (!pack->files || !pack->held_ids) {
+    perror("Error allocating pack");
+    return -1;
+  }
+  if (store_segmented() && !(pack->tmp_path = store_temp_path())) {
+    perror("Error allocating pack");
+    return -1;
+  }
+  uint64_t total = 0;
+  size_t off = 0;
+  for (uint32_t i = 0; i < pack->count; i++) {
+    PackEntryHeader entry;
+    if (pack->index_len - off < PACK_ENTRY_SIZE) {
+      fprintf(stderr, "Malformed pack index from %s\n", conn->peer);
+      return -1;
+    }
+    decode_pack_entry(&entry, pack->index + off);
+    off += PACK_ENTRY_SIZE;
+    if (entry.path_len == 0 || entry.path_len > MAX_WIRE_PATH || entry.path_len > pack->index_len - off ||
+	entry.size > conn->header.body_len || !wire_path_ok(pack->index + off, entry.path_len)) {
+      fprintf(stderr, "Malformed pack index from %s\n", conn->peer);
+      return -1;
+    }
+    PackFile *f = &pack->files[i];
+    size_t full_len = sizeof(BACKUP_DIR) + 1 + entry.path_len;
+    f->path = malloc(full_len);
+    f->tmp_path = pack->tmp_path ? NULL : store_temp_path();
+    if (!f->path || !(f->tmp_path || pack->tmp_path)) {
+      perror("Error allocating pack");
+      return -1;
+    }
+    snprintf(f->path, full_len, "%s/%.*s", BACKUP_DIR, (int)entry.path_len, (const char *)pack->index + off);
+    off += entry.path_len;
+    memcpy(f->blob_id, entry.blob_id, BLOB_ID_SIZE);
+    f->offset = pack->tmp_path ? total : 0;
+    f->size = entry.size;
+    total += entry.size;
+  }
+  if (off != pack->index_len || total != conn->header.body_len - PACK_PREFIX_SIZE - pack->index_len) {
+    fprintf(stderr, "Malformed pack index from %s\n", conn->peer);
+    return -1;
+  }
+  free(pack->index);
+  pack->index = NULL;
+  conn->body_left = total;
+  if (total == 0) {
+    submit_close(conn);
+    conn->state = CONN_HEADER;
+  } else {
+    conn->state = (conn->header.flags & MSG_FLAG_FRAMED) ? CONN_FRAME_HEADER : CONN_BODY;
+  }
+  return 0;
+}
+
+/* the whole MSG_HAVE body is in: check that its entries add up to it,
+ * then look them up on the strand */
+static int submit_have(Connection *conn) {
+  const unsigned char *body = conn->have;
+  uint64_t len = conn->header.body_len;
+  uint32_t count = read32(body);
+  uint64_t off = HAVE_PREFIX_SIZE;
+  for (uint32_t i = 0; i < count && off + HAVE_ENTRY_SIZE <= len; i++) {
+    uint32_t path_len = read32(body + off + BLOB_ID_SIZE);
+    if (path_len == 0 || path_len > MAX_WIRE_PATH || path_len > len - off - HAVE_ENTRY_SIZE ||
+	!wire_path_ok(body + off + HAVE_ENTRY_SIZE, path_len)) {
+      break;
+    }
+    off += HAVE_ENTRY_SIZE + path_len;
+    if (i + 1 == count && off == len) {
+      DiskJob *dj = new_job(conn, JOB_HAVE, NULL, NULL, NULL, NULL, conn->header.seq);
+      dj->payload = conn->have;
+      conn->have = NULL;
+      queue_job(conn, dj);
+      return 0;
+    }
+  }
+  fprintf(stderr, "Malformed have request from %s\n", conn->peer);
+  return -1;
+}
+
+/* p points at the hello header; clients older than version 3 send only
+ * their version, which is enough to turn them away */
+static int handle_hello(Connection *conn, const unsigned char *p, size_t body_len) {
+  uint32_t client_version = 0, algo = 0, codecs = 0;
+  if (body_len >= 4) {
+    memcpy(&client_version, p + MSG_HEADER_SIZE, 4);
+    client_version = be32toh(client_version);
+  }
+  if (body_len >= 8) {
+    memcpy(&algo, p + MSG_HEADER_SIZE + 4, 4);
+    algo = be32toh(algo);
+  }
+  if (body_len >= 12) {
+    memcpy(&codecs, p + MSG_HEADER_SIZE + 8, 4);
+    codecs = be32toh(codecs);
+  }
+
+  // echo the algorithm if we can verify it, 0 if not
+  int algo_ok = client_version == PROTOCOL_VERSION && hash_ctx_init(&conn->hash, algo) == 0;
+  conn->hash_algo = algo_ok ? algo : 0;
+
+  // pick a codec the client offered, if any
+  if (algo_ok && (codecs & COMPRESS_SUPPORTED & (1u << COMPRESS_DEFLATE)) &&
+      (conn->scratch = malloc(STREAM_CHUNK_SIZE)) != NULL &&
+      decompressor_init(&conn->dec, COMPRESS_DEFLATE) == 0) {
+    conn->codec = COMPRESS_DEFLATE;
+  }
+
+  unsigned char reply[MSG_HEADER_SIZE + HELLO_BODY_SIZE];
+  MsgHeader hello = { MSG_HELLO, 0, 0, 0, HELLO_BODY_SIZE };
+  encode_header(&hello, reply);
+  uint32_t v = htobe32(PROTOCOL_VERSION);
+  memcpy(reply + MSG_HEADER_SIZE, &v, 4);
+  v = htobe32(conn->hash_algo);
+  memcpy(reply + MSG_HEADER_SIZE + 4, &v, 4);
+  v = htobe32(conn->codec);
+  memcpy(reply + MSG_HEADER_SIZE + 8, &v, 4);
+  if (out_append(conn, reply, sizeof(reply)) == -1) {
+    return -1;
+  }
+  mark_dirty(conn);
+
+  if (client_version != PROTOCOL_VERSION) {
+    fprintf(stderr, "Client %s speaks protocol version %u, we need %u\n", conn->peer,
+	    client_version, PROTOCOL_VERSION);
+    conn->state = CONN_DONE; // closes once the reply is out
+  } else if (!algo_ok) {
+    fprintf(stderr, "Client %s uses unknown hash algorithm %u\n", conn->peer, algo);
+    conn->state = CONN_DONE;
+  } else {
+    conn->state = CONN_HEADER;
+  }
+  return 0;
+}
+
+/* consumes as much of inbuf as possible. Returns -1 on a protocol error. */
+static int process_input(Connection *conn) {
+  while (1) {
+    size_t avail = conn->in_len - conn->in_off;
+    unsigned char *p = conn->inbuf + conn->in_off;
+
+    switch (conn->state) {
+    case CONN_HELLO: {
+      if (avail < MSG_HEADER_SIZE) {
+	return 0;
+      }
+      MsgHeader header;
+      decode_header(&header, p);
+      if (header.type != MSG_HELLO || header.body_len > HELLO_BODY_SIZE) {
+	fprintf(stderr, "Client %s did not send a valid hello\n", conn->peer);
+	return -1;
+      }
+      if (avail < MSG_HEADER_SIZE + header.body_len) {
+	return 0;
+      }
+      conn->in_off += MSG_HEADER_SIZE + header.body_len;
+      if (handle_hello(conn, p, (size_t)header.body_len) == -1) {
+	return -1;
+      }
+      break;
+    }
+
+    case CONN_HEADER:
+      if (avail < MSG_HEADER_SIZE) {
+	return 0;
+      }
+      decode_header(&conn->header, p);
+      conn->in_off += MSG_HEADER_SIZE;
+      if (conn->header.type == MSG_END) {
+	conn->state = CONN_DONE;
+	return 0;
+      }
+      if (conn->header.type != MSG_PUT_DIR && conn->header.type != MSG_PUT_REF &&
+	  conn->header.type != MSG_PUT_BLOB && conn->header.type != MSG_GET_SIG &&
+	  conn->header.type != MSG_PUT_DELTA && conn->header.type != MSG_PUT_PACK &&
+	  conn->header.type != MSG_HAVE && conn->header.type != MSG_PUT_PART &&
+	  conn->header.type != MSG_GET_BLOB && conn->header.type != MSG_GET_TREE) {
+	fprintf(stderr, "Unknown request type %u from %s\n", conn->header.type, conn->peer);
+	return -1;
+      }
+      // packs and have requests carry their paths in the body instead
+      if ((conn->header.type == MSG_PUT_PACK || conn->header.type == MSG_HAVE) != (conn->header.path_len == 0) ||
+	  conn->header.path_len > MAX_WIRE_PATH ||
+	  (conn->header.type == MSG_PUT_DIR && conn->header.body_len != 0) ||
+	  (conn->header.type == MSG_GET_TREE && conn->header.body_len != 0) ||
+	  (conn->header.type == MSG_PUT_REF && conn->header.body_len != BLOB_ID_SIZE) ||
+	  (conn->header.type == MSG_PUT_BLOB && conn->header.body_len < BLOB_ID_SIZE) ||
+	  (conn->header.type == MSG_GET_SIG && conn->header.body_len != BLOB_ID_SIZE) ||
+	  (conn->header.type == MSG_GET_BLOB && conn->header.body_len != BLOB_ID_SIZE) ||
+	  (conn->header.type == MSG_PUT_DELTA && conn->header.body_len < DELTA_PREFIX_SIZE) ||
+	  (conn->header.type == MSG_PUT_PACK && conn->header.body_len < PACK_PREFIX_SIZE) ||
+	  (conn->header.type == MSG_PUT_PART && conn->header.body_len < PART_PREFIX_SIZE) ||
+	  (conn->header.type == MSG_HAVE &&
+	   (conn->header.body_len < HAVE_PREFIX_SIZE + HAVE_ENTRY_SIZE || conn->header.body_len > HAVE_MAX_BODY)) ||
+	  (conn->header.flags & ~(MSG_FLAG_FRAMED | MSG_FLAG_RESUME)) ||
+	  ((conn->header.flags & MSG_FLAG_RESUME) &&
+	   (conn->header.type != MSG_PUT_BLOB || conn->header.body_len < BLOB_ID_SIZE + RESUME_OFFSET_SIZE)) ||
+	  ((conn->header.flags & MSG_FLAG_FRAMED) &&
+	   ((conn->header.type != MSG_PUT_BLOB && conn->header.type != MSG_PUT_PACK &&
+	     conn->header.type != MSG_PUT_PART) || conn->codec == COMPRESS_NONE))) {
+	fprintf(stderr, "Malformed request from %s\n", conn->peer);
+	return -1;
+      }
+      conn->state = CONN_PATH;
+      break;
+
+    case CONN_PATH: {
+      if (conn->header.type == MSG_PUT_PACK) {
+	if (avail < PACK_PREFIX_SIZE) {
+	  return 0;
+	}
+	conn->in_off += PACK_PREFIX_SIZE;
+	if (start_pack(conn, p) == -1) {
+	  return -1;
+	}
+	break;
+      }
+      if (conn->header.type == MSG_HAVE) {
+	conn->have = malloc(conn->header.body_len);
+	if (!conn->have) {
+	  perror("Error allocating have request");
+	  return -1;
+	}
+	conn->have_got = 0;
+	conn->state = CONN_HAVE;
+	break;
+      }
+      // blob requests carry the id right after the path, deltas their
+      // whole prefix; take both at once
+      uint32_t path_len = conn->header.path_len;
+      size_t need = path_len;
+      if (conn->header.type == MSG_PUT_DELTA) {
+	need += DELTA_PREFIX_SIZE;
+      } else if (conn->header.type == MSG_PUT_PART) {
+	need += PART_PREFIX_SIZE;
+      } else if (conn->header.flags & MSG_FLAG_RESUME) {
+	need += BLOB_ID_SIZE + RESUME_OFFSET_SIZE;
+      } else if (conn->header.type != MSG_PUT_DIR && conn->header.type != MSG_GET_TREE) {
+	need += BLOB_ID_SIZE;
+      }
+      if (avail < need) {
+	return 0;
+      }
+      if (!wire_path_ok(p, path_len)) {
+	fprintf(stderr, "Path outside the backup from %s\n", conn->peer);
+	return -1;
+      }
+      size_t full_len = sizeof(BACKUP_DIR) + 1 + path_len;
+      char *path = malloc(full_len);
+      if (!path) {
+	perror("Error allocating path");
+	return -1;
+      }
+      snprintf(path, full_len, "%s/%.*s", BACKUP_DIR, (int)path_len, (const char *)p);
+      conn->in_off += need;
+
+      // This logic works, but is dependent on recieving folders from the client before the files that are within them.
+      // Disk jobs run in order per connection, so the mkdir lands first.
+      if (conn->header.type == MSG_PUT_DIR) {
+	submit_job(conn, JOB_MKDIR, NULL, NULL, path, NULL, conn->header.seq);
+	conn->state = CONN_HEADER;
+	break;
+      }
+      if (conn->header.type == MSG_PUT_REF) {
+	submit_job(conn, JOB_LINK, NULL, NULL, path, p + path_len, conn->header.seq);
+	conn->state = CONN_HEADER;
+	break;
+      }
+      if (conn->header.type == MSG_GET_SIG) {
+	submit_job(conn, JOB_SIGNATURE, NULL, NULL, path, p + path_len, conn->header.seq);
+	conn->state = CONN_HEADER;
+	break;
+      }
+      if (conn->header.type == MSG_GET_BLOB) {
+	submit_job(conn, JOB_READ, NULL, NULL, path, p + path_len, conn->header.seq);
+	conn->state = CONN_HEADER;
+	break;
+      }
+      if (conn->header.type == MSG_GET_TREE) {
+	submit_job(conn, JOB_TREE, NULL, NULL, path, NULL, conn->header.seq);
+	conn->state = CONN_HEADER;
+	break;
+      }
+
+      FileTarget *file = calloc(1, sizeof(FileTarget));
+      if (!file || !(file->tmp_path = store_temp_path())) {
+	perror("Error allocating file target");
+	free(file);
+	free(path);
+	return -1;
+      }
+      file->path = path;
+      file->fd = -1;
+      file->basis_fd = -1;
+      file->hash = &conn->hash;
+      file->framed = (conn->header.flags & MSG_FLAG_FRAMED) != 0;
+      file->store_frames = file->framed && conn->server->store_frames;
+      file->dec = &conn->dec;
+      file->scratch = conn->scratch;
+      memcpy(file->blob_id, p + path_len, BLOB_ID_SIZE);
+      if (conn->header.type == MSG_PUT_DELTA) {
+	file->delta = 1;
+	memcpy(file->basis_id, p + path_len + BLOB_ID_SIZE, BLOB_ID_SIZE);
+	file->block_size = read32(p + path_len + 2 * BLOB_ID_SIZE);
+	conn->body_left = conn->header.body_len - DELTA_PREFIX_SIZE;
+      } else if (conn->header.flags & MSG_FLAG_RESUME) {
+	uint64_t offset;
+	memcpy(&offset, p + path_len + BLOB_ID_SIZE, sizeof(offset));
+	file->resume_from = file->written = be64toh(offset);
+	file->store_frames = 0;
+	conn->body_left = conn->header.body_len - BLOB_ID_SIZE - RESUME_OFFSET_SIZE;
+	file->size = file->resume_from + conn->body_left;
+      } else if (conn->header.type == MSG_PUT_PART) {
+	// parts are stored plain, whatever they were sent as
+	uint64_t v;
+	memcpy(&v, p + path_len + BLOB_ID_SIZE, sizeof(v));
+	file->part_offset = be64toh(v);
+	memcpy(&v, p + path_len + BLOB_ID_SIZE + 8, sizeof(v));
+	file->blob_size = be64toh(v);
+	file->part = 1;
+	file->store_frames = 0;
+	file->size = conn->header.body_len - PART_PREFIX_SIZE;
+	conn->body_left = file->size;
+      } else {
+	file->size = conn->header.body_len - BLOB_ID_SIZE;
+	conn->body_left = file->size;
+      }
+      conn->file = file;
+      submit_job(conn, JOB_OPEN, file, NULL, NULL, NULL, 0);
+      if (file->delta && (file->block_size < DELTA_MIN_BLOCK || file->block_size > DELTA_MAX_BLOCK)) {
+	fprintf(stderr, "Malformed delta from %s\n", conn->peer);
+	return -1; // conn_close finishes the file off
+      }
+      if ((conn->header.flags & MSG_FLAG_RESUME) && file->resume_from == 0) {
+	fprintf(stderr, "Malformed resume from %s\n", conn->peer);
+	return -1;
+      }
+      if (file->part && (file->size == 0 || file->part_offset > file->blob_size ||
+			 file->size > file->blob_size - file->part_offset)) {
+	fprintf(stderr, "Malformed part from %s\n", conn->peer);
+	return -1;
+      }
+      if (conn->body_left == 0) {
+	submit_job(conn, JOB_CLOSE, file, NULL, NULL, NULL, conn->header.seq);
+	conn->file = NULL;
+	conn->state = CONN_HEADER;
+      } else if (file->delta) {
+	conn->state = CONN_DELTA_OP;
+      } else {
+	conn->state = file->framed ? CONN_FRAME_HEADER : CONN_BODY;
+      }
+      break;
+    }
+
+    case CONN_PACK_INDEX: {
+      PackTarget *pack = conn->pack;
+      size_t n = pack->index_len - pack->index_got;
+      if (n > avail) n = avail;
+      memcpy(pack->index + pack->index_got, p, n);
+      pack->index_got += n;
+      conn->in_off += n;
+      if (pack->index_got < pack->index_len) {
+	return 0;
+      }
+      if (parse_pack_index(conn) == -1) {
+	free_pack(pack);
+	conn->pack = NULL;
+	return -1;
+      }
+      break;
+    }
+
+    case CONN_HAVE: {
+      size_t n = conn->header.body_len - conn->have_got;
+      if (n > avail) n = avail;
+      memcpy(conn->have + conn->have_got, p, n);
+      conn->have_got += n;
+      conn->in_off += n;
+      if (conn->have_got < conn->header.body_len) {
+	return 0;
+      }
+      if (submit_have(conn) == -1) {
+	return -1;
+      }
+      conn->state = CONN_HEADER;
+      break;
+    }
+
+    case CONN_DELTA_OP: {
+      if (avail < DELTA_LITERAL_SIZE) {
+	return 0;
+      }
+      uint32_t op = read32(p);
+      uint32_t arg = read32(p + 4);
+      if (op == DELTA_OP_LITERAL) {
+	if (arg == 0 || arg > STREAM_CHUNK_SIZE || DELTA_LITERAL_SIZE + (uint64_t)arg > conn->body_left) {
+	  fprintf(stderr, "Malformed delta from %s\n", conn->peer);
+	  return -1;
+	}
+	conn->in_off += DELTA_LITERAL_SIZE;
+	conn->body_left -= DELTA_LITERAL_SIZE;
+	conn->frame_raw = conn->frame_left = arg;
+	conn->state = CONN_LITERAL;
+	break;
+      }
+      if (op != DELTA_OP_COPY || conn->body_left < DELTA_COPY_SIZE) {
+	fprintf(stderr, "Malformed delta from %s\n", conn->peer);
+	return -1;
+      }
+      if (avail < DELTA_COPY_SIZE) {
+	return 0;
+      }
+      uint32_t count = read32(p + 8);
+      conn->in_off += DELTA_COPY_SIZE;
+      conn->body_left -= DELTA_COPY_SIZE;
+      DiskJob *dj = new_job(conn, JOB_COPY, conn->file, NULL, NULL, NULL, 0);
+      dj->offset = (uint64_t)arg * conn->file->block_size;
+      dj->length = (uint64_t)count * conn->file->block_size;
+      queue_job(conn, dj);
+      if (conn->body_left == 0) {
+	submit_job(conn, JOB_CLOSE, conn->file, NULL, NULL, NULL, conn->header.seq);
+	conn->file = NULL;
+	conn->state = CONN_HEADER;
+      }
+      break;
+    }
+
+    case CONN_FRAME_HEADER: {
+      if (avail < FRAME_HEADER_SIZE) {
+	return 0;
+      }
+      FrameHeader frame;
+      decode_frame(&frame, p);
+      if (frame.raw_len == 0 || frame.raw_len > STREAM_CHUNK_SIZE || frame.raw_len > conn->body_left ||
+	  frame.data_len == 0 || frame.data_len > frame.raw_len) {
+	fprintf(stderr, "Malformed frame from %s\n", conn->peer);
+	return -1;
+      }
+      conn->in_off += FRAME_HEADER_SIZE;
+      conn->frame_raw = frame.raw_len;
+      conn->frame_left = frame.data_len;
+      conn->state = CONN_FRAME_DATA;
+      break;
+    }
+
+    case CONN_BODY:
+    case CONN_FRAME_DATA:
+    case CONN_LITERAL: {
+      if (avail == 0) {
+	return 0;
+      }
+      if (!conn->chunk && !(conn->chunk = acquire_buffer(conn))) {
+	return 0;
+      }
+      ChunkBuffer *chunk = conn->chunk;
+      size_t n = body_room(conn);
+      if (n > avail) n = avail;
+      memcpy(chunk->data + chunk->len, p, n);
+      chunk->len += n;
+      conn->in_off += n;
+      body_advance(conn, n);
+      break;
+    }
+
+    case CONN_DONE:
+      return 0;
+    }
+  }
+}
+
+Connection *conn_create(Server *server, int sock, const struct sockaddr_in *addr) {
+  Connection *conn = calloc(1, sizeof(Connection));
+  if (!conn) {
+    perror("Error allocating connection");
+    return NULL;
+  }
+  conn->sock = sock;
+  conn->server = server;
+  conn->state = CONN_HELLO;
+  snprintf(conn->peer, sizeof(conn->peer), "%s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+    perror("Error registering connection");
+    free(conn);
+    return NULL;
+  }
+  conn->events = EPOLLIN;
+  if (server->connections++ == 0) {
+    server->busy_since_ns = now_ns();
+    server->busy_bytes = __atomic_load_n(&server->bytes_stored, __ATOMIC_RELAXED);
+    server->busy_sent = server->bytes_sent;
+    group_commit_get_stats(&server->commit, &server->busy_stats);
+  }
+  // a connection is as good a clock as any for the idle ones
+  retire_assemblies(server);
+  log_info("Connection from: %s (%zu active)", conn->peer, server->connections);
+  return conn;
+}
+
+void conn_on_readable(Connection *conn) {
+  while (!conn->closed && !conn->read_paused && conn->state != CONN_DONE) {
+    if (process_input(conn) == -1) {
+      conn_close(conn);
+      return;
+    }
+    if (conn->read_paused || conn->state == CONN_DONE) {
+      break;
+    }
+
+    ssize_t n;
+    if ((conn->state == CONN_BODY || conn->state == CONN_FRAME_DATA || conn->state == CONN_LITERAL) &&
+	conn->in_off == conn->in_len) {
+      // nothing buffered: receive the body straight into the chunk buffer
+      if (!conn->chunk && !(conn->chunk = acquire_buffer(conn))) {
+	break;
+      }
+      ChunkBuffer *chunk = conn->chunk;
+      uint64_t start = metrics_now();
+      n = recv(conn->sock, chunk->data + chunk->len, body_room(conn), 0);
+      if (n > 0) {
+	metrics_since(METRIC_RECV, start, (uint64_t)n);
+	chunk->len += n;
+	body_advance(conn, n);
+	continue;
+      }
+    } else {
+      if (conn->in_off > 0) {
+	memmove(conn->inbuf, conn->inbuf + conn->in_off, conn->in_len - conn->in_off);
+	conn->in_len -= conn->in_off;
+	conn->in_off = 0;
+      }
+      uint64_t start = metrics_now();
+      n = recv(conn->sock, conn->inbuf + conn->in_len, CONN_INBUF_SIZE - conn->in_len, 0);
+      if (n > 0) {
+	metrics_since(METRIC_RECV, start, (uint64_t)n);
+	conn->in_len += n;
+	continue;
+      }
+    }
+
+    if (n == 0) {
+      conn_close(conn);
+      return;
+    }
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("Error receiving from client");
+      conn_close(conn);
+      return;
+    }
+    break;
+  }
+
+  maybe_finish(conn);
+  update_events(conn);
+}
+
+void conn_on_hangup(Connection *conn) {
+  // pick up whatever the client sent before it went away
+  conn_on_readable(conn);
+  conn_close(conn);
+}
+
+void conn_on_writable(Connection *conn) {
+  if (conn->closed) {
+    return;
+  }
+  if (flush_out(conn) == -1) {
+    conn_close(conn);
+    return;
+  }
+  maybe_finish(conn);
+  update_events(conn);
+}
+
+void server_handle_completions(Server *server) {
+  Job *job = pool_take_completed(&server->pool);
+  while (job) {
+    Job *next = job->next;
+    DiskJob *dj = (DiskJob *)job;
+    Connection *conn = dj->conn;
+
+    switch (dj->kind) {
+    case JOB_LINK:
+      if (dj->status == ACK_NEED_DATA && dj->offset > 0) {
+	uint64_t offset = htobe64(dj->offset);
+	if (queue_reply(conn, MSG_RESUME, dj->seq, (const unsigned char *)&offset, sizeof(offset)) == 0) {
+	  free(dj->path);
+	  break;
+	}
+      }
+      queue_ack(conn, dj->seq, dj->status);
+      free(dj->path);
+      break;
+    case JOB_MKDIR:
+      queue_ack(conn, dj->seq, dj->status);
+      free(dj->path);
+      break;
+    case JOB_SIGNATURE:
+      if (dj->status != ACK_OK || queue_reply(conn, MSG_SIGNATURE, dj->seq, dj->payload, dj->payload_len) == -1) {
+	queue_ack(conn, dj->seq, ACK_NEED_DATA);
+      }
+      free(dj->payload);
+      free(dj->path);
+      break;
+    case JOB_READ:
+      if (dj->status != ACK_OK || queue_blob(conn, dj) == -1) {
+	queue_ack(conn, dj->seq, ACK_FAILED);
+      }
+      free(dj->path);
+      break;
+    case JOB_HAVE:
+      if (dj->status != ACK_OK || queue_reply(conn, MSG_NEEDED, dj->seq, dj->payload, dj->payload_len) == -1) {
+	queue_ack(conn, dj->seq, ACK_FAILED);
+      }
+      free(dj->payload);
+      break;
+    case JOB_TREE:
+      if (dj->status != ACK_OK || queue_reply(conn, MSG_TREE, dj->seq, dj->payload, dj->payload_len) == -1) {
+	queue_ack(conn, dj->seq, ACK_FAILED);
+      }
+      free(dj->payload);
+      free(dj->path);
+      break;
+    case JOB_OPEN:
+    case JOB_COPY:
+      break;
+    case JOB_WRITE:
+      release_buffer(server, conn, dj->chunk);
+      break;
+    case JOB_CLOSE:
+      queue_ack(conn, dj->seq, dj->status);
+      if (dj->file->assembly) {
+	free_assembly(dj->file->assembly);
+      }
+      free(dj->file->tmp_path);
+      free(dj->file->path);
+      free(dj->file);
+      break;
+    case JOB_PACK_WRITE:
+      release_buffer(server, conn, dj->chunk);
+      break;
+    case JOB_PACK_CLOSE:
+      if (dj->pack->failed > 0) {
+	log_warn("%u of %u packed files from %s were not stored", dj->pack->failed, dj->pack->count,
+		 conn->peer);
+      }
+      queue_ack(conn, dj->seq, dj->status);
+      free_pack(dj->pack);
+      break;
+    }
+    conn->jobs_outstanding--;
+    free(dj);
+    maybe_finish(conn);
+    job = next;
+  }
+
+  // buffers came back; let paused connections try again
+  Connection *waiting = server->waiting_head;
+  server->waiting_head = server->waiting_tail = NULL;
+  while (waiting) {
+    Connection *conn = waiting;
+    waiting = conn->next_waiting;
+    conn->waiting = 0;
+    if (conn->closed) {
+      continue;
+    }
+    conn->read_paused = 0;
+    conn_on_readable(conn);
+  }
+}
+
+void server_flush_dirty(Server *server) {
+  Connection *conn = server->dirty_head;
+  server->dirty_head = NULL;
+  while (conn) {
+    Connection *next = conn->next_dirty;
+    conn->dirty = 0;
+    if (!conn->closed) {
+      if (move_acks_to_out(conn) == -1 || flush_out(conn) == -1) {
+	conn_close(conn);
+      } else {
+	maybe_finish(conn);
+	update_events(conn);
+      }
+    }
+    conn = next;
+  }
+}
+
+void server_reap(Server *server) {
+  Connection **link = &server->closed_head;
+  int reaped = 0;
+  while (*link) {
+    Connection *conn = *link;
+    if (conn->jobs_outstanding == 0 && !conn->dirty && !conn->waiting) {
+      *link = conn->next_closed;
+      hash_ctx_free(&conn->hash);
+      decompressor_free(&conn->dec);
+      free(conn->scratch);
+      free(conn->outbuf);
+      free(conn);
+      reaped = 1;
+    } else {
+      link = &conn->next_closed;
+    }
+  }
+  // its parts are all closed now
+  if (reaped) {
+    retire_assemblies(server);
+  }
+}
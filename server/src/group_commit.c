@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "group_commit.h"
+#include "metrics.h"
+
+static size_t hold_bucket(const unsigned char *id) {
+  uint32_t h;
+  memcpy(&h, id, sizeof(h)); // ids are hashes already
+  return h % HOLD_BUCKETS;
+}
+
+/* the hold functions are called with the lock held */
+static HeldBlob *find_held(GroupCommit *gc, const unsigned char *id) {
+  HeldBlob *held = gc->held[hold_bucket(id)];
+  while (held && memcmp(held->id, id, BLOB_ID_SIZE) != 0) {
+    held = held->next;
+  }
+  return held;
+}
+
+static int hold(GroupCommit *gc, const unsigned char *id) {
+  HeldBlob *held = find_held(gc, id);
+  if (!held) {
+    held = malloc(sizeof(HeldBlob));
+    if (!held) {
+      return -1; // only costs a re-upload if someone refers to it early
+    }
+    memcpy(held->id, id, BLOB_ID_SIZE);
+    held->count = 0;
+    size_t b = hold_bucket(id);
+    held->next = gc->held[b];
+    gc->held[b] = held;
+  }
+  held->count++;
+  return 0;
+}
+
+static void release(GroupCommit *gc, const unsigned char *id) {
+  HeldBlob **link = &gc->held[hold_bucket(id)];
+  while (*link && memcmp((*link)->id, id, BLOB_ID_SIZE) != 0) {
+    link = &(*link)->next;
+  }
+  HeldBlob *held = *link;
+  if (held && --held->count == 0) {
+    *link = held->next;
+    free(held);
+  }
+}
+
+/* one syncfs, timed. Returns its duration. */
+static uint64_t sync_store(GroupCommit *gc) {
+  uint64_t start = metrics_now();
+  if (syncfs(gc->sync_fd) == -1) {
+    perror("Error syncing the store");
+  }
+  uint64_t ns = metrics_now() - start;
+  metrics_observe(METRIC_SYNC, ns, 0);
+  return ns;
+}
+
+static void *commit_main(void *arg) {
+  GroupCommit *gc = arg;
+
+  pthread_mutex_lock(&gc->lock);
+  while (1) {
+    while (!gc->head && !gc->stopping) {
+      pthread_cond_wait(&gc->ready_cond, &gc->lock);
+    }
+    if (!gc->head) {
+      break;
+    }
+    CommitEntry *batch = gc->head;
+    gc->head = gc->tail = NULL;
+    pthread_mutex_unlock(&gc->lock);
+
+    uint64_t first = 0, second = 0;
+    if (gc->sync) {
+      first = sync_store(gc);
+    }
+    size_t count = 0;
+    for (CommitEntry *e = batch; e; e = e->next) {
+      e->job->run(e->job);
+      count++;
+    }
+    if (gc->sync) {
+      second = sync_store(gc);
+    }
+
+    pthread_mutex_lock(&gc->lock);
+    for (CommitEntry *e = batch; e; e = e->next) {
+      for (uint32_t i = 0; i < e->held; i++) {
+	release(gc, e->ids + (size_t)i * BLOB_ID_SIZE);
+      }
+    }
+    gc->stats.batches++;
+    gc->stats.entries += count;
+    if (gc->sync) {
+      gc->stats.syncs += 2;
+      gc->stats.sync_ns += first + second;
+      uint64_t longest = first > second ? first : second;
+      if (longest > gc->stats.sync_max_ns) {
+	gc->stats.sync_max_ns = longest;
+      }
+    }
+    pthread_mutex_unlock(&gc->lock);
+
+    while (batch) {
+      CommitEntry *next = batch->next;
+      pool_complete(gc->pool, batch->job);
+      free(batch);
+      batch = next;
+    }
+    pthread_mutex_lock(&gc->lock);
+  }
+  pthread_mutex_unlock(&gc->lock);
+  return NULL;
+}
+
+int group_commit_init(GroupCommit *gc, WorkerPool *pool, const char *dir, int sync) {
+  memset(gc, 0, sizeof(*gc));
+  gc->pool = pool;
+  gc->sync = sync;
+  gc->sync_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (gc->sync_fd == -1) {
+    perror("Error opening the store for syncing");
+    return -1;
+  }
+  pthread_mutex_init(&gc->lock, NULL);
+  pthread_cond_init(&gc->ready_cond, NULL);
+  if (pthread_create(&gc->thread, NULL, commit_main, gc) != 0) {
+    perror("Error starting commit thread");
+    close(gc->sync_fd);
+    return -1;
+  }
+  gc->started = 1;
+  return 0;
+}
+
+/* called with the lock held */
+static void enqueue(GroupCommit *gc, Job *job, const unsigned char *hold_ids, uint32_t count) {
+  CommitEntry *e = malloc(sizeof(CommitEntry));
+  if (!e) {
+    perror("Error queueing commit");
+    exit(EXIT_FAILURE);
+  }
+  e->job = job;
+  e->ids = hold_ids;
+  e->held = 0;
+  while (e->held < count && hold(gc, hold_ids + (size_t)e->held * BLOB_ID_SIZE) == 0) {
+    e->held++;
+  }
+  e->next = NULL;
+  if (gc->tail) {
+    gc->tail->next = e;
+  } else {
+    gc->head = e;
+  }
+  gc->tail = e;
+  pthread_cond_signal(&gc->ready_cond);
+}
+
+void group_commit_submit(GroupCommit *gc, Job *job, const unsigned char *hold_ids, uint32_t count) {
+  pthread_mutex_lock(&gc->lock);
+  enqueue(gc, job, hold_ids, count);
+  pthread_mutex_unlock(&gc->lock);
+}
+
+int group_commit_submit_if_held(GroupCommit *gc, Job *job, const unsigned char *id) {
+  pthread_mutex_lock(&gc->lock);
+  int held = find_held(gc, id) != NULL;
+  if (held) {
+    enqueue(gc, job, NULL, 0);
+  }
+  pthread_mutex_unlock(&gc->lock);
+  return held;
+}
+
+void group_commit_get_stats(GroupCommit *gc, GroupCommitStats *out) {
+  pthread_mutex_lock(&gc->lock);
+  *out = gc->stats;
+  pthread_mutex_unlock(&gc->lock);
+}
+
+void group_commit_shutdown(GroupCommit *gc) {
+  if (gc->started) {
+    pthread_mutex_lock(&gc->lock);
+    gc->stopping = 1;
+    pthread_cond_broadcast(&gc->ready_cond);
+    pthread_mutex_unlock(&gc->lock);
+    pthread_join(gc->thread, NULL);
+    gc->started = 0;
+  }
+  close(gc->sync_fd);
+}
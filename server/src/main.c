@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,27 +7,167 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include "connection.h"
+#include "log.h"
+#include "options.h"
+#include "protocol.h"
+#include "store.h"
 
 #define PORT 8080
-#define MAX_CLIENTS 1  
-#define BUFFER_SIZE 1024 
-#define BACKUP_DIR "backup"
+#define LISTEN_BACKLOG SOMAXCONN
+#define MAX_EVENTS 256
+#define MAX_WORKERS 1024
+
+// epoll tags for the fds that aren't connections
+static int listen_tag;
+static int pool_tag;
+static int metrics_tag;
+
+static void accept_clients(Server *server, int server_socket) {
+  while (1) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_len = sizeof(client_address);
+    int client_socket = accept4(server_socket, (struct sockaddr *)&client_address, &client_address_len,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_socket == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	perror("Error accepting connection");
+      }
+      return;
+    }
+    if (!conn_create(server, client_socket, &client_address)) {
+      close(client_socket);
+    }
+  }
+}
+
+/* listening Unix socket for --metrics. Returns -1 on failure. */
+static int open_metrics_socket(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Metrics socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    perror("Error creating metrics socket");
+    return -1;
+  }
+  unlink(path); // left behind by an earlier run
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+    perror("Error binding metrics socket");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* every scraper gets the current metrics and is hung up on. The text is a
+ * few KB, well within a fresh socket's buffer, so this never blocks. */
+static void serve_metrics(Server *server, int metrics_socket) {
+  while (1) {
+    int sock = accept4(metrics_socket, NULL, NULL, SOCK_CLOEXEC);
+    if (sock == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	perror("Error accepting metrics connection");
+      }
+      return;
+    }
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out) {
+      server_write_metrics(server, out);
+      fclose(out);
+      if (send(sock, text, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len) {
+	perror("Error sending metrics");
+      }
+      free(text);
+    }
+    close(sock);
+  }
+}
 
 /* 
- * Server logic to accept connection and data from client
+ * Server logic to accept connections and data from clients.
+ *
+ * A single epoll loop drives every connection's state machine; blocking
+ * disk work is handed to a worker pool so one slow client or disk doesn't
+ * hold up the others.
+ *
+ * --workers N  number of disk worker threads, 1 to MAX_WORKERS (default:
+ *              online CPUs)
+ * --store-compressed
+ *              keep blobs that were uploaded compressed in their frame
+ *              format instead of decompressing them (see store.h); their
+ *              paths are then only in the manifest, not under backup/
+ * --segments   append small blobs to large segment files instead of
+ *              keeping a file per blob and per path (see segment.h)
+ * --no-sync    don't sync before acking; a crash can then lose or tear
+ *              acknowledged files (see group_commit.h)
+ * --metrics PATH
+ *              serve phase latencies and gauges in the Prometheus text
+ *              format to anyone connecting to the Unix socket at PATH
+ * --log-level error|warn|info|debug
+ *              console verbosity (default info); debug lists every file
+ * --log-rate N lines per second each level may print, 0 for no limit
  */
 
-int main() {
-  int server_socket, client_socket;
-  struct sockaddr_in server_address, client_address;
-  socklen_t client_address_len = sizeof(client_address);
-  ssize_t bytes_received;
-  size_t filename_size;
-  size_t file_size;
-  char *filename = NULL;
-  char *file_content = NULL;
-  char filepath[256];
-  int processing_status;
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [--workers N] [--store-compressed] [--segments] [--no-sync] [--metrics PATH]\n"
+	  "          [--log-level error|warn|info|debug] [--log-rate N]\n", prog);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  int server_socket;
+  struct sockaddr_in server_address;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus;
+  int store_frames = 0;
+  int segments = 0;
+  int sync = 1;
+  const char *metrics_path = NULL;
+  int log_lvl = LOG_LEVEL_INFO;
+  int log_rate = LOG_DEFAULT_RATE;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 1, MAX_WORKERS, &workers) == -1) {
+	return usage(argv[0]);
+      }
+      i++;
+    } else if (strcmp(argv[i], "--store-compressed") == 0) {
+      store_frames = 1;
+    } else if (strcmp(argv[i], "--segments") == 0) {
+      segments = 1;
+    } else if (strcmp(argv[i], "--no-sync") == 0) {
+      sync = 0;
+    } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_path = argv[++i];
+    } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+      log_lvl = log_level_from_name(argv[++i]);
+      if (log_lvl == -1) {
+	fprintf(stderr, "Unknown log level '%s'\n", argv[i]);
+	return 1;
+      }
+    } else if (strcmp(argv[i], "--log-rate") == 0 && i + 1 < argc) {
+      if (parse_number(argv[i], argv[i + 1], 0, INT_MAX, &log_rate) == -1) {
+	return usage(argv[0]);
+      }
+      i++;
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  log_init((LogLevel)log_lvl, log_rate);
 
   // Create the backup directory if it doesn't exist in the current directory
   struct stat st = {0};
@@ -35,16 +176,23 @@ int main() {
       perror("Error creating backup directory");
       return 1;
     } else {
-      printf("Created backup directory: %s\n", BACKUP_DIR);
+      log_info("Created backup directory: %s", BACKUP_DIR);
     }
   }
 
-  server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (store_init(segments) == -1) {
+    return 1;
+  }
+
+  server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (server_socket == -1) {
     perror("Error creating socket");
     return 1;
   }
 
+  int reuse = 1;
+  setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(PORT); 
@@ -57,145 +205,98 @@ int main() {
   }
 
   // listen for connection
-  if (listen(server_socket, MAX_CLIENTS) == -1) {
+  if (listen(server_socket, LISTEN_BACKLOG) == -1) {
     perror("Error listening for connections");
     close(server_socket);
     return 1;
   }
 
-  printf("Server listening on port %d...\n", PORT);
+  Server server;
+  memset(&server, 0, sizeof(server));
+  pthread_mutex_init(&server.assembly_lock, NULL);
+  server.store_frames = store_frames;
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server.epoll_fd == -1) {
+    perror("Error creating epoll instance");
+    close(server_socket);
+    return 1;
+  }
+  if (manifest_open(&server.manifest, MANIFEST_FILE) == -1) {
+    close(server_socket);
+    return 1;
+  }
+  log_info("Manifest holds %zu paths", server.manifest.count);
+  if (store_start_compactor(&server.manifest) == -1) {
+    close(server_socket);
+    return 1;
+  }
+  if (pool_init(&server.pool, workers) == -1 ||
+      group_commit_init(&server.commit, &server.pool, BLOB_DIR, sync) == -1) {
+    close(server_socket);
+    return 1;
+  }
 
-  // accept incoming connections
-  while (1) {
-    client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len);
-    if (client_socket == -1) {
-      perror("Error accepting connection");
-      continue; // no client yet - restart loop
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+  ev.data.ptr = &pool_tag;
+  epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.pool.event_fd, &ev);
+  int metrics_socket = -1;
+  if (metrics_path) {
+    if ((metrics_socket = open_metrics_socket(metrics_path)) == -1) {
+      close(server_socket);
+      return 1;
     }
+    ev.data.ptr = &metrics_tag;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, metrics_socket, &ev);
+  }
 
-    printf("Connection from: %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-
-    while (1) { // Handling client in a loop until disconnection
-
-      // Receive filename size - disconnect if 0 
-      bytes_received = recv(client_socket, &filename_size, sizeof(filename_size), 0);
-      if (bytes_received <= 0) {
-	if (bytes_received == 0) {
-	  printf("Client disconnected: %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-	} else {
-	  perror("Error receiving filename size");
-	}
-	break;
-      }
-
-      // Allocate space for filename, +1 for null terminator
-      filename = (char*)malloc(filename_size + 1);
-      if (filename == NULL) {
-	perror("Error allocating memory for filename");
-	break;
-      }
-
-      // Receive filename - disconnect if 0 
-      bytes_received = recv(client_socket, filename, filename_size, 0);
-      if (bytes_received <= 0) {
-	if (bytes_received == 0) {
-	  printf("Client disconnected: %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-	} else {
-	  perror("Error receiving filename");
-	}
-	free(filename);
-	break; 
-      }
-      filename[filename_size] = '\0';
-      printf("Filename: %s\n", filename);
-
-      // if filename ends with '/', type is folder. mkdir here, then restart loop. 
-      // This logic works, but is dependent on recieving folders from the client before the files that are within them.
-      // Shouldn't be a problem with current client code.
-      if (filename[filename_size - 1] == '/') {
-	snprintf(filepath, sizeof(filepath), "%s/%s", BACKUP_DIR, filename);
-	if (mkdir(filepath, 0777) == -1) {
-	  perror("Error creating directory");
-	  processing_status = -1;
-	} else {
-	  printf("Created directory: %s\n", filepath);
-	  processing_status = 1; 
-	}
-
-	send(client_socket, &processing_status, sizeof(processing_status), 0);
-
-	free(filename);
-	filename = NULL;
-	continue;
-      }
-
-      // Receive file size - disconnect if 0 
-      bytes_received = recv(client_socket, &file_size, sizeof(file_size), 0);
-      if (bytes_received <= 0) {
-	if (bytes_received == 0) {
-	  printf("Client disconnected: %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-	} else {
-	  perror("Error receiving file size");
-	}
-	free(filename);
-	break; 
-      }
-
-      //Allocate space for file content
-      file_content = (char *)malloc(file_size);
-      if (file_content == NULL) {
-	perror("Error allocating memory for file content");
-	free(filename);
-	break;
-      }
+  log_info("Server listening on port %d with %d disk workers%s...", PORT, workers,
+	   sync ? "" : ", not syncing");
 
-      // Receive file content - disconnect if 0 bytes rec
-      bytes_received = recv(client_socket, file_content, file_size, 0);
-      if (bytes_received <= 0)
-      {
-	if (bytes_received == 0)
-	{
-	  printf("Client disconnected: %s:%d\n", inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
-	} else {
-	  perror("Error receiving file content");
-	}
-	free(filename);
-	free(file_content);
-	break;
-      }
-
-      snprintf(filepath, sizeof(filepath), "%s/%s", BACKUP_DIR, filename);
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    int n = epoll_wait(server.epoll_fd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      perror("Error waiting for events");
+      break;
+    }
 
-      // Reconstruct the file and store it on disk
-      FILE *fp = fopen(filepath, "wb");
-      if (fp == NULL) {
-	perror("Error opening file for writing");
-	processing_status = -1; 
+    for (int i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag == &listen_tag) {
+	accept_clients(&server, server_socket);
+      } else if (tag == &pool_tag) {
+	server_handle_completions(&server);
+      } else if (tag == &metrics_tag) {
+	serve_metrics(&server, metrics_socket);
       } else {
-	size_t bytes_written = fwrite(file_content, 1, file_size, fp);
-	if (bytes_written < file_size) {
-	  perror("Error writing to file");
-	  processing_status = -1; 
-	} else {
-	  printf("File '%s' saved successfully to '%s' (%zu bytes).\n", filename, filepath, bytes_written);
-	  processing_status = 1;
+	Connection *conn = tag;
+	if (events[i].events & EPOLLOUT) {
+	  conn_on_writable(conn);
+	}
+	if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+	  conn_on_hangup(conn);
+	} else if (events[i].events & EPOLLIN) {
+	  conn_on_readable(conn);
 	}
-	fclose(fp);
       }
-
-      send(client_socket, &processing_status, sizeof(processing_status),0);
-
-      free(filename);
-      free(file_content);
-      filename = NULL;
-      file_content = NULL;
     }
 
-    close(client_socket);
-    printf("Waiting for the next client\n");
+    // acks gathered during this round go out as one batch per client
+    server_flush_dirty(&server);
+    server_reap(&server);
   }
 
-
+  group_commit_shutdown(&server.commit);
+  pool_shutdown(&server.pool);
+  store_close();
+  manifest_close(&server.manifest);
+  close(server.epoll_fd);
+  if (metrics_socket != -1) {
+    close(metrics_socket);
+    unlink(metrics_path);
+  }
   close(server_socket); // will never be reached
   return 0;
 }
@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "hash.h"
+#include "log.h"
+#include "manifest.h"
+#include "store.h"
+
+#define MANIFEST_MIN_BUCKETS 1024
+#define MANIFEST_MIN_DIR_BUCKETS 256
+
+/* FNV-1a; paths share long prefixes, so every byte counts */
+static uint64_t path_hash(const char *path, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)path[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static ManifestEntry *find_entry(const Manifest *m, const char *path, size_t len) {
+  if (m->capacity == 0) {
+    return NULL;
+  }
+  ManifestEntry *e = m->buckets[path_hash(path, len) & (m->capacity - 1)];
+  while (e && (e->rec.path_len != len || memcmp(e->path, path, len) != 0)) {
+    e = e->next;
+  }
+  return e;
+}
+
+static int grow(Manifest *m) {
+  size_t capacity = m->capacity ? m->capacity * 2 : MANIFEST_MIN_BUCKETS;
+  ManifestEntry **buckets = calloc(capacity, sizeof(ManifestEntry *));
+  if (!buckets) {
+    return -1;
+  }
+  for (size_t i = 0; i < m->capacity; i++) {
+    ManifestEntry *e = m->buckets[i];
+    while (e) {
+      ManifestEntry *next = e->next;
+      size_t b = path_hash(e->path, e->rec.path_len) & (capacity - 1);
+      e->next = buckets[b];
+      buckets[b] = e;
+      e = next;
+    }
+  }
+  free(m->buckets);
+  m->buckets = buckets;
+  m->capacity = capacity;
+  return 0;
+}
+
+static ManifestDir *find_dir(const Manifest *m, const char *path, size_t len) {
+  if (m->dir_capacity == 0) {
+    return NULL;
+  }
+  ManifestDir *d = m->dir_buckets[path_hash(path, len) & (m->dir_capacity - 1)];
+  while (d && (d->path_len != len || memcmp(d->path, path, len) != 0)) {
+    d = d->next;
+  }
+  return d;
+}
+
+static int grow_dirs(Manifest *m) {
+  size_t capacity = m->dir_capacity ? m->dir_capacity * 2 : MANIFEST_MIN_DIR_BUCKETS;
+  ManifestDir **buckets = calloc(capacity, sizeof(ManifestDir *));
+  if (!buckets) {
+    return -1;
+  }
+  for (size_t i = 0; i < m->dir_capacity; i++) {
+    ManifestDir *d = m->dir_buckets[i];
+    while (d) {
+      ManifestDir *next = d->next;
+      size_t b = path_hash(d->path, d->path_len) & (capacity - 1);
+      d->next = buckets[b];
+      buckets[b] = d;
+      d = next;
+    }
+  }
+  free(m->dir_buckets);
+  m->dir_buckets = buckets;
+  m->dir_capacity = capacity;
+  return 0;
+}
+
+/* the directory of the first len bytes of path, created along with its
+ * parents if it is new */
+static ManifestDir *get_dir(Manifest *m, const char *path, size_t len) {
+  ManifestDir *d = find_dir(m, path, len);
+  if (d) {
+    return d;
+  }
+  ManifestDir *parent = NULL;
+  const char *slash = memrchr(path, '/', len);
+  if (slash && !(parent = get_dir(m, path, (size_t)(slash - path)))) {
+    return NULL;
+  }
+  if (m->dir_count >= m->dir_capacity && grow_dirs(m) == -1) {
+    return NULL;
+  }
+  d = calloc(1, sizeof(ManifestDir) + len + 1);
+  if (!d) {
+    return NULL;
+  }
+  memcpy(d->path, path, len);
+  d->path_len = (uint32_t)len;
+  d->parent = parent;
+  if (parent) {
+    d->sibling = parent->dirs;
+    parent->dirs = d;
+  }
+  size_t b = path_hash(path, len) & (m->dir_capacity - 1);
+  d->next = m->dir_buckets[b];
+  m->dir_buckets[b] = d;
+  m->dir_count++;
+  return d;
+}
+
+/* something below d changed: its digest and all above are stale */
+static void touch_dir(ManifestDir *d) {
+  for (; d; d = d->parent) {
+    d->digest_algo = 0;
+  }
+}
+
+/* the directory path is in, if it has been filed */
+static ManifestDir *dir_of(const Manifest *m, const char *path, size_t len) {
+  const char *slash = memrchr(path, '/', len);
+  return slash ? find_dir(m, path, (size_t)(slash - path)) : NULL;
+}
+
+/* adds path, or gives it the record's blob if it is known already */
+static int put_entry(Manifest *m, const ManifestRecord *rec, const char *path) {
+  ManifestEntry *e = find_entry(m, path, rec->path_len);
+  if (e) {
+    if (e->rec.hash_algo != rec->hash_algo || memcmp(e->rec.blob_id, rec->blob_id, BLOB_ID_SIZE) != 0) {
+      touch_dir(dir_of(m, path, rec->path_len));
+    }
+    e->rec = *rec;
+    return 0;
+  }
+  if (m->count >= m->capacity && grow(m) == -1) {
+    perror("Error growing manifest");
+    return -1;
+  }
+  e = malloc(sizeof(ManifestEntry) + rec->path_len + 1);
+  if (!e) {
+    perror("Error allocating manifest entry");
+    return -1;
+  }
+  e->rec = *rec;
+  memcpy(e->path, path, rec->path_len);
+  e->path[rec->path_len] = '\0';
+  size_t b = path_hash(path, rec->path_len) & (m->capacity - 1);
+  e->next = m->buckets[b];
+  m->buckets[b] = e;
+  m->count++;
+
+  // paths are all under BACKUP_DIR, so there is a directory to file it in
+  const char *slash = memrchr(path, '/', rec->path_len);
+  ManifestDir *d = slash ? get_dir(m, path, (size_t)(slash - path)) : NULL;
+  if (d) {
+    e->dir_next = d->files;
+    d->files = e;
+    touch_dir(d);
+  } else {
+    e->dir_next = NULL;
+    perror("Error filing manifest entry by directory");
+  }
+  return 0;
+}
+
+/* the entries of d that a digest in hash_algo covers, unsorted */
+static HashChild *dir_children(const ManifestDir *d, uint32_t hash_algo, size_t *count) {
+  size_t n = 1;
+  for (const ManifestEntry *f = d->files; f; f = f->dir_next) {
+    n++;
+  }
+  for (const ManifestDir *sub = d->dirs; sub; sub = sub->sibling) {
+    n++;
+  }
+  HashChild *children = malloc(n * sizeof(HashChild));
+  if (!children) {
+    return NULL;
+  }
+  size_t i = 0;
+  for (const ManifestEntry *f = d->files; f; f = f->dir_next) {
+    if (f->rec.hash_algo == hash_algo) {
+      children[i++] = (HashChild){ f->path + d->path_len + 1, f->rec.path_len - d->path_len - 1, f->rec.blob_id, 0 };
+    }
+  }
+  for (const ManifestDir *sub = d->dirs; sub; sub = sub->sibling) {
+    if (sub->has_digest) {
+      children[i++] = (HashChild){ sub->path + d->path_len + 1, sub->path_len - d->path_len - 1, sub->digest, 1 };
+    }
+  }
+  *count = i;
+  return children;
+}
+
+/* brings the digests of d and everything below it up to date */
+static int update_digest(ManifestDir *d, HashCtx *ctx) {
+  if (d->digest_algo == ctx->algo) {
+    return 0;
+  }
+  for (ManifestDir *sub = d->dirs; sub; sub = sub->sibling) {
+    if (update_digest(sub, ctx) == -1) {
+      return -1;
+    }
+  }
+  size_t count;
+  HashChild *children = dir_children(d, ctx->algo, &count);
+  if (!children) {
+    return -1;
+  }
+  int status = count > 0 ? hash_folder(ctx, children, count, d->digest) : 0;
+  free(children);
+  if (status == -1) {
+    return -1;
+  }
+  d->has_digest = count > 0;
+  d->digest_algo = ctx->algo;
+  return 0;
+}
+
+static int append(int fd, const ManifestRecord *rec, const char *path) {
+  struct iovec iov[2] = { { (void *)rec, sizeof(*rec) }, { (void *)path, rec->path_len } };
+  ssize_t n;
+  do {
+    n = writev(fd, iov, 2);
+  } while (n < 0 && errno == EINTR);
+  return n == (ssize_t)(sizeof(*rec) + rec->path_len) ? 0 : -1;
+}
+
+/* reads every intact record of the log into the table. Returns the
+ * length of the intact part, 0 if there is no log or it isn't ours. */
+static off_t load(Manifest *m, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return 0;
+  }
+  ManifestHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != MANIFEST_MAGIC ||
+      header.version != MANIFEST_VERSION) {
+    fclose(file);
+    return 0;
+  }
+  char buf[MAX_WIRE_PATH + 64]; // BACKUP_DIR "/" wire path
+  ManifestRecord rec;
+  off_t good = (off_t)sizeof(header);
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    if (rec.path_len == 0 || rec.path_len >= sizeof(buf) || fread(buf, 1, rec.path_len, file) != rec.path_len) {
+      break;
+    }
+    if (put_entry(m, &rec, buf) == -1) {
+      break;
+    }
+    m->records++;
+    good = (off_t)ftell(file);
+  }
+  fclose(file);
+  return good;
+}
+
+/* writes the live entries to a new log and moves it over the old one */
+static int compact(Manifest *m, const char *path) {
+  size_t len = strlen(path) + 8;
+  char *tmp = malloc(len);
+  if (!tmp) {
+    return -1;
+  }
+  snprintf(tmp, len, "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  ManifestHeader header = { MANIFEST_MAGIC, MANIFEST_VERSION };
+  int status = fd == -1 || write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ? -1 : 0;
+  for (size_t i = 0; i < m->capacity && status == 0; i++) {
+    for (ManifestEntry *e = m->buckets[i]; e && status == 0; e = e->next) {
+      status = append(fd, &e->rec, e->path);
+    }
+  }
+  if (fd != -1 && (fsync(fd) == -1 || close(fd) == -1)) {
+    status = -1;
+  }
+  if (status == 0 && rename(tmp, path) == -1) {
+    status = -1;
+  }
+  if (status == -1) {
+    perror("Error compacting manifest");
+    unlink(tmp);
+  } else {
+    m->records = m->count;
+  }
+  free(tmp);
+  return status;
+}
+
+int manifest_open(Manifest *m, const char *path) {
+  memset(m, 0, sizeof(*m));
+  m->fd = -1;
+  pthread_mutex_init(&m->lock, NULL);
+  if (grow(m) == -1) {
+    perror("Error allocating manifest");
+    return -1;
+  }
+
+  off_t good = load(m, path);
+  if (good == 0) {
+    // missing or unreadable: start over
+    m->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    ManifestHeader header = { MANIFEST_MAGIC, MANIFEST_VERSION };
+    int status = m->fd == -1 || write(m->fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ? -1 : 0;
+    if (m->fd != -1) {
+      close(m->fd);
+    }
+    if (status == -1) {
+      perror("Error creating manifest");
+      return -1;
+    }
+  } else if (m->records >= MANIFEST_COMPACT_MIN && m->records > 2 * m->count) {
+    if (compact(m, path) == 0) {
+      log_info("Compacted the manifest to %zu paths", m->count);
+    }
+  } else if (truncate(path, good) == -1) {
+    // appending after a torn record would hide everything that follows
+    perror("Error trimming manifest");
+    return -1;
+  }
+
+  m->fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (m->fd == -1) {
+    perror("Error opening manifest");
+    return -1;
+  }
+  return 0;
+}
+
+void manifest_record(Manifest *m, const char *path, uint32_t hash_algo, const unsigned char *id) {
+  struct stat st;
+  uint64_t size;
+  int64_t mtime;
+  if (lstat(path, &st) == 0) {
+    size = (uint64_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+  } else if (store_blob_size(hash_algo, id, &size) == 0) {
+    // in a segment or in frame format: there is no file at path
+    mtime = (int64_t)time(NULL);
+  } else {
+    fprintf(stderr, "Error recording %s: blob not in the store\n", path);
+    return;
+  }
+  ManifestRecord rec = { (uint32_t)strlen(path), hash_algo, { 0 }, size, mtime };
+  memcpy(rec.blob_id, id, BLOB_ID_SIZE);
+
+  // only the commit thread appends, the lock is for the table
+  if (m->fd != -1 && append(m->fd, &rec, path) == -1) {
+    perror("Error writing manifest; it is no longer kept up to date");
+    close(m->fd);
+    m->fd = -1;
+  }
+  pthread_mutex_lock(&m->lock);
+  put_entry(m, &rec, path);
+  m->records++;
+  pthread_mutex_unlock(&m->lock);
+}
+
+int manifest_has(Manifest *m, const char *path, uint32_t hash_algo, const unsigned char *id) {
+  pthread_mutex_lock(&m->lock);
+  ManifestEntry *e = find_entry(m, path, strlen(path));
+  int found = e && e->rec.hash_algo == hash_algo && memcmp(e->rec.blob_id, id, BLOB_ID_SIZE) == 0;
+  pthread_mutex_unlock(&m->lock);
+  return found;
+}
+
+int manifest_tree(Manifest *m, const char *path, uint32_t hash_algo, unsigned char **body, size_t *len) {
+  HashCtx ctx;
+  if (hash_ctx_init(&ctx, hash_algo) == -1) {
+    return -1;
+  }
+  HashChild *children = NULL;
+  size_t count = 0;
+  unsigned char digest[BLOB_ID_SIZE] = { 0 };
+  int status = 0;
+  *body = NULL;
+  pthread_mutex_lock(&m->lock);
+  ManifestDir *d = find_dir(m, path, strlen(path));
+  if (d) {
+    // the parents' digests were taken from the ones about to be replaced
+    if (d->digest_algo != hash_algo) {
+      touch_dir(d->parent);
+    }
+    status = update_digest(d, &ctx);
+    if (status == 0 && !(children = dir_children(d, hash_algo, &count))) {
+      status = -1;
+    }
+    // sorts them for the listing, and gives the digest just kept
+    if (status == 0 && count > 0) {
+      status = hash_folder(&ctx, children, count, digest);
+    }
+  }
+  if (status == 0) {
+    *len = TREE_PREFIX_SIZE;
+    for (size_t i = 0; i < count; i++) {
+      *len += TREE_ENTRY_SIZE + children[i].name_len;
+    }
+    *body = malloc(*len);
+  }
+  if (*body) {
+    memcpy(*body, digest, BLOB_ID_SIZE);
+    uint32_t n = htobe32((uint32_t)count);
+    memcpy(*body + BLOB_ID_SIZE, &n, 4);
+    unsigned char *p = *body + TREE_PREFIX_SIZE;
+    for (size_t i = 0; i < count; i++) {
+      TreeEntryHeader entry = { children[i].is_folder ? 1 : 0, (uint32_t)children[i].name_len, { 0 } };
+      memcpy(entry.digest, children[i].digest, BLOB_ID_SIZE);
+      encode_tree_entry(&entry, p);
+      memcpy(p + TREE_ENTRY_SIZE, children[i].name, children[i].name_len);
+      p += TREE_ENTRY_SIZE + children[i].name_len;
+    }
+  } else {
+    status = -1;
+  }
+  pthread_mutex_unlock(&m->lock);
+  free(children);
+  hash_ctx_free(&ctx);
+  return status;
+}
+
+void manifest_each(Manifest *m, void (*fn)(void *ctx, const ManifestRecord *rec), void *ctx) {
+  pthread_mutex_lock(&m->lock);
+  for (size_t i = 0; i < m->capacity; i++) {
+    for (ManifestEntry *e = m->buckets[i]; e; e = e->next) {
+      fn(ctx, &e->rec);
+    }
+  }
+  pthread_mutex_unlock(&m->lock);
+}
+
+void manifest_close(Manifest *m) {
+  if (m->fd != -1) {
+    close(m->fd);
+    m->fd = -1;
+  }
+  for (size_t i = 0; i < m->capacity; i++) {
+    ManifestEntry *e = m->buckets[i];
+    while (e) {
+      ManifestEntry *next = e->next;
+      free(e);
+      e = next;
+    }
+  }
+  free(m->buckets);
+  m->buckets = NULL;
+  m->capacity = m->count = 0;
+  for (size_t i = 0; i < m->dir_capacity; i++) {
+    ManifestDir *d = m->dir_buckets[i];
+    while (d) {
+      ManifestDir *next = d->next;
+      free(d);
+      d = next;
+    }
+  }
+  free(m->dir_buckets);
+  m->dir_buckets = NULL;
+  m->dir_capacity = m->dir_count = 0;
+  pthread_mutex_destroy(&m->lock);
+}
@@ -0,0 +1,729 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "log.h"
+#include "segment.h"
+
+#define SEGMENT_MIN_CAPACITY 4096
+#define SEGMENT_PATH_SIZE (sizeof(SEGMENT_DIR) + 16)
+
+static void segment_path(uint32_t id, const char *ext, char *out) {
+  snprintf(out, SEGMENT_PATH_SIZE, "%s/%08x.%s", SEGMENT_DIR, id, ext);
+}
+
+/* ids are digests already, any 8 bytes of them will do */
+static size_t id_hash(uint32_t algo, const unsigned char *id) {
+  uint64_t h;
+  memcpy(&h, id, sizeof(h));
+  return (size_t)(h ^ algo);
+}
+
+/* slot holding the blob, or the free one it would go in */
+static size_t slot_of(const SegmentStore *s, uint32_t algo, const unsigned char *id) {
+  size_t mask = s->capacity - 1;
+  size_t i = id_hash(algo, id) & mask;
+  while (s->entries[i].segment != 0 &&
+	 (s->entries[i].hash_algo != algo || memcmp(s->entries[i].blob_id, id, BLOB_ID_SIZE) != 0)) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static SegmentEntry *find(const SegmentStore *s, uint32_t algo, const unsigned char *id) {
+  if (s->capacity == 0) {
+    return NULL;
+  }
+  SegmentEntry *e = &s->entries[slot_of(s, algo, id)];
+  return e->segment != 0 ? e : NULL;
+}
+
+static int grow(SegmentStore *s) {
+  size_t capacity = s->capacity ? s->capacity * 2 : SEGMENT_MIN_CAPACITY;
+  SegmentEntry *old = s->entries;
+  size_t old_capacity = s->capacity;
+  s->entries = calloc(capacity, sizeof(SegmentEntry));
+  if (!s->entries) {
+    s->entries = old;
+    return -1;
+  }
+  s->capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].segment != 0) {
+      s->entries[slot_of(s, old[i].hash_algo, old[i].blob_id)] = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+/* adds the blob at (segment, offset, length), or moves it there */
+static int set_entry(SegmentStore *s, uint32_t algo, const unsigned char *id, uint32_t segment, uint64_t offset,
+		     uint64_t length) {
+  if ((s->count + 1) * 4 > s->capacity * 3 && grow(s) == -1) {
+    perror("Error growing segment index");
+    return -1;
+  }
+  SegmentEntry *e = &s->entries[slot_of(s, algo, id)];
+  if (e->segment == 0) {
+    memcpy(e->blob_id, id, BLOB_ID_SIZE);
+    e->hash_algo = (uint16_t)algo;
+    e->flags = 0;
+    s->count++;
+  }
+  e->segment = segment;
+  e->offset = (uint32_t)offset;
+  e->length = (uint32_t)length;
+  return 0;
+}
+
+/* frees slot i, shifting back the entries of the run after it that
+ * would otherwise no longer be found */
+static void remove_entry(SegmentStore *s, size_t i) {
+  size_t mask = s->capacity - 1;
+  for (size_t j = (i + 1) & mask; s->entries[j].segment != 0; j = (j + 1) & mask) {
+    size_t home = id_hash(s->entries[j].hash_algo, s->entries[j].blob_id) & mask;
+    // it may fill the hole unless its home lies in (i, j]
+    int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+    if (!stays) {
+      s->entries[i] = s->entries[j];
+      i = j;
+    }
+  }
+  s->entries[i].segment = 0;
+  s->count--;
+}
+
+static SegmentInfo *add_segment(SegmentStore *s, uint32_t id) {
+  if (s->segment_count == s->segment_cap) {
+    size_t cap = s->segment_cap ? s->segment_cap * 2 : 16;
+    SegmentInfo *segments = realloc(s->segments, cap * sizeof(SegmentInfo));
+    if (!segments) {
+      perror("Error allocating segment list");
+      return NULL;
+    }
+    s->segments = segments;
+    s->segment_cap = cap;
+  }
+  SegmentInfo *info = &s->segments[s->segment_count++];
+  *info = (SegmentInfo){ id, 0, 0 };
+  return info;
+}
+
+static ssize_t find_segment(const SegmentStore *s, uint32_t id) {
+  size_t lo = 0, hi = s->segment_count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (s->segments[mid].id < id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < s->segment_count && s->segments[lo].id == id ? (ssize_t)lo : -1;
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t offset) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = pread(fd, p, len, (off_t)offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+    offset += (uint64_t)n;
+  }
+  return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, (off_t)offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+    offset += (uint64_t)n;
+  }
+  return 0;
+}
+
+/* len bytes from in at in_off to out at out_off, in the kernel where it
+ * can */
+static int copy_range(int in, uint64_t in_off, int out, uint64_t out_off, uint64_t len) {
+  loff_t src = (loff_t)in_off, dst = (loff_t)out_off;
+  while (len > 0) {
+    ssize_t n = copy_file_range(in, &src, out, &dst, len, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      break;
+    }
+    len -= (uint64_t)n;
+  }
+  char buf[65536];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? (size_t)len : sizeof(buf);
+    if (pread_all(in, buf, n, (uint64_t)src) == -1 || pwrite_all(out, buf, n, (uint64_t)dst) == -1) {
+      return -1;
+    }
+    src += (loff_t)n;
+    dst += (loff_t)n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int by_offset(const void *a, const void *b) {
+  uint32_t x = ((const SegmentIndexRecord *)a)->offset, y = ((const SegmentIndexRecord *)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+/* writes the index of a segment that is complete, in the order its
+ * records are in, so reading them back goes front to back */
+static int write_index(SegmentStore *s, const SegmentInfo *info) {
+  size_t count = 0;
+  for (size_t i = 0; i < s->capacity; i++) {
+    count += s->entries[i].segment == info->id;
+  }
+  SegmentIndexRecord *recs = calloc(count ? count : 1, sizeof(SegmentIndexRecord));
+  if (!recs) {
+    return -1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < s->capacity; i++) {
+    const SegmentEntry *e = &s->entries[i];
+    if (e->segment == info->id) {
+      recs[n] = (SegmentIndexRecord){ e->hash_algo, e->offset, e->length, 0, { 0 } };
+      memcpy(recs[n++].blob_id, e->blob_id, BLOB_ID_SIZE);
+    }
+  }
+  qsort(recs, count, sizeof(SegmentIndexRecord), by_offset);
+
+  char path[SEGMENT_PATH_SIZE], tmp[SEGMENT_PATH_SIZE + 4];
+  segment_path(info->id, "idx", path);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  SegmentIndexHeader header = { SEGMENT_INDEX_MAGIC, (uint32_t)count };
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  int status = fd == -1 || pwrite_all(fd, &header, sizeof(header), 0) == -1 ||
+	  pwrite_all(fd, recs, count * sizeof(SegmentIndexRecord), sizeof(header)) == -1 ? -1 : 0;
+  if (fd != -1 && (fsync(fd) == -1 || close(fd) == -1)) {
+    status = -1;
+  }
+  if (status == 0 && rename(tmp, path) == -1) {
+    status = -1;
+  }
+  if (status == -1) {
+    unlink(tmp);
+  }
+  free(recs);
+  return status;
+}
+
+/* the active segment is full: sync it, index it and start the next */
+static int roll(SegmentStore *s) {
+  if (s->active_fd != -1) {
+    SegmentInfo *last = &s->segments[s->segment_count - 1];
+    // without an index it is scanned at the next start, so that is all
+    // that can go wrong here
+    if (fdatasync(s->active_fd) == -1 || write_index(s, last) == -1) {
+      perror("Error sealing segment");
+    }
+    last->sealed_at = (int64_t)time(NULL);
+    close(s->active_fd);
+    s->active_fd = -1;
+  }
+  uint32_t id = s->segment_count ? s->segments[s->segment_count - 1].id + 1 : 1;
+  char path[SEGMENT_PATH_SIZE];
+  segment_path(id, "seg", path);
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    perror("Error creating segment");
+    return -1;
+  }
+  if (!add_segment(s, id)) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  s->active_fd = fd;
+  return 0;
+}
+
+/* appends a record for length bytes of fd at offset; lock held */
+static int append(SegmentStore *s, uint32_t algo, const unsigned char *id, int fd, uint64_t offset,
+		  uint64_t length) {
+  SegmentInfo *active = s->active_fd != -1 ? &s->segments[s->segment_count - 1] : NULL;
+  if (!active || (active->size > 0 && active->size + sizeof(SegmentRecord) + length > SEGMENT_TARGET_SIZE)) {
+    if (roll(s) == -1) {
+      return -1;
+    }
+    active = &s->segments[s->segment_count - 1];
+  }
+  SegmentRecord rec = { SEGMENT_RECORD_MAGIC, algo, (uint32_t)length, 0, { 0 } };
+  memcpy(rec.blob_id, id, BLOB_ID_SIZE);
+  // a record that fails halfway is overwritten by the next one
+  uint64_t at = active->size;
+  if (pwrite_all(s->active_fd, &rec, sizeof(rec), at) == -1 ||
+      copy_range(fd, offset, s->active_fd, at + sizeof(rec), length) == -1) {
+    perror("Error appending to segment");
+    return -1;
+  }
+  if (set_entry(s, algo, id, active->id, at + sizeof(rec), length) == -1) {
+    return -1;
+  }
+  active->size = at + sizeof(rec) + length;
+  return 0;
+}
+
+/* reads a sealed segment's index into the table. Returns -1 if it has
+ * none or it doesn't fit the segment. */
+static int load_index(SegmentStore *s, SegmentInfo *info) {
+  char path[SEGMENT_PATH_SIZE];
+  segment_path(info->id, "idx", path);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  SegmentIndexHeader header;
+  SegmentIndexRecord *recs = NULL;
+  int status = -1;
+  if (fstat(fd, &st) == 0 && pread_all(fd, &header, sizeof(header), 0) == 0 &&
+      header.magic == SEGMENT_INDEX_MAGIC &&
+      (uint64_t)st.st_size == sizeof(header) + (uint64_t)header.count * sizeof(SegmentIndexRecord) &&
+      (recs = malloc((header.count ? header.count : 1) * sizeof(SegmentIndexRecord))) &&
+      pread_all(fd, recs, header.count * sizeof(SegmentIndexRecord), sizeof(header)) == 0) {
+    status = 0;
+    for (uint32_t i = 0; i < header.count && status == 0; i++) {
+      if (!hash_name(recs[i].hash_algo) || recs[i].length > SEGMENT_MAX_BLOB ||
+	  (uint64_t)recs[i].offset + recs[i].length > info->size) {
+	status = -1;
+      }
+    }
+    for (uint32_t i = 0; i < header.count && status == 0; i++) {
+      status = set_entry(s, recs[i].hash_algo, recs[i].blob_id, info->id, recs[i].offset, recs[i].length);
+    }
+    info->sealed_at = (int64_t)st.st_mtime;
+  }
+  free(recs);
+  close(fd);
+  return status;
+}
+
+/* reads back the records of a segment that wasn't sealed, checking each
+ * against its id, and cuts it off after the last good one */
+static int scan_segment(SegmentStore *s, SegmentInfo *info, int fd, HashCtx *hashes) {
+  char *buf = malloc(SEGMENT_MAX_BLOB);
+  if (!buf) {
+    perror("Error allocating segment buffer");
+    return -1;
+  }
+  uint64_t good = 0;
+  SegmentRecord rec;
+  while (good + sizeof(rec) <= info->size && pread_all(fd, &rec, sizeof(rec), good) == 0) {
+    uint64_t at = good + sizeof(rec);
+    unsigned char digest[HASH_DIGEST_SIZE];
+    if (rec.magic != SEGMENT_RECORD_MAGIC || (rec.hash_algo != HASH_SHA256 && rec.hash_algo != HASH_BLAKE3) ||
+	rec.length > SEGMENT_MAX_BLOB || at + rec.length > info->size ||
+	pread_all(fd, buf, rec.length, at) == -1) {
+      break;
+    }
+    HashCtx *hash = &hashes[rec.hash_algo == HASH_BLAKE3];
+    if (hash_begin(hash) == -1 || hash_update(hash, buf, rec.length) == -1 || hash_finish(hash, digest) == -1 ||
+	memcmp(digest, rec.blob_id, BLOB_ID_SIZE) != 0) {
+      break;
+    }
+    if (set_entry(s, rec.hash_algo, rec.blob_id, info->id, at, rec.length) == -1) {
+      free(buf);
+      return -1;
+    }
+    good = at + rec.length;
+  }
+  free(buf);
+  if (good < info->size) {
+    log_warn("Segment %08x: cut off %llu bytes after the last intact record", info->id,
+	     (unsigned long long)(info->size - good));
+    if (ftruncate(fd, (off_t)good) == -1) {
+      perror("Error trimming segment");
+      return -1;
+    }
+    info->size = good;
+  }
+  return 0;
+}
+
+static int by_id(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* ids of the segments on disk, ascending */
+static uint32_t *list_segments(size_t *count) {
+  *count = 0;
+  DIR *dir = opendir(SEGMENT_DIR);
+  if (!dir) {
+    return errno == ENOENT ? calloc(1, sizeof(uint32_t)) : NULL;
+  }
+  size_t cap = 16;
+  uint32_t *ids = malloc(cap * sizeof(uint32_t));
+  struct dirent *entry;
+  while (ids && (entry = readdir(dir)) != NULL) {
+    unsigned int id;
+    char ext[8];
+    if (sscanf(entry->d_name, "%8x.%7s", &id, ext) != 2 || strcmp(ext, "seg") != 0 || id == 0) {
+      if (strstr(entry->d_name, ".idx.tmp")) {
+	unlinkat(dirfd(dir), entry->d_name, 0); // an index a crash cut short
+      }
+      continue;
+    }
+    if (*count == cap) {
+      uint32_t *grown = realloc(ids, (cap *= 2) * sizeof(uint32_t));
+      if (!grown) {
+	free(ids);
+	ids = NULL;
+	break;
+      }
+      ids = grown;
+    }
+    ids[(*count)++] = id;
+  }
+  closedir(dir);
+  if (ids) {
+    qsort(ids, *count, sizeof(uint32_t), by_id);
+  }
+  return ids;
+}
+
+int segment_store_open(SegmentStore *s, int writes) {
+  memset(s, 0, sizeof(*s));
+  s->active_fd = -1;
+  s->writes = writes;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_rwlock_init(&s->linking, NULL);
+  pthread_cond_init(&s->wake, NULL);
+  if (grow(s) == -1) {
+    perror("Error allocating segment index");
+    return -1;
+  }
+  size_t count;
+  uint32_t *ids = list_segments(&count);
+  if (!ids) {
+    perror("Error listing segments");
+    return -1;
+  }
+  HashCtx hashes[2];
+  if (hash_ctx_init(&hashes[0], HASH_SHA256) == -1 || hash_ctx_init(&hashes[1], HASH_BLAKE3) == -1) {
+    fprintf(stderr, "Error initializing segment digests\n");
+    free(ids);
+    return -1;
+  }
+
+  // in id order, so that a blob compaction copied but didn't get to
+  // delete yet ends up at its newer place
+  int status = 0;
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < count && status == 0; i++) {
+    char path[SEGMENT_PATH_SIZE];
+    segment_path(ids[i], "seg", path);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    SegmentInfo *info = NULL;
+    if (fd == -1 || fstat(fd, &st) == -1 || !(info = add_segment(s, ids[i]))) {
+      perror("Error opening segment");
+      status = -1;
+    } else {
+      info->size = (uint64_t)st.st_size;
+      if (load_index(s, info) == -1) {
+	int last = i + 1 == count;
+	status = scan_segment(s, info, fd, hashes);
+	if (status == 0 && !last && writes) {
+	  // sealed, but the index got lost
+	  write_index(s, info);
+	  info->sealed_at = (int64_t)time(NULL);
+	} else if (status == 0 && last && writes) {
+	  s->active_fd = fd;
+	  fd = -1;
+	}
+      }
+      bytes += info->size;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  hash_ctx_free(&hashes[0]);
+  hash_ctx_free(&hashes[1]);
+  free(ids);
+  if (status == 0) {
+    log_info("Segments hold %zu blobs in %zu files (%llu bytes)", s->count, s->segment_count,
+	     (unsigned long long)bytes);
+  }
+  return status;
+}
+
+int segment_store_put(SegmentStore *s, uint32_t algo, const unsigned char *id, int fd, uint64_t offset,
+		      uint64_t length) {
+  if (length > SEGMENT_MAX_BLOB) {
+    return -1;
+  }
+  pthread_mutex_lock(&s->lock);
+  int status = 0;
+  if (!find(s, algo, id)) {
+    status = s->writes ? append(s, algo, id, fd, offset, length) : -1;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return status;
+}
+
+int segment_store_has(SegmentStore *s, uint32_t algo, const unsigned char *id, int link) {
+  pthread_mutex_lock(&s->lock);
+  SegmentEntry *e = find(s, algo, id);
+  if (e && link) {
+    e->flags |= SEGMENT_LINKED;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return e != NULL;
+}
+
+int segment_store_length(SegmentStore *s, uint32_t algo, const unsigned char *id, uint64_t *length) {
+  pthread_mutex_lock(&s->lock);
+  SegmentEntry *e = find(s, algo, id);
+  if (e) {
+    *length = e->length;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return e ? 0 : -1;
+}
+
+int segment_store_open_blob(SegmentStore *s, uint32_t algo, const unsigned char *id, uint64_t *offset,
+			    uint64_t *length) {
+  // compaction may move it and delete the segment in between; it is
+  // found at its new place the second time
+  for (int attempt = 0; attempt < 2; attempt++) {
+    pthread_mutex_lock(&s->lock);
+    SegmentEntry *e = find(s, algo, id);
+    uint32_t segment = e ? e->segment : 0;
+    if (e) {
+      *offset = e->offset;
+      *length = e->length;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!segment) {
+      return -1;
+    }
+    char path[SEGMENT_PATH_SIZE];
+    segment_path(segment, "seg", path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 || errno != ENOENT) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+static void mark_live(void *ctx, const ManifestRecord *rec) {
+  SegmentEntry *e = find(ctx, rec->hash_algo, rec->blob_id);
+  if (e) {
+    e->flags |= SEGMENT_LIVE;
+  }
+}
+
+/* copies what is still live out of a segment, then deletes it */
+static void compact_segment(SegmentStore *s, uint32_t segment) {
+  char path[SEGMENT_PATH_SIZE], index[SEGMENT_PATH_SIZE];
+  segment_path(segment, "seg", path);
+  segment_path(segment, "idx", index);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror("Error opening segment for compaction");
+    return;
+  }
+  // the table moves entries around as they are added and removed, so
+  // the ones to look at are picked out first
+  pthread_mutex_lock(&s->lock);
+  size_t count = 0;
+  for (size_t i = 0; i < s->capacity; i++) {
+    count += s->entries[i].segment == segment;
+  }
+  SegmentEntry *todo = malloc((count ? count : 1) * sizeof(SegmentEntry));
+  for (size_t i = 0, n = 0; todo && i < s->capacity; i++) {
+    if (s->entries[i].segment == segment) {
+      todo[n++] = s->entries[i];
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (!todo) {
+    perror("Error allocating compaction list");
+    close(fd);
+    return;
+  }
+
+  uint64_t moved = 0, dropped = 0;
+  int status = 0;
+  for (size_t i = 0; i < count && status == 0; i++) {
+    pthread_mutex_lock(&s->lock);
+    size_t slot = slot_of(s, todo[i].hash_algo, todo[i].blob_id);
+    SegmentEntry e = s->entries[slot];
+    if (e.segment == segment && e.flags) {
+      status = append(s, e.hash_algo, e.blob_id, fd, e.offset, e.length);
+      moved += e.length;
+    } else if (e.segment == segment) {
+      remove_entry(s, slot);
+      dropped += sizeof(SegmentRecord) + e.length;
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  free(todo);
+  close(fd);
+  if (status == -1) {
+    return; // whatever got copied is found at its new place
+  }
+
+  // the copies have to be durable before the originals go
+  pthread_mutex_lock(&s->lock);
+  if (s->active_fd != -1 && fdatasync(s->active_fd) == -1) {
+    status = -1;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (status == -1 || (unlink(index) == -1 && errno != ENOENT) || unlink(path) == -1) {
+    perror("Error removing compacted segment");
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  ssize_t at = find_segment(s, segment);
+  if (at != -1) {
+    memmove(&s->segments[at], &s->segments[at + 1], (s->segment_count - (size_t)at - 1) * sizeof(SegmentInfo));
+    s->segment_count--;
+  }
+  s->reclaimed += dropped;
+  pthread_mutex_unlock(&s->lock);
+  log_info("Compacted segment %08x: kept %llu bytes, reclaimed %llu", segment, (unsigned long long)moved,
+	   (unsigned long long)dropped);
+}
+
+/* one look for segments that are mostly dead. Data only dies when a path
+ * is pointed elsewhere, so without new manifest records or segments that
+ * just got old enough there is nothing to do. */
+static void compact(SegmentStore *s) {
+  Manifest *m = s->manifest;
+  pthread_mutex_lock(&m->lock);
+  uint64_t records = m->records;
+  int intact = m->fd != -1;
+  pthread_mutex_unlock(&m->lock);
+  if (!intact) {
+    return; // paths it missed would look dead
+  }
+
+  int64_t cutoff = (int64_t)time(NULL) - SEGMENT_COMPACT_MIN_AGE;
+  pthread_mutex_lock(&s->lock);
+  size_t old = 0;
+  for (size_t i = 0; i < s->segment_count; i++) {
+    old += s->segments[i].sealed_at != 0 && s->segments[i].sealed_at <= cutoff;
+  }
+  pthread_mutex_unlock(&s->lock);
+  if (old == 0 || (records == s->compacted_records && old == s->compacted_old)) {
+    return;
+  }
+  s->compacted_records = records;
+
+  // no link may fall between reading the manifest and the marks, and
+  // links from here on mark what they point at themselves
+  pthread_rwlock_wrlock(&s->linking);
+  pthread_mutex_lock(&s->lock);
+  for (size_t i = 0; i < s->capacity; i++) {
+    s->entries[i].flags = 0;
+  }
+  manifest_each(m, mark_live, s);
+  pthread_rwlock_unlock(&s->linking);
+
+  uint64_t *live = calloc(s->segment_count ? s->segment_count : 1, sizeof(uint64_t));
+  uint32_t *victims = malloc((s->segment_count ? s->segment_count : 1) * sizeof(uint32_t));
+  size_t count = 0;
+  if (live && victims) {
+    for (size_t i = 0; i < s->capacity; i++) {
+      const SegmentEntry *e = &s->entries[i];
+      ssize_t at = e->segment != 0 && e->flags ? find_segment(s, e->segment) : -1;
+      if (at != -1) {
+	live[at] += sizeof(SegmentRecord) + e->length;
+      }
+    }
+    for (size_t i = 0; i < s->segment_count; i++) {
+      const SegmentInfo *info = &s->segments[i];
+      if (info->sealed_at != 0 && info->sealed_at <= cutoff && live[i] * 100 < info->size * SEGMENT_COMPACT_LIVE) {
+	victims[count++] = info->id;
+      }
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  s->compacted_old = old - count;
+
+  for (size_t i = 0; i < count; i++) {
+    compact_segment(s, victims[i]);
+  }
+  free(live);
+  free(victims);
+}
+
+static void *compactor_main(void *arg) {
+  SegmentStore *s = arg;
+  pthread_mutex_lock(&s->lock);
+  while (!s->stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += SEGMENT_COMPACT_INTERVAL;
+    pthread_cond_timedwait(&s->wake, &s->lock, &until);
+    if (s->stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&s->lock);
+    compact(s);
+    pthread_mutex_lock(&s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+int segment_store_start_compactor(SegmentStore *s, Manifest *m) {
+  s->manifest = m;
+  if (pthread_create(&s->compactor, NULL, compactor_main, s) != 0) {
+    fprintf(stderr, "Error starting segment compaction\n");
+    return -1;
+  }
+  s->compactor_started = 1;
+  return 0;
+}
+
+void segment_store_close(SegmentStore *s) {
+  if (s->compactor_started) {
+    pthread_mutex_lock(&s->lock);
+    s->stopping = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->compactor, NULL);
+    s->compactor_started = 0;
+  }
+  if (s->active_fd != -1) {
+    close(s->active_fd);
+    s->active_fd = -1;
+  }
+  free(s->entries);
+  free(s->segments);
+  s->entries = NULL;
+  s->segments = NULL;
+  s->capacity = s->count = s->segment_count = s->segment_cap = 0;
+  pthread_rwlock_destroy(&s->linking);
+  pthread_cond_destroy(&s->wake);
+  pthread_mutex_destroy(&s->lock);
+}
@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "segment.h"
+#include "store.h"
+
+static uint64_t temp_counter;
+static SegmentStore segments;
+static int segments_loaded;
+
+static int make_dir(const char *path) {
+  if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+    perror("Error creating blob store directory");
+    return -1;
+  }
+  return 0;
+}
+
+/* blobs/xx from before the per-algorithm namespaces held SHA-256 ids */
+static int migrate_legacy_store(void) {
+  char legacy[sizeof(BLOB_DIR) + 4];
+  char path[BLOB_PATH_SIZE];
+  snprintf(legacy, sizeof(legacy), "%s/00", BLOB_DIR);
+  if (access(legacy, F_OK) != 0) {
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s/%s", BLOB_DIR, hash_name(HASH_SHA256));
+  if (make_dir(path) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < 256; i++) {
+    snprintf(legacy, sizeof(legacy), "%s/%02x", BLOB_DIR, i);
+    snprintf(path, sizeof(path), "%s/%s/%02x", BLOB_DIR, hash_name(HASH_SHA256), i);
+    if (rename(legacy, path) == -1 && errno != ENOENT) {
+      perror("Error migrating blob store");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* uploads a crash cut short; nothing refers to them */
+static void sweep_temp_files(void) {
+  DIR *dir = opendir(BLOB_TMP_DIR);
+  if (!dir) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+/* partials nobody came back for */
+static void sweep_stale_partials(void) {
+  DIR *dir = opendir(BLOB_PARTIAL_DIR);
+  if (!dir) {
+    return;
+  }
+  time_t cutoff = time(NULL) - PARTIAL_MAX_AGE;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat st;
+    if (entry->d_name[0] != '.' && fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 &&
+	st.st_mtime < cutoff) {
+      unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+  }
+  closedir(dir);
+}
+
+int store_init(int use_segments) {
+  static const uint32_t algos[] = { HASH_SHA256, HASH_BLAKE3 };
+  if (make_dir(BLOB_DIR) == -1 || make_dir(BLOB_TMP_DIR) == -1 || make_dir(BLOB_PARTIAL_DIR) == -1 ||
+      migrate_legacy_store() == -1) {
+    return -1;
+  }
+  sweep_temp_files();
+  sweep_stale_partials();
+  char path[BLOB_PATH_SIZE];
+  for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+    const char *name = hash_name(algos[a]);
+    snprintf(path, sizeof(path), "%s/%s", BLOB_DIR, name);
+    if (make_dir(path) == -1) {
+      return -1;
+    }
+    for (int i = 0; i < 256; i++) {
+      snprintf(path, sizeof(path), "%s/%s/%02x", BLOB_DIR, name, i);
+      if (make_dir(path) == -1) {
+	return -1;
+      }
+    }
+  }
+  if (use_segments && make_dir(SEGMENT_DIR) == -1) {
+    return -1;
+  }
+  if (use_segments || access(SEGMENT_DIR, F_OK) == 0) {
+    if (segment_store_open(&segments, use_segments) == -1) {
+      return -1;
+    }
+    segments_loaded = 1;
+  }
+  return 0;
+}
+
+int store_segmented(void) {
+  return segments_loaded && segments.writes;
+}
+
+int store_start_compactor(Manifest *m) {
+  return store_segmented() ? segment_store_start_compactor(&segments, m) : 0;
+}
+
+void store_close(void) {
+  if (segments_loaded) {
+    segment_store_close(&segments);
+    segments_loaded = 0;
+  }
+}
+
+void store_blob_path(uint32_t algo, const unsigned char *id, char *out) {
+  char hex[BLOB_HEX_SIZE + 1];
+  blob_id_to_hex(id, hex);
+  snprintf(out, BLOB_PATH_SIZE, "%s/%s/%.2s/%s", BLOB_DIR, hash_name(algo), hex, hex + 2);
+}
+
+/* path of the blob as stored, plain or framed. Returns -1 if we don't
+ * have it. */
+static int find_blob(uint32_t algo, const unsigned char *id, char *out) {
+  store_blob_path(algo, id, out);
+  if (access(out, F_OK) == 0) {
+    return 0;
+  }
+  strcat(out, BLOB_FRAMES_SUFFIX);
+  return access(out, F_OK) == 0 ? 0 : -1;
+}
+
+/* 1 if find_blob found the frame format */
+static int is_framed(const char *path) {
+  size_t len = strlen(path), suffix = strlen(BLOB_FRAMES_SUFFIX);
+  return len > suffix && strcmp(path + len - suffix, BLOB_FRAMES_SUFFIX) == 0;
+}
+
+int store_has_blob(uint32_t algo, const unsigned char *id) {
+  char path[BLOB_PATH_SIZE];
+  return find_blob(algo, id, path) == 0 || (segments_loaded && segment_store_has(&segments, algo, id, 0));
+}
+
+int store_open_blob(uint32_t algo, const unsigned char *id) {
+  char path[BLOB_PATH_SIZE];
+  store_blob_path(algo, id, path);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int store_open_read(uint32_t algo, const unsigned char *id, StoredBlob *blob) {
+  char path[BLOB_PATH_SIZE];
+  memset(blob, 0, sizeof(*blob));
+  if (find_blob(algo, id, path) == -1) {
+    blob->fd = segments_loaded ? segment_store_open_blob(&segments, algo, id, &blob->offset, &blob->length) : -1;
+    blob->size = blob->length;
+    return blob->fd == -1 ? -1 : 0;
+  }
+  blob->fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (blob->fd == -1 || fstat(blob->fd, &st) == -1) {
+    perror("Error opening blob for reading");
+    if (blob->fd != -1) {
+      close(blob->fd);
+    }
+    return -1;
+  }
+  blob->length = blob->size = (uint64_t)st.st_size;
+  if (is_framed(path)) {
+    unsigned char header[BLOB_FRAMES_HEADER_SIZE] = { 0 };
+    uint32_t magic, codec;
+    uint64_t size;
+    ssize_t n = pread(blob->fd, header, sizeof(header), 0);
+    memcpy(&magic, header, 4);
+    memcpy(&codec, header + 4, 4);
+    memcpy(&size, header + 8, 8);
+    if (n != (ssize_t)sizeof(header) || be32toh(magic) != BLOB_FRAMES_MAGIC) {
+      fprintf(stderr, "Error reading blob: bad frame header in %s\n", path);
+      close(blob->fd);
+      return -1;
+    }
+    blob->codec = be32toh(codec);
+    blob->size = be64toh(size);
+    blob->offset = BLOB_FRAMES_HEADER_SIZE;
+    blob->length -= BLOB_FRAMES_HEADER_SIZE;
+  }
+  return 0;
+}
+
+char *store_temp_path(void) {
+  uint64_t n = __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED);
+  size_t len = sizeof(BLOB_TMP_DIR) + 48;
+  char *path = malloc(len);
+  if (path) {
+    snprintf(path, len, "%s/%d.%llu", BLOB_TMP_DIR, (int)getpid(), (unsigned long long)n);
+  }
+  return path;
+}
+
+int store_commit_blob(const char *tmp_path, uint32_t algo, const unsigned char *id, int framed) {
+  char path[BLOB_PATH_SIZE];
+  if (store_has_blob(algo, id)) {
+    // someone else stored the same contents first
+    unlink(tmp_path);
+    return 0;
+  }
+  if (!framed && store_segmented()) {
+    int fd = open(tmp_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size < SEGMENT_MAX_BLOB) {
+      int status = segment_store_put(&segments, algo, id, fd, 0, (uint64_t)st.st_size);
+      close(fd);
+      unlink(tmp_path);
+      return status;
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+  store_blob_path(algo, id, path);
+  if (framed) {
+    strcat(path, BLOB_FRAMES_SUFFIX);
+  }
+  if (rename(tmp_path, path) == -1) {
+    perror("Error moving blob into the store");
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+int store_commit_range(int fd, uint64_t offset, uint64_t length, uint32_t algo, const unsigned char *id) {
+  if (store_has_blob(algo, id)) {
+    return 0;
+  }
+  if (store_segmented() && length < SEGMENT_MAX_BLOB) {
+    return segment_store_put(&segments, algo, id, fd, offset, length);
+  }
+  // too big for a segment: a file of its own after all
+  char *tmp = store_temp_path();
+  int out = tmp ? open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666) : -1;
+  if (out == -1) {
+    perror("Error creating blob");
+    free(tmp);
+    return -1;
+  }
+  loff_t src = (loff_t)offset;
+  int status = 0;
+  while (length > 0 && status == 0) {
+    ssize_t n = copy_file_range(fd, &src, out, NULL, length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      status = -1;
+    } else {
+      length -= (uint64_t)n;
+    }
+  }
+  if (close(out) == -1 || status == -1) {
+    perror("Error copying blob");
+    unlink(tmp);
+    status = -1;
+  } else {
+    status = store_commit_blob(tmp, algo, id, 0);
+  }
+  free(tmp);
+  return status;
+}
+
+int store_blob_size(uint32_t algo, const unsigned char *id, uint64_t *size) {
+  if (segments_loaded && segment_store_length(&segments, algo, id, size) == 0) {
+    return 0;
+  }
+  StoredBlob blob;
+  if (store_open_read(algo, id, &blob) == -1) {
+    return -1;
+  }
+  close(blob.fd);
+  *size = blob.size;
+  return 0;
+}
+
+static void partial_path(uint32_t algo, const unsigned char *id, char *out) {
+  char hex[BLOB_HEX_SIZE + 1];
+  blob_id_to_hex(id, hex);
+  snprintf(out, BLOB_PARTIAL_PATH_SIZE, "%s/%s-%s", BLOB_PARTIAL_DIR, hash_name(algo), hex);
+}
+
+uint64_t store_partial_size(uint32_t algo, const unsigned char *id) {
+  char path[BLOB_PARTIAL_PATH_SIZE];
+  partial_path(algo, id, path);
+  struct stat st;
+  return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+int store_keep_partial(const char *tmp_path, uint32_t algo, const unsigned char *id) {
+  char path[BLOB_PARTIAL_PATH_SIZE];
+  partial_path(algo, id, path);
+  if (rename(tmp_path, path) == -1) {
+    perror("Error keeping partial upload");
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+int store_claim_partial(uint32_t algo, const unsigned char *id, const char *tmp_path) {
+  char path[BLOB_PARTIAL_PATH_SIZE];
+  partial_path(algo, id, path);
+  return rename(path, tmp_path);
+}
+
+/* private copy of a blob, for when it can't take another hard link */
+static int copy_blob(const char *blob_path, const char *tmp) {
+  int in = open(blob_path, O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    return -1;
+  }
+  int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (out == -1) {
+    close(in);
+    return -1;
+  }
+  int status = 0;
+  while (1) {
+    ssize_t n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      status = -1;
+      break;
+    }
+  }
+  close(in);
+  if (close(out) == -1 || status == -1) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+int store_make_parents(const char *path) {
+  char *copy = strdup(path);
+  if (!copy) {
+    return -1;
+  }
+  int status = 0;
+  for (char *slash = strchr(copy + 1, '/'); slash && status == 0; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    if (mkdir(copy, 0777) == -1 && errno != EEXIST) {
+      status = -1;
+    }
+    *slash = '/';
+  }
+  free(copy);
+  return status;
+}
+
+int store_link(uint32_t algo, const unsigned char *id, const char *path) {
+  char blob_path[BLOB_PATH_SIZE];
+  int found = find_blob(algo, id, blob_path) == 0;
+  if (!found && !(segments_loaded && segment_store_has(&segments, algo, id, 1))) {
+    fprintf(stderr, "Error linking blob: not in the store\n");
+    return -1;
+  }
+  if (!found || is_framed(blob_path)) {
+    // no file with the contents to link to: the manifest record is all
+    // there is to it, and what path held before would contradict it
+    if (unlink(path) == -1 && errno != ENOENT) {
+      perror("Error replacing path");
+      return -1;
+    }
+    return 0;
+  }
+
+  // link under a temporary name, then rename over whatever was there
+  uint64_t n = __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED);
+  size_t len = strlen(path) + 48;
+  char *tmp = malloc(len);
+  if (!tmp) {
+    perror("Error allocating link path");
+    return -1;
+  }
+  snprintf(tmp, len, "%s.cvlink.%d.%llu", path, (int)getpid(), (unsigned long long)n);
+
+  int status = link(blob_path, tmp);
+  if (status == -1 && errno == ENOENT && store_make_parents(path) == 0) {
+    status = link(blob_path, tmp);
+  }
+  // very common contents (empty files) run into the filesystem's link
+  // limit; those paths get their own copy instead
+  if (status == -1 && (errno != EMLINK || copy_blob(blob_path, tmp) == -1)) {
+    perror("Error linking blob");
+    status = -1;
+  } else if (rename(tmp, path) == -1) {
+    perror("Error moving link into place");
+    unlink(tmp);
+    status = -1;
+  } else {
+    // rename is a no-op if path already links this blob; drop tmp then
+    unlink(tmp);
+  }
+  free(tmp);
+  return status;
+}
+
+void store_begin_links(void) {
+  if (segments_loaded) {
+    pthread_rwlock_rdlock(&segments.linking);
+  }
+}
+
+void store_end_links(void) {
+  if (segments_loaded) {
+    pthread_rwlock_unlock(&segments.linking);
+  }
+}
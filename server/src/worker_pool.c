@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "worker_pool.h"
+
+static void push_ready(WorkerPool *pool, Strand *strand) {
+  strand->next = NULL;
+  if (pool->ready_tail) {
+    pool->ready_tail->next = strand;
+  } else {
+    pool->ready_head = strand;
+  }
+  pool->ready_tail = strand;
+  pthread_cond_signal(&pool->ready_cond);
+}
+
+/* called with the lock held */
+static void push_done(WorkerPool *pool, Job *job) {
+  job->next = NULL;
+  int was_empty = pool->done_head == NULL;
+  if (pool->done_tail) {
+    pool->done_tail->next = job;
+  } else {
+    pool->done_head = job;
+  }
+  pool->done_tail = job;
+  if (was_empty) {
+    uint64_t one = 1;
+    if (write(pool->event_fd, &one, sizeof(one)) == -1) {
+      perror("Error signalling event loop");
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  WorkerPool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->ready_head && !pool->stopping) {
+      pthread_cond_wait(&pool->ready_cond, &pool->lock);
+    }
+    if (!pool->ready_head) {
+      break; // stopping and nothing left to do
+    }
+
+    Strand *strand = pool->ready_head;
+    pool->ready_head = strand->next;
+    if (!pool->ready_head) {
+      pool->ready_tail = NULL;
+    }
+    Job *job = strand->head;
+    strand->head = job->next;
+    if (!strand->head) {
+      strand->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // once passed on, the job may be gone by the time run returns
+    int finished = job->run(job);
+
+    pthread_mutex_lock(&pool->lock);
+    // back of the line so one busy connection can't starve the rest
+    if (strand->head) {
+      push_ready(pool, strand);
+    } else {
+      strand->scheduled = 0;
+    }
+    if (finished) {
+      push_done(pool, job);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+int pool_init(WorkerPool *pool, int nthreads) {
+  memset(pool, 0, sizeof(*pool));
+  pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (pool->event_fd == -1) {
+    perror("Error creating eventfd");
+    return -1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready_cond, NULL);
+
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  if (!pool->threads) {
+    perror("Error allocating worker threads");
+    return -1;
+  }
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+      perror("Error starting worker thread");
+      pool_shutdown(pool);
+      return -1;
+    }
+    pool->nthreads++;
+  }
+  return 0;
+}
+
+void pool_submit(WorkerPool *pool, Strand *strand, Job *job) {
+  job->next = NULL;
+  pthread_mutex_lock(&pool->lock);
+  if (strand->tail) {
+    strand->tail->next = job;
+  } else {
+    strand->head = job;
+  }
+  strand->tail = job;
+  if (!strand->scheduled) {
+    strand->scheduled = 1;
+    push_ready(pool, strand);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_complete(WorkerPool *pool, Job *job) {
+  pthread_mutex_lock(&pool->lock);
+  push_done(pool, job);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+Job *pool_take_completed(WorkerPool *pool) {
+  uint64_t count;
+  if (read(pool->event_fd, &count, sizeof(count)) == -1) {
+    // EAGAIN: nothing signalled, but still check the list
+  }
+  pthread_mutex_lock(&pool->lock);
+  Job *jobs = pool->done_head;
+  pool->done_head = NULL;
+  pool->done_tail = NULL;
+  pthread_mutex_unlock(&pool->lock);
+  return jobs;
+}
+
+void pool_shutdown(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->ready_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pool->threads = NULL;
+  close(pool->event_fd);
+}